@@ -1,16 +1,222 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
 #include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/file.h>
 
-#define FILENAME "accounts.dat"
+#define FILENAME "accounts.dat" // A FileHeader, then a HotRecord per account
+#define COLD_FILE "accounts.cold" // A FileHeader, then a ColdRecord per account, in the same order
+#define FORMAT_MAGIC "BANKACCT" // The eight bytes a header starts with
+#define FORMAT_VERSION 2
+#define BYTE_ORDER_MARK 0x01020304u
+#define ACCOUNT_OPEN 0x1 // HotRecord flag; records without it are not accounts
 #define MAX_NAME_LEN 100
 #define MAX_PASS_LEN 50
+#define INDEX_MIN_CAP 1024 // Initial slots of the account index; always a power of two
+#define LOAD_BATCH 4096 // Records read per fread in whole-file passes
+#define MAX_LINE_LEN 256
+#define JOURNAL_FILE "journal.log"
+#define CHECKPOINT_FILE "accounts.ckpt"
+#define JOURNAL_BUFFER 4096 // Entries buffered before they are written out
+#define JOURNAL_CHECKPOINT_BYTES (64 << 20) // Journal growth that triggers a checkpoint
+#define BATCH_CHUNK 1024 // Transactions a batch worker applies between journal commits
+#define MAX_THREADS 64
+#define STATEMENT_MAX 256 // Longest statement line
+#define STATEMENT_BUFFER (4 << 20) // stdio buffer of the statements file
+#define CRED_PBKDF2 2 // struct Credential version
+#define KDF_SALT_LEN 16
+#define KDF_KEY_LEN 32
+#define KDF_TARGET_MS 50 // Time one password derivation should take on this host
+#define KDF_MIN_COST 12
+#define KDF_MAX_COST 24
+#define VERIFY_CACHE_SIZE 64 // Recent successful logins remembered; a power of two
+#define VERIFY_CACHE_TTL 300 // Seconds a remembered login stays valid
 
-struct Account {
+// A stored password: PBKDF2-HMAC-SHA256 with a per-account salt and
+// 2^cost iterations. It takes the 50 bytes that used to hold the djb2 hash
+// as decimal text, so a record whose version byte is a digit is a legacy
+// one; it is rehashed the next time its owner logs in.
+struct Credential {
+    unsigned char version;
+    unsigned char cost;
+    unsigned char salt[KDF_SALT_LEN];
+    unsigned char key[KDF_KEY_LEN];
+};
+
+// Starts both account files. Every field has a fixed width and there is no
+// implicit padding; byte_order tells apart a file from a host of the other
+// endianness. The header fills a cache line so that records stay aligned.
+struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t record_size;
+    uint32_t reserved[11];
+};
+
+// The part of an account that balance updates, the index and settlement
+// touch: four records to a cache line
+struct HotRecord {
+    int32_t acc_no;
+    uint32_t flags;
+    double balance;
+};
+
+// The part only account creation and login need
+struct ColdRecord {
+    int32_t acc_no;
+    char name[MAX_NAME_LEN];
+    struct Credential cred;
+    char reserved[6];
+};
+
+_Static_assert(sizeof(struct FileHeader) == 64, "FileHeader must stay 64 bytes");
+_Static_assert(sizeof(struct HotRecord) == 16, "HotRecord must stay 16 bytes");
+_Static_assert(sizeof(struct ColdRecord) == 160, "ColdRecord must stay 160 bytes");
+
+// A record of the headerless FILENAME written before FORMAT_VERSION 2, as
+// the compiler laid it out; only read to convert such a file
+struct LegacyAccount {
     int acc_no;
     char name[MAX_NAME_LEN];
-    char password_hash[MAX_PASS_LEN];
+    struct Credential cred;
+    double balance;
+};
+
+// Maps account numbers to their record position in both files. Built once at
+// startup, so lookups never scan the file. Open addressing with linear probing;
+// a key of 0 marks an empty slot (account numbers start at 1001).
+struct AccountIndex {
+    int *keys;
+    long *records;
+    size_t cap;
+    size_t count;
+    long record_count; // Whole hot records read so far; other terminals may have added more
+    int next_acc_no;
+};
+
+struct AccountIndex acc_index;
+
+// A balance change in JOURNAL_FILE. It carries the balance after the change,
+// so replaying an entry that already reached FILENAME is harmless. `check`
+// covers the rest of the entry and marks where a torn tail begins.
+struct JournalEntry {
+    uint64_t seq;
+    int acc_no;
+    char op; // 'D'eposit, 'W'ithdraw, 'I'nterest, 'T'ransfer out or 'R'eceived transfer; a 'T' is always followed by its 'R'
+    double amount;
     double balance;
+    uint32_t check;
+};
+
+// Where FILENAME is known to be complete: every entry before `offset` (up to `seq`) is in it
+struct Checkpoint {
+    uint64_t seq;
+    uint64_t offset;
+    uint32_t check;
+};
+
+// The append-only journal. Entries are buffered and made durable together
+// by journal_commit: while one committer waits for fsync, the others queue
+// up behind it and share the next one (group commit).
+struct Journal {
+    int fd;
+    uint64_t next_seq;
+    struct JournalEntry buf[JOURNAL_BUFFER];
+    size_t buffered;
+    uint64_t size; // Bytes written to JOURNAL_FILE
+    struct Checkpoint ckpt;
+    uint64_t durable_seq; // Entries up to this one are on disk
+    int syncing; // A committer is in fdatasync
+    int failed;
+    int unapplied; // Committed entries may be missing from FILENAME, so the checkpoint must not move past them
+    pthread_mutex_t lock;
+    pthread_cond_t synced;
+};
+
+struct Sha256 {
+    uint32_t h[8];
+    unsigned char block[64];
+    size_t used; // Bytes waiting in block
+    uint64_t length; // Bytes hashed so far
+};
+
+// HMAC-SHA256 states with the padded key already absorbed, reused for every message
+struct Hmac {
+    struct Sha256 inner;
+    struct Sha256 outer;
+};
+
+// A recent successful login. Keyed by terminal session and account; the
+// digest binds it to the stored key and the password, which is never kept.
+struct VerifiedLogin {
+    pid_t session;
+    int acc_no;
+    unsigned char digest[32];
+    time_t expires;
+};
+
+struct VerifiedLogin verify_cache[VERIFY_CACHE_SIZE];
+int kdf_cost_tuned; // Chosen by kdf_cost on first use
+
+struct Journal journal = {.fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER, .synced = PTHREAD_COND_INITIALIZER};
+
+enum BatchStatus { BATCH_OK, BATCH_INSUFFICIENT_FUNDS, BATCH_NO_SUCH_ACCOUNT, BATCH_INVALID };
+
+// One line of a batch transaction file and the outcome of applying it
+struct BatchTxn {
+    long line;
+    int acc_no;
+    int to_acc_no; // Transfers only
+    char op; // 'D'eposit, 'W'ithdraw or 'T'ransfer
+    double amount;
+    long record; // Position of the account in FILENAME, then its slot in BatchEngine.balances; -1 if there is none or it is not applied
+    long to_record;
+    enum BatchStatus status;
+    double balance; // After the transaction
+    double to_balance;
+};
+
+// State shared by the batch workers. Balances of the accounts a batch touches
+// live in memory while it runs. Each account belongs to one worker, by its
+// slot modulo the number of workers, which applies the account's transactions
+// in file order without taking locks. A transfer between accounts of two
+// workers is where they meet: the receiving one stops there, and the sending
+// one applies the transfer once the receiving one has applied everything
+// before it.
+struct BatchEngine {
+    struct BatchTxn *txns;
+    size_t count;
+    double *balances;
+    int workers; // Set once every worker has been started
+    int joined; // Workers that took their number
+    size_t reached[MAX_THREADS]; // Each worker has applied its transactions before this one
+    int failed;
+    pthread_mutex_t lock; // Guards the fields above
+    pthread_cond_t progress; // A worker reached a transfer, or failed
+};
+
+// State shared by the month-end workers. They claim blocks of LOAD_BATCH
+// accounts in order and append each block's statements in that same order.
+struct MonthEnd {
+    double rate; // Annual, in percent
+    long records;
+    long next_block; // First block not yet claimed
+    long written_block; // Block whose statements go out next
+    long done; // Accounts finished
+    double paid; // Interest paid so far
+    int running; // Workers not yet finished
+    int failed;
+    FILE *out;
+    pthread_mutex_t lock;
+    pthread_cond_t turn; // A block was written or a worker finished
 };
 
 // --- Function Prototypes ---
@@ -23,10 +229,83 @@ void withdraw(int acc_no);
 void check_balance(int acc_no);
 int get_next_acc_no();
 void hash_password(const char *password, char *hash);
+int set_password(struct Credential *cred, const char *password);
+int verify_password(const struct ColdRecord *acc, const char *password);
+int kdf_cost();
+void pbkdf2(const char *password, const unsigned char *salt, size_t salt_len, unsigned long iterations, unsigned char *out);
+void hmac_init(struct Hmac *m, const void *key, size_t len);
+void hmac(const struct Hmac *m, const void *data, size_t len, unsigned char *out);
+void sha256_init(struct Sha256 *s);
+void sha256_update(struct Sha256 *s, const void *data, size_t len);
+void sha256_final(struct Sha256 *s, unsigned char *out);
+void sha256_block(uint32_t *h, const unsigned char *p);
+int equal_bytes(const unsigned char *a, const unsigned char *b, size_t len);
 void clear_input_buffer();
+int index_load();
+int index_refresh(FILE *fp);
+int index_insert(int acc_no, long record);
+long index_find(int acc_no);
+size_t index_slot(const struct AccountIndex *ix, int acc_no);
+int read_record(FILE *fp, long record, void *rec, size_t size);
+int write_record(FILE *fp, long record, const void *rec, size_t size);
+FILE *open_store(const char *path, size_t record_size);
+int write_header(FILE *fp, size_t record_size);
+int check_header(FILE *fp, const char *path, size_t record_size);
+int migrate_legacy();
+int run_batch(const char *txn_path, const char *result_path, int threads);
+int batch_read(const char *txn_path, struct BatchTxn **txns, size_t *count);
+long *batch_accounts(struct BatchTxn *txns, size_t count, size_t *n);
+int batch_balances(const long *records, double *balances, size_t n, int write);
+void *batch_worker(void *arg);
+void batch_reach(struct BatchEngine *engine, int worker, size_t txn);
+int batch_wait(struct BatchEngine *engine, int worker, size_t txn);
+int batch_apply(struct BatchEngine *engine, struct BatchTxn *t);
+void batch_write_result(FILE *out, const struct BatchTxn *t);
+int cmp_long(const void *a, const void *b);
+int run_month_end(double rate, const char *statements_path, int threads);
+void *month_end_worker(void *arg);
+int month_end_block(struct MonthEnd *job, FILE *hot, FILE *cold, long first, size_t n, struct HotRecord *hb,
+                    struct ColdRecord *cb, char *text, size_t *len, double *paid);
+int journal_open();
+int journal_recover();
+int journal_append(int acc_no, char op, double amount, double balance);
+int journal_append_transfer(const struct BatchTxn *t);
+void journal_add(int acc_no, char op, double amount, double balance);
+int journal_write();
+int journal_commit();
+int journal_checkpoint();
+void journal_maybe_checkpoint();
+void journal_close();
+uint32_t checksum(const void *data, size_t len);
 
 // --- Main Function ---
-int main() {
+int main(int argc, char *argv[]) {
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int batch = argc > 1 && strcmp(argv[1], "--batch") == 0;
+    int month_end = argc > 1 && strcmp(argv[1], "--month-end") == 0;
+    double rate = 0;
+    char *end = NULL;
+    if (argc == 5) threads = atoi(argv[4]);
+    if (month_end && argc >= 3) rate = strtod(argv[2], &end);
+    if (argc > 1 && (argc < 4 || argc > 5 || !(batch || month_end) || threads < 1 || threads > MAX_THREADS ||
+                     (month_end && (end == argv[2] || *end != '\0' || !(rate >= 0 && rate <= 1000))))) {
+        printf("Usage: %s [--batch transactions-file results-file [threads]]\n", argv[0]);
+        printf("       %s [--month-end annual-rate-percent statements-file [threads]]\n", argv[0]);
+        return 1;
+    }
+    if (index_load() != 0) {
+        printf("Error: Could not load %s.\n", FILENAME);
+        return 1;
+    }
+    if (journal_open() != 0) {
+        perror("Error opening " JOURNAL_FILE);
+        return 1;
+    }
+    if (argc >= 4) {
+        int rc = batch ? run_batch(argv[2], argv[3], threads) : run_month_end(rate, argv[3], threads);
+        journal_close();
+        return rc == 0 ? 0 : 1;
+    }
     main_menu();
     return 0;
 }
@@ -51,7 +330,9 @@ void main_menu() {
         switch (choice) {
             case 1: create_account(); break;
             case 2: login(); break;
-            case 3: exit(0);
+            case 3:
+                journal_close();
+                exit(0);
             default: printf("\nInvalid choice.\n");
         }
     }
@@ -60,35 +341,57 @@ void main_menu() {
 // --- Core Functionality ---
 
 void create_account() {
-    struct Account acc;
-    acc.acc_no = get_next_acc_no();
-    acc.balance = 0.0;
+    struct HotRecord hot = {0, ACCOUNT_OPEN, 0.0};
+    struct ColdRecord cold;
+    memset(&cold, 0, sizeof(cold));
 
-    printf("\n--- Create New Account (Account No: %d) ---\n", acc.acc_no);
+    printf("\n--- Create New Account ---\n");
     printf("Enter your full name: ");
-    fgets(acc.name, MAX_NAME_LEN, stdin);
-    acc.name[strcspn(acc.name, "\n")] = 0;
+    fgets(cold.name, MAX_NAME_LEN, stdin);
+    cold.name[strcspn(cold.name, "\n")] = 0;
 
     char password[MAX_PASS_LEN];
     printf("Create a password: ");
     fgets(password, MAX_PASS_LEN, stdin);
     password[strcspn(password, "\n")] = 0;
-    hash_password(password, acc.password_hash);
+    if (set_password(&cold.cred, password) != 0) {
+        perror("Error creating account");
+        return;
+    }
 
-    FILE *fp = fopen(FILENAME, "ab");
-    if (!fp) {
+    // Other terminals create accounts too, so the record position and account
+    // number are only taken once the lock on FILENAME is held and the records
+    // they added are read. Written at the end of the last whole record, so a
+    // torn tail from a crash is overwritten. The account exists once its hot
+    // record does, so the cold one goes first.
+    FILE *hot_fp = open_store(FILENAME, sizeof(struct HotRecord));
+    int rc = hot_fp ? index_refresh(hot_fp) : -1;
+    long record = acc_index.record_count;
+    hot.acc_no = cold.acc_no = get_next_acc_no();
+    if (rc == 0) {
+        FILE *fp = open_store(COLD_FILE, sizeof(struct ColdRecord));
+        rc = fp ? write_record(fp, record, &cold, sizeof(cold)) : -1;
+        if (fp && fclose(fp) != 0) rc = -1;
+    }
+    if (rc == 0) rc = write_record(hot_fp, record, &hot, sizeof(hot));
+    if (hot_fp && fclose(hot_fp) != 0) rc = -1;
+    if (rc != 0) {
         perror("Error creating account");
         return;
     }
-    fwrite(&acc, sizeof(struct Account), 1, fp);
-    fclose(fp);
+    if (index_insert(hot.acc_no, record) != 0) {
+        printf("Error: Out of memory indexing the new account.\n");
+        exit(1);
+    }
+    acc_index.record_count++;
+    acc_index.next_acc_no = hot.acc_no + 1;
 
-    printf("\nAccount created successfully! Your account number is %d.\n", acc.acc_no);
+    printf("\nAccount created successfully! Your account number is %d.\n", hot.acc_no);
 }
 
 void login() {
     int acc_no;
-    char password[MAX_PASS_LEN], hashed_pass[MAX_PASS_LEN];
+    char password[MAX_PASS_LEN];
 
     printf("\n--- Account Login ---\n");
     printf("Enter account number: ");
@@ -102,23 +405,35 @@ void login() {
     printf("Enter password: ");
     fgets(password, MAX_PASS_LEN, stdin);
     password[strcspn(password, "\n")] = 0;
-    hash_password(password, hashed_pass);
 
-    FILE *fp = fopen(FILENAME, "rb");
-    if (!fp) {
+    // The account may have been created by another terminal
+    long record = index_find(acc_no);
+    if (record < 0) {
+        FILE *fp = fopen(FILENAME, "rb");
+        if (fp && index_refresh(fp) != 0) {
+            printf("Error: Out of memory indexing accounts.\n");
+            exit(1);
+        }
+        if (fp) fclose(fp);
+        record = index_find(acc_no);
+    }
+    if (acc_index.count == 0) {
         printf("No accounts found. Please create one first.\n");
         return;
     }
 
-    struct Account acc;
+    struct ColdRecord acc;
     int found = 0;
-    while (fread(&acc, sizeof(struct Account), 1, fp)) {
-        if (acc.acc_no == acc_no && strcmp(acc.password_hash, hashed_pass) == 0) {
-            found = 1;
-            break;
-        }
+    FILE *fp = (record >= 0) ? fopen(COLD_FILE, "rb+") : NULL;
+    if (fp) {
+        found = read_record(fp, record, &acc, sizeof(acc)) == 0 && acc.acc_no == acc_no && verify_password(&acc, password);
+        if (found && acc.cred.version != CRED_PBKDF2 && set_password(&acc.cred, password) == 0) write_record(fp, record, &acc, sizeof(acc));
+        fclose(fp);
+    } else {
+        // An unknown account costs as much as a wrong password
+        struct Credential dummy;
+        set_password(&dummy, password);
     }
-    fclose(fp);
 
     if (found) {
         printf("\nLogin successful! Welcome, %s.\n", acc.name);
@@ -159,65 +474,76 @@ void logged_in_menu(int acc_no) {
 void deposit(int acc_no) {
     double amount;
     printf("Enter amount to deposit: ");
-    if (scanf("%lf", &amount) != 1 || amount <= 0) {
+    if (scanf("%lf", &amount) != 1 || !isfinite(amount) || !(amount > 0)) {
         printf("Invalid amount.\n");
         clear_input_buffer();
         return;
     }
     clear_input_buffer();
 
+    long record = index_find(acc_no);
     FILE *fp = fopen(FILENAME, "rb+");
-    struct Account acc;
-    while (fread(&acc, sizeof(struct Account), 1, fp)) {
-        if (acc.acc_no == acc_no) {
-            acc.balance += amount;
-            fseek(fp, -sizeof(struct Account), SEEK_CUR);
-            fwrite(&acc, sizeof(struct Account), 1, fp);
-            printf("Successfully deposited %.2f. New balance: %.2f\n", amount, acc.balance);
-            break;
-        }
+    struct HotRecord acc;
+    if (!fp || record < 0 || read_record(fp, record, &acc, sizeof(acc)) != 0) {
+        printf("Error: Could not read account %d.\n", acc_no);
+        if (fp) fclose(fp);
+        return;
+    }
+    acc.balance += amount;
+    // The journal entry is durable before the record changes in place
+    if (journal_append(acc_no, 'D', amount, acc.balance) != 0 || journal_commit() != 0 || write_record(fp, record, &acc, sizeof(acc)) != 0) {
+        printf("Error: Could not update account %d.\n", acc_no);
+        journal.unapplied = 1;
+    } else {
+        printf("Successfully deposited %.2f. New balance: %.2f\n", amount, acc.balance);
     }
     fclose(fp);
+    journal_maybe_checkpoint();
 }
 
 void withdraw(int acc_no) {
     double amount;
     printf("Enter amount to withdraw: ");
-    if (scanf("%lf", &amount) != 1 || amount <= 0) {
+    if (scanf("%lf", &amount) != 1 || !isfinite(amount) || !(amount > 0)) {
         printf("Invalid amount.\n");
         clear_input_buffer();
         return;
     }
     clear_input_buffer();
 
+    long record = index_find(acc_no);
     FILE *fp = fopen(FILENAME, "rb+");
-    struct Account acc;
-    while (fread(&acc, sizeof(struct Account), 1, fp)) {
-        if (acc.acc_no == acc_no) {
-            if (acc.balance < amount) {
-                printf("Insufficient funds. Current balance: %.2f\n", acc.balance);
-            } else {
-                acc.balance -= amount;
-                fseek(fp, -sizeof(struct Account), SEEK_CUR);
-                fwrite(&acc, sizeof(struct Account), 1, fp);
-                printf("Successfully withdrew %.2f. New balance: %.2f\n", amount, acc.balance);
-            }
-            break;
+    struct HotRecord acc;
+    if (!fp || record < 0 || read_record(fp, record, &acc, sizeof(acc)) != 0) {
+        printf("Error: Could not read account %d.\n", acc_no);
+        if (fp) fclose(fp);
+        return;
+    }
+    if (acc.balance < amount) {
+        printf("Insufficient funds. Current balance: %.2f\n", acc.balance);
+    } else {
+        acc.balance -= amount;
+        if (journal_append(acc_no, 'W', amount, acc.balance) != 0 || journal_commit() != 0 || write_record(fp, record, &acc, sizeof(acc)) != 0) {
+            printf("Error: Could not update account %d.\n", acc_no);
+            journal.unapplied = 1;
+        } else {
+            printf("Successfully withdrew %.2f. New balance: %.2f\n", amount, acc.balance);
         }
     }
     fclose(fp);
+    journal_maybe_checkpoint();
 }
 
 void check_balance(int acc_no) {
+    long record = index_find(acc_no);
     FILE *fp = fopen(FILENAME, "rb");
-    struct Account acc;
-    while (fread(&acc, sizeof(struct Account), 1, fp)) {
-        if (acc.acc_no == acc_no) {
-            printf("\nYour current balance is: %.2f\n", acc.balance);
-            break;
-        }
+    struct HotRecord acc;
+    if (fp && record >= 0 && read_record(fp, record, &acc, sizeof(acc)) == 0) {
+        printf("\nYour current balance is: %.2f\n", acc.balance);
+    } else {
+        printf("Error: Could not read account %d.\n", acc_no);
     }
-    fclose(fp);
+    if (fp) fclose(fp);
 }
 
 
@@ -229,20 +555,13 @@ void clear_input_buffer() {
 }
 
 int get_next_acc_no() {
-    FILE *fp = fopen(FILENAME, "rb");
-    if (!fp) return 1001;
-    struct Account acc;
-    int max_no = 1000;
-    while (fread(&acc, sizeof(struct Account), 1, fp)) {
-        if (acc.acc_no > max_no) max_no = acc.acc_no;
-    }
-    fclose(fp);
-    return max_no + 1;
+    return acc_index.next_acc_no;
 }
 
 /**
  * @brief A simple, non-secure hashing function for demonstration.
- * DO NOT use this for real-world applications.
+ * DO NOT use this for real-world applications. Only legacy credentials,
+ * stored as its decimal text, are still checked with it.
  */
 void hash_password(const char *password, char *hash) {
     unsigned long h = 5381;
@@ -252,3 +571,1076 @@ void hash_password(const char *password, char *hash) {
     }
     sprintf(hash, "%lu", h);
 }
+
+// --- Account Index ---
+
+/**
+ * @brief Builds the account index with one sequential pass over the hot
+ * records of FILENAME and caches the next free account number. A missing file
+ * is an empty bank; a file without a header is converted first.
+ * @return 0 on success, -1 if the files could not be read or memory ran out.
+ */
+int index_load() {
+    acc_index.next_acc_no = 1001;
+    acc_index.record_count = 0;
+    FILE *fp = fopen(FILENAME, "rb");
+    if (!fp) return 0;
+    char magic[sizeof(((struct FileHeader *)0)->magic)];
+    if (fread(magic, sizeof(magic), 1, fp) != 1 || memcmp(magic, FORMAT_MAGIC, sizeof(magic)) != 0) {
+        fclose(fp);
+        if (migrate_legacy() != 0) return -1;
+        if (!(fp = fopen(FILENAME, "rb"))) return -1;
+    }
+    if (check_header(fp, FILENAME, sizeof(struct HotRecord)) != 0) {
+        fclose(fp);
+        return -1;
+    }
+
+    struct HotRecord *batch = malloc(LOAD_BATCH * sizeof(struct HotRecord));
+    if (!batch) {
+        fclose(fp);
+        return -1;
+    }
+    size_t n;
+    int rc = 0;
+    while (rc == 0 && (n = fread(batch, sizeof(struct HotRecord), LOAD_BATCH, fp)) > 0) {
+        for (size_t i = 0; i < n && rc == 0; i++) {
+            long record = acc_index.record_count++;
+            if (batch[i].flags & ACCOUNT_OPEN) rc = index_insert(batch[i].acc_no, record);
+            if (batch[i].acc_no >= acc_index.next_acc_no) acc_index.next_acc_no = batch[i].acc_no + 1;
+        }
+    }
+    if (ferror(fp)) rc = -1;
+    free(batch);
+    fclose(fp);
+
+    // Names and credentials must be readable for every account
+    if (rc == 0 && acc_index.record_count > 0) {
+        FILE *cold = fopen(COLD_FILE, "rb");
+        rc = cold ? check_header(cold, COLD_FILE, sizeof(struct ColdRecord)) : -1;
+        if (cold) fclose(cold);
+    }
+    return rc;
+}
+
+/**
+ * @brief Indexes the whole hot records other terminals appended to FILENAME
+ * since we last read it and advances the next free account number past them.
+ * Costs one seek when nothing was appended.
+ * @return 0 on success, -1 if the records could not be read or memory ran out.
+ */
+int index_refresh(FILE *fp) {
+    if (fseek(fp, 0, SEEK_END) != 0) return -1;
+    long size = ftell(fp);
+    if (size < (long)sizeof(struct FileHeader)) return size < 0 ? -1 : 0;
+    long records = (size - (long)sizeof(struct FileHeader)) / (long)sizeof(struct HotRecord);
+    struct HotRecord rec;
+    while (acc_index.record_count < records) {
+        if (read_record(fp, acc_index.record_count, &rec, sizeof(rec)) != 0) return -1;
+        if ((rec.flags & ACCOUNT_OPEN) && index_insert(rec.acc_no, acc_index.record_count) != 0) return -1;
+        if (rec.acc_no >= acc_index.next_acc_no) acc_index.next_acc_no = rec.acc_no + 1;
+        acc_index.record_count++;
+    }
+    return 0;
+}
+
+// Slot of an account number in the index: where it is, or the empty slot where it belongs
+size_t index_slot(const struct AccountIndex *ix, int acc_no) {
+    size_t i = ((unsigned)acc_no * 2654435761u) & (ix->cap - 1);
+    while (ix->keys[i] != 0 && ix->keys[i] != acc_no) i = (i + 1) & (ix->cap - 1);
+    return i;
+}
+
+/**
+ * @brief Records the position of an account, doubling the table once it is
+ * half full.
+ * @return 0 on success, -1 if memory ran out.
+ */
+int index_insert(int acc_no, long record) {
+    if ((acc_index.count + 1) * 2 > acc_index.cap) {
+        struct AccountIndex grown = acc_index;
+        grown.cap = acc_index.cap ? acc_index.cap * 2 : INDEX_MIN_CAP;
+        grown.keys = calloc(grown.cap, sizeof(int));
+        grown.records = malloc(grown.cap * sizeof(long));
+        if (!grown.keys || !grown.records) {
+            free(grown.keys);
+            free(grown.records);
+            return -1;
+        }
+        for (size_t i = 0; i < acc_index.cap; i++) {
+            if (acc_index.keys[i] == 0) continue;
+            size_t j = index_slot(&grown, acc_index.keys[i]);
+            grown.keys[j] = acc_index.keys[i];
+            grown.records[j] = acc_index.records[i];
+        }
+        free(acc_index.keys);
+        free(acc_index.records);
+        acc_index = grown;
+    }
+    size_t i = index_slot(&acc_index, acc_no);
+    if (acc_index.keys[i] == 0) acc_index.count++;
+    acc_index.keys[i] = acc_no;
+    acc_index.records[i] = record;
+    return 0;
+}
+
+// Returns the record position of an account, or -1 if there is no such account
+long index_find(int acc_no) {
+    if (acc_index.cap == 0 || acc_no == 0) return -1;
+    size_t i = index_slot(&acc_index, acc_no);
+    return acc_index.keys[i] == acc_no ? acc_index.records[i] : -1;
+}
+
+// Reads record number `record` of a file of `size`-byte records after a FileHeader
+int read_record(FILE *fp, long record, void *rec, size_t size) {
+    if (fseek(fp, (long)sizeof(struct FileHeader) + record * (long)size, SEEK_SET) != 0) return -1;
+    return fread(rec, size, 1, fp) == 1 ? 0 : -1;
+}
+
+int write_record(FILE *fp, long record, const void *rec, size_t size) {
+    if (fseek(fp, (long)sizeof(struct FileHeader) + record * (long)size, SEEK_SET) != 0) return -1;
+    if (fwrite(rec, size, 1, fp) != 1) return -1;
+    return fflush(fp) == 0 ? 0 : -1;
+}
+
+// Opens an account file for update under an exclusive lock, held until it is
+// closed, and writes its header if the file is new
+FILE *open_store(const char *path, size_t record_size) {
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return NULL;
+    FILE *fp = fdopen(fd, "rb+");
+    if (!fp) {
+        close(fd);
+        return NULL;
+    }
+    if (flock(fd, LOCK_EX) != 0 || fseek(fp, 0, SEEK_END) != 0 || (ftell(fp) == 0 && write_header(fp, record_size) != 0)) {
+        fclose(fp);
+        return NULL;
+    }
+    return fp;
+}
+
+int write_header(FILE *fp, size_t record_size) {
+    struct FileHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, FORMAT_MAGIC, sizeof(h.magic));
+    h.version = FORMAT_VERSION;
+    h.byte_order = BYTE_ORDER_MARK;
+    h.record_size = (uint32_t)record_size;
+    return fwrite(&h, sizeof(h), 1, fp) == 1 ? 0 : -1;
+}
+
+// Reads and checks the header of an account file, leaving fp at the first record
+int check_header(FILE *fp, const char *path, size_t record_size) {
+    struct FileHeader h;
+    if (fseek(fp, 0, SEEK_SET) != 0 || fread(&h, sizeof(h), 1, fp) != 1 || memcmp(h.magic, FORMAT_MAGIC, sizeof(h.magic)) != 0) {
+        printf("Error: %s is not an account file.\n", path);
+        return -1;
+    }
+    if (h.version != FORMAT_VERSION || h.byte_order != BYTE_ORDER_MARK || h.record_size != record_size) {
+        printf("Error: %s has an unsupported format (version %u).\n", path, h.version);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Converts a headerless FILENAME of LegacyAccount records into the hot
+ * and cold files. Both are written under temporary names and renamed into
+ * place cold first, so a crash at any point leaves a legacy FILENAME that is
+ * simply converted again.
+ * @return 0 on success, -1 on an I/O or memory error.
+ */
+int migrate_legacy() {
+    FILE *in = fopen(FILENAME, "rb");
+    FILE *hot = fopen(FILENAME ".tmp", "wb");
+    FILE *cold = fopen(COLD_FILE ".tmp", "wb");
+    struct LegacyAccount *batch = malloc(LOAD_BATCH * sizeof(struct LegacyAccount));
+    int rc = (in && hot && cold && batch) ? 0 : -1;
+    if (rc == 0 && (write_header(hot, sizeof(struct HotRecord)) != 0 || write_header(cold, sizeof(struct ColdRecord)) != 0)) rc = -1;
+    long count = 0;
+    size_t n;
+    while (rc == 0 && (n = fread(batch, sizeof(struct LegacyAccount), LOAD_BATCH, in)) > 0) {
+        for (size_t i = 0; i < n && rc == 0; i++) {
+            struct HotRecord h = {batch[i].acc_no, ACCOUNT_OPEN, batch[i].balance};
+            struct ColdRecord c;
+            memset(&c, 0, sizeof(c));
+            c.acc_no = batch[i].acc_no;
+            memcpy(c.name, batch[i].name, sizeof(c.name));
+            c.cred = batch[i].cred;
+            if (fwrite(&h, sizeof(h), 1, hot) != 1 || fwrite(&c, sizeof(c), 1, cold) != 1) rc = -1;
+        }
+        count += (long)n;
+    }
+    if (in && ferror(in)) rc = -1;
+    if (hot && (fflush(hot) != 0 || fsync(fileno(hot)) != 0)) rc = -1;
+    if (cold && (fflush(cold) != 0 || fsync(fileno(cold)) != 0)) rc = -1;
+    if (in) fclose(in);
+    if (hot && fclose(hot) != 0) rc = -1;
+    if (cold && fclose(cold) != 0) rc = -1;
+    free(batch);
+    if (rc == 0 && (rename(COLD_FILE ".tmp", COLD_FILE) != 0 || rename(FILENAME ".tmp", FILENAME) != 0)) rc = -1;
+    if (rc != 0) {
+        perror("Error converting " FILENAME);
+        remove(FILENAME ".tmp");
+        remove(COLD_FILE ".tmp");
+        return -1;
+    }
+    printf("Converted %ld accounts in %s to format version %d.\n", count, FILENAME, FORMAT_VERSION);
+    return 0;
+}
+
+// --- Batch Processing ---
+
+/**
+ * @brief Applies a file of transactions, one "acc_no D|W amount" or
+ * "acc_no T amount to_acc_no" per line, on `threads` workers. The accounts
+ * are divided among the workers, and every account's transactions apply in
+ * file order, so the outcome is that of applying the file in order whatever
+ * the number of threads. Workers commit the journal every BATCH_CHUNK
+ * transactions. Once every update is durable, the new balances are written
+ * back in one pass over FILENAME. Writes one result line per transaction, in
+ * file order, to result_path.
+ * @return 0 on success, -1 on an I/O or memory error.
+ */
+int run_batch(const char *txn_path, const char *result_path, int threads) {
+    struct BatchEngine engine;
+    memset(&engine, 0, sizeof(engine));
+    if (batch_read(txn_path, &engine.txns, &engine.count) != 0) return -1;
+
+    size_t n = 0;
+    long *records = batch_accounts(engine.txns, engine.count, &n);
+    engine.balances = malloc((n ? n : 1) * sizeof(double));
+    int rc = (records && engine.balances) ? batch_balances(records, engine.balances, n, 0) : -1;
+    if (rc != 0) perror("Error reading accounts");
+
+    if (rc == 0) {
+        pthread_t workers[MAX_THREADS];
+        int started = 0;
+        pthread_mutex_init(&engine.lock, NULL);
+        pthread_cond_init(&engine.progress, NULL);
+        // The accounts are divided among the workers that did start
+        pthread_mutex_lock(&engine.lock);
+        while (started < threads && pthread_create(&workers[started], NULL, batch_worker, &engine) == 0) started++;
+        engine.workers = started ? started : 1;
+        pthread_mutex_unlock(&engine.lock);
+        if (started == 0) batch_worker(&engine);
+        for (int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+        pthread_cond_destroy(&engine.progress);
+        pthread_mutex_destroy(&engine.lock);
+        // Every update is in the journal, so FILENAME can be written
+        if (engine.failed || batch_balances(records, engine.balances, n, 1) != 0) {
+            perror("Error updating accounts");
+            journal.unapplied = 1;
+            rc = -1;
+        } else {
+            journal_maybe_checkpoint();
+        }
+    }
+    free(records);
+    free(engine.balances);
+    if (rc != 0) {
+        free(engine.txns);
+        return -1;
+    }
+
+    size_t totals[4] = {0};
+    FILE *out = fopen(result_path, "w");
+    if (!out) {
+        perror("Error writing results");
+        free(engine.txns);
+        return -1;
+    }
+    for (size_t i = 0; i < engine.count; i++) {
+        totals[engine.txns[i].status]++;
+        batch_write_result(out, &engine.txns[i]);
+    }
+    rc = fclose(out) == 0 ? 0 : -1;
+    if (rc != 0) perror("Error writing results");
+    printf("Processed %zu transactions: %zu applied, %zu with insufficient funds, %zu for unknown accounts, %zu invalid.\n",
+           engine.count, totals[BATCH_OK], totals[BATCH_INSUFFICIENT_FUNDS], totals[BATCH_NO_SUCH_ACCOUNT], totals[BATCH_INVALID]);
+    free(engine.txns);
+    return rc;
+}
+
+/**
+ * @brief Reads a transaction file, looking up each account's position. Blank
+ * lines and lines starting with '#' are skipped; malformed ones are kept as
+ * BATCH_INVALID so that they still get a result line.
+ * @return 0 on success, -1 if the file could not be read or memory ran out.
+ */
+int batch_read(const char *txn_path, struct BatchTxn **txns, size_t *count) {
+    FILE *in = fopen(txn_path, "r");
+    if (!in) {
+        perror("Error opening transactions");
+        return -1;
+    }
+    char line[MAX_LINE_LEN];
+    size_t cap = 0;
+    long line_no = 0;
+    *txns = NULL;
+    *count = 0;
+    while (fgets(line, sizeof(line), in)) {
+        line_no++;
+        char *p = line + strspn(line, " \t");
+        if (*p == '\n' || *p == '\0' || *p == '#') continue;
+        if (*count == cap) {
+            size_t new_cap = cap ? cap * 2 : 1024;
+            struct BatchTxn *grown = realloc(*txns, new_cap * sizeof(struct BatchTxn));
+            if (!grown) {
+                printf("Error: Out of memory reading transactions.\n");
+                free(*txns);
+                fclose(in);
+                return -1;
+            }
+            *txns = grown;
+            cap = new_cap;
+        }
+
+        struct BatchTxn *t = &(*txns)[(*count)++];
+        char op[16];
+        memset(t, 0, sizeof(*t));
+        t->line = line_no;
+        t->record = -1;
+        t->to_record = -1;
+        t->status = BATCH_INVALID;
+        int fields = sscanf(p, "%d %15s %lf %d", &t->acc_no, op, &t->amount, &t->to_acc_no);
+        if (fields < 3 || !isfinite(t->amount) || !(t->amount > 0)) continue;
+        t->op = (char)(op[0] & ~0x20);
+        if (op[1] != '\0' || (t->op != 'D' && t->op != 'W' && t->op != 'T')) continue;
+        if ((t->op == 'T') != (fields == 4) || (t->op == 'T' && t->to_acc_no == t->acc_no)) continue;
+        t->record = index_find(t->acc_no);
+        if (t->op == 'T') t->to_record = index_find(t->to_acc_no);
+        t->status = (t->record >= 0 && (t->op != 'T' || t->to_record >= 0)) ? BATCH_OK : BATCH_NO_SUCH_ACCOUNT;
+    }
+    fclose(in);
+    return 0;
+}
+
+/**
+ * @brief Collects the distinct positions of the accounts the transactions
+ * touch, sorted, and turns each transaction's positions into slots in
+ * that array; those of transactions that are not applied become -1.
+ * @return The positions (n of them), or NULL if memory ran out.
+ */
+long *batch_accounts(struct BatchTxn *txns, size_t count, size_t *n) {
+    long *records = malloc((2 * count + 1) * sizeof(long));
+    if (!records) return NULL;
+    *n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (txns[i].status != BATCH_OK) continue;
+        records[(*n)++] = txns[i].record;
+        if (txns[i].op == 'T') records[(*n)++] = txns[i].to_record;
+    }
+    qsort(records, *n, sizeof(long), cmp_long);
+    size_t unique = 0;
+    for (size_t i = 0; i < *n; i++) {
+        if (unique == 0 || records[unique - 1] != records[i]) records[unique++] = records[i];
+    }
+    *n = unique;
+    for (size_t i = 0; i < count; i++) {
+        struct BatchTxn *t = &txns[i];
+        if (t->status != BATCH_OK) {
+            t->record = t->to_record = -1;
+            continue;
+        }
+        t->record = (long *)bsearch(&t->record, records, unique, sizeof(long), cmp_long) - records;
+        if (t->op == 'T') t->to_record = (long *)bsearch(&t->to_record, records, unique, sizeof(long), cmp_long) - records;
+    }
+    return records;
+}
+
+/**
+ * @brief Reads (or, with `write`, stores) the balances of the accounts at the
+ * sorted positions `records`, in a single pass over FILENAME that touches
+ * only the LOAD_BATCH blocks holding one of them.
+ * @return 0 on success, -1 on an I/O error.
+ */
+int batch_balances(const long *records, double *balances, size_t n, int write) {
+    if (n == 0) return 0;
+    FILE *fp = fopen(FILENAME, write ? "rb+" : "rb");
+    struct HotRecord *batch = malloc(LOAD_BATCH * sizeof(struct HotRecord));
+    int rc = (fp && batch) ? 0 : -1;
+    size_t next = 0;
+    while (rc == 0 && next < n) {
+        long first = records[next] - records[next] % LOAD_BATCH;
+        size_t got = 0;
+        long offset = (long)sizeof(struct FileHeader) + first * (long)sizeof(struct HotRecord);
+        if (fseek(fp, offset, SEEK_SET) == 0) got = fread(batch, sizeof(struct HotRecord), LOAD_BATCH, fp);
+        if (records[next] >= first + (long)got) {
+            rc = -1;
+            break;
+        }
+        for (; next < n && records[next] < first + (long)got; next++) {
+            if (write) batch[records[next] - first].balance = balances[next];
+            else balances[next] = batch[records[next] - first].balance;
+        }
+        if (write && (fseek(fp, offset, SEEK_SET) != 0 || fwrite(batch, sizeof(struct HotRecord), got, fp) != got)) rc = -1;
+    }
+    if (fp && fclose(fp) != 0) rc = -1;
+    free(batch);
+    return rc;
+}
+
+// Applies, in file order, the transactions of the accounts this worker owns
+void *batch_worker(void *arg) {
+    struct BatchEngine *engine = arg;
+    pthread_mutex_lock(&engine->lock);
+    int self = engine->joined++, workers = engine->workers;
+    pthread_mutex_unlock(&engine->lock);
+
+    size_t pending = 0;
+    int rc = 0;
+    for (size_t i = 0; i < engine->count && rc == 0; i++) {
+        struct BatchTxn *t = &engine->txns[i];
+        // Not t->status: the worker applying a transfer changes it meanwhile
+        if (t->record < 0) continue;
+        int from = (int)(t->record % workers);
+        int to = t->op == 'T' ? (int)(t->to_record % workers) : from;
+        if (from != self && to != self) continue;
+        if (from == to) {
+            rc = batch_apply(engine, t);
+        } else if (from == self) {
+            rc = batch_wait(engine, to, i);
+            if (rc == 0) rc = batch_apply(engine, t);
+            batch_reach(engine, self, i + 1);
+        } else {
+            batch_reach(engine, self, i);
+            rc = batch_wait(engine, from, i + 1);
+            continue;
+        }
+        if (rc == 0 && ++pending == BATCH_CHUNK) {
+            rc = journal_commit();
+            pending = 0;
+        }
+    }
+    if (rc == 0) rc = journal_commit();
+    if (rc != 0) {
+        pthread_mutex_lock(&engine->lock);
+        engine->failed = 1;
+        pthread_cond_broadcast(&engine->progress);
+        pthread_mutex_unlock(&engine->lock);
+    }
+    return NULL;
+}
+
+// Records that a worker has applied all its transactions before `txn`
+void batch_reach(struct BatchEngine *engine, int worker, size_t txn) {
+    pthread_mutex_lock(&engine->lock);
+    engine->reached[worker] = txn;
+    pthread_cond_broadcast(&engine->progress);
+    pthread_mutex_unlock(&engine->lock);
+}
+
+// Waits until a worker has applied all its transactions before `txn`; -1 if another worker failed
+int batch_wait(struct BatchEngine *engine, int worker, size_t txn) {
+    pthread_mutex_lock(&engine->lock);
+    while (engine->reached[worker] < txn && !engine->failed) pthread_cond_wait(&engine->progress, &engine->lock);
+    int rc = engine->failed ? -1 : 0;
+    pthread_mutex_unlock(&engine->lock);
+    return rc;
+}
+
+// Applies one transaction and journals the new balances. No other worker
+// touches its accounts meanwhile.
+int batch_apply(struct BatchEngine *engine, struct BatchTxn *t) {
+    if (t->status != BATCH_OK) return 0;
+    double *balance = &engine->balances[t->record];
+    int rc = 0;
+    if (t->op != 'D' && *balance < t->amount) {
+        t->status = BATCH_INSUFFICIENT_FUNDS;
+    } else if (t->op == 'T') {
+        double *to = &engine->balances[t->to_record];
+        *balance -= t->amount;
+        *to += t->amount;
+        t->to_balance = *to;
+    } else {
+        *balance += (t->op == 'D') ? t->amount : -t->amount;
+    }
+    t->balance = *balance;
+    if (t->op == 'T') {
+        if (t->status == BATCH_INSUFFICIENT_FUNDS) t->to_balance = engine->balances[t->to_record];
+        else rc = journal_append_transfer(t);
+    } else if (t->status == BATCH_OK) {
+        rc = journal_append(t->acc_no, t->op, t->amount, t->balance);
+    }
+    return rc;
+}
+
+void batch_write_result(FILE *out, const struct BatchTxn *t) {
+    static const char *names[] = {"OK", "INSUFFICIENT_FUNDS", "NO_SUCH_ACCOUNT", "INVALID"};
+    if (t->status == BATCH_INVALID) {
+        fprintf(out, "%ld INVALID\n", t->line);
+    } else if (t->op == 'T') {
+        fprintf(out, "%ld %d T %.2f %d %s %.2f %.2f\n", t->line, t->acc_no, t->amount, t->to_acc_no, names[t->status], t->balance, t->to_balance);
+    } else {
+        fprintf(out, "%ld %d %c %.2f %s %.2f\n", t->line, t->acc_no, t->op, t->amount, names[t->status], t->balance);
+    }
+}
+
+int cmp_long(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+// --- Month-End Processing ---
+
+/**
+ * @brief Pays a month of interest, at `rate` percent a year rounded to the
+ * cent, on every positive balance and writes a statement line per account to
+ * statements_path. Blocks of accounts are handled by `threads` workers; each
+ * block's interest is journaled and committed before the block is written
+ * back. Reports progress every second and the throughput at the end.
+ * @return 0 on success, -1 on an I/O or memory error.
+ */
+int run_month_end(double rate, const char *statements_path, int threads) {
+    struct MonthEnd job;
+    memset(&job, 0, sizeof(job));
+    job.rate = rate;
+    job.records = acc_index.record_count;
+    job.out = fopen(statements_path, "w");
+    if (!job.out) {
+        perror("Error writing statements");
+        return -1;
+    }
+    setvbuf(job.out, NULL, _IOFBF, STATEMENT_BUFFER);
+    fprintf(job.out, "# acc_no\tname\topening\tinterest\tclosing\n");
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.turn, NULL);
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_t workers[MAX_THREADS];
+    int started = 0;
+    pthread_mutex_lock(&job.lock);
+    while (started < threads && pthread_create(&workers[started], NULL, month_end_worker, &job) == 0) {
+        started++;
+        job.running++;
+    }
+    pthread_mutex_unlock(&job.lock);
+    if (started == 0) {
+        job.running = 1;
+        month_end_worker(&job);
+    }
+
+    // Wake at least once a second to report progress until the last worker is done
+    struct timespec report_at;
+    clock_gettime(CLOCK_REALTIME, &report_at);
+    report_at.tv_sec++;
+    pthread_mutex_lock(&job.lock);
+    while (job.running > 0) {
+        if (pthread_cond_timedwait(&job.turn, &job.lock, &report_at) != ETIMEDOUT) continue;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double secs = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+        printf("Month-end: %ld of %ld accounts (%d%%), %.0f accounts/s\n", job.done, job.records,
+               job.records ? (int)(job.done * 100 / job.records) : 100, job.done / secs);
+        fflush(stdout);
+        report_at.tv_sec++;
+    }
+    pthread_mutex_unlock(&job.lock);
+    for (int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.turn);
+
+    int rc = job.failed ? -1 : 0;
+    if (fclose(job.out) != 0) rc = -1;
+    if (rc != 0) {
+        perror("Error running month-end");
+        journal.unapplied = 1;
+        return -1;
+    }
+    journal_maybe_checkpoint();
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double secs = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Month-end: paid %.2f in interest on %ld accounts in %.2f s (%.0f accounts/s). Statements are in %s.\n",
+           job.paid, job.done, secs, secs > 0 ? job.done / secs : 0.0, statements_path);
+    return 0;
+}
+
+// Claims blocks until none are left; a failed worker keeps taking its turn so the others never wait on it
+void *month_end_worker(void *arg) {
+    struct MonthEnd *job = arg;
+    FILE *hot = fopen(FILENAME, "rb+");
+    FILE *cold = fopen(COLD_FILE, "rb");
+    struct HotRecord *hb = malloc(LOAD_BATCH * sizeof(struct HotRecord));
+    struct ColdRecord *cb = malloc(LOAD_BATCH * sizeof(struct ColdRecord));
+    char *text = malloc(LOAD_BATCH * STATEMENT_MAX);
+    int rc = (hot && cold && hb && cb && text) ? 0 : -1;
+
+    for (;;) {
+        long block = __atomic_fetch_add(&job->next_block, 1, __ATOMIC_RELAXED);
+        long first = block * LOAD_BATCH;
+        if (first >= job->records) break;
+        size_t n = (size_t)(job->records - first < LOAD_BATCH ? job->records - first : LOAD_BATCH);
+        size_t len = 0;
+        double paid = 0;
+        if (rc == 0 && !__atomic_load_n(&job->failed, __ATOMIC_RELAXED)) rc = month_end_block(job, hot, cold, first, n, hb, cb, text, &len, &paid);
+
+        pthread_mutex_lock(&job->lock);
+        while (job->written_block != block) pthread_cond_wait(&job->turn, &job->lock);
+        if (rc == 0 && !job->failed && fwrite(text, 1, len, job->out) != len) rc = -1;
+        if (rc != 0) job->failed = 1;
+        if (!job->failed) {
+            job->done += (long)n;
+            job->paid += paid;
+        }
+        job->written_block++;
+        pthread_cond_broadcast(&job->turn);
+        pthread_mutex_unlock(&job->lock);
+    }
+
+    pthread_mutex_lock(&job->lock);
+    job->running--;
+    pthread_cond_broadcast(&job->turn);
+    pthread_mutex_unlock(&job->lock);
+    if (hot) fclose(hot);
+    if (cold) fclose(cold);
+    free(hb);
+    free(cb);
+    free(text);
+    return NULL;
+}
+
+/**
+ * @brief Pays the interest of the n accounts from record `first` and formats
+ * their statements into text. The new balances reach FILENAME only after
+ * their journal entries are committed.
+ * @return 0 on success, -1 on an I/O error.
+ */
+int month_end_block(struct MonthEnd *job, FILE *hot, FILE *cold, long first, size_t n, struct HotRecord *hb,
+                    struct ColdRecord *cb, char *text, size_t *len, double *paid) {
+    long hot_offset = (long)sizeof(struct FileHeader) + first * (long)sizeof(struct HotRecord);
+    long cold_offset = (long)sizeof(struct FileHeader) + first * (long)sizeof(struct ColdRecord);
+    if (fseek(hot, hot_offset, SEEK_SET) != 0 || fread(hb, sizeof(struct HotRecord), n, hot) != n ||
+        fseek(cold, cold_offset, SEEK_SET) != 0 || fread(cb, sizeof(struct ColdRecord), n, cold) != n) {
+        return -1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (!(hb[i].flags & ACCOUNT_OPEN)) continue;
+        double opening = hb[i].balance;
+        double interest = opening > 0 ? (long long)(opening * job->rate / 12 + 0.5) / 100.0 : 0.0;
+        if (interest > 0) {
+            hb[i].balance += interest;
+            if (journal_append(hb[i].acc_no, 'I', interest, hb[i].balance) != 0) return -1;
+        }
+        *paid += interest;
+        int w = snprintf(text + *len, STATEMENT_MAX, "%d\t%.*s\t%.2f\t%.2f\t%.2f\n", hb[i].acc_no,
+                         (int)strnlen(cb[i].name, sizeof(cb[i].name)), cb[i].name, opening, interest, hb[i].balance);
+        if (w < 0 || w >= STATEMENT_MAX) return -1;
+        *len += (size_t)w;
+    }
+    if (journal_commit() != 0) return -1;
+    if (fseek(hot, hot_offset, SEEK_SET) != 0 || fwrite(hb, sizeof(struct HotRecord), n, hot) != n || fflush(hot) != 0) return -1;
+    return 0;
+}
+
+// --- Journal ---
+
+/**
+ * @brief Opens JOURNAL_FILE for appending after replaying whatever a crash
+ * may have kept out of FILENAME.
+ * @return 0 on success, -1 on an I/O error (errno is set).
+ */
+int journal_open() {
+    journal.fd = open(JOURNAL_FILE, O_RDWR | O_CREAT, 0644);
+    if (journal.fd < 0) return -1;
+    FILE *fp = fopen(CHECKPOINT_FILE, "rb");
+    if (fp) {
+        struct Checkpoint c;
+        if (fread(&c, sizeof(c), 1, fp) == 1 && c.check == checksum(&c, offsetof(struct Checkpoint, check))) journal.ckpt = c;
+        fclose(fp);
+    }
+    journal.next_seq = journal.ckpt.seq + 1;
+    return journal_recover();
+}
+
+/**
+ * @brief Re-applies the journal entries after the checkpoint to FILENAME, in
+ * order, up to the first torn or out-of-sequence entry, where the journal is
+ * cut so that new entries follow the last good one. Then checkpoints.
+ * @return 0 on success, -1 on an I/O error.
+ */
+int journal_recover() {
+    FILE *accounts = NULL;
+    struct JournalEntry e;
+    uint64_t offset = journal.ckpt.offset;
+    int replayed = 0;
+
+    while (pread(journal.fd, &e, sizeof(e), (off_t)offset) == (ssize_t)sizeof(e)) {
+        if (e.check != checksum(&e, offsetof(struct JournalEntry, check)) || e.seq != journal.next_seq) break;
+        if (e.op == 'T') {
+            // Half a transfer never committed
+            struct JournalEntry r;
+            if (pread(journal.fd, &r, sizeof(r), (off_t)(offset + sizeof(e))) != (ssize_t)sizeof(r) ||
+                r.check != checksum(&r, offsetof(struct JournalEntry, check)) || r.seq != e.seq + 1 || r.op != 'R') {
+                break;
+            }
+        }
+        // An account whose creation never reached FILENAME has nothing to update
+        long record = index_find(e.acc_no);
+        struct HotRecord acc;
+        if (record >= 0) {
+            if (!accounts && !(accounts = fopen(FILENAME, "rb+"))) return -1;
+            if (read_record(accounts, record, &acc, sizeof(acc)) != 0) {
+                fclose(accounts);
+                return -1;
+            }
+            acc.balance = e.balance;
+            if (write_record(accounts, record, &acc, sizeof(acc)) != 0) {
+                fclose(accounts);
+                return -1;
+            }
+        }
+        journal.next_seq++;
+        offset += sizeof(e);
+        replayed++;
+    }
+    journal.durable_seq = journal.next_seq - 1;
+    if (accounts && fclose(accounts) != 0) return -1;
+    if (ftruncate(journal.fd, (off_t)offset) != 0 || lseek(journal.fd, (off_t)offset, SEEK_SET) < 0) return -1;
+    journal.size = offset;
+    if (replayed > 0) printf("Recovered %d balance updates from %s.\n", replayed, JOURNAL_FILE);
+    return replayed > 0 ? journal_checkpoint() : 0;
+}
+
+// Buffers a balance change; it is durable only after journal_commit
+int journal_append(int acc_no, char op, double amount, double balance) {
+    pthread_mutex_lock(&journal.lock);
+    int rc = (journal.buffered == JOURNAL_BUFFER) ? journal_write() : 0;
+    if (rc == 0) journal_add(acc_no, op, amount, balance);
+    pthread_mutex_unlock(&journal.lock);
+    return rc;
+}
+
+// Buffers both sides of a transfer next to each other
+int journal_append_transfer(const struct BatchTxn *t) {
+    pthread_mutex_lock(&journal.lock);
+    int rc = (journal.buffered + 2 > JOURNAL_BUFFER) ? journal_write() : 0;
+    if (rc == 0) {
+        journal_add(t->acc_no, 'T', t->amount, t->balance);
+        journal_add(t->to_acc_no, 'R', t->amount, t->to_balance);
+    }
+    pthread_mutex_unlock(&journal.lock);
+    return rc;
+}
+
+// Adds an entry to the buffer, which has room; journal.lock is held
+void journal_add(int acc_no, char op, double amount, double balance) {
+    struct JournalEntry *e = &journal.buf[journal.buffered++];
+    memset(e, 0, sizeof(*e));
+    e->seq = journal.next_seq++;
+    e->acc_no = acc_no;
+    e->op = op;
+    e->amount = amount;
+    e->balance = balance;
+    e->check = checksum(e, offsetof(struct JournalEntry, check));
+}
+
+// Writes the buffered entries out, without waiting for the disk; journal.lock is held
+int journal_write() {
+    size_t len = journal.buffered * sizeof(struct JournalEntry);
+    const char *p = (const char *)journal.buf;
+    while (len > 0) {
+        ssize_t n = write(journal.fd, p, len);
+        if (n < 0) return -1;
+        p += n;
+        len -= (size_t)n;
+        journal.size += (uint64_t)n;
+    }
+    journal.buffered = 0;
+    return 0;
+}
+
+/**
+ * @brief Makes every entry appended so far durable. One committer at a time
+ * writes the buffer and syncs; those arriving meanwhile wait and are usually
+ * covered by its sync or share the following one.
+ * @return 0 on success, -1 on an I/O error.
+ */
+int journal_commit() {
+    pthread_mutex_lock(&journal.lock);
+    uint64_t target = journal.next_seq - 1;
+    while (journal.durable_seq < target && !journal.failed) {
+        if (journal.syncing) {
+            pthread_cond_wait(&journal.synced, &journal.lock);
+            continue;
+        }
+        uint64_t upto = journal.next_seq - 1;
+        if (journal_write() != 0) {
+            journal.failed = 1;
+            break;
+        }
+        journal.syncing = 1;
+        pthread_mutex_unlock(&journal.lock);
+        int rc = fdatasync(journal.fd);
+        pthread_mutex_lock(&journal.lock);
+        journal.syncing = 0;
+        if (rc != 0) journal.failed = 1;
+        else journal.durable_seq = upto;
+        pthread_cond_broadcast(&journal.synced);
+    }
+    int rc = journal.failed ? -1 : 0;
+    pthread_mutex_unlock(&journal.lock);
+    return rc;
+}
+
+/**
+ * @brief Records that FILENAME holds every committed entry: FILENAME is synced
+ * first, then the checkpoint is replaced atomically. The journal itself is
+ * kept as the transaction history.
+ * @return 0 on success, -1 on an I/O error.
+ */
+int journal_checkpoint() {
+    int fd = open(FILENAME, O_RDWR);
+    if (fd >= 0 && fsync(fd) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (fd >= 0) close(fd);
+
+    struct Checkpoint c;
+    memset(&c, 0, sizeof(c));
+    c.seq = journal.next_seq - 1;
+    c.offset = journal.size;
+    c.check = checksum(&c, offsetof(struct Checkpoint, check));
+    FILE *fp = fopen(CHECKPOINT_FILE ".tmp", "wb");
+    if (!fp) return -1;
+    int rc = (fwrite(&c, sizeof(c), 1, fp) == 1 && fflush(fp) == 0 && fsync(fileno(fp)) == 0) ? 0 : -1;
+    if (fclose(fp) != 0) rc = -1;
+    if (rc == 0) rc = rename(CHECKPOINT_FILE ".tmp", CHECKPOINT_FILE);
+    if (rc == 0) journal.ckpt = c;
+    return rc;
+}
+
+// Checkpoints once the journal has grown by JOURNAL_CHECKPOINT_BYTES; call only after the committed entries are in FILENAME
+void journal_maybe_checkpoint() {
+    if (!journal.unapplied && journal.size - journal.ckpt.offset >= JOURNAL_CHECKPOINT_BYTES && journal_checkpoint() != 0) {
+        perror("Error checkpointing " FILENAME);
+    }
+}
+
+// Checkpoints unless a failed update left entries that only the next start's replay can apply
+void journal_close() {
+    if (journal.fd < 0) return;
+    if (!journal.unapplied && journal.size > journal.ckpt.offset && journal_checkpoint() != 0) perror("Error checkpointing " FILENAME);
+    close(journal.fd);
+    journal.fd = -1;
+}
+
+// FNV-1a, enough to tell a torn write from a whole one
+uint32_t checksum(const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+// --- Password Hashing ---
+
+// Stores a freshly salted key derived at this host's cost
+int set_password(struct Credential *cred, const char *password) {
+    FILE *rnd = fopen("/dev/urandom", "rb");
+    if (!rnd) return -1;
+    size_t got = fread(cred->salt, 1, KDF_SALT_LEN, rnd);
+    fclose(rnd);
+    if (got != KDF_SALT_LEN) return -1;
+    cred->version = CRED_PBKDF2;
+    cred->cost = (unsigned char)kdf_cost();
+    pbkdf2(password, cred->salt, KDF_SALT_LEN, 1UL << cred->cost, cred->key);
+    return 0;
+}
+
+/**
+ * @brief Checks a password against an account's credential. A repeat of a
+ * recent successful login from the same terminal session is answered from
+ * verify_cache with one SHA-256 instead of the full derivation.
+ * @return 1 if the password matches, 0 if not.
+ */
+int verify_password(const struct ColdRecord *acc, const char *password) {
+    if (acc->cred.version != CRED_PBKDF2) {
+        char hash[MAX_PASS_LEN];
+        hash_password(password, hash);
+        return strncmp((const char *)&acc->cred, hash, sizeof(acc->cred)) == 0;
+    }
+    if (acc->cred.cost >= 8 * sizeof(unsigned long)) return 0;
+
+    pid_t session = getsid(0);
+    time_t now = time(NULL);
+    unsigned char digest[32];
+    struct Sha256 s;
+    sha256_init(&s);
+    sha256_update(&s, acc->cred.key, KDF_KEY_LEN);
+    sha256_update(&s, password, strlen(password));
+    sha256_final(&s, digest);
+    struct VerifiedLogin *v = &verify_cache[((unsigned)acc->acc_no * 2654435761u ^ (unsigned)session) & (VERIFY_CACHE_SIZE - 1)];
+    if (v->session == session && v->acc_no == acc->acc_no && v->expires > now && equal_bytes(v->digest, digest, sizeof(digest))) return 1;
+
+    unsigned char key[KDF_KEY_LEN];
+    pbkdf2(password, acc->cred.salt, KDF_SALT_LEN, 1UL << acc->cred.cost, key);
+    if (!equal_bytes(key, acc->cred.key, KDF_KEY_LEN)) return 0;
+    v->session = session;
+    v->acc_no = acc->acc_no;
+    memcpy(v->digest, digest, sizeof(digest));
+    v->expires = now + VERIFY_CACHE_TTL;
+    return 1;
+}
+
+/**
+ * @brief The log2 iteration count that makes one derivation take about
+ * KDF_TARGET_MS here, measured once per run. Each credential keeps the cost
+ * it was made with, so verifying it takes the same time on the same host.
+ */
+int kdf_cost() {
+    if (kdf_cost_tuned) return kdf_cost_tuned;
+    struct timespec start, end;
+    unsigned char key[KDF_KEY_LEN], salt[KDF_SALT_LEN] = {0};
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pbkdf2("benchmark", salt, KDF_SALT_LEN, 1UL << KDF_MIN_COST, key);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    int cost = KDF_MIN_COST;
+    while (cost < KDF_MAX_COST && ms < KDF_TARGET_MS) {
+        cost++;
+        ms *= 2;
+    }
+    kdf_cost_tuned = cost;
+    return cost;
+}
+
+// PBKDF2-HMAC-SHA256 for a single KDF_KEY_LEN block
+void pbkdf2(const char *password, const unsigned char *salt, size_t salt_len, unsigned long iterations, unsigned char *out) {
+    struct Hmac m;
+    unsigned char u[32], first[64 + 4];
+    hmac_init(&m, password, strlen(password));
+    if (salt_len > 64) salt_len = 64;
+    memcpy(first, salt, salt_len);
+    memcpy(first + salt_len, "\0\0\0\1", 4);
+    hmac(&m, first, salt_len + 4, u);
+    memcpy(out, u, KDF_KEY_LEN);
+    for (unsigned long i = 1; i < iterations; i++) {
+        hmac(&m, u, sizeof(u), u);
+        for (int j = 0; j < KDF_KEY_LEN; j++) out[j] ^= u[j];
+    }
+}
+
+void hmac_init(struct Hmac *m, const void *key, size_t len) {
+    unsigned char k[64] = {0}, pad[64];
+    if (len > sizeof(k)) {
+        struct Sha256 s;
+        sha256_init(&s);
+        sha256_update(&s, key, len);
+        sha256_final(&s, k);
+    } else {
+        memcpy(k, key, len);
+    }
+    for (int i = 0; i < 64; i++) pad[i] = k[i] ^ 0x36;
+    sha256_init(&m->inner);
+    sha256_update(&m->inner, pad, sizeof(pad));
+    for (int i = 0; i < 64; i++) pad[i] = k[i] ^ 0x5c;
+    sha256_init(&m->outer);
+    sha256_update(&m->outer, pad, sizeof(pad));
+}
+
+void hmac(const struct Hmac *m, const void *data, size_t len, unsigned char *out) {
+    struct Sha256 s = m->inner;
+    sha256_update(&s, data, len);
+    sha256_final(&s, out);
+    s = m->outer;
+    sha256_update(&s, out, 32);
+    sha256_final(&s, out);
+}
+
+void sha256_init(struct Sha256 *s) {
+    static const uint32_t iv[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(s->h, iv, sizeof(iv));
+    s->used = 0;
+    s->length = 0;
+}
+
+void sha256_update(struct Sha256 *s, const void *data, size_t len) {
+    const unsigned char *p = data;
+    s->length += len;
+    while (len > 0) {
+        size_t take = sizeof(s->block) - s->used;
+        if (take > len) take = len;
+        memcpy(s->block + s->used, p, take);
+        s->used += take;
+        p += take;
+        len -= take;
+        if (s->used == sizeof(s->block)) {
+            sha256_block(s->h, s->block);
+            s->used = 0;
+        }
+    }
+}
+
+void sha256_final(struct Sha256 *s, unsigned char *out) {
+    uint64_t bits = s->length * 8;
+    s->block[s->used++] = 0x80;
+    if (s->used > 56) {
+        memset(s->block + s->used, 0, sizeof(s->block) - s->used);
+        sha256_block(s->h, s->block);
+        s->used = 0;
+    }
+    memset(s->block + s->used, 0, 56 - s->used);
+    for (int i = 0; i < 8; i++) s->block[56 + i] = (unsigned char)(bits >> (56 - 8 * i));
+    sha256_block(s->h, s->block);
+    for (int i = 0; i < 8; i++) {
+        out[4 * i] = (unsigned char)(s->h[i] >> 24);
+        out[4 * i + 1] = (unsigned char)(s->h[i] >> 16);
+        out[4 * i + 2] = (unsigned char)(s->h[i] >> 8);
+        out[4 * i + 3] = (unsigned char)s->h[i];
+    }
+}
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+// Compresses one 64-byte block into the state h
+void sha256_block(uint32_t *h, const unsigned char *p) {
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = hh + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+        uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        hh = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += hh;
+}
+
+// Compares without stopping at the first difference, so timing says nothing about the key
+int equal_bytes(const unsigned char *a, const unsigned char *b, size_t len) {
+    unsigned char diff = 0;
+    for (size_t i = 0; i < len; i++) diff |= a[i] ^ b[i];
+    return diff == 0;
+}
@@ -2,11 +2,24 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
-
-#define USERS_FILE "chat_users.txt"
+#include <limits.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#define USERS_FILE "chat_users.dat" // USERS_MAGIC, then "username\0password\0" per user in registration order
+#define LEGACY_USERS_FILE "chat_users.txt" // "username;password" lines; converted once when USERS_FILE is missing
+#define USERS_MAGIC "CHATDIR1"
+#define DIRECTORY_MIN_CAP 1024 // Initial slots of the user directory; always a power of two
 #define MESSAGES_FILE "chat_messages.txt"
+#define INBOX_DIR "chat_inbox" // One index file per recipient
+#define INBOX_MARK INBOX_DIR "/indexed" // How many bytes of MESSAGES_FILE the index covers
+#define INBOX_PAGE 20 // Messages shown at a time
+#define INBOX_SYNC_BATCH (1 << 20) // Messages indexed per round while catching up
 #define MAX_LEN 100
 #define MAX_MSG_LEN 256
+#define MAX_LINE_LEN (2 * MAX_LEN + MAX_MSG_LEN + 32)
 
 struct User {
     char username[MAX_LEN];
@@ -20,6 +33,34 @@ struct Message {
     long timestamp;
 };
 
+// A message to one user: where its line starts in MESSAGES_FILE. A user's
+// entries are kept in timestamp order (a clock that went back is clamped to
+// the previous entry), so a page can be found by binary search.
+struct InboxEntry {
+    long offset;
+    long timestamp;
+};
+
+// An entry waiting to be added while catching up, with the hash of its recipient
+struct InboxPending {
+    unsigned long long user;
+    struct InboxEntry entry;
+};
+
+// Every registered user, loaded once. `data` is USERS_FILE as on disk, so
+// loading is a single read; the slots (open addressing, linear probing) hold
+// the offset of a username in it plus one, 0 marking an empty slot.
+struct UserDirectory {
+    char *data;
+    size_t len;
+    size_t cap;
+    size_t *slots;
+    size_t slot_cap;
+    size_t count;
+};
+
+struct UserDirectory users;
+
 // --- Function Prototypes ---
 void register_user();
 void login();
@@ -29,10 +70,35 @@ void view_inbox(const char *username);
 void list_users();
 int user_exists(const char *username);
 void clear_input_buffer();
+int directory_load();
+int directory_migrate();
+int directory_add(const char *username, const char *password);
+int directory_reload();
+int directory_refresh(FILE *fp);
+int directory_scan(size_t size);
+int directory_insert(size_t offset);
+const char *directory_find(const char *username);
+size_t directory_slot(const struct UserDirectory *dir, const char *username);
+int inbox_sync();
+int inbox_flush(struct InboxPending *pending, size_t count);
+int inbox_append(unsigned long long user, struct InboxEntry *entries, size_t count);
+long inbox_load(const char *username, struct InboxEntry **entries);
+long inbox_find(const struct InboxEntry *entries, long count, long before);
+long inbox_read_mark();
+int inbox_set_mark(long offset);
+unsigned long long user_hash(const char *username);
+void inbox_path(unsigned long long user, char *path, size_t len);
+int cmp_pending(const void *a, const void *b);
+int parse_message(const char *line, struct Message *msg);
 
 // --- Main Function ---
 int main() {
     int choice;
+    if (directory_load() != 0) {
+        perror("Error loading " USERS_FILE);
+        return 1;
+    }
+    if (inbox_sync() != 0) perror("Error indexing " MESSAGES_FILE);
     while (1) {
         printf("\n===== Offline Chat Simulation =====\n");
         printf("1. Register\n");
@@ -76,9 +142,15 @@ void register_user() {
     fgets(u.password, MAX_LEN, stdin);
     u.password[strcspn(u.password, "\n")] = 0;
 
-    FILE *fp = fopen(USERS_FILE, "a");
-    fprintf(fp, "%s;%s\n", u.username, u.password);
-    fclose(fp);
+    int rc = directory_add(u.username, u.password);
+    if (rc > 0) {
+        printf("Username already exists.\n");
+        return;
+    }
+    if (rc != 0) {
+        perror("Error registering user");
+        return;
+    }
 
     printf("User '%s' registered successfully.\n", u.username);
 }
@@ -94,21 +166,15 @@ void login() {
     fgets(password, MAX_LEN, stdin);
     password[strcspn(password, "\n")] = 0;
 
-    FILE *fp = fopen(USERS_FILE, "r");
-    if (!fp) {
+    // Someone may have registered from another process since we started
+    if (!directory_find(username)) directory_reload();
+    if (users.count == 0) {
         printf("No users registered yet.\n");
         return;
     }
 
-    struct User u;
-    int logged_in = 0;
-    while (fscanf(fp, "%[^;];%[^\n]\n", u.username, u.password) == 2) {
-        if (strcmp(u.username, username) == 0 && strcmp(u.password, password) == 0) {
-            logged_in = 1;
-            break;
-        }
-    }
-    fclose(fp);
+    const char *stored = directory_find(username);
+    int logged_in = stored && strcmp(stored, password) == 0;
 
     if (logged_in) {
         printf("\nLogin successful. Welcome, %s!\n", username);
@@ -164,13 +230,38 @@ void send_message(const char *sender) {
     msg.content[strcspn(msg.content, "\n")] = 0;
     msg.timestamp = time(NULL);
 
+    // Other processes send too: the message, its index entry and the mark are
+    // written under an exclusive lock on MESSAGES_FILE, so every index gets
+    // its entries in file order
     FILE *fp = fopen(MESSAGES_FILE, "a");
+    if (!fp || flock(fileno(fp), LOCK_EX) != 0 || fseek(fp, 0, SEEK_END) != 0) {
+        perror("Error sending message");
+        if (fp) fclose(fp);
+        return;
+    }
+    long offset = ftell(fp);
     fprintf(fp, "%s;%s;%ld;%s\n", msg.sender, msg.receiver, msg.timestamp, msg.content);
-    fclose(fp);
+    long end = ftell(fp);
+    int rc = (fflush(fp) == 0 && offset >= 0 && end >= 0) ? 0 : -1;
+    // The mark only moves past messages that are all indexed: if this or an
+    // earlier send failed to index, the next start indexes them from the mark
+    struct InboxEntry entry = {offset, msg.timestamp};
+    if (rc == 0 && inbox_append(user_hash(msg.receiver), &entry, 1) == 0 && inbox_read_mark() == offset) inbox_set_mark(end);
+    if (fclose(fp) != 0) rc = -1;
+    if (rc != 0) {
+        perror("Error sending message");
+        return;
+    }
 
     printf("Message sent to %s.\n", msg.receiver);
 }
 
+/**
+ * @brief Shows a user's messages, newest page first, reading only the
+ * messages their inbox index points at. Each page holds INBOX_PAGE messages,
+ * or a few more so that messages sent in the same second stay together, and
+ * the next one starts before the oldest timestamp shown.
+ */
 void view_inbox(const char *username) {
     printf("\n--- Your Inbox ---\n");
     FILE *fp = fopen(MESSAGES_FILE, "r");
@@ -179,18 +270,33 @@ void view_inbox(const char *username) {
         return;
     }
 
+    struct InboxEntry *entries = NULL;
+    long total = inbox_load(username, &entries);
     struct Message msg;
+    char line[MAX_LINE_LEN];
     int count = 0;
-    while (fscanf(fp, "%[^;];%[^;];%ld;%[^\n]\n", msg.sender, msg.receiver, &msg.timestamp, msg.content) == 4) {
-        if (strcmp(msg.receiver, username) == 0) {
+    long end = total;
+    while (end > 0) {
+        long start = end > INBOX_PAGE ? end - INBOX_PAGE : 0;
+        start = inbox_find(entries, end, entries[start].timestamp);
+        for (long i = start; i < end; i++) {
+            if (fseek(fp, entries[i].offset, SEEK_SET) != 0 || !fgets(line, sizeof(line), fp)) continue;
+            // Index files are named by a hash, so check whose message this is
+            if (parse_message(line, &msg) != 0 || strcmp(msg.receiver, username) != 0) continue;
             time_t ts = msg.timestamp;
             char time_str[30];
             strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M", localtime(&ts));
             printf("From: %s [%s]\n> %s\n\n", msg.sender, time_str, msg.content);
             count++;
         }
+        end = start;
+        if (end > 0) {
+            printf("Show older messages? (y/n): ");
+            if (!fgets(line, sizeof(line), stdin) || (line[0] != 'y' && line[0] != 'Y')) break;
+        }
     }
     fclose(fp);
+    free(entries);
 
     if (count == 0) {
         printf("Your inbox is empty.\n");
@@ -201,34 +307,375 @@ void view_inbox(const char *username) {
 
 void list_users() {
     printf("\n--- Registered Users ---\n");
-    FILE *fp = fopen(USERS_FILE, "r");
-    if (!fp) {
+    directory_reload();
+    if (users.count == 0) {
         printf("No users registered.\n");
         return;
     }
+    // In registration order: each username is followed by its password
+    for (size_t i = strlen(USERS_MAGIC); i < users.len;) {
+        printf("- %s\n", users.data + i);
+        i += strlen(users.data + i) + 1;
+        i += strlen(users.data + i) + 1;
+    }
+}
+
+int user_exists(const char *username) {
+    if (directory_find(username)) return 1;
+    return directory_reload() == 0 && directory_find(username) != NULL;
+}
+
+void clear_input_buffer() {
+    int c;
+    while ((c = getchar()) != '\n' && c != EOF);
+}
+
+// --- User Directory ---
+
+/**
+ * @brief Reads USERS_FILE with one fread and indexes every username,
+ * converting LEGACY_USERS_FILE first if only that exists. A torn last entry
+ * is left out; the next registration overwrites it.
+ * @return 0 on success, -1 on an I/O or memory error, or if USERS_FILE is
+ * not a user directory.
+ */
+int directory_load() {
+    FILE *fp = fopen(USERS_FILE, "rb");
+    if (!fp) {
+        if (directory_migrate() != 0) return -1;
+        fp = fopen(USERS_FILE, "rb");
+    }
+    long size = -1;
+    if (fp && fseek(fp, 0, SEEK_END) == 0) size = ftell(fp);
+    size_t magic = strlen(USERS_MAGIC);
+    users.cap = size > 0 ? (size_t)size : magic;
+    users.data = malloc(users.cap);
+    if (!users.data || size < 0 || fseek(fp, 0, SEEK_SET) != 0 || fread(users.data, 1, (size_t)size, fp) != (size_t)size) {
+        if (fp) fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    if ((size_t)size < magic || memcmp(users.data, USERS_MAGIC, magic) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    users.len = magic;
+    return directory_scan((size_t)size);
+}
+
+// Writes USERS_FILE from LEGACY_USERS_FILE, or an empty directory if there is none
+int directory_migrate() {
+    FILE *in = fopen(LEGACY_USERS_FILE, "r");
+    FILE *out = fopen(USERS_FILE ".tmp", "wb");
+    if (!out) {
+        if (in) fclose(in);
+        return -1;
+    }
+    int rc = fwrite(USERS_MAGIC, strlen(USERS_MAGIC), 1, out) == 1 ? 0 : -1;
     struct User u;
-    while (fscanf(fp, "%[^;];%[^\n]\n", u.username, u.password) == 2) {
-        printf("- %s\n", u.username);
+    while (rc == 0 && in && fscanf(in, "%99[^;];%99[^\n]\n", u.username, u.password) == 2) {
+        if (fwrite(u.username, strlen(u.username) + 1, 1, out) != 1 || fwrite(u.password, strlen(u.password) + 1, 1, out) != 1) rc = -1;
+    }
+    if (in) fclose(in);
+    if (fclose(out) != 0) rc = -1;
+    if (rc == 0) rc = rename(USERS_FILE ".tmp", USERS_FILE);
+    if (rc != 0) remove(USERS_FILE ".tmp");
+    return rc;
+}
+
+/**
+ * @brief Registers a user. Holding an exclusive lock on USERS_FILE, first
+ * picks up users other processes appended since we last read it, then
+ * appends after the last whole entry and adds it to the in-memory directory.
+ * @return 0 on success, 1 if the username was taken meanwhile, -1 on an I/O
+ * or memory error.
+ */
+int directory_add(const char *username, const char *password) {
+    FILE *fp = fopen(USERS_FILE, "rb+");
+    if (!fp) return -1;
+    if (flock(fileno(fp), LOCK_EX) != 0 || directory_refresh(fp) != 0) {
+        fclose(fp);
+        return -1;
+    }
+    if (directory_find(username)) {
+        fclose(fp);
+        return 1;
+    }
+
+    size_t name_len = strlen(username) + 1, pass_len = strlen(password) + 1;
+    if (users.len + name_len + pass_len > users.cap) {
+        size_t cap = users.cap * 2 > users.len + name_len + pass_len ? users.cap * 2 : users.len + name_len + pass_len;
+        char *grown = realloc(users.data, cap);
+        if (!grown) {
+            fclose(fp);
+            return -1;
+        }
+        users.data = grown;
+        users.cap = cap;
     }
+    size_t offset = users.len;
+    memcpy(users.data + offset, username, name_len);
+    memcpy(users.data + offset + name_len, password, pass_len);
+
+    // Writing over a torn tail is safe under the lock; truncate what is left of it
+    int rc = (fseek(fp, (long)offset, SEEK_SET) == 0 && fwrite(users.data + offset, name_len + pass_len, 1, fp) == 1 && fflush(fp) == 0) ? 0 : -1;
+    if (rc == 0 && ftruncate(fileno(fp), (off_t)(offset + name_len + pass_len)) != 0) rc = -1;
+    if (fclose(fp) != 0) rc = -1;
+    if (rc == 0) rc = directory_insert(offset);
+    if (rc == 0) users.len += name_len + pass_len;
+    return rc;
+}
+
+// Picks up users other processes registered since we last read USERS_FILE
+int directory_reload() {
+    FILE *fp = fopen(USERS_FILE, "rb");
+    if (!fp) return -1;
+    int rc = directory_refresh(fp);
     fclose(fp);
+    return rc;
 }
 
-int user_exists(const char *username) {
-    FILE *fp = fopen(USERS_FILE, "r");
+/**
+ * @brief Reads whatever `fp` holds past users.len into users.data and indexes
+ * the whole entries in it. Costs one seek when nothing was appended.
+ * @return 0 on success, -1 on an I/O or memory error.
+ */
+int directory_refresh(FILE *fp) {
+    if (fseek(fp, 0, SEEK_END) != 0) return -1;
+    long size = ftell(fp);
+    if (size < 0) return -1;
+    if ((size_t)size <= users.len) return 0;
+    if ((size_t)size > users.cap) {
+        size_t cap = users.cap * 2 > (size_t)size ? users.cap * 2 : (size_t)size;
+        char *grown = realloc(users.data, cap);
+        if (!grown) return -1;
+        users.data = grown;
+        users.cap = cap;
+    }
+    size_t extra = (size_t)size - users.len;
+    if (fseek(fp, (long)users.len, SEEK_SET) != 0 || fread(users.data + users.len, 1, extra, fp) != extra) return -1;
+    return directory_scan((size_t)size);
+}
+
+// Indexes the whole "name\0pass\0" entries in users.data from users.len up to
+// `size`, leaving users.len after the last one; a torn tail stays unindexed
+int directory_scan(size_t size) {
+    size_t i = users.len;
+    while (i < size) {
+        const char *name_end = memchr(users.data + i, '\0', size - i);
+        const char *pass_end = name_end ? memchr(name_end + 1, '\0', size - (size_t)(name_end + 1 - users.data)) : NULL;
+        if (!pass_end) break;
+        if (directory_insert(i) != 0) return -1;
+        i = (size_t)(pass_end + 1 - users.data);
+        users.len = i;
+    }
+    return 0;
+}
+
+/**
+ * @brief Indexes the username at `offset` in users.data, doubling the slots
+ * once they are half full.
+ * @return 0 on success, -1 if memory ran out.
+ */
+int directory_insert(size_t offset) {
+    if ((users.count + 1) * 2 > users.slot_cap) {
+        size_t cap = users.slot_cap ? users.slot_cap * 2 : DIRECTORY_MIN_CAP;
+        size_t *slots = calloc(cap, sizeof(size_t));
+        if (!slots) return -1;
+        struct UserDirectory grown = users;
+        grown.slots = slots;
+        grown.slot_cap = cap;
+        for (size_t i = 0; i < users.slot_cap; i++) {
+            if (users.slots[i] != 0) slots[directory_slot(&grown, users.data + users.slots[i] - 1)] = users.slots[i];
+        }
+        free(users.slots);
+        users.slots = slots;
+        users.slot_cap = cap;
+    }
+    size_t i = directory_slot(&users, users.data + offset);
+    if (users.slots[i] == 0) users.count++;
+    users.slots[i] = offset + 1;
+    return 0;
+}
+
+// Returns the password of a registered user, or NULL if there is no such user
+const char *directory_find(const char *username) {
+    if (users.slot_cap == 0) return NULL;
+    size_t i = directory_slot(&users, username);
+    if (users.slots[i] == 0) return NULL;
+    const char *name = users.data + users.slots[i] - 1;
+    return name + strlen(name) + 1;
+}
+
+// Slot of a username: where it is, or the empty slot where it belongs
+size_t directory_slot(const struct UserDirectory *dir, const char *username) {
+    size_t i = (size_t)user_hash(username) & (dir->slot_cap - 1);
+    while (dir->slots[i] != 0 && strcmp(dir->data + dir->slots[i] - 1, username) != 0) i = (i + 1) & (dir->slot_cap - 1);
+    return i;
+}
+
+// --- Inbox Index ---
+
+/**
+ * @brief Brings the inbox index up to date with MESSAGES_FILE, indexing every
+ * message past INBOX_MARK: messages from before the index existed, and any
+ * whose send was interrupted before the index was updated. Entries are
+ * grouped by recipient, so each index file is opened once per round. Holds
+ * the lock on MESSAGES_FILE that senders take.
+ * @return 0 on success, -1 on an I/O or memory error.
+ */
+int inbox_sync() {
+    if (mkdir(INBOX_DIR, 0755) != 0 && errno != EEXIST) return -1;
+    FILE *fp = fopen(MESSAGES_FILE, "r");
     if (!fp) return 0;
-    struct User u;
-    int found = 0;
-    while (fscanf(fp, "%[^;];%[^\n]\n", u.username, u.password) == 2) {
-        if (strcmp(u.username, username) == 0) {
-            found = 1;
-            break;
+    if (flock(fileno(fp), LOCK_EX) != 0) {
+        fclose(fp);
+        return -1;
+    }
+    long mark = inbox_read_mark();
+    struct InboxPending *pending = malloc(INBOX_SYNC_BATCH * sizeof(struct InboxPending));
+    if (!pending || fseek(fp, mark, SEEK_SET) != 0) {
+        free(pending);
+        fclose(fp);
+        return -1;
+    }
+
+    char line[MAX_LINE_LEN];
+    struct Message msg;
+    long offset = mark;
+    size_t count = 0;
+    int rc = 0;
+    while (rc == 0 && fgets(line, sizeof(line), fp)) {
+        if (parse_message(line, &msg) == 0) {
+            pending[count].user = user_hash(msg.receiver);
+            pending[count].entry.offset = offset;
+            pending[count].entry.timestamp = msg.timestamp;
+            count++;
+        }
+        offset = ftell(fp);
+        if (count == INBOX_SYNC_BATCH) {
+            rc = inbox_flush(pending, count);
+            if (rc == 0) rc = inbox_set_mark(offset);
+            count = 0;
         }
     }
+    if (rc == 0) rc = inbox_flush(pending, count);
+    if (rc == 0 && offset != mark) rc = inbox_set_mark(offset);
+    free(pending);
     fclose(fp);
-    return found;
+    return rc;
 }
 
-void clear_input_buffer() {
-    int c;
-    while ((c = getchar()) != '\n' && c != EOF);
+// Appends pending entries with one index-file update per recipient
+int inbox_flush(struct InboxPending *pending, size_t count) {
+    qsort(pending, count, sizeof(struct InboxPending), cmp_pending);
+    struct InboxEntry *entries = malloc((count ? count : 1) * sizeof(struct InboxEntry));
+    if (!entries) return -1;
+    int rc = 0;
+    for (size_t i = 0; i < count && rc == 0;) {
+        size_t n = 0;
+        unsigned long long user = pending[i].user;
+        while (i < count && pending[i].user == user) entries[n++] = pending[i++].entry;
+        rc = inbox_append(user, entries, n);
+    }
+    free(entries);
+    return rc;
+}
+
+/**
+ * @brief Adds entries, in offset order, to a user's index. Entries the index
+ * already has (their offset is not past its last one) are skipped, so
+ * re-indexing after an interrupted send never lists a message twice.
+ * @return 0 on success, -1 on an I/O error.
+ */
+int inbox_append(unsigned long long user, struct InboxEntry *entries, size_t count) {
+    char path[64];
+    inbox_path(user, path, sizeof(path));
+    FILE *fp = fopen(path, "rb+");
+    if (!fp) fp = fopen(path, "wb+");
+    if (!fp) return -1;
+
+    struct InboxEntry last = {-1, LONG_MIN};
+    if (fseek(fp, -(long)sizeof(last), SEEK_END) == 0 && fread(&last, sizeof(last), 1, fp) != 1) last.offset = -1;
+    size_t first = 0;
+    while (first < count && entries[first].offset <= last.offset) first++;
+    for (size_t i = first; i < count; i++) {
+        if (entries[i].timestamp < last.timestamp) entries[i].timestamp = last.timestamp;
+        last = entries[i];
+    }
+    int rc = 0;
+    if (first < count && (fseek(fp, 0, SEEK_END) != 0 || fwrite(entries + first, sizeof(struct InboxEntry), count - first, fp) != count - first)) rc = -1;
+    if (fclose(fp) != 0) rc = -1;
+    return rc;
+}
+
+// Reads a user's whole index; returns the number of entries
+long inbox_load(const char *username, struct InboxEntry **entries) {
+    char path[64];
+    inbox_path(user_hash(username), path, sizeof(path));
+    *entries = NULL;
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return 0;
+    long count = 0;
+    if (fseek(fp, 0, SEEK_END) == 0) count = ftell(fp) / (long)sizeof(struct InboxEntry);
+    if (count > 0) *entries = malloc(count * sizeof(struct InboxEntry));
+    if (!*entries || fseek(fp, 0, SEEK_SET) != 0) count = 0;
+    else count = (long)fread(*entries, sizeof(struct InboxEntry), count, fp);
+    fclose(fp);
+    return count;
+}
+
+// Returns the first of `count` sorted entries whose timestamp is at least `before`
+long inbox_find(const struct InboxEntry *entries, long count, long before) {
+    long lo = 0, hi = count;
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        if (entries[mid].timestamp < before) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Returns the offset INBOX_MARK holds; 0, so that everything is indexed again, if it cannot be read
+long inbox_read_mark() {
+    long mark = 0;
+    FILE *fp = fopen(INBOX_MARK, "r");
+    if (fp) {
+        if (fscanf(fp, "%ld", &mark) != 1) mark = 0;
+        fclose(fp);
+    }
+    return mark;
+}
+
+int inbox_set_mark(long offset) {
+    FILE *fp = fopen(INBOX_MARK, "w");
+    if (!fp) return -1;
+    fprintf(fp, "%ld\n", offset);
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+// 64-bit FNV-1a of a username; inbox index files are named by it, so any username makes a safe file name
+unsigned long long user_hash(const char *username) {
+    unsigned long long h = 14695981039346656037ull;
+    for (const unsigned char *p = (const unsigned char *)username; *p; p++) h = (h ^ *p) * 1099511628211ull;
+    return h;
+}
+
+void inbox_path(unsigned long long user, char *path, size_t len) {
+    snprintf(path, len, INBOX_DIR "/%016llx.idx", user);
+}
+
+// Orders pending entries by recipient, then by position in MESSAGES_FILE
+int cmp_pending(const void *a, const void *b) {
+    const struct InboxPending *x = a, *y = b;
+    if (x->user != y->user) return (x->user > y->user) - (x->user < y->user);
+    return (x->entry.offset > y->entry.offset) - (x->entry.offset < y->entry.offset);
+}
+
+// Splits a MESSAGES_FILE line; the content may be empty
+int parse_message(const char *line, struct Message *msg) {
+    msg->content[0] = '\0';
+    int n = sscanf(line, "%99[^;];%99[^;];%ld;%255[^\n]", msg->sender, msg->receiver, &msg->timestamp, msg->content);
+    return n >= 3 ? 0 : -1;
 }
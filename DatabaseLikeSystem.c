@@ -1,164 +1,8890 @@
+#define _GNU_SOURCE // For writer-preferring reader/writer locks
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_AVX2_KERNELS 1 // Selected at runtime when the CPU supports AVX2
+#endif
 
-#define MAX_CMD_LEN 512
 #define MAX_TABLE_NAME 50
 #define MAX_COL_NAME 50
 #define MAX_COLS 10
 #define MAX_ROW_LEN 1024
+#define MAX_PATH_LEN 128
+#define BLOCK_ROWS 4096 // Rows read per column per I/O during a scan
+#define READ_BUFFER_SIZE (1 << 20)
+#define WRITE_BUFFER_SIZE (1 << 20)
+#define CHUNK_ROWS (16 * BLOCK_ROWS) // Rows handed to a scan worker at a time
+#define SCAN_WINDOW 4 // Finished chunks each worker may run ahead of ordered output
+#define MAX_THREADS 64
+#define ARENA_BLOCK_SIZE (1 << 20)
+#define TABLE_MAGIC "MSQLTBL1"
+#define TABLE_VERSION 2
+#define BITMAP_WORDS (BLOCK_ROWS / 64)
+#define MAX_PREDICATES 16
+#define MAX_TOKEN_LEN 256
+#define MAX_INDEXES 4
+#define INDEX_MAGIC "MSQLIDX1"
+#define BPT_PAGE_SIZE 4096
+#define BPT_LEAF_MAX ((BPT_PAGE_SIZE - 16) / 16)
+#define BPT_INNER_MAX ((BPT_PAGE_SIZE - 16) / 24)
+#define INDEX_SELECTIVITY 8 // Use an index only while it narrows the scan to 1/8 of the rows
+#define WAL_FILE "minisql.wal" // Log of a single-process version; each process now logs to minisql-<pid>.wal
+#define WAL_MAGIC 0x4C41574DU // "MWAL"
+#define WAL_BUFFER_SIZE (1 << 20) // Log bytes buffered before they are written out
+#define WAL_BATCH_BYTES (1 << 20) // Row bytes an appender gathers into one log record
+#define WAL_CHECKPOINT_BYTES (64 << 20) // Log size that triggers a checkpoint
+#define MAX_DIRTY_TABLES 64
+#define MAX_CATALOG_TABLES 64
+#define STMT_CACHE_SIZE 64
+#define STMT_KEY_MAX 4096 // Longer statements (such as bulk INSERTs) are planned but not cached
+#define MAX_PLAN_NODES 8
+#define POOL_PAGE_SIZE (BLOCK_ROWS * sizeof(uint64_t)) // One column block per buffer pool page
+#define POOL_MAX_FRAMES (1 << 19) // Must be a power of two; caps the budget at 16GB
+#define POOL_MIN_FRAMES 1024 // Enough for every scan worker to pin its blocks
+#define POOL_MAX_FILES 256
+#define POOL_DEFAULT_MB 256
+#define SORT_MEMORY (64 << 20) // Memory an ORDER BY buffers before spilling sorted runs
+#define SORT_TOPK_MAX 100000 // Larger LIMITs use the full external sort
+#define SORT_IO_BUFFER (64 << 10)
+#define JOIN_MEMORY (64 << 20) // Build rows a hash join holds before partitioning both sides to disk
+#define JOIN_PARTITIONS 32
+#define AGG_MEMORY (64 << 20) // Groups an aggregation holds before partitioning them to disk
+#define AGG_PARTITIONS 32
+#define MAX_SELECT_ITEMS (2 * MAX_COLS) // Enough for SELECT * over a join
+#define CODE_MAGIC 0x43444F43U // "CODC"
+#define SERVER_READ_SIZE (64 << 10)
+#define SESSION_INPUT_MAX (64 << 20) // Unanswered input a client may send before it is disconnected
+#define SESSION_OUT_BUFFER (64 << 10)
+#define SESSION_SEND_TIMEOUT 30 // Seconds a client may leave its reply unread before it is disconnected
+#define REPLY_END ".\n" // Ends the reply to each statement in server mode
+#define TXN_FILE "minisql.txn"
+#define TXN_MAGIC 0x4E58544DU // "MTXN"
+#define MAX_PROCESSES 64 // Processes that may share one table directory
+#define MAX_TXN_TABLES 8 // Tables one transaction may write
+#define LOCK_TIMEOUT 30 // Seconds a writer waits for another writer of the same table
+#define VACUUM_INTERVAL 10 // Seconds between passes of the background vacuum
+
+// Orderings accepted by a comparison operator
+#define ORD_LT 1
+#define ORD_EQ 2
+#define ORD_GT 4
+
+// Column types. Every column file stores fixed-width 8-byte values: the value
+// itself for INT/REAL, and the end offset into the column's string heap for TEXT.
+// A TEXT column declared DICT instead keeps each distinct string once in its
+// heap (the dictionary) and packs the row's dictionary code into its column file.
+typedef enum { COL_INT = 1, COL_REAL = 2, COL_TEXT = 3 } ColType;
+
+// On-disk header stored in <table>.dat
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t col_count;
+    uint64_t row_count;
+    uint8_t col_types[MAX_COLS];
+    uint16_t sorted_cols; // Bit per INT/REAL column whose values never decrease
+    uint16_t dict_cols; // Bit per dictionary-encoded TEXT column
+    uint8_t reserved[2];
+    uint64_t commit_txn; // Commit that published this row count; version 1 headers end before it
+} TableHeader;
+
+// Start of the column file of a DICT column. Row r's code is the `bits`-bit
+// field at bit r * bits after it, least significant bits first. The file is
+// rewritten with a wider field when the dictionary outgrows 2^bits codes.
+typedef struct {
+    uint32_t magic;
+    uint32_t bits;
+} CodeHeader;
+
+// Precedes each string of a dictionary; the code of a string is its position.
+// `check` lets a reader stop at an entry torn by a crash.
+typedef struct {
+    uint32_t len;
+    uint32_t check;
+} DictEntry;
+
+// A dictionary in memory: the valid part of the heap file and where each
+// code's entry starts in it. Appenders also hash the strings to their codes.
+typedef struct {
+    char *data;
+    size_t size;
+    size_t cap;
+    uint64_t *offs;
+    uint32_t count;
+    uint32_t offs_cap;
+    uint64_t *slots; // Per string: the high half of its hash, then its code + 1; 0 when empty
+    uint32_t slot_count; // A power of two, or 0 without a hash table
+} Dict;
+
+// Statistics of one column over one block of BLOCK_ROWS rows, stored in
+// <table>.<col>.zone at entry (row / BLOCK_ROWS). `min` and `max` are
+// zone_key values, which order like the column's values. `rows` is the
+// number of rows covered; 0 marks an unknown block that is never skipped.
+typedef struct {
+    uint64_t min;
+    uint64_t max;
+    uint64_t rows;
+} ZoneEntry;
+
+// A secondary index as listed in <table>.idx
+typedef struct {
+    char name[MAX_COL_NAME];
+    int col;
+} IndexDef;
+
+// In-memory view of a table: the schema from <table>.sch, its header and indexes
+typedef struct {
+    char name[MAX_TABLE_NAME];
+    int col_count;
+    char cols[MAX_COLS][MAX_COL_NAME];
+    ColType types[MAX_COLS];
+    TableHeader header;
+    int index_count;
+    IndexDef indexes[MAX_INDEXES];
+} Table;
+
+// A single column value parsed from an INSERT statement
+typedef struct {
+    int64_t i;
+    double r;
+    const char *s;
+    size_t len;
+} Value;
+
+// --- Query Types ---
+
+typedef enum { TOK_END, TOK_IDENT, TOK_NUMBER, TOK_STRING, TOK_OP, TOK_LPAREN, TOK_RPAREN, TOK_COMMA, TOK_STAR, TOK_ERROR } TokenType;
+
+// `src` and `src_len` give the token's raw text in the statement, including
+// any quotes; literals are numbered by `param` in order of appearance.
+typedef struct {
+    TokenType type;
+    char text[MAX_TOKEN_LEN];
+    const char *src;
+    size_t src_len;
+    int param; // -1 for anything but a literal
+} Token;
+
+// Cursor over a statement; `tok` is the current (not yet consumed) token
+typedef struct {
+    const char *p;
+    Token tok;
+    int literals;
+} Lexer;
+
+typedef enum { OP_EQ, OP_NE, OP_LT, OP_LE, OP_GT, OP_GE, OP_PREFIX } CmpOp;
+typedef enum { EXPR_CMP, EXPR_AND, EXPR_OR } ExprKind;
+
+// A node of a WHERE clause. Comparison leaves hold a column and a literal,
+// AND/OR nodes refer to their children by index into Where.nodes. A cached
+// plan rebinds `lit` from statement literal number `param` on every run.
+typedef struct {
+    ExprKind kind;
+    int left, right;
+    int side; // Table of the column in a join: 0 for FROM, 1 for JOIN
+    int col;
+    CmpOp op;
+    Value lit;
+    char text[MAX_TOKEN_LEN];
+    int param;
+} Expr;
+
+typedef struct {
+    Expr nodes[MAX_PREDICATES * 2];
+    int count;
+    int root; // -1 when there is no WHERE clause
+} Where;
+
+// Tables a SELECT resolves column names against: the FROM table and any JOIN table
+typedef struct {
+    const Table *tables[2];
+    int count;
+} Scope;
+
+// One block of a column as loaded by a scan. For TEXT columns `values` holds
+// heap end offsets and `heap` the block's string bytes starting at heap_base.
+// Page-aligned blocks point `values` into the pinned pool `frame`; others are
+// copied into `buf`. For DICT columns `values` holds the rows' codes, unpacked
+// into `buf` from the packed bytes read into `heap`.
+typedef struct {
+    uint64_t *values;
+    uint64_t *buf;
+    int frame;
+    char *heap;
+    size_t heap_cap;
+    uint64_t heap_base;
+    uint64_t heap_next; // Heap offset where the following block starts
+    const Dict *dict; // NULL unless the column is a DICT column
+    int bits;
+} ColumnBlock;
+
+// Reads the needed columns of a table block by block
+typedef struct {
+    const Table *t;
+    int needed[MAX_COLS];
+    int col_file[MAX_COLS];
+    int heap_file[MAX_COLS];
+    ColumnBlock blocks[MAX_COLS];
+    uint64_t next_row;
+    int sequential; // Whole-table scans; see pool_pin
+    Dict *dicts[MAX_COLS];
+    // For each comparison of the WHERE clause the scan is filtered by that
+    // tests a DICT column: the codes it accepts, built on first use, their
+    // number, and the lowest one
+    uint64_t *code_sets[MAX_PREDICATES * 2];
+    uint32_t code_matches[MAX_PREDICATES * 2];
+    uint32_t code_first[MAX_PREDICATES * 2];
+    uint64_t bytes_read; // Column and heap bytes loaded, for EXPLAIN ANALYZE
+} Scan;
+
+// --- Index Types ---
+
+// B+-tree entries are ordered by (key, row), which keeps duplicate keys unique
+typedef struct {
+    uint64_t key;
+    uint64_t row;
+} IndexEntry;
+
+// One page of <table>.<index>.bpt. Leaves hold entries and link to their right
+// sibling through `next`; inner pages keep their leftmost child in `next` and
+// (separator, child) pairs after it, each separator being its child's first entry.
+typedef struct {
+    uint32_t is_leaf;
+    uint32_t count;
+    uint64_t next;
+    union {
+        IndexEntry entries[BPT_LEAF_MAX];
+        struct {
+            IndexEntry sep;
+            uint64_t child;
+        } inner[BPT_INNER_MAX];
+    };
+} IndexPage;
+
+typedef char index_page_size_check[(sizeof(IndexPage) == BPT_PAGE_SIZE) ? 1 : -1];
+
+// Page 0 of an index file
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t col;
+    uint64_t root;
+    uint64_t page_count;
+    uint64_t height;
+} IndexMeta;
+
+typedef struct {
+    int file; // Buffer pool file, -1 when closed
+    IndexMeta meta;
+} Index;
+
+// --- Bulk Write Types ---
+
+// Gathers appended bytes for one file; full buffers are copied into the buffer pool
+typedef struct {
+    int file; // -1 when unused
+    uint64_t off; // File offset of buf[0]
+    char *buf;
+    size_t len;
+} ColumnWriter;
+
+// Appends rows at the end of a table through one buffered writer per file.
+// Rows become visible only when appender_close commits the new row count.
+typedef struct {
+    Table *t;
+    ColumnWriter col_out[MAX_COLS];
+    ColumnWriter heap_out[MAX_COLS];
+    uint64_t heap_end[MAX_COLS];
+    Index indexes[MAX_INDEXES];
+    uint64_t row_count;
+    uint64_t floor_rows; // Replay only: published rows the new row count never drops below
+    uint64_t txn;
+    uint64_t lsn; // Log position of the COMMIT record, for wal_commit
+    uint32_t more; // Tables of the same transaction that commit after this one
+    char *batch; // Rows not yet logged, in WAL row encoding
+    size_t batch_len;
+    size_t batch_cap;
+    uint32_t batch_rows;
+    int replay; // Set during recovery: rows are already in the log
+    uint16_t sorted; // Becomes the header's sorted_cols on commit
+    Value last[MAX_COLS]; // Previous value of each INT/REAL column
+    int zone_file[MAX_COLS];
+    ZoneEntry zones[MAX_COLS]; // Entries of the block being appended to
+    Dict dicts[MAX_COLS];
+    int code_bits[MAX_COLS];
+    uint64_t code_acc[MAX_COLS]; // Packed bits not yet making up a whole byte
+    int code_fill[MAX_COLS];
+} Appender;
+
+// --- Write-Ahead Log Types ---
+
+typedef enum { WAL_BEGIN = 1, WAL_ROWS = 2, WAL_COMMIT = 3 } WalType;
+
+// Every log record starts with this header; `checksum` covers the payload.
+// BEGIN carries the table name; ROWS carries the table name, the first row
+// number, the row count and the rows. COMMIT carries the table name, its new
+// row count and how many more of the transaction's tables follow: only the
+// COMMIT with none left commits the transaction.
+typedef struct {
+    uint32_t magic;
+    uint32_t type;
+    uint64_t txn;
+    uint32_t len;
+    uint32_t checksum;
+} WalRecord;
+
+// This process's log. Records collect in `buf`; `next_lsn`, `written_lsn` and
+// `synced_lsn` are byte positions of the appended, written and durable log.
+typedef struct {
+    int fd;
+    char *buf;
+    size_t len;
+    size_t cap;
+    uint64_t next_lsn;
+    uint64_t written_lsn;
+    uint64_t synced_lsn;
+    uint64_t checkpoint_lsn;
+    uint64_t next_txn;
+    int syncing;
+    int failed;
+    int open_txns; // Transactions with rows in the log but no COMMIT yet; a checkpoint waits for none
+    char path[MAX_PATH_LEN];
+    char dirty[MAX_DIRTY_TABLES][MAX_TABLE_NAME]; // Tables written since the last checkpoint
+    int dirty_count;
+    int dirty_overflow;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_rwlock_t gate; // Held shared while appending to the log and exclusively by checkpoints
+} Wal;
+
+// A ROWS record of a committed transaction, found by wal_scan
+typedef struct {
+    int log; // Which of the logs being replayed
+    long off; // Where its payload starts
+    uint32_t len;
+    uint64_t txn;
+    uint64_t start_row;
+    char table[MAX_TABLE_NAME];
+} WalRows;
+
+// What wal_scan collects from the logs being replayed
+typedef struct {
+    WalRows *rows;
+    size_t count;
+    size_t cap;
+    char touched[MAX_DIRTY_TABLES][MAX_TABLE_NAME]; // Tables named in any record; their indexes are rebuilt
+    int touched_count;
+} WalReplay;
+
+// --- Transaction Types ---
+
+// A version of a table kept in <table>.ver while old snapshots may need it:
+// snapshots from `txn` on (until the next entry) see the first `row_count`
+// rows. Rows are only ever appended, so a version is just a row count.
+typedef struct {
+    uint64_t txn;
+    uint64_t row_count;
+} VersionEntry;
+
+// A process using the directory and the oldest snapshot it still reads
+typedef struct {
+    int32_t pid; // 0 when the slot is free
+    uint32_t reserved;
+    uint64_t oldest; // UINT64_MAX while it reads no snapshot
+} TxnSlot;
+
+// minisql.txn, mapped shared by every process using the directory. Commits
+// are numbered from `last_commit`. Byte 0 of the file is the commit lock;
+// byte 1 is held shared by every live process, so one can tell it is alone.
+typedef struct {
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t last_commit;
+    TxnSlot slots[MAX_PROCESSES];
+} TxnShared;
+
+// Contents of <table>.lock, whose byte 0 is the table's writer lock and byte 1
+// its index latch. A writer that dies leaves this for the next one to act on.
+typedef struct {
+    uint32_t index_dirty; // A writer changed index pages and has not finished
+    uint32_t reserved;
+    uint64_t txn; // Logged commit not yet published, or 0
+    char log[MAX_PATH_LEN]; // The log holding it
+} LockState;
+
+// A table written by a transaction, with its writer lock and open appender
+typedef struct {
+    Table t;
+    Appender app;
+    int lock_fd; // <table>.lock
+} TxnTable;
+
+// A session's transaction. Outside BEGIN ... COMMIT each statement runs in one
+// of its own. Reads see the tables as of `snapshot`, except those the
+// transaction writes, which show the latest rows plus its own.
+typedef struct Txn {
+    int active; // Inside BEGIN ... COMMIT
+    int failed; // A write failed part way; only ROLLBACK is left
+    int reading; // `snapshot` is registered with the process
+    uint64_t snapshot;
+    uint64_t wal_txn; // Log transaction id shared by the rows of every table
+    TxnTable *tables[MAX_TXN_TABLES];
+    int table_count;
+    struct Txn *prev_reading;
+    struct Txn *next_reading;
+} Txn;
+
+// This process's view of minisql.txn. `reading` lists the transactions with
+// a registered snapshot; `lock` covers it and this process's slot.
+typedef struct {
+    int fd;
+    TxnShared *shared;
+    int slot;
+    Txn *reading;
+    int stopping;
+    int vacuum_started;
+    pthread_t vacuum;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_mutex_t commit; // This process's half of the commit lock; byte 0 of the file is the other
+} TxnManager;
+
+// --- Buffer Pool Types ---
+
+// A pool frame holding one page of a file. `len` is how much of the page
+// exists in the file (or has been written); `ref` is the clock bit.
+typedef struct {
+    int file; // -1 when the frame is free
+    uint64_t page_no;
+    int pins;
+    char dirty;
+    char ref;
+    char loading; // Being read in; waiters sleep on the pool's cond
+    uint32_t len;
+    int next; // Next frame in the same hash bucket
+    char *data;
+} Frame;
+
+typedef struct {
+    char path[MAX_PATH_LEN];
+    int fd; // -1 when the slot is free
+    int refs; // Open handles; only unreferenced files may be closed
+    int retired; // Replaced on disk: no longer found by path, closed by the last pool_release
+    uint64_t used; // Pool tick of the last pool_file call, for picking which to close
+} PoolFile;
+
+// Pages of column, heap and index files shared by every statement and
+// thread. Frame buffers are allocated lazily up to `frame_limit`.
+typedef struct {
+    Frame *frames;
+    int *buckets;
+    int frame_count;
+    int frame_limit;
+    int hand;
+    PoolFile files[POOL_MAX_FILES];
+    uint64_t tick;
+    uint64_t hits;
+    uint64_t misses;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} BufferPool;
+
+// --- Profiling Types ---
+
+// A point in time on the wall clock and in the CPU time of the calling thread
+typedef struct {
+    uint64_t wall_ns;
+    uint64_t cpu_ns;
+} Stamp;
+
+// What EXPLAIN ANALYZE measured for one plan operator. Scan workers add to
+// these concurrently, so they are updated atomically. Times add up over the
+// threads that ran the operator.
+typedef struct {
+    uint64_t rows_in;
+    uint64_t rows_out;
+    uint64_t bytes_read; // Column bytes loaded by a scan
+    uint64_t blocks_read;
+    uint64_t blocks_skipped; // By zone maps
+    uint64_t wall_ns;
+    uint64_t cpu_ns;
+    long candidates; // Scans: rows an index narrowed the scan to, -1 for a full scan
+    char note[64]; // How the operator ran, such as the side a hash join built
+} OpStats;
+
+// The profile of an EXPLAIN statement. Under EXPLAIN ANALYZE the SELECT runs
+// with its result rows going to `sink`, which counts and discards them.
+typedef struct {
+    OpStats ops[MAX_PLAN_NODES];
+    int cached; // The plan came from the statement cache
+    uint64_t parse_ns;
+    uint64_t catalog_ns;
+    uint64_t exec_ns;
+    FILE *sink;
+    uint64_t result_rows;
+    uint64_t result_bytes;
+} Profile;
+
+// --- Parallel Scan Types ---
+
+// Called for each filtered block of a parallel scan. `bits` selects the rows of
+// the block; `out` is the chunk's output stream (NULL for unordered scans).
+// Returns 0 to continue, -1 on error, or 1 to end a serial scan early.
+typedef int (*BlockFn)(void *arg, int worker, const Scan *s, size_t n, const uint64_t *bits, FILE *out);
+
+typedef struct {
+    // Set by the caller
+    const Table *t;
+    const int *needed;
+    const Where *where;
+    const uint64_t *cands; // Sorted candidate rows from an index, or NULL
+    long cand_count;
+    BlockFn fn;
+    void *arg;
+    FILE *out;
+    int serial; // Scan on the calling thread only, so `fn` can stop it early
+    // Zone maps of the columns the WHERE clause compares, NULL where missing
+    ZoneEntry *zones[MAX_COLS];
+    uint64_t blocks_skipped;
+    // Counters of the scan, its filter and the operator `fn` feeds under
+    // EXPLAIN ANALYZE; NULL otherwise
+    OpStats *scan_stats;
+    OpStats *filter_stats;
+    OpStats *fn_stats;
+    // Shared between workers
+    int workers;
+    uint64_t chunk_count;
+    uint64_t next_chunk;
+    uint64_t emitted;
+    char **chunk_buf;
+    size_t *chunk_len;
+    char *chunk_done;
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} ParallelScan;
+
+typedef struct {
+    ParallelScan *ps;
+    int worker;
+    FILE *reply; // Reply stream of the statement running the scan
+} ScanWorker;
+
+// Output columns of a SELECT
+typedef struct {
+    int cols[MAX_SELECT_ITEMS];
+    int count;
+    uint64_t limit; // Rows to print before stopping, 0 for all
+    uint64_t emitted;
+} Projection;
+
+// --- Aggregation Types ---
+
+typedef enum { AGG_COUNT, AGG_SUM, AGG_AVG, AGG_MIN, AGG_MAX } AggFunc;
+
+// One entry of a SELECT list: a column, or an aggregate over a column (-1 for COUNT(*))
+typedef struct {
+    int is_agg;
+    AggFunc func;
+    int side; // Table of the column in a join
+    int col;
+} SelectItem;
+
+// Running state of one aggregate in one group. SUM/MIN/MAX of INT columns
+// use `i`; MIN/MAX of TEXT columns use `s`, which points at a 4-byte length
+// and then the bytes; everything else, including AVG's running sum, uses `d`.
+typedef struct {
+    int64_t count;
+    union {
+        int64_t i;
+        double d;
+        const char *s;
+    } v;
+} AggState;
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used;
+    size_t cap;
+    char data[];
+} ArenaBlock;
+
+// Bump allocator; everything in it is released at once
+typedef struct {
+    ArenaBlock *head;
+} Arena;
+
+// A group of a hash aggregation. Its AggStates follow it in memory, then its key.
+typedef struct {
+    uint64_t hash;
+    uint32_t key_len;
+} AggGroup;
+
+// Open-addressing hash table of groups, one per scan worker
+typedef struct {
+    AggGroup **slots;
+    size_t cap;
+    size_t count;
+    size_t bytes; // Groups and TEXT values in the arena
+    Arena arena;
+    char *key_buf;
+    size_t key_cap;
+    FILE *parts[AGG_PARTITIONS]; // Groups moved to disk once the table outgrew its budget
+} AggTable;
+
+typedef struct {
+    const Table *t;
+    int group_cols[MAX_COLS];
+    int group_count;
+    SelectItem aggs[MAX_SELECT_ITEMS];
+    int agg_count;
+    size_t budget; // Bytes each worker's table holds before it is partitioned
+    AggTable tables[MAX_THREADS];
+} Aggregation;
+
+// --- Sort Types ---
+
+// Buffers records (a memcmp-ordered key and a payload) for ORDER BY. Without
+// a limit, a full buffer is sorted and spilled to a temporary file as a run.
+typedef struct {
+    char *buf; // Records: key length, payload length, key, payload
+    size_t len;
+    size_t cap;
+    size_t dead; // Bytes of records pushed out of the top-K heap
+    size_t *recs; // Offsets of the records in buf
+    size_t count;
+    size_t rec_cap;
+    size_t budget;
+    uint64_t limit; // Keep only the `limit` smallest keys, in a max-heap (0: keep all)
+    FILE **runs;
+    int run_count;
+    int run_cap;
+    char *key; // Key of the record being built
+    size_t key_len;
+    size_t key_cap;
+    char *payload;
+    size_t payload_len;
+    size_t payload_cap;
+} Sorter;
+
+// Position in one sorted run during the final merge
+typedef struct {
+    FILE *fp; // Spilled run, or NULL for records still in memory
+    char **recs;
+    size_t pos;
+    size_t count;
+    char *cur; // Current record, NULL once the run is exhausted
+    char *buf;
+    size_t cap;
+} RunCursor;
+
+// Receives the payload of each record in sorted order
+typedef void (*RecordFn)(void *arg, const char *payload, uint32_t len);
+
+// An ORDER BY key: a table column, or for grouped queries a SELECT item (`item` >= 0)
+typedef struct {
+    int item;
+    int side;
+    int col;
+    int desc;
+} OrderKey;
+
+typedef struct {
+    const Table *t;
+    const OrderKey *keys;
+    int key_count;
+    Projection proj;
+    Sorter sorters[MAX_THREADS];
+} SortJob;
+
+typedef struct {
+    const Aggregation *ag;
+    const SelectItem *items;
+    int item_count;
+    char *buf; // A group copied out of a sorter record, where its states are aligned
+    size_t cap;
+    int failed;
+} GroupPrinter;
+
+// --- Statement Types ---
+
+typedef enum {
+    STMT_CREATE_TABLE, STMT_CREATE_INDEX, STMT_INSERT, STMT_LOAD, STMT_SELECT, STMT_SET_THREADS, STMT_SET_MEMORY,
+    STMT_CHECKPOINT, STMT_BEGIN, STMT_COMMIT, STMT_ROLLBACK, STMT_VACUUM, STMT_EXIT
+} StmtKind;
+
+typedef enum { EXPLAIN_NONE, EXPLAIN_PLAN, EXPLAIN_ANALYZE } ExplainMode;
+
+typedef enum { PLAN_SCAN, PLAN_FILTER, PLAN_JOIN, PLAN_PROJECT, PLAN_AGGREGATE, PLAN_SORT, PLAN_LIMIT } PlanOp;
+
+// An operator of a SELECT plan, reading from node `child` (-1 for a leaf).
+// A join reads its second input from node `right`.
+typedef struct {
+    PlanOp op;
+    int child;
+    int right;
+} PlanNode;
+
+// A parsed and checked statement. Literals are not part of the plan: they
+// are numbered in order of appearance and supplied as Params on each run.
+typedef struct {
+    StmtKind kind;
+    char table[MAX_TABLE_NAME];
+    uint64_t version; // Catalog version the plan was checked against
+    int param_count;
+    // CREATE TABLE
+    Table def;
+    // CREATE INDEX
+    char index_name[MAX_COL_NAME];
+    int index_col;
+    // INSERT
+    size_t row_count;
+    // SELECT
+    ExplainMode explain;
+    SelectItem items[MAX_SELECT_ITEMS];
+    int item_count;
+    int agg_count;
+    int group_cols[MAX_COLS];
+    int group_count;
+    int needed[MAX_COLS];
+    Where where;
+    OrderKey order[MAX_COLS];
+    int order_count;
+    int limit_param; // Literal holding the LIMIT, -1 without one
+    // JOIN: the second table, the ON column of each table, and the columns
+    // and share of the WHERE clause of the second table
+    char join_table[MAX_TABLE_NAME];
+    int join_cols[2];
+    int join_needed[MAX_COLS];
+    Where join_where;
+    PlanNode nodes[MAX_PLAN_NODES];
+    int node_count;
+    int root;
+} Plan;
+
+// One literal of a statement; its unquoted text is at Params.text + off
+typedef struct {
+    TokenType type;
+    uint32_t off;
+    uint32_t len;
+} Param;
+
+typedef struct {
+    Param *items;
+    size_t count;
+    size_t cap;
+    char *text;
+    size_t text_len;
+    size_t text_cap;
+} Params;
+
+// A cached plan, keyed by the statement text with every literal replaced by '?'
+typedef struct {
+    char *key;
+    uint64_t hash;
+    uint64_t last_used;
+    Plan *plan;
+} CachedPlan;
+
+typedef struct {
+    CachedPlan entries[STMT_CACHE_SIZE];
+    uint64_t tick;
+    pthread_mutex_t lock;
+} StmtCache;
+
+// Schemas and headers of the tables opened so far, so statements do not re-read them
+typedef struct {
+    Table *tables[MAX_CATALOG_TABLES];
+    int count;
+    uint64_t version; // Bumped whenever a table or index is created
+    pthread_mutex_t lock;
+} Catalog;
+
+// --- Join Types ---
+
+// One input of a join: the rows its scan returns, its ON column, and the
+// columns each row carries into the join (its payload, as encode_row writes it)
+typedef struct {
+    const Table *t;
+    const Where *where;
+    const int *needed;
+    uint64_t *cands;
+    long cand_count;
+    int key_col;
+    int cols[MAX_COLS];
+    int col_count;
+} JoinSide;
+
+// A build row in a join's hash table: its key bytes followed by its payload
+typedef struct JoinEntry {
+    struct JoinEntry *next;
+    uint64_t hash;
+    uint32_t key_len;
+    uint32_t payload_len;
+    char data[];
+} JoinEntry;
+
+// Written before each row's key and payload in a join partition file
+typedef struct {
+    uint64_t hash;
+    uint32_t key_len;
+    uint32_t payload_len;
+} JoinSpill;
+
+typedef struct {
+    const Plan *plan;
+    JoinSide sides[2];
+    int build; // Side loaded into the hash table; the other side probes it
+    JoinEntry **buckets;
+    size_t bucket_count; // A power of two
+    size_t entry_count;
+    size_t bytes;
+    Arena arena;
+    FILE *parts[2][JOIN_PARTITIONS]; // Each side's partitions once the build side outgrew JOIN_MEMORY
+    int spilled;
+    uint64_t limit;
+    uint64_t emitted;
+    OpStats *stats; // The join's counters under EXPLAIN ANALYZE, or NULL
+    Sorter sorters[MAX_THREADS]; // ORDER BY records: the left payload's length, then both payloads
+    char *rows[MAX_THREADS]; // Payload of the row each worker is joining
+    size_t row_len[MAX_THREADS];
+    size_t row_cap[MAX_THREADS];
+} JoinJob;
+
+// Steps through the selected rows of one side of a merge join in table order
+typedef struct {
+    const JoinSide *side;
+    Scan s;
+    uint64_t bits[BITMAP_WORDS];
+    uint64_t start; // First row of the loaded block
+    size_t n;
+    size_t r; // Current row within the block
+    int done;
+    OpStats *scan_stats; // Under EXPLAIN ANALYZE, or NULL
+    OpStats *filter_stats;
+} MergeCursor;
+
+// --- Server Types ---
+
+// One client connection. Its statements run one at a time, in order, on
+// whichever worker picks the session up; output goes straight to `out`.
+typedef struct Session {
+    int fd;
+    FILE *out;
+    char *in; // Received bytes; those from `in_off` on are not yet run
+    size_t in_off;
+    size_t in_len;
+    size_t in_cap;
+    int threads; // The session's SET THREADS
+    int busy; // Queued for or running on a worker
+    int eof; // The client sent its last statement; reply to the rest, then close
+    int closing; // Close without running the rest ('exit', or the client stopped reading)
+    int broken; // A write to the client failed
+    int done; // Idle and finished; the event loop frees it
+    Txn txn;
+    struct Session *next; // All sessions, owned by the event loop
+    struct Session *next_ready;
+} Session;
+
+// The event loop reads from every connection; workers run the statements of
+// sessions with a complete line. Session input and flags are under `lock`.
+typedef struct {
+    int listen_fd;
+    int epoll_fd;
+    int wake_fd; // eventfd a worker signals when a closing session becomes idle
+    Session *sessions;
+    Session *ready_head;
+    Session *ready_tail;
+    int stopping;
+    int accept_paused; // Out of descriptors; listening resumes when a session closes
+    int session_threads; // SET THREADS of a new session
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} Server;
+
+// Worker threads used by scans; SET THREADS changes it for the running session
+__thread int scan_threads = 1;
+
+// Where the statement running on this thread prints; NULL means stdout
+__thread FILE *reply_out;
+
+// The transaction of the session running on this thread
+__thread Txn *session_txn;
+
+// Profile of the EXPLAIN statement running on this thread, NULL for other statements
+__thread Profile *session_profile;
+
+Catalog catalog = {.lock = PTHREAD_MUTEX_INITIALIZER};
+StmtCache stmt_cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+Wal wal = {.fd = -1, .next_txn = 1, .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER,
+           .gate = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP};
+
+Server server = {.listen_fd = -1, .epoll_fd = -1, .wake_fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+volatile sig_atomic_t server_stop;
+
+TxnManager txns = {.fd = -1, .slot = -1, .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER,
+                   .commit = PTHREAD_MUTEX_INITIALIZER};
+
+BufferPool pool = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
 
 // --- Function Prototypes ---
-void handle_create(char *cmd);
-void handle_insert(char *cmd);
-void handle_select(char *cmd);
+int run_statement(const char *cmd);
+int normalize_statement(const char *cmd, Params *params, char **key, size_t *key_len);
+int params_add(Params *ps, const Token *tok);
+const char *param_text(const Params *ps, int i);
+void params_free(Params *ps);
+int stmt_cache_lookup(const char *key, uint64_t hash, Plan *plan);
+int stmt_cache_store(const char *key, uint64_t hash, const Plan *plan);
+int parse_statement(const char *cmd, Plan *plan);
+int accept_keyword(Lexer *lx, const char *kw);
+int accept_token(Lexer *lx, TokenType type);
+int expect_keyword(Lexer *lx, const char *kw);
+int expect_token(Lexer *lx, TokenType type, const char *text);
+int parse_name(Lexer *lx, char *buf, size_t size, const char *what);
+const char *token_text(const Token *tok);
+int parse_create_table(Lexer *lx, Plan *plan);
+int parse_create_index(Lexer *lx, Plan *plan);
+int parse_insert(Lexer *lx, Plan *plan);
+int parse_load(Lexer *lx, Plan *plan);
+int parse_set(Lexer *lx, Plan *plan);
+int parse_select(Lexer *lx, Plan *plan);
+int parse_join(Lexer *lx, Plan *plan, Scope *sc, Table *u);
+int plan_add(Plan *plan, PlanOp op, int child);
+void handle_create(const Plan *plan);
+int create_table_files(const Table *def, const char *schema_filename);
+void handle_insert(const Plan *plan, const Params *params);
+void handle_select(const Plan *plan, const Params *params);
+void handle_load(const Plan *plan, const Params *params);
 void trim_whitespace(char *str);
+int load_table(const char *table_name, Table *t);
+int read_table(const char *table_name, Table *t);
+int convert_legacy_table(const char *table_name);
+int read_header(const char *table_name, TableHeader *h);
+int table_snapshot(const char *table_name, uint64_t snapshot, Table *t);
+int table_refresh(const char *table_name, Table *t);
+Table *catalog_get(const char *table_name);
+void catalog_invalidate(const char *table_name);
+Table *catalog_put(Table *t);
+int write_header(const Table *t);
+void column_path(char *buf, const char *table_name, int col, const char *ext);
+int find_column(const Table *t, const char *name);
+int resolve_column(const Scope *sc, const char *name, int *side);
+const char *type_name(ColType type);
+int parse_type(const char *str, ColType *type);
+int convert_value(ColType type, const char *str, size_t len, Value *val);
+int appender_open(Appender *a, Table *t, uint64_t txn);
+int appender_add(Appender *a, const Value *vals);
+int appender_close(Appender *a, int commit);
+int appender_sync(Appender *a);
+int csv_split(char *line, char **fields, int max_fields);
+double now_seconds(void);
+void lex_init(Lexer *lx, const char *str);
+void lex_next(Lexer *lx);
+int str_ieq(const char *a, const char *b);
+int parse_where_or(Lexer *lx, const Scope *sc, Where *w);
+int parse_where_and(Lexer *lx, const Scope *sc, Where *w);
+int parse_where_predicate(Lexer *lx, const Scope *sc, Where *w);
+int where_combine(Where *w, ExprKind kind, int left, int right);
+void collect_terms(const Where *w, int node, int *out, int *count);
+int where_side(const Where *w, int node);
+int where_copy(Where *dst, const Where *src, int node);
+int split_where(Plan *plan);
+int bind_where(Where *w, const Table *t, const Params *params);
+int bind_literal(Expr *e, const Table *t, const char *text);
+int scan_open(Scan *s, const Table *t, const int *needed);
+int scan_read_block(Scan *s, uint64_t start, size_t n);
+void scan_close(Scan *s);
+const char *block_text(const ColumnBlock *b, size_t r, size_t *len);
+void eval_where(const Where *w, int node, Scan *s, size_t n, uint64_t *bits);
+void print_value(FILE *out, const Scan *s, int col, size_t r);
+void print_real(FILE *out, double v);
+int emit_rows(void *arg, int worker, const Scan *s, size_t n, const uint64_t *bits, FILE *out);
+void handle_set(const Plan *plan, const Params *params);
+void handle_checkpoint(void);
+void handle_transaction(const Plan *plan);
+void handle_vacuum(void);
+int parse_select_item(Lexer *lx, const Scope *sc, SelectItem *item);
+int parse_order_key(Lexer *lx, const Scope *sc, const Plan *plan, OrderKey *key);
+const char *item_label(const Table *t, const SelectItem *item, char *buf);
+void *arena_alloc(Arena *a, size_t size);
+void arena_free(Arena *a);
+uint64_t hash_bytes(const char *data, size_t len);
+AggState *group_states(AggGroup *g);
+char *group_key(AggGroup *g, int agg_count);
+size_t group_size(int agg_count, const AggGroup *g);
+int agg_is_text(const Aggregation *ag, int i);
+const char *agg_text(const AggState *st, uint32_t *len);
+int agg_keep_text(AggTable *ht, AggState *st, CmpOp op, const char *str, uint32_t len);
+AggGroup *agg_lookup(AggTable *ht, int agg_count, uint64_t hash, const char *key, uint32_t key_len);
+void agg_table_free(AggTable *ht);
+size_t build_group_key(const Aggregation *ag, const Scan *s, size_t r, AggTable *ht);
+int agg_update(const Aggregation *ag, AggTable *ht, AggState *states, const Scan *s, size_t r);
+int agg_merge(const Aggregation *ag, AggTable *ht, AggState *into, const AggState *from);
+int group_encode(const Aggregation *ag, AggGroup *g, char **buf, size_t *len, size_t *cap);
+void group_decode(const Aggregation *ag, AggGroup *g);
+int agg_spill(const Aggregation *ag, AggTable *ht);
+int agg_read_group(FILE *fp, const Aggregation *ag, char **buf, size_t *cap, AggGroup **g);
+int aggregate_rows(void *arg, int worker, const Scan *s, size_t n, const uint64_t *bits, FILE *out);
+void print_group_row(FILE *out, const Aggregation *ag, const SelectItem *items, int item_count, AggGroup *g);
+void run_aggregate(const Plan *plan, const Table *t, const Where *where, uint64_t *cands, long cand_count, uint64_t limit);
+const char *group_value(const Aggregation *ag, AggGroup *g, int col, uint32_t *len);
+int group_sort_key(Sorter *s, const Plan *plan, const Aggregation *ag, const OrderKey *key, AggGroup *g);
+int agg_emit(const Plan *plan, AggTable *groups, Sorter *s, GroupPrinter *gp, uint64_t limit, uint64_t *seq);
+void print_sorted_group(void *arg, const char *payload, uint32_t len);
+char *buf_extend(char **buf, size_t *len, size_t *cap, size_t add);
+void sorter_init(Sorter *s, size_t budget, uint64_t limit);
+void sorter_free(Sorter *s);
+int sort_key_u64(Sorter *s, uint64_t u, int desc);
+int sort_key_int(Sorter *s, int64_t v, int desc);
+int sort_key_real(Sorter *s, double v, int desc);
+int sort_key_text(Sorter *s, const char *str, size_t len, int desc);
+int record_cmp(const char *a, const char *b);
+int record_qsort_cmp(const void *a, const void *b);
+size_t record_size(const char *rec);
+int sorter_wants(const Sorter *s);
+void sorter_sift_down(Sorter *s, size_t i);
+int sorter_add(Sorter *s, const void *payload, uint32_t payload_len);
+int sorter_compact(Sorter *s);
+char **sorter_sorted(Sorter *s);
+int sorter_spill(Sorter *s);
+int run_advance(RunCursor *c);
+void run_heap_down(RunCursor *runs, int *heap, int count, int i);
+int sort_merge(Sorter *sorters, int sorter_count, uint64_t limit, RecordFn fn, void *arg);
+int encode_row(char **buf, size_t *len, size_t *cap, const Scan *s, const int *cols, int count, size_t r);
+const char *decode_value(ColType type, const char *p, Value *v);
+void print_field(FILE *out, ColType type, const Value *v);
+int sort_rows(void *arg, int worker, const Scan *s, size_t n, const uint64_t *bits, FILE *out);
+void print_sorted_row(void *arg, const char *payload, uint32_t len);
+void run_sort(const Plan *plan, const Table *t, const Where *where, uint64_t *cands, long cand_count, uint64_t limit);
+const char *join_key(const Scan *s, int col, size_t r, double *zero, size_t *len);
+int join_insert(JoinJob *job, uint64_t hash, const char *key, uint32_t key_len, const char *payload, uint32_t payload_len);
+void join_reset(JoinJob *job);
+int join_spill_row(JoinJob *job, int side, uint64_t hash, const char *key, uint32_t key_len, const char *payload, uint32_t payload_len);
+int join_spill_table(JoinJob *job);
+int join_read_row(FILE *fp, JoinSpill *h, char **buf, size_t *cap);
+size_t join_decode(const JoinSide *side, const char *row, Value *vals);
+void join_print(const JoinJob *job, FILE *out, Value vals[2][MAX_COLS]);
+int join_emit(JoinJob *job, int worker, FILE *out, const char *build_row, const char *probe_row);
+int join_build_rows(void *arg, int worker, const Scan *s, size_t n, const uint64_t *bits, FILE *out);
+int join_probe_rows(void *arg, int worker, const Scan *s, size_t n, const uint64_t *bits, FILE *out);
+int join_partitions(JoinJob *job);
+int run_hash_join(JoinJob *job);
+int merge_next(MergeCursor *c);
+void merge_key(const MergeCursor *c, Value *v);
+int merge_cmp(ColType type, const Value *a, const Value *b);
+int run_merge_join(JoinJob *job);
+void join_carry(JoinSide *side, int col);
+void print_sorted_join(void *arg, const char *payload, uint32_t len);
+void run_join(const Plan *plan, const Table *const *tables, const Where *wheres, uint64_t limit);
+void run_select(const Plan *plan, const Table *const *tables, const Where *wheres, uint64_t limit);
+FILE *result_stream(void);
+ssize_t sink_write(void *cookie, const char *buf, size_t len);
+uint64_t now_ns(void);
+void stamp(Stamp *s);
+void op_add(OpStats *st, uint64_t rows_in, uint64_t rows_out, Stamp *lap);
+void op_read(OpStats *st, uint64_t bytes);
+OpStats *op_stats(const Plan *plan, PlanOp op, int side);
+int plan_find(const Plan *plan, PlanOp op, int side);
+void scan_profile(ParallelScan *ps, const Plan *plan, int side, PlanOp consumer);
+uint64_t bits_count(const uint64_t *bits, size_t n);
+void profile_finish(const Plan *plan, uint64_t limit);
+void explain_select(const Plan *plan, const Table *const *tables, const Where *wheres, uint64_t limit);
+void explain_node(const Plan *plan, int node, int depth, int side, const Table *const *tables, const Where *wheres, uint64_t limit);
+void explain_where(const Where *w, int node, const Table *t, int top);
+void explain_stats(const Plan *plan, int node);
+const char *op_name(PlanOp op);
+void select_rows(const Where *w, Scan *s, size_t n, uint64_t *bits);
+uint64_t zone_key(ColType type, const Value *v);
+void zone_add(ZoneEntry *z, ColType type, const Value *v);
+int zone_write(Appender *a, int col);
+void zone_load(ParallelScan *ps);
+void zone_free(ParallelScan *ps);
+int zone_match(const ParallelScan *ps, int node, uint64_t block);
+int scan_chunk(ParallelScan *ps, Scan *s, int worker, uint64_t chunk, FILE *out);
+int scan_block(ParallelScan *ps, Scan *s, int worker, uint64_t start, size_t n, const uint64_t *mask, FILE *out);
+int is_dict(const Table *t, int col);
+uint32_t dict_check(const char *str, size_t len);
+int dict_load(Dict *d, int file, int hashed);
+void dict_free(Dict *d);
+const char *dict_text(const Dict *d, uint64_t code, size_t *len);
+uint32_t dict_find(const Dict *d, const char *str, size_t len, uint64_t hash);
+int dict_insert(Dict *d, uint32_t code, uint64_t hash);
+int64_t dict_add(Dict *d, const char *str, size_t len, uint64_t hash);
+int code_bits_for(uint64_t code);
+int codes_read(int file, int bits, uint64_t start, size_t n, uint64_t *out, char **buf, size_t *cap, int sequential);
+size_t codes_pack(const uint64_t *codes, size_t n, int bits, char *out);
+int codes_open(Appender *a, int col);
+int codes_widen(Appender *a, int col, int bits);
+int codes_put(Appender *a, int col, uint64_t code);
+int64_t dict_code(Appender *a, int col, const Value *v);
+int text_matches(const char *str, size_t len, CmpOp op, const char *k, size_t k_len);
+int build_code_set(const Where *w, int node, Scan *s);
+void filter_codes(const Scan *s, int node, const uint64_t *codes, size_t n, uint64_t *bits);
+void *scan_worker(void *arg);
+int parallel_scan(ParallelScan *ps);
+int op_orderings(CmpOp op);
+void filter_int64(const int64_t *v, size_t n, CmpOp op, int64_t k, uint64_t *bits);
+void filter_double(const double *v, size_t n, CmpOp op, double k, uint64_t *bits);
+void filter_text(const ColumnBlock *b, size_t n, CmpOp op, const char *k, size_t k_len, uint64_t *bits);
+void handle_create_index(const Plan *plan);
+uint64_t index_key(ColType type, const Value *v);
+uint64_t block_key(const Scan *s, int col, size_t r);
+int entry_cmp(const IndexEntry *a, const IndexEntry *b);
+int entry_qsort_cmp(const void *a, const void *b);
+int row_qsort_cmp(const void *a, const void *b);
+void index_path(char *buf, const char *table_name, const char *index_name);
+int index_open(Index *ix, const Table *t, const IndexDef *def);
+int index_close(Index *ix);
+int page_read(Index *ix, uint64_t page_no, IndexPage *page);
+int page_write(Index *ix, uint64_t page_no, const IndexPage *page);
+uint32_t inner_child_slot(const IndexPage *page, const IndexEntry *e);
+uint64_t inner_child(const IndexPage *page, uint32_t slot);
+uint32_t leaf_lower_bound(const IndexPage *page, const IndexEntry *e);
+int index_insert_at(Index *ix, uint64_t page_no, const IndexEntry *e, IndexEntry *up_sep, uint64_t *up_page);
+int index_insert(Index *ix, uint64_t key, uint64_t row);
+long index_range(Index *ix, uint64_t lo, uint64_t hi, uint64_t limit, uint64_t **rows);
+int index_build(const char *path, int col, IndexEntry *entries, size_t count);
+int build_index(const Table *t, const char *index_name, int col);
+void collect_conjuncts(const Where *w, int node, int *out, int *count);
+long plan_index_lookup(const Table *t, const Where *w, uint64_t **rows);
+int plan_index_choice(const Table *t, const Where *w, uint64_t *lo, uint64_t *hi);
+int pool_init(size_t budget);
+void pool_shutdown(void);
+int pool_set_budget(size_t budget);
+uint32_t pool_hash(int file, uint64_t page_no);
+int pool_find(int file, uint64_t page_no);
+void pool_unhash(int frame);
+int pool_write_back(int frame);
+int pool_evict(int frame);
+int pool_victim(void);
+int pool_pin(int file, uint64_t page_no, int sequential);
+void pool_unpin(int frame, int dirty);
+char *pool_data(int frame);
+size_t pool_len(int frame);
+int pool_read(int file, uint64_t off, void *buf, size_t len, int sequential);
+int pool_write(int file, uint64_t off, const void *buf, size_t len);
+int pool_file(const char *path);
+void pool_release(int file);
+int pool_close_file(int file);
+void pool_drop_file(const char *path);
+void pool_drop_table(const char *table_name);
+void pool_retire(const char *drop);
+int pool_flush(int file);
+int pool_flush_table(const char *table_name);
+int writer_open(ColumnWriter *w, const char *path, uint64_t off);
+int writer_put(ColumnWriter *w, const void *data, size_t len);
+int writer_flush(ColumnWriter *w);
+int writer_close(ColumnWriter *w);
+int write_all(int fd, const char *buf, size_t len);
+int sync_path(const char *path);
+int sync_table(const char *table_name);
+int table_file_of(const char *path, const char *table_name);
+uint64_t wal_append(uint32_t type, uint64_t txn, const char *payload, uint32_t len);
+int wal_write(void);
+int wal_commit(uint64_t lsn);
+void wal_mark_dirty(const char *table_name);
+int wal_checkpoint(void);
+void wal_maybe_checkpoint(void);
+size_t wal_put_name(char *p, const char *name);
+const char *wal_get_name(const char *p, const char *end, char *name);
+int wal_encode_row(Appender *a, const Value *vals);
+const char *wal_decode_row(const Table *t, const char *p, const char *end, Value *vals);
+int wal_flush_batch(Appender *a);
+void wal_recover(void);
+uint64_t wal_replay(char (*logs)[MAX_PATH_LEN], int log_count, char (*tables)[MAX_TABLE_NAME], int table_count,
+                    uint64_t only_txn);
+int wal_scan(FILE *fp, int log, char (*tables)[MAX_TABLE_NAME], int table_count, uint64_t only_txn, WalReplay *rp);
+int wal_rows_cmp(const void *a, const void *b);
+int wal_open(int alone);
+void wal_close(void);
+int txn_open(void);
+int txn_start(void);
+void txn_close(void);
+void txn_seed(void);
+void txn_snapshot_begin(Txn *txn);
+void txn_snapshot_end(Txn *txn);
+TxnTable *txn_table(Txn *txn, const char *table_name);
+int txn_read_table(Txn *txn, const char *table_name, Table *t);
+int txn_finish(Txn *txn, int rc);
+int txn_commit(Txn *txn);
+void txn_rollback(Txn *txn);
+void txn_end(Txn *txn, int clean);
+int publish_tables(Appender **apps, int count);
+int publish_unchanged(Table *t);
+uint64_t version_rows(const char *table_name, uint64_t snapshot, const TableHeader *h);
+int version_append(const Table *t, uint64_t txn, uint64_t row_count);
+int file_lock(int fd, short type, off_t start, int wait);
+int table_lock_open(const char *table_name, int wait);
+int table_lock_recover(int fd, const char *table_name);
+int lock_state_write(int fd, const LockState *st);
+int index_latch(const Table *t);
+int rebuild_indexes(const char *table_name);
+void *vacuum_main(void *arg);
+long vacuum_run(void);
+long vacuum_table(const char *table_name, uint64_t horizon);
+uint64_t vacuum_horizon(void);
+int list_files(const char *suffix, char (**names)[MAX_PATH_LEN]);
+FILE *reply_stream(void);
+int reply(const char *fmt, ...);
+void reply_error(const char *what);
+int server_run(const char *path, int workers);
+int server_listen(const char *path);
+void server_accept(void);
+void server_read(Session *sn);
+void server_reap(void);
+void *server_worker(void *arg);
+int session_next_line(Session *sn);
+void session_queue(Session *sn);
+void session_run(Session *sn, const char *line);
+ssize_t session_write(void *cookie, const char *buf, size_t len);
+void session_free(Session *sn);
+void server_signal(int sig);
+#ifdef HAVE_AVX2_KERNELS
+int cpu_has_avx2(void);
+size_t filter_int64_avx2(const int64_t *v, size_t n, int ord, int64_t k, uint64_t *bits);
+size_t filter_double_avx2(const double *v, size_t n, int ord, double k, uint64_t *bits);
+#endif
 
 // --- Main Function ---
-int main() {
-    char cmd[MAX_CMD_LEN];
-    printf("MiniSQL Engine. Use CREATE, INSERT, SELECT, or 'exit'.\n");
+int main(int argc, char **argv) {
+    char *cmd = NULL;
+    size_t cmd_cap = 0;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    scan_threads = (cpus < 1) ? 1 : (cpus > MAX_THREADS) ? MAX_THREADS : (int)cpus;
+
+    // minisql --server <socket> [workers] serves clients instead of reading stdin
+    int workers = scan_threads;
+    if (argc > 1 && (argc < 3 || argc > 4 || strcmp(argv[1], "--server") != 0 ||
+                     (argc == 4 && ((workers = atoi(argv[3])) < 1 || workers > MAX_THREADS)))) {
+        printf("Usage: %s [--server socket-path [workers (1-%d)]]\n", argv[0], MAX_THREADS);
+        return 1;
+    }
+    if (pool_init((size_t)POOL_DEFAULT_MB << 20) != 0) {
+        printf("Not enough memory for the buffer pool.\n");
+        return 1;
+    }
+    // Only the first process to open the directory recovers the logs of earlier ones
+    int alone = txn_open();
+    if (alone < 0) {
+        perror("Error opening " TXN_FILE);
+        return 1;
+    }
+    if (wal_open(alone) != 0) {
+        perror("Error opening the write-ahead log");
+        return 1;
+    }
+    if (txn_start() != 0) {
+        printf("Too many processes are using this directory.\n");
+        return 1;
+    }
+    if (argc > 1) {
+        int rc = server_run(argv[2], workers);
+        txn_close();
+        wal_close();
+        pool_shutdown();
+        return rc;
+    }
+    printf("MiniSQL Engine. Use CREATE TABLE, CREATE INDEX, INSERT, LOAD DATA, SELECT, EXPLAIN [ANALYZE], BEGIN, COMMIT, ROLLBACK, SET THREADS, SET MEMORY, CHECKPOINT, VACUUM, or 'exit'.\n");
 
+    Txn txn;
+    memset(&txn, 0, sizeof(txn));
+    session_txn = &txn;
     while (1) {
         printf("minisql> ");
-        fgets(cmd, sizeof(cmd), stdin);
+        fflush(stdout);
+        if (getline(&cmd, &cmd_cap, stdin) < 0) break;
 
-        if (strncmp(cmd, "exit", 4) == 0) break;
-        if (strncmp(cmd, "CREATE", 6) == 0) handle_create(cmd);
-        else if (strncmp(cmd, "INSERT", 6) == 0) handle_insert(cmd);
-        else if (strncmp(cmd, "SELECT", 6) == 0) handle_select(cmd);
-        else printf("Unknown command.\n");
+        if (run_statement(cmd)) break;
+        wal_maybe_checkpoint();
     }
+    if (txn.active) printf("Transaction rolled back.\n");
+    txn_rollback(&txn);
+    txn_close();
+    wal_close();
+    pool_shutdown();
+    free(cmd);
     return 0;
 }
 
 // --- Core Logic ---
 
 void trim_whitespace(char *str) {
+    char *start = str;
     char *end;
-    while (isspace((unsigned char)*str)) str++;
+    while (isspace((unsigned char)*start)) start++;
+    if (start != str) memmove(str, start, strlen(start) + 1);
     if (*str == 0) return;
     end = str + strlen(str) - 1;
     while (end > str && isspace((unsigned char)*end)) end--;
     end[1] = '\0';
 }
 
-void handle_create(char *cmd) {
-    char table_name[MAX_TABLE_NAME];
-    char schema_filename[MAX_TABLE_NAME + 4];
-    char data_filename[MAX_TABLE_NAME + 4];
+FILE *reply_stream(void) {
+    return reply_out ? reply_out : stdout;
+}
+
+// Prints to the client of the running statement (stdout outside server mode)
+int reply(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vfprintf(reply_stream(), fmt, ap);
+    va_end(ap);
+    return n;
+}
 
-    // CREATE TABLE table_name (col1, col2, ...)
-    sscanf(cmd, "CREATE TABLE %s", table_name);
-    table_name[strcspn(table_name, " (")] = 0;
+// Like perror, but to the client of the running statement
+void reply_error(const char *what) {
+    reply("%s: %s\n", what, strerror(errno));
+}
 
-    sprintf(schema_filename, "%s.sch", table_name);
-    sprintf(data_filename, "%s.dat", table_name);
+void handle_create(const Plan *plan) {
+    Table t = plan->def;
+    char schema_filename[MAX_PATH_LEN];
 
-    char *cols_str = strchr(cmd, '(');
-    if (!cols_str) {
-        printf("Invalid CREATE syntax.\n");
+    // The writer lock keeps other processes from creating the same table at once
+    int lock_fd = table_lock_open(t.name, 1);
+    if (lock_fd < 0) return;
+    sprintf(schema_filename, "%s.sch", t.name);
+    if (access(schema_filename, F_OK) == 0) {
+        reply("Table '%s' already exists.\n", t.name);
+        close(lock_fd);
         return;
     }
-    cols_str++; // Skip '('
-    char *end_cols = strchr(cols_str, ')');
-    if (end_cols) *end_cols = '\0';
+    if (create_table_files(&t, schema_filename) == 0) {
+        catalog_invalidate(t.name);
+        reply("Table '%s' created.\n", t.name);
+    }
+    close(lock_fd);
+}
+
+/**
+ * @brief Creates the files of a new table. The empty column files and the
+ * header are made durable first; the schema file is renamed into place last,
+ * so a table either exists completely or not at all.
+ * @return 0 on success, -1 (after printing the reason) otherwise.
+ */
+int create_table_files(const Table *def, const char *schema_filename) {
+    Table t = *def;
+
+    for (int i = 0; i < t.col_count; i++) {
+        char path[MAX_PATH_LEN];
+        column_path(path, t.name, i, "col");
+        pool_drop_file(path);
+        FILE *fp = fopen(path, "wb");
+        CodeHeader ch = {CODE_MAGIC, 0};
+        if (fp && is_dict(&t, i) && fwrite(&ch, sizeof(ch), 1, fp) != 1) {
+            fclose(fp);
+            fp = NULL;
+        }
+        if (!fp || fclose(fp) != 0 || sync_path(path) != 0) {
+            reply_error("Error creating column file");
+            return -1;
+        }
+        column_path(path, t.name, i, "zone");
+        pool_drop_file(path);
+        fp = fopen(path, "wb");
+        if (!fp || fclose(fp) != 0 || sync_path(path) != 0) {
+            reply_error("Error creating column file");
+            return -1;
+        }
+        if (t.types[i] == COL_TEXT) {
+            column_path(path, t.name, i, "heap");
+            pool_drop_file(path);
+            fp = fopen(path, "wb");
+            if (!fp || fclose(fp) != 0 || sync_path(path) != 0) {
+                reply_error("Error creating column file");
+                return -1;
+            }
+        }
+    }
 
-    FILE *fp = fopen(schema_filename, "w");
-    char *token = strtok(cols_str, ",");
-    while (token) {
-        trim_whitespace(token);
-        fprintf(fp, "%s\n", token);
-        token = strtok(NULL, ",");
+    memcpy(t.header.magic, TABLE_MAGIC, sizeof(t.header.magic));
+    t.header.version = TABLE_VERSION;
+    t.header.col_count = t.col_count;
+    t.header.row_count = 0;
+    t.header.commit_txn = 0;
+    t.header.sorted_cols = 0;
+    for (int i = 0; i < t.col_count; i++) {
+        t.header.col_types[i] = t.types[i];
+        // An empty column is in order; appending a smaller value clears its bit
+        if (t.types[i] != COL_TEXT) t.header.sorted_cols |= (uint16_t)(1u << i);
+    }
+    char data_filename[MAX_PATH_LEN];
+    sprintf(data_filename, "%s.dat", t.name);
+    remove(data_filename);
+    sprintf(data_filename, "%s.ver", t.name);
+    remove(data_filename);
+    sprintf(data_filename, "%s.dat", t.name);
+    if (write_header(&t) != 0 || sync_path(data_filename) != 0) {
+        reply_error("Error creating table header");
+        return -1;
     }
-    fclose(fp);
 
-    // Create empty data file
-    fp = fopen(data_filename, "w");
-    fclose(fp);
+    char tmp_filename[MAX_PATH_LEN + 4];
+    snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", schema_filename);
+    FILE *fp = fopen(tmp_filename, "w");
+    if (!fp) {
+        reply_error("Error creating schema file");
+        return -1;
+    }
+    for (int i = 0; i < t.col_count; i++) {
+        fprintf(fp, "%s %s%s\n", t.cols[i], type_name(t.types[i]), is_dict(&t, i) ? " DICT" : "");
+    }
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0 || fclose(fp) != 0 || rename(tmp_filename, schema_filename) != 0) {
+        reply_error("Error creating schema file");
+        remove(tmp_filename);
+        return -1;
+    }
+    sync_path(".");
 
-    printf("Table '%s' created.\n", table_name);
+    return 0;
 }
 
-void handle_insert(char *cmd) {
-    char table_name[MAX_TABLE_NAME];
-    char data_filename[MAX_TABLE_NAME + 4];
+void handle_insert(const Plan *plan, const Params *params) {
+    Txn *txn = session_txn;
+    Table t;
+
+    if (load_table(plan->table, &t) != 0) return;
+
+    // Every value is converted and checked before anything is written, so a
+    // bad value anywhere in the statement leaves the table untouched.
+    double started = now_seconds();
+    size_t row_count = plan->row_count;
+    Value *vals = malloc(row_count * t.col_count * sizeof(Value));
+    if (!vals) {
+        reply("Not enough memory for %zu rows.\n", row_count);
+        return;
+    }
+    for (size_t i = 0; i < params->count; i++) {
+        int col = (int)(i % t.col_count);
+        if (convert_value(t.types[col], param_text(params, (int)i), params->items[i].len, &vals[i]) != 0) {
+            reply("Invalid %s value '%s' for column '%s'.\n", type_name(t.types[col]), param_text(params, (int)i),
+                   t.cols[col]);
+            free(vals);
+            return;
+        }
+    }
 
-    // INSERT INTO table_name VALUES (val1, val2, ...)
-    sscanf(cmd, "INSERT INTO %s", table_name);
-    
-    char *values_str = strstr(cmd, "VALUES (");
-    if (!values_str) {
-        printf("Invalid INSERT syntax.\n");
+    TxnTable *tt = txn_table(txn, t.name);
+    if (!tt) {
+        free(vals);
         return;
     }
-    values_str += strlen("VALUES (");
-    char *end_values = strrchr(values_str, ')');
-    if (end_values) *end_values = '\0';
+    int rc = 0;
+    pthread_rwlock_rdlock(&wal.gate);
+    for (size_t r = 0; r < row_count && rc == 0; r++) {
+        if (appender_add(&tt->app, &vals[r * t.col_count]) != 0) {
+            reply("Error writing to table '%s'.\n", t.name);
+            rc = -1;
+        }
+    }
+    pthread_rwlock_unlock(&wal.gate);
+    free(vals);
+    if (txn_finish(txn, rc) != 0) return;
+
+    if (row_count == 1) {
+        reply("Row inserted into '%s'.\n", t.name);
+    } else {
+        double elapsed = now_seconds() - started;
+        reply("%zu rows inserted into '%s' in %.3f s (%.0f rows/s).\n", row_count, t.name, elapsed,
+               elapsed > 0 ? row_count / elapsed : 0.0);
+    }
+}
+
+void handle_load(const Plan *plan, const Params *params) {
+    const char *file_name = param_text(params, 0);
+    char *fields[MAX_COLS + 1];
+    Value vals[MAX_COLS];
+    Txn *txn = session_txn;
+    Table t;
+
+    if (load_table(plan->table, &t) != 0) return;
 
-    sprintf(data_filename, "%s.dat", table_name);
-    FILE *fp = fopen(data_filename, "a");
+    FILE *fp = fopen(file_name, "rb");
     if (!fp) {
-        printf("Table '%s' does not exist.\n", table_name);
+        reply_error("Error opening CSV file");
         return;
     }
+    size_t cap = READ_BUFFER_SIZE, len = 0;
+    char *buf = malloc(cap);
+    TxnTable *tt = buf ? txn_table(txn, t.name) : NULL;
+    if (!tt) {
+        if (!buf) reply("Could not prepare table '%s' for loading.\n", t.name);
+        free(buf);
+        fclose(fp);
+        return;
+    }
+    uint64_t first_row = tt->app.row_count;
+
+    // The file is read in large chunks and split into lines in place; a line
+    // cut off by the end of a chunk is moved to the front and completed by the
+    // next read. Nothing becomes visible unless every line loads.
+    double started = now_seconds();
+    uint64_t line_no = 0, loaded = 0;
+    int eof = 0, failed = 0;
+    pthread_rwlock_rdlock(&wal.gate);
+    while (!failed && (!eof || len > 0)) {
+        if (!eof) {
+            size_t got = fread(buf + len, 1, cap - len - 1, fp);
+            if (got == 0) eof = 1;
+            len += got;
+        }
 
-    char *token = strtok(values_str, ",");
-    int first = 1;
-    while (token) {
-        trim_whitespace(token);
-        // Remove quotes if they exist
-        if (token[0] == '\'' || token[0] == '"') token++;
-        if (token[strlen(token)-1] == '\'' || token[strlen(token)-1] == '"') token[strlen(token)-1] = '\0';
-        
-        fprintf(fp, "%s%s", (first ? "" : ","), token);
-        first = 0;
-        token = strtok(NULL, ",");
+        char *p = buf, *end = buf + len;
+        while (!failed && p < end) {
+            char *nl = memchr(p, '\n', (size_t)(end - p));
+            if (!nl) {
+                if (!eof) break;
+                nl = end;
+            }
+            *nl = '\0';
+            line_no++;
+            if (nl > p && nl[-1] == '\r') nl[-1] = '\0';
+
+            if (*p) {
+                int n = csv_split(p, fields, MAX_COLS + 1);
+                if (n != t.col_count) {
+                    reply("Line %llu: expected %d values, got %d.\n", (unsigned long long)line_no, t.col_count, n);
+                    failed = 1;
+                    break;
+                }
+                for (int i = 0; i < n && !failed; i++) {
+                    if (convert_value(t.types[i], fields[i], strlen(fields[i]), &vals[i]) != 0) {
+                        reply("Line %llu: invalid %s value '%s' for column '%s'.\n", (unsigned long long)line_no,
+                               type_name(t.types[i]), fields[i], t.cols[i]);
+                        failed = 1;
+                    }
+                }
+                if (!failed && appender_add(&tt->app, vals) != 0) {
+                    reply("Error writing to table '%s'.\n", t.name);
+                    failed = 2;
+                }
+                loaded++;
+            }
+            p = (nl < end) ? nl + 1 : end;
+        }
+
+        len = (size_t)(end - p);
+        memmove(buf, p, len);
+        if (len + 1 >= cap) {
+            char *grown = realloc(buf, cap * 2);
+            if (!grown) {
+                reply("Line %llu is too long.\n", (unsigned long long)line_no + 1);
+                failed = 1;
+                break;
+            }
+            buf = grown;
+            cap *= 2;
+        }
+        if (eof && len == 0) break;
     }
-    fprintf(fp, "\n");
+    pthread_rwlock_unlock(&wal.gate);
+    free(buf);
     fclose(fp);
 
-    printf("Row inserted into '%s'.\n", table_name);
+    // Inside a transaction the lines added before a bad one cannot be taken
+    // back on their own; if there were none, the transaction carries on
+    if (failed == 1 && txn->active && tt->app.row_count == first_row) {
+        reply("Load aborted; no rows were added.\n");
+        return;
+    }
+    if (txn_finish(txn, failed ? -1 : 0) != 0 || failed) {
+        if (failed) reply(txn->active ? "Load aborted; ROLLBACK the transaction.\n" : "Load aborted; no rows were added.\n");
+        return;
+    }
+    double elapsed = now_seconds() - started;
+    reply("Loaded %llu rows into '%s' in %.3f s (%.0f rows/s).\n", (unsigned long long)loaded, t.name, elapsed,
+           elapsed > 0 ? loaded / elapsed : 0.0);
 }
 
-void handle_select(char *cmd) {
-    char table_name[MAX_TABLE_NAME];
-    char data_filename[MAX_TABLE_NAME + 4];
-    char schema_filename[MAX_TABLE_NAME + 4];
-    char cols[MAX_COLS][MAX_COL_NAME];
-    int col_count = 0;
+void handle_select(const Plan *plan, const Params *params) {
+    char label[MAX_COL_NAME + 8];
+    const SelectItem *items = plan->items;
+    int item_count = plan->item_count;
+    int joined = plan->join_table[0] != '\0';
+    Table t, u;
+    const Table *tables[2] = {&t, &u};
+    Where wheres[2];
+    Where *where = &wheres[0];
 
-    // SELECT * FROM table_name
-    sscanf(cmd, "SELECT * FROM %s", table_name);
-    table_name[strcspn(table_name, ";\n")] = 0;
+    Profile *prof = session_profile;
+    uint64_t limit = 0; // No LIMIT
+    if (plan->explain && !prof) {
+        reply("Not enough memory to profile the statement.\n");
+        return;
+    }
+    uint64_t started = prof ? now_ns() : 0;
+    if (txn_read_table(session_txn, plan->table, &t) != 0) return;
+    if (joined && txn_read_table(session_txn, plan->join_table, &u) != 0) return;
+    if (prof) prof->catalog_ns += now_ns() - started;
+    wheres[0] = plan->where;
+    if (bind_where(where, &t, params) != 0) return;
+    if (joined) {
+        wheres[1] = plan->join_where;
+        if (bind_where(&wheres[1], &u, params) != 0) return;
+    }
+    if (plan->limit_param >= 0) {
+        char *end;
+        long long n = strtoll(param_text(params, plan->limit_param), &end, 10);
+        if (*end || n < 0) {
+            reply("LIMIT needs a whole number of rows.\n");
+            return;
+        }
+        limit = (uint64_t)n;
+    }
+    if (plan->explain == EXPLAIN_PLAN) {
+        explain_select(plan, tables, wheres, limit);
+        return;
+    }
+
+    // EXPLAIN ANALYZE runs the query with its result rows counted, not printed
+    if (prof) {
+        cookie_io_functions_t io = {.write = sink_write};
+        prof->sink = fopencookie(prof, "w", io);
+        if (!prof->sink) {
+            reply("Not enough memory to profile the statement.\n");
+            return;
+        }
+    } else {
+        for (int i = 0; i < item_count; i++) reply("%-20s", item_label(tables[items[i].side], &items[i], label));
+        reply("\n");
+        for (int i = 0; i < item_count * 20; i++) reply("-");
+        reply("\n");
+    }
+    started = prof ? now_ns() : 0;
+    if (plan->limit_param < 0 || limit > 0) run_select(plan, tables, wheres, limit);
+    if (prof) {
+        fclose(prof->sink);
+        prof->sink = NULL;
+        prof->exec_ns = now_ns() - started;
+        profile_finish(plan, limit);
+        explain_select(plan, tables, wheres, limit);
+    }
+}
 
-    sprintf(data_filename, "%s.dat", table_name);
-    sprintf(schema_filename, "%s.sch", table_name);
+// Runs a bound SELECT, printing its rows to result_stream()
+void run_select(const Plan *plan, const Table *const *tables, const Where *wheres, uint64_t limit) {
+    const Table *t = tables[0];
+    const Where *where = &wheres[0];
+    if (plan->join_table[0]) {
+        run_join(plan, tables, wheres, limit);
+        return;
+    }
 
-    FILE *schema_fp = fopen(schema_filename, "r");
-    if (!schema_fp) {
-        printf("Table '%s' does not exist.\n", table_name);
+    uint64_t *cands = NULL;
+    OpStats *scan = op_stats(plan, PLAN_SCAN, 0);
+    Stamp lap;
+    if (scan) stamp(&lap);
+    long cand_count = plan_index_lookup(t, where, &cands);
+    if (scan) {
+        scan->candidates = cand_count;
+        op_add(scan, 0, 0, &lap);
+    }
+    if (plan->agg_count > 0 || plan->group_count > 0) {
+        run_aggregate(plan, t, where, cands, cand_count, limit);
+        free(cands);
         return;
     }
-    while (col_count < MAX_COLS && fscanf(schema_fp, "%s", cols[col_count]) == 1) {
-        printf("%-20s", cols[col_count]);
-        col_count++;
+    if (plan->order_count > 0) {
+        run_sort(plan, t, where, cands, cand_count, limit);
+        free(cands);
+        return;
     }
-    printf("\n");
-    for(int i=0; i<col_count*20; i++) printf("-");
-    printf("\n");
-    fclose(schema_fp);
 
-    FILE *data_fp = fopen(data_filename, "r");
-    char line[MAX_ROW_LEN];
-    while (fgets(line, sizeof(line), data_fp)) {
-        line[strcspn(line, "\n")] = 0;
-        char *token = strtok(line, ",");
-        while (token) {
-            printf("%-20s", token);
-            token = strtok(NULL, ",");
+    // Rows come out in table order: each worker buffers the output of its
+    // chunks and the chunks are written in sequence. A LIMIT scans serially
+    // instead, so it can stop as soon as enough rows are out.
+    Projection proj;
+    ParallelScan ps;
+    proj.count = 0;
+    proj.limit = limit;
+    proj.emitted = 0;
+    for (int i = 0; i < plan->item_count; i++) proj.cols[proj.count++] = plan->items[i].col;
+    memset(&ps, 0, sizeof(ps));
+    ps.t = t;
+    ps.needed = plan->needed;
+    ps.where = where;
+    ps.cand_count = cand_count;
+    ps.cands = (cand_count >= 0) ? cands : NULL;
+    ps.fn = emit_rows;
+    ps.arg = &proj;
+    ps.out = result_stream();
+    ps.serial = (limit != 0);
+    scan_profile(&ps, plan, 0, PLAN_PROJECT);
+    if (cand_count != 0 && parallel_scan(&ps) != 0) reply("Table '%s' is missing column data.\n", t->name);
+    free(cands);
+}
+
+const char *item_label(const Table *t, const SelectItem *item, char *buf) {
+    static const char *funcs[] = {"COUNT", "SUM", "AVG", "MIN", "MAX"};
+    if (!item->is_agg) return t->cols[item->col];
+    sprintf(buf, "%s(%s)", funcs[item->func], item->col < 0 ? "*" : t->cols[item->col]);
+    return buf;
+}
+
+// Prints the projected columns of every selected row of a block
+int emit_rows(void *arg, int worker, const Scan *s, size_t n, const uint64_t *bits, FILE *out) {
+    Projection *proj = arg;
+    (void)worker;
+    for (size_t w = 0; w < (n + 63) / 64; w++) {
+        uint64_t word = bits[w];
+        while (word) {
+            size_t r = w * 64 + (size_t)__builtin_ctzll(word);
+            word &= word - 1;
+            for (int i = 0; i < proj->count; i++) print_value(out, s, proj->cols[i], r);
+            fputc('\n', out);
+            if (proj->limit && ++proj->emitted == proj->limit) return 1;
+        }
+    }
+    return 0;
+}
+
+void print_value(FILE *out, const Scan *s, int col, size_t r) {
+    const ColumnBlock *b = &s->blocks[col];
+    switch (s->t->types[col]) {
+        case COL_INT:
+            fprintf(out, "%-20lld", (long long)((const int64_t *)b->values)[r]);
+            break;
+        case COL_REAL:
+            print_real(out, ((const double *)b->values)[r]);
+            break;
+        case COL_TEXT: {
+            size_t len;
+            const char *str = block_text(b, r, &len);
+            fprintf(out, "%-20.*s", (int)len, str);
+            break;
+        }
+    }
+}
+
+// Prints a REAL with the fewest digits that read back as the same value
+void print_real(FILE *out, double v) {
+    char buf[32];
+    for (int digits = 15; digits <= 17; digits++) {
+        snprintf(buf, sizeof(buf), "%.*g", digits, v);
+        if (strtod(buf, NULL) == v) break;
+    }
+    fprintf(out, "%-20s", buf);
+}
+
+void handle_set(const Plan *plan, const Params *params) {
+    char *end;
+    long value = strtol(param_text(params, 0), &end, 10);
+
+    if (plan->kind == STMT_SET_MEMORY) {
+        long max_mb = (long)(((uint64_t)POOL_MAX_FRAMES * POOL_PAGE_SIZE) >> 20);
+        long min_mb = (long)(((uint64_t)POOL_MIN_FRAMES * POOL_PAGE_SIZE) >> 20);
+        if (*end || value < min_mb || value > max_mb) {
+            reply("Usage: SET MEMORY mb (%ld-%ld).\n", min_mb, max_mb);
+            return;
+        }
+        if (pool_set_budget((size_t)value << 20) != 0) reply_error("Error releasing buffer pool pages");
+        reply("Buffer pool limited to %ld MB.\n", value);
+        return;
+    }
+    long threads = value;
+    if (*end || threads < 1 || threads > MAX_THREADS) {
+        reply("Usage: SET THREADS n (1-%d).\n", MAX_THREADS);
+        return;
+    }
+    scan_threads = (int)threads;
+    reply("Scans will use up to %d threads.\n", scan_threads);
+}
+
+void handle_checkpoint(void) {
+    pthread_rwlock_wrlock(&wal.gate);
+    int rc = wal_checkpoint();
+    pthread_rwlock_unlock(&wal.gate);
+    if (rc < 0) {
+        reply_error("Checkpoint failed");
+        return;
+    }
+    reply(rc > 0 ? "Checkpoint deferred until open transactions end.\n" : "Checkpoint complete.\n");
+}
+
+void handle_transaction(const Plan *plan) {
+    Txn *txn = session_txn;
+    switch (plan->kind) {
+        case STMT_BEGIN:
+            if (txn->active) {
+                reply("A transaction is already open.\n");
+                return;
+            }
+            txn->active = 1;
+            txn_snapshot_begin(txn);
+            reply("Transaction started.\n");
+            break;
+        case STMT_COMMIT:
+            if (!txn->active) {
+                reply("No transaction is open.\n");
+            } else if (txn->failed) {
+                txn_rollback(txn);
+                reply("The transaction failed and was rolled back.\n");
+            } else if (txn_commit(txn) == 0) {
+                reply("Transaction committed.\n");
+            }
+            break;
+        default:
+            if (!txn->active) {
+                reply("No transaction is open.\n");
+                return;
+            }
+            txn_rollback(txn);
+            reply("Transaction rolled back.\n");
+            break;
+    }
+}
+
+void handle_vacuum(void) {
+    long removed = vacuum_run();
+    reply("Vacuum removed %ld old table versions.\n", removed);
+}
+
+// --- Scans ---
+
+/**
+ * @brief Opens the column files marked in `needed` for block-wise reading
+ * through the buffer pool.
+ * @return 0 on success, -1 if a column file could not be opened.
+ */
+int scan_open(Scan *s, const Table *t, const int *needed) {
+    memset(s, 0, sizeof(*s));
+    s->t = t;
+    for (int c = 0; c < MAX_COLS; c++) s->col_file[c] = s->heap_file[c] = s->blocks[c].frame = -1;
+    for (int c = 0; c < t->col_count; c++) {
+        char path[MAX_PATH_LEN];
+        if (!needed[c]) continue;
+        s->needed[c] = 1;
+        column_path(path, t->name, c, "col");
+        s->col_file[c] = pool_file(path);
+        s->blocks[c].buf = malloc(BLOCK_ROWS * sizeof(uint64_t));
+        if (s->col_file[c] < 0 || !s->blocks[c].buf) {
+            scan_close(s);
+            return -1;
+        }
+        if (t->types[c] == COL_TEXT) {
+            column_path(path, t->name, c, "heap");
+            s->heap_file[c] = pool_file(path);
+            if (s->heap_file[c] < 0) {
+                scan_close(s);
+                return -1;
+            }
+        }
+        if (is_dict(t, c)) {
+            CodeHeader ch;
+            s->dicts[c] = calloc(1, sizeof(Dict));
+            if (!s->dicts[c] || pool_read(s->col_file[c], 0, &ch, sizeof(ch), 0) != 0 || ch.magic != CODE_MAGIC ||
+                dict_load(s->dicts[c], s->heap_file[c], 0) != 0) {
+                scan_close(s);
+                return -1;
+            }
+            s->blocks[c].dict = s->dicts[c];
+            s->blocks[c].bits = (int)ch.bits;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Loads rows [start, start + n) of every needed column. A block that
+ * starts on a page boundary is used in place in the pool; any other span
+ * (such as one starting at an index candidate) is copied out.
+ */
+int scan_read_block(Scan *s, uint64_t start, size_t n) {
+    for (int c = 0; c < s->t->col_count; c++) {
+        ColumnBlock *b = &s->blocks[c];
+        if (!s->needed[c]) continue;
+
+        if (b->frame >= 0) {
+            pool_unpin(b->frame, 0);
+            b->frame = -1;
+        }
+        if (b->dict) {
+            if (codes_read(s->col_file[c], b->bits, start, n, b->buf, &b->heap, &b->heap_cap, s->sequential) != 0) return -1;
+            b->values = b->buf;
+            s->bytes_read += (n * (size_t)b->bits + 7) / 8;
+            continue;
+        }
+        if (start % BLOCK_ROWS == 0) {
+            b->frame = pool_pin(s->col_file[c], start / BLOCK_ROWS, s->sequential);
+            if (b->frame < 0) return -1;
+            if (pool_len(b->frame) < n * sizeof(uint64_t)) return -1;
+            b->values = (uint64_t *)pool_data(b->frame);
+        } else {
+            if (pool_read(s->col_file[c], start * sizeof(uint64_t), b->buf, n * sizeof(uint64_t), s->sequential) != 0) return -1;
+            b->values = b->buf;
+        }
+        s->bytes_read += n * sizeof(uint64_t);
+        if (s->t->types[c] != COL_TEXT || n == 0) continue;
+
+        if (start != s->next_row) {
+            b->heap_next = 0;
+            if (start > 0 && pool_read(s->col_file[c], (start - 1) * sizeof(uint64_t), &b->heap_next, sizeof(uint64_t), 0) != 0) return -1;
+        }
+        size_t bytes = (size_t)(b->values[n - 1] - b->heap_next);
+        if (bytes + 1 > b->heap_cap) {
+            char *grown = realloc(b->heap, bytes + 1);
+            if (!grown) return -1;
+            b->heap = grown;
+            b->heap_cap = bytes + 1;
+        }
+        if (pool_read(s->heap_file[c], b->heap_next, b->heap, bytes, s->sequential) != 0) return -1;
+        s->bytes_read += bytes;
+        b->heap_base = b->heap_next;
+        b->heap_next = b->values[n - 1];
+    }
+    s->next_row = start + n;
+    return 0;
+}
+
+void scan_close(Scan *s) {
+    for (int c = 0; c < MAX_COLS; c++) {
+        if (s->blocks[c].frame >= 0) pool_unpin(s->blocks[c].frame, 0);
+        if (s->col_file[c] >= 0) pool_release(s->col_file[c]);
+        if (s->heap_file[c] >= 0) pool_release(s->heap_file[c]);
+        free(s->blocks[c].buf);
+        free(s->blocks[c].heap);
+        if (s->dicts[c]) dict_free(s->dicts[c]);
+        free(s->dicts[c]);
+    }
+    for (int i = 0; i < MAX_PREDICATES * 2; i++) free(s->code_sets[i]);
+    memset(s, 0, sizeof(*s));
+    for (int c = 0; c < MAX_COLS; c++) s->col_file[c] = s->heap_file[c] = s->blocks[c].frame = -1;
+}
+
+const char *block_text(const ColumnBlock *b, size_t r, size_t *len) {
+    if (b->dict) return dict_text(b->dict, b->values[r], len);
+    uint64_t begin = (r == 0) ? b->heap_base : b->values[r - 1];
+    *len = (size_t)(b->values[r] - begin);
+    return b->heap + (begin - b->heap_base);
+}
+
+// --- Zone Maps ---
+
+// Orders values of a column as unsigned integers; -0.0 counts as 0.0, which it equals
+uint64_t zone_key(ColType type, const Value *v) {
+    if (type == COL_REAL && v->r == 0) {
+        Value zero = *v;
+        zero.r = 0.0;
+        return index_key(type, &zero);
+    }
+    return index_key(type, v);
+}
+
+// Widens a block's entry to cover one more value
+void zone_add(ZoneEntry *z, ColType type, const Value *v) {
+    if (z->rows == UINT64_MAX) return;
+    uint64_t k = zone_key(type, v);
+    if (z->rows == 0 || k < z->min) z->min = k;
+    if (z->rows == 0 || k > z->max) z->max = k;
+    z->rows++;
+}
+
+// Stores the entry of the block the appender is in; an unknown block is stored with no rows
+int zone_write(Appender *a, int col) {
+    ZoneEntry z = a->zones[col];
+    uint64_t block = (a->row_count - 1) / BLOCK_ROWS;
+    if (z.rows == UINT64_MAX) z.rows = 0;
+    return pool_write(a->zone_file[col], block * sizeof(ZoneEntry), &z, sizeof(z));
+}
+
+/**
+ * @brief Reads the zone map of every column the WHERE clause compares. A
+ * column without one (a table from before zone maps) is left NULL.
+ */
+void zone_load(ParallelScan *ps) {
+    uint64_t blocks = (ps->t->header.row_count + BLOCK_ROWS - 1) / BLOCK_ROWS;
+    memset(ps->zones, 0, sizeof(ps->zones));
+    if (!ps->where || ps->where->root < 0 || blocks == 0) return;
+    for (int i = 0; i < ps->where->count; i++) {
+        const Expr *e = &ps->where->nodes[i];
+        char path[MAX_PATH_LEN];
+        if (e->kind != EXPR_CMP || ps->zones[e->col]) continue;
+        column_path(path, ps->t->name, e->col, "zone");
+        if (access(path, F_OK) != 0) continue;
+        int file = pool_file(path);
+        ZoneEntry *zones = malloc(blocks * sizeof(ZoneEntry));
+        if (file >= 0 && zones && pool_read(file, 0, zones, blocks * sizeof(ZoneEntry), 1) == 0) {
+            ps->zones[e->col] = zones;
+        } else {
+            free(zones);
+        }
+        if (file >= 0) pool_release(file);
+    }
+}
+
+void zone_free(ParallelScan *ps) {
+    for (int c = 0; c < MAX_COLS; c++) {
+        free(ps->zones[c]);
+        ps->zones[c] = NULL;
+    }
+}
+
+/**
+ * @brief Returns 0 if no row of a block can satisfy the condition at `node`
+ * according to the block's zone entries, 1 if some row might. TEXT entries
+ * hold 8-byte prefixes, so their bounds are only compared inclusively.
+ */
+int zone_match(const ParallelScan *ps, int node, uint64_t block) {
+    const Expr *e = &ps->where->nodes[node];
+    if (e->kind == EXPR_AND) return zone_match(ps, e->left, block) && zone_match(ps, e->right, block);
+    if (e->kind == EXPR_OR) return zone_match(ps, e->left, block) || zone_match(ps, e->right, block);
+
+    const ZoneEntry *z = ps->zones[e->col] ? &ps->zones[e->col][block] : NULL;
+    if (!z || z->rows == 0) return 1;
+    ColType type = ps->t->types[e->col];
+    int exact = (type != COL_TEXT);
+    uint64_t k = zone_key(type, &e->lit);
+    switch (e->op) {
+        case OP_EQ: return z->min <= k && k <= z->max;
+        case OP_NE: return !exact || z->min != z->max || z->min != k || (type == COL_REAL && e->lit.r != e->lit.r);
+        case OP_LT: return exact ? z->min < k : z->min <= k;
+        case OP_LE: return z->min <= k;
+        case OP_GT: return exact ? z->max > k : z->max >= k;
+        case OP_GE: return z->max >= k;
+        case OP_PREFIX: {
+            char high[8];
+            Value hv = e->lit;
+            memset(high, 0xFF, sizeof(high));
+            memcpy(high, e->lit.s, e->lit.len < 8 ? e->lit.len : 8);
+            hv.s = high;
+            hv.len = 8;
+            return z->max >= k && z->min <= index_key(COL_TEXT, &hv);
         }
-        printf("\n");
     }
-    fclose(data_fp);
+    return 1;
+}
+
+// --- Dictionary Encoding ---
+
+int is_dict(const Table *t, int col) {
+    return t->types[col] == COL_TEXT && ((t->header.dict_cols >> col) & 1);
+}
+
+// Checksum of a dictionary entry; never 0, so a zeroed page is never an entry
+uint32_t dict_check(const char *str, size_t len) {
+    return (uint32_t)hash_bytes(str, len) | 1;
+}
+
+/**
+ * @brief Reads a dictionary from a heap file through the buffer pool. Entries
+ * are taken up to the first one that is incomplete or fails its check, which
+ * can only follow a crash; appends then continue from there. With `hashed`
+ * set the strings are also hashed for dict_find.
+ */
+int dict_load(Dict *d, int file, int hashed) {
+    memset(d, 0, sizeof(*d));
+    size_t total = 0;
+    for (uint64_t page_no = 0;; page_no++) {
+        int f = pool_pin(file, page_no, 0);
+        if (f < 0) return -1;
+        size_t len = pool_len(f);
+        if (total + len > d->cap) {
+            size_t cap = d->cap ? d->cap * 2 : POOL_PAGE_SIZE;
+            while (cap < total + len) cap *= 2;
+            char *grown = realloc(d->data, cap);
+            if (!grown) {
+                pool_unpin(f, 0);
+                return -1;
+            }
+            d->data = grown;
+            d->cap = cap;
+        }
+        memcpy(d->data + total, pool_data(f), len);
+        pool_unpin(f, 0);
+        total += len;
+        if (len < POOL_PAGE_SIZE) break;
+    }
+
+    while (d->size + sizeof(DictEntry) <= total) {
+        DictEntry e;
+        memcpy(&e, d->data + d->size, sizeof(e));
+        const char *str = d->data + d->size + sizeof(e);
+        if (e.len > total - d->size - sizeof(e) || e.check != dict_check(str, e.len)) break;
+        if (d->count == d->offs_cap) {
+            uint32_t cap = d->offs_cap ? d->offs_cap * 2 : 64;
+            uint64_t *grown = realloc(d->offs, cap * sizeof(uint64_t));
+            if (!grown) return -1;
+            d->offs = grown;
+            d->offs_cap = cap;
+        }
+        d->offs[d->count++] = d->size;
+        d->size += sizeof(e) + e.len;
+        // A string written twice (possible after recovery) keeps its first code
+        uint64_t hash = hash_bytes(str, e.len);
+        if (hashed && dict_find(d, str, e.len, hash) == UINT32_MAX && dict_insert(d, d->count - 1, hash) != 0) return -1;
+    }
+    return 0;
+}
+
+void dict_free(Dict *d) {
+    free(d->data);
+    free(d->offs);
+    free(d->slots);
+    memset(d, 0, sizeof(*d));
+}
+
+const char *dict_text(const Dict *d, uint64_t code, size_t *len) {
+    DictEntry e;
+    memcpy(&e, d->data + d->offs[code], sizeof(e));
+    *len = e.len;
+    return d->data + d->offs[code] + sizeof(e);
+}
+
+// Returns the code of a string, or UINT32_MAX if it is not in the dictionary
+uint32_t dict_find(const Dict *d, const char *str, size_t len, uint64_t hash) {
+    if (d->slot_count == 0) return UINT32_MAX;
+    for (uint32_t i = (uint32_t)hash & (d->slot_count - 1); d->slots[i]; i = (i + 1) & (d->slot_count - 1)) {
+        size_t code_len;
+        uint32_t code = (uint32_t)d->slots[i] - 1;
+        if ((d->slots[i] >> 32) != (hash >> 32)) continue;
+        const char *code_str = dict_text(d, code, &code_len);
+        if (code_len == len && memcmp(code_str, str, len) == 0) return code;
+    }
+    return UINT32_MAX;
+}
+
+/**
+ * @brief Adds a code to the hash table, first doubling the table (and
+ * re-adding every lower code) once it would be half full.
+ */
+int dict_insert(Dict *d, uint32_t code, uint64_t hash) {
+    if ((uint64_t)(code + 1) * 2 > d->slot_count) {
+        uint32_t count = d->slot_count ? d->slot_count * 2 : 64;
+        uint64_t *slots = calloc(count, sizeof(uint64_t));
+        if (!slots) return -1;
+        free(d->slots);
+        d->slots = slots;
+        d->slot_count = count;
+        for (uint32_t c = 0; c < code; c++) {
+            size_t len;
+            const char *str = dict_text(d, c, &len);
+            uint64_t h = hash_bytes(str, len);
+            if (dict_find(d, str, len, h) == UINT32_MAX && dict_insert(d, c, h) != 0) return -1;
+        }
+    }
+    uint32_t i = (uint32_t)hash & (d->slot_count - 1);
+    while (d->slots[i]) i = (i + 1) & (d->slot_count - 1);
+    d->slots[i] = (hash & 0xFFFFFFFF00000000ULL) | ((uint64_t)code + 1);
+    return 0;
+}
+
+/**
+ * @brief Appends a new string to a dictionary in memory.
+ * @return Its code, or -1 if out of memory.
+ */
+int64_t dict_add(Dict *d, const char *str, size_t len, uint64_t hash) {
+    DictEntry e = {(uint32_t)len, dict_check(str, len)};
+    if (d->count == UINT32_MAX - 1) return -1;
+    if (d->size + sizeof(e) + len > d->cap) {
+        size_t cap = d->cap ? d->cap * 2 : POOL_PAGE_SIZE;
+        while (cap < d->size + sizeof(e) + len) cap *= 2;
+        char *grown = realloc(d->data, cap);
+        if (!grown) return -1;
+        d->data = grown;
+        d->cap = cap;
+    }
+    if (d->count == d->offs_cap) {
+        uint32_t cap = d->offs_cap ? d->offs_cap * 2 : 64;
+        uint64_t *grown = realloc(d->offs, cap * sizeof(uint64_t));
+        if (!grown) return -1;
+        d->offs = grown;
+        d->offs_cap = cap;
+    }
+    memcpy(d->data + d->size, &e, sizeof(e));
+    memcpy(d->data + d->size + sizeof(e), str, len);
+    d->offs[d->count++] = d->size;
+    d->size += sizeof(e) + len;
+    if (dict_insert(d, d->count - 1, hash) != 0) return -1;
+    return d->count - 1;
+}
+
+// Bits needed to store a code; a column with a single string needs none
+int code_bits_for(uint64_t code) {
+    return code == 0 ? 0 : 64 - __builtin_clzll(code);
+}
+
+/**
+ * @brief Unpacks the codes of rows [start, start + n) of a DICT column file
+ * into `out`. The packed bytes are read into *buf, which grows as needed.
+ */
+int codes_read(int file, int bits, uint64_t start, size_t n, uint64_t *out, char **buf, size_t *cap, int sequential) {
+    if (bits == 0 || n == 0) {
+        memset(out, 0, n * sizeof(uint64_t));
+        return 0;
+    }
+    uint64_t lo = start * bits / 8, hi = ((start + n) * bits + 7) / 8;
+    size_t len = (size_t)(hi - lo);
+    // Each code is taken from an unaligned 8-byte load, which may run past the last byte
+    if (len + 8 > *cap) {
+        char *grown = realloc(*buf, len + 8);
+        if (!grown) return -1;
+        *buf = grown;
+        *cap = len + 8;
+    }
+    if (pool_read(file, sizeof(CodeHeader) + lo, *buf, len, sequential) != 0) return -1;
+    memset(*buf + len, 0, 8);
+
+    uint64_t mask = (1ULL << bits) - 1;
+    size_t bit = (size_t)(start * bits % 8);
+    for (size_t i = 0; i < n; i++, bit += (size_t)bits) {
+        uint64_t word;
+        memcpy(&word, *buf + bit / 8, sizeof(word));
+        out[i] = (word >> (bit % 8)) & mask;
+    }
+    return 0;
+}
+
+// Packs codes `bits` bits each from the start of `out`; returns the bytes used
+size_t codes_pack(const uint64_t *codes, size_t n, int bits, char *out) {
+    uint64_t acc = 0;
+    int fill = 0;
+    size_t len = 0;
+    for (size_t i = 0; i < n; i++) {
+        acc |= codes[i] << fill;
+        fill += bits;
+        while (fill >= 8) {
+            out[len++] = (char)(acc & 0xFF);
+            acc >>= 8;
+            fill -= 8;
+        }
+    }
+    if (fill > 0) out[len++] = (char)acc;
+    return len;
+}
+
+/**
+ * @brief Positions an appender's writer for a DICT column after the last
+ * row's code. The bits of a byte shared with earlier rows are carried over,
+ * so rewriting that byte leaves their codes as they were.
+ */
+int codes_open(Appender *a, int col) {
+    char path[MAX_PATH_LEN];
+    CodeHeader ch;
+    ColumnWriter *w = &a->col_out[col];
+    column_path(path, a->t->name, col, "col");
+    if (writer_open(w, path, 0) != 0 || pool_read(w->file, 0, &ch, sizeof(ch), 0) != 0 || ch.magic != CODE_MAGIC) return -1;
+
+    uint64_t bit = a->row_count * ch.bits;
+    a->code_bits[col] = (int)ch.bits;
+    a->code_fill[col] = (int)(bit % 8);
+    a->code_acc[col] = 0;
+    w->off = sizeof(CodeHeader) + bit / 8;
+    if (a->code_fill[col] > 0) {
+        unsigned char last;
+        if (pool_read(w->file, w->off, &last, 1, 0) != 0) return -1;
+        a->code_acc[col] = last & ((1u << a->code_fill[col]) - 1);
+    }
+    return 0;
+}
+
+/**
+ * @brief Rewrites a DICT column file with `bits`-bit codes, for a dictionary
+ * that has outgrown the current width. The new file is built beside the old
+ * one from every row written so far, made durable and renamed over it, so a
+ * crash leaves one complete version. This happens at most once per bit.
+ */
+int codes_widen(Appender *a, int col, int bits) {
+    char path[MAX_PATH_LEN], tmp[MAX_PATH_LEN + 4];
+    ColumnWriter *w = &a->col_out[col];
+    int old_bits = a->code_bits[col];
+    uint64_t *codes = malloc(BLOCK_ROWS * sizeof(uint64_t));
+    char *packed = malloc(BLOCK_ROWS * sizeof(uint32_t));
+    char *buf = NULL;
+    size_t cap = 0;
+    int rc = 0;
+
+    // Every code written so far goes into the pool first
+    char last = (char)a->code_acc[col];
+    if (a->code_fill[col] > 0 && writer_put(w, &last, 1) != 0) rc = -1;
+    if (writer_close(w) != 0) rc = -1;
+
+    column_path(path, a->t->name, col, "col");
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int file = pool_file(path);
+    FILE *fp = fopen(tmp, "wb");
+    CodeHeader ch = {CODE_MAGIC, (uint32_t)bits};
+    uint64_t start = 0;
+    if (rc != 0 || !codes || !packed || file < 0 || !fp || fwrite(&ch, sizeof(ch), 1, fp) != 1) rc = -1;
+    while (rc == 0 && start < a->row_count) {
+        size_t n = (a->row_count - start < BLOCK_ROWS) ? (size_t)(a->row_count - start) : BLOCK_ROWS;
+        size_t len = 0;
+        if (codes_read(file, old_bits, start, n, codes, &buf, &cap, 1) != 0) rc = -1;
+        else len = codes_pack(codes, n, bits, packed);
+        if (rc == 0 && fwrite(packed, 1, len, fp) != len) rc = -1;
+        start += n;
+    }
+    if (rc == 0 && (fflush(fp) != 0 || fsync(fileno(fp)) != 0)) rc = -1;
+    if (fp && fclose(fp) != 0) rc = -1;
+    if (file >= 0) pool_release(file);
+    free(codes);
+    free(packed);
+    free(buf);
+    if (rc == 0) {
+        // The pool's pages of the old file are all in the new one
+        pool_drop_file(path);
+        if (rename(tmp, path) != 0 || sync_path(".") != 0) rc = -1;
+    }
+    if (rc != 0) {
+        remove(tmp);
+        return -1;
+    }
+    return codes_open(a, col);
+}
+
+// Adds one row's code to a DICT column, writing out each completed byte
+int codes_put(Appender *a, int col, uint64_t code) {
+    a->code_acc[col] |= code << a->code_fill[col];
+    a->code_fill[col] += a->code_bits[col];
+    while (a->code_fill[col] >= 8) {
+        char byte = (char)(a->code_acc[col] & 0xFF);
+        if (writer_put(&a->col_out[col], &byte, 1) != 0) return -1;
+        a->code_acc[col] >>= 8;
+        a->code_fill[col] -= 8;
+    }
+    return 0;
+}
+
+/**
+ * @brief Returns the code of a value of a DICT column, adding the value to
+ * the dictionary (and widening the column's codes) if it is new.
+ */
+int64_t dict_code(Appender *a, int col, const Value *v) {
+    Dict *d = &a->dicts[col];
+    uint64_t hash = hash_bytes(v->s, v->len);
+    uint32_t code = dict_find(d, v->s, v->len, hash);
+    if (code != UINT32_MAX) return code;
+
+    int64_t added = dict_add(d, v->s, v->len, hash);
+    if (added < 0 || writer_put(&a->heap_out[col], d->data + d->offs[added], sizeof(DictEntry) + v->len) != 0) return -1;
+    int bits = code_bits_for((uint64_t)added);
+    if (bits > a->code_bits[col] && codes_widen(a, col, bits) != 0) return -1;
+    return added;
+}
+
+// --- Parallel Scans ---
+
+// Selects the rows of the current block that satisfy the WHERE clause
+void select_rows(const Where *w, Scan *s, size_t n, uint64_t *bits) {
+    if (w && w->root >= 0) {
+        eval_where(w, w->root, s, n, bits);
+        return;
+    }
+    memset(bits, 0, BITMAP_WORDS * sizeof(uint64_t));
+    for (size_t r = 0; r < n; r++) bits[r / 64] |= 1ULL << (r % 64);
+}
+
+/**
+ * @brief Scans one chunk of rows: block by block for a full scan, or only the
+ * block spans holding candidate rows when an index narrowed the scan.
+ */
+int scan_chunk(ParallelScan *ps, Scan *s, int worker, uint64_t chunk, FILE *out) {
+    uint64_t row_count = ps->t->header.row_count;
+    uint64_t start = chunk * CHUNK_ROWS;
+    uint64_t end = (row_count - start < CHUNK_ROWS) ? row_count : start + CHUNK_ROWS;
+
+    s->sequential = !ps->cands;
+    if (!ps->cands) {
+        while (start < end) {
+            size_t n = (end - start < BLOCK_ROWS) ? (size_t)(end - start) : BLOCK_ROWS;
+            if (ps->where && ps->where->root >= 0 && !zone_match(ps, ps->where->root, start / BLOCK_ROWS)) {
+                __atomic_fetch_add(&ps->blocks_skipped, 1, __ATOMIC_RELAXED);
+                start += n;
+                continue;
+            }
+            int rc = scan_block(ps, s, worker, start, n, NULL, out);
+            if (rc != 0) return rc;
+            start += n;
+        }
+        return 0;
+    }
+
+    // First candidate of the chunk
+    long c = 0, hi = ps->cand_count;
+    while (c < hi) {
+        long mid = (c + hi) / 2;
+        if (ps->cands[mid] < start) c = mid + 1;
+        else hi = mid;
+    }
+    while (c < ps->cand_count && ps->cands[c] < end) {
+        long last = c;
+        start = ps->cands[c];
+        while (last + 1 < ps->cand_count && ps->cands[last + 1] < start + BLOCK_ROWS && ps->cands[last + 1] < end) last++;
+        size_t n = (size_t)(ps->cands[last] - start + 1);
+
+        uint64_t mask[BITMAP_WORDS] = {0};
+        for (; c <= last; c++) {
+            size_t r = (size_t)(ps->cands[c] - start);
+            mask[r / 64] |= 1ULL << (r % 64);
+        }
+        int rc = scan_block(ps, s, worker, start, n, mask, out);
+        if (rc != 0) return rc;
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads rows [start, start + n), selects those passing the WHERE clause
+ * (and `mask`, when an index picked the candidates) and hands them to ps->fn.
+ * Under EXPLAIN ANALYZE each of the three steps is timed separately.
+ */
+int scan_block(ParallelScan *ps, Scan *s, int worker, uint64_t start, size_t n, const uint64_t *mask, FILE *out) {
+    uint64_t bits[BITMAP_WORDS];
+    uint64_t bytes = s->bytes_read;
+    uint64_t loaded = 0, selected = 0;
+    Stamp lap;
+
+    if (ps->scan_stats) stamp(&lap);
+    if (scan_read_block(s, start, n) != 0) return -1;
+    if (ps->scan_stats) {
+        loaded = mask ? bits_count(mask, n) : n;
+        op_read(ps->scan_stats, s->bytes_read - bytes);
+        op_add(ps->scan_stats, 0, loaded, &lap);
+    }
+
+    select_rows(ps->where, s, n, bits);
+    if (mask) {
+        for (size_t w = 0; w < BITMAP_WORDS; w++) bits[w] &= mask[w];
+    }
+    if (ps->scan_stats) {
+        selected = bits_count(bits, n);
+        op_add(ps->filter_stats, loaded, selected, &lap);
+    }
+
+    int rc = ps->fn(ps->arg, worker, s, n, bits, out);
+    op_add(ps->fn_stats, selected, 0, &lap);
+    return rc;
+}
+
+void *scan_worker(void *arg) {
+    ScanWorker *sw = arg;
+    ParallelScan *ps = sw->ps;
+    Scan s;
+    reply_out = sw->reply;
+    int failed = scan_open(&s, ps->t, ps->needed) != 0;
+
+    while (!failed) {
+        // Ordered scans stay at most SCAN_WINDOW chunks per worker ahead of the
+        // output, which bounds the memory held in finished chunks.
+        pthread_mutex_lock(&ps->lock);
+        while (ps->out && !ps->failed && ps->next_chunk < ps->chunk_count &&
+               ps->next_chunk >= ps->emitted + (uint64_t)ps->workers * SCAN_WINDOW) {
+            pthread_cond_wait(&ps->cond, &ps->lock);
+        }
+        if (ps->failed || ps->next_chunk >= ps->chunk_count) {
+            pthread_mutex_unlock(&ps->lock);
+            break;
+        }
+        uint64_t chunk = ps->next_chunk++;
+        pthread_mutex_unlock(&ps->lock);
+
+        char *buf = NULL;
+        size_t len = 0;
+        FILE *out = ps->out ? open_memstream(&buf, &len) : NULL;
+        if (ps->out && !out) {
+            failed = 1;
+            break;
+        }
+        failed = scan_chunk(ps, &s, sw->worker, chunk, out) != 0;
+        if (out) fclose(out);
+
+        pthread_mutex_lock(&ps->lock);
+        if (failed) {
+            free(buf);
+        } else if (ps->out) {
+            ps->chunk_buf[chunk] = buf;
+            ps->chunk_len[chunk] = len;
+            ps->chunk_done[chunk] = 1;
+        }
+        pthread_cond_broadcast(&ps->cond);
+        pthread_mutex_unlock(&ps->lock);
+    }
+
+    if (failed) {
+        pthread_mutex_lock(&ps->lock);
+        ps->failed = 1;
+        pthread_cond_broadcast(&ps->cond);
+        pthread_mutex_unlock(&ps->lock);
+    }
+    if (s.t) scan_close(&s);
+    return NULL;
+}
+
+/**
+ * @brief Runs a scan over CHUNK_ROWS-row chunks on up to scan_threads workers.
+ * Each worker reads, filters and hands its blocks to ps->fn. With ps->out set,
+ * each chunk's output is buffered and written to ps->out in table order;
+ * otherwise chunks finish in any order and fn keeps per-worker state.
+ * @return 0 on success, -1 if column data could not be read.
+ */
+int parallel_scan(ParallelScan *ps) {
+    uint64_t row_count = ps->t->header.row_count;
+    ps->chunk_count = (row_count + CHUNK_ROWS - 1) / CHUNK_ROWS;
+    ps->next_chunk = ps->emitted = 0;
+    ps->failed = 0;
+    ps->blocks_skipped = 0;
+    if (!ps->cands) zone_load(ps);
+    ps->workers = scan_threads;
+    if ((uint64_t)ps->workers > ps->chunk_count) ps->workers = (int)ps->chunk_count;
+    if ((ps->cands && ps->cand_count < BLOCK_ROWS) || ps->serial) ps->workers = 1;
+    if (ps->scan_stats) ps->scan_stats->rows_in += ps->cands ? (uint64_t)ps->cand_count : row_count;
+
+    if (ps->workers <= 1) {
+        Scan s;
+        int rc = 0;
+        ps->workers = 1;
+        if (scan_open(&s, ps->t, ps->needed) != 0) {
+            zone_free(ps);
+            return -1;
+        }
+        for (uint64_t chunk = 0; chunk < ps->chunk_count && rc == 0; chunk++) {
+            rc = scan_chunk(ps, &s, 0, chunk, ps->out);
+        }
+        scan_close(&s);
+        zone_free(ps);
+        if (ps->scan_stats) ps->scan_stats->blocks_skipped += ps->blocks_skipped;
+        return rc < 0 ? -1 : 0;
+    }
+
+    pthread_t threads[MAX_THREADS];
+    ScanWorker workers[MAX_THREADS];
+    if (ps->out) {
+        ps->chunk_buf = calloc(ps->chunk_count, sizeof(char *));
+        ps->chunk_len = calloc(ps->chunk_count, sizeof(size_t));
+        ps->chunk_done = calloc(ps->chunk_count, 1);
+        if (!ps->chunk_buf || !ps->chunk_len || !ps->chunk_done) {
+            free(ps->chunk_buf);
+            free(ps->chunk_len);
+            free(ps->chunk_done);
+            zone_free(ps);
+            return -1;
+        }
+    }
+    pthread_mutex_init(&ps->lock, NULL);
+    pthread_cond_init(&ps->cond, NULL);
+    int started = 0;
+    for (int i = 0; i < ps->workers; i++) {
+        workers[i].ps = ps;
+        workers[i].worker = i;
+        workers[i].reply = reply_out;
+        if (pthread_create(&threads[i], NULL, scan_worker, &workers[i]) != 0) break;
+        started++;
+    }
+    if (started == 0) ps->failed = 1;
+
+    for (uint64_t chunk = 0; ps->out && chunk < ps->chunk_count; chunk++) {
+        pthread_mutex_lock(&ps->lock);
+        while (!ps->chunk_done[chunk] && !ps->failed) pthread_cond_wait(&ps->cond, &ps->lock);
+        int ready = ps->chunk_done[chunk];
+        pthread_mutex_unlock(&ps->lock);
+        if (!ready) break;
+
+        fwrite(ps->chunk_buf[chunk], 1, ps->chunk_len[chunk], ps->out);
+        free(ps->chunk_buf[chunk]);
+        ps->chunk_buf[chunk] = NULL;
+        pthread_mutex_lock(&ps->lock);
+        ps->emitted++;
+        pthread_cond_broadcast(&ps->cond);
+        pthread_mutex_unlock(&ps->lock);
+    }
+
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&ps->lock);
+    pthread_cond_destroy(&ps->cond);
+    if (ps->out) {
+        for (uint64_t chunk = 0; chunk < ps->chunk_count; chunk++) free(ps->chunk_buf[chunk]);
+        free(ps->chunk_buf);
+        free(ps->chunk_len);
+        free(ps->chunk_done);
+        ps->chunk_buf = NULL;
+    }
+    zone_free(ps);
+    if (ps->scan_stats) ps->scan_stats->blocks_skipped += ps->blocks_skipped;
+    return ps->failed ? -1 : 0;
+}
+
+// --- Hash Aggregation ---
+
+void *arena_alloc(Arena *a, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    if (!a->head || a->head->used + size > a->head->cap) {
+        size_t cap = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        ArenaBlock *b = malloc(sizeof(ArenaBlock) + cap);
+        if (!b) return NULL;
+        b->next = a->head;
+        b->used = 0;
+        b->cap = cap;
+        a->head = b;
+    }
+    void *p = a->head->data + a->head->used;
+    a->head->used += size;
+    return p;
+}
+
+void arena_free(Arena *a) {
+    while (a->head) {
+        ArenaBlock *next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+}
+
+uint64_t hash_bytes(const char *data, size_t len) {
+    uint64_t h = 0x9E3779B97F4A7C15ULL ^ len;
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, data, 8);
+        h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 32;
+        data += 8;
+        len -= 8;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, data, len);
+    h = (h ^ tail) * 0xC4CEB9FE1A85EC53ULL;
+    return h ^ (h >> 29);
+}
+
+AggState *group_states(AggGroup *g) {
+    return (AggState *)(g + 1);
+}
+
+char *group_key(AggGroup *g, int agg_count) {
+    return (char *)(group_states(g) + agg_count);
+}
+
+// Bytes of a group in its table: the header, its AggStates and its key
+size_t group_size(int agg_count, const AggGroup *g) {
+    return sizeof(AggGroup) + agg_count * sizeof(AggState) + g->key_len;
+}
+
+// Whether an aggregate keeps a TEXT value: MIN or MAX of a TEXT column
+int agg_is_text(const Aggregation *ag, int i) {
+    const SelectItem *item = &ag->aggs[i];
+    return (item->func == AGG_MIN || item->func == AGG_MAX) && ag->t->types[item->col] == COL_TEXT;
+}
+
+const char *agg_text(const AggState *st, uint32_t *len) {
+    memcpy(len, st->v.s, sizeof(*len));
+    return st->v.s + sizeof(*len);
+}
+
+/**
+ * @brief Makes `str` the TEXT value of a MIN (op OP_LT) or MAX (OP_GT) state
+ * if it has none yet or `str` compares `op` to it. The value is copied into
+ * the table's arena; the one it replaces stays there until the table is freed.
+ * @return 0 on success, -1 if memory ran out.
+ */
+int agg_keep_text(AggTable *ht, AggState *st, CmpOp op, const char *str, uint32_t len) {
+    if (st->count > 0) {
+        uint32_t cur_len;
+        const char *cur = agg_text(st, &cur_len);
+        if (!text_matches(str, len, op, cur, cur_len)) return 0;
+    }
+    char *p = arena_alloc(&ht->arena, sizeof(len) + len);
+    if (!p) return -1;
+    memcpy(p, &len, sizeof(len));
+    memcpy(p + sizeof(len), str, len);
+    st->v.s = p;
+    ht->bytes += sizeof(len) + len;
+    return 0;
+}
+
+/**
+ * @brief Finds the group for a key, adding a zeroed one if it is new. Groups
+ * live in the table's arena; the slot array only holds pointers and is probed
+ * linearly, doubling once it is 70% full.
+ */
+AggGroup *agg_lookup(AggTable *ht, int agg_count, uint64_t hash, const char *key, uint32_t key_len) {
+    if (ht->count * 10 >= ht->cap * 7) {
+        size_t cap = ht->cap ? ht->cap * 2 : 1024;
+        AggGroup **slots = calloc(cap, sizeof(AggGroup *));
+        if (!slots) return NULL;
+        for (size_t i = 0; i < ht->cap; i++) {
+            AggGroup *g = ht->slots[i];
+            if (!g) continue;
+            size_t j = g->hash & (cap - 1);
+            while (slots[j]) j = (j + 1) & (cap - 1);
+            slots[j] = g;
+        }
+        free(ht->slots);
+        ht->slots = slots;
+        ht->cap = cap;
+    }
+
+    size_t i = hash & (ht->cap - 1);
+    while (ht->slots[i]) {
+        AggGroup *g = ht->slots[i];
+        if (g->hash == hash && g->key_len == key_len && memcmp(group_key(g, agg_count), key, key_len) == 0) return g;
+        i = (i + 1) & (ht->cap - 1);
+    }
+
+    size_t size = sizeof(AggGroup) + agg_count * sizeof(AggState) + key_len;
+    AggGroup *g = arena_alloc(&ht->arena, size);
+    if (!g) return NULL;
+    ht->bytes += size;
+    g->hash = hash;
+    g->key_len = key_len;
+    memset(group_states(g), 0, agg_count * sizeof(AggState));
+    memcpy(group_key(g, agg_count), key, key_len);
+    ht->slots[i] = g;
+    ht->count++;
+    return g;
+}
+
+void agg_table_free(AggTable *ht) {
+    free(ht->slots);
+    free(ht->key_buf);
+    arena_free(&ht->arena);
+    for (int p = 0; p < AGG_PARTITIONS; p++) {
+        if (ht->parts[p]) fclose(ht->parts[p]);
+    }
+    memset(ht, 0, sizeof(*ht));
+}
+
+// Group keys concatenate the GROUP BY values: 8 bytes per INT or REAL value,
+// and a 4-byte length followed by the bytes for TEXT.
+size_t build_group_key(const Aggregation *ag, const Scan *s, size_t r, AggTable *ht) {
+    size_t len = 0;
+    for (int i = 0; i < ag->group_count; i++) {
+        int col = ag->group_cols[i];
+        const ColumnBlock *b = &s->blocks[col];
+        const char *src = (const char *)&b->values[r];
+        size_t src_len = 8;
+        uint32_t text_len = 0;
+        if (ag->t->types[col] == COL_TEXT) {
+            size_t l;
+            src = block_text(b, r, &l);
+            src_len = l;
+            text_len = (uint32_t)l;
+        }
+        size_t need = len + src_len + sizeof(uint32_t);
+        if (need > ht->key_cap) {
+            size_t cap = need * 2;
+            char *grown = realloc(ht->key_buf, cap);
+            if (!grown) return (size_t)-1;
+            ht->key_buf = grown;
+            ht->key_cap = cap;
+        }
+        if (ag->t->types[col] == COL_TEXT) {
+            memcpy(ht->key_buf + len, &text_len, sizeof(text_len));
+            len += sizeof(text_len);
+        }
+        memcpy(ht->key_buf + len, src, src_len);
+        len += src_len;
+    }
+    return len;
+}
+
+int agg_update(const Aggregation *ag, AggTable *ht, AggState *states, const Scan *s, size_t r) {
+    for (int i = 0; i < ag->agg_count; i++) {
+        const SelectItem *item = &ag->aggs[i];
+        AggState *st = &states[i];
+        if (item->func != AGG_COUNT) {
+            const ColumnBlock *b = &s->blocks[item->col];
+            if (ag->t->types[item->col] == COL_INT) {
+                int64_t x = ((const int64_t *)b->values)[r];
+                switch (item->func) {
+                    case AGG_SUM: st->v.i += x; break;
+                    case AGG_AVG: st->v.d += (double)x; break;
+                    case AGG_MIN: if (st->count == 0 || x < st->v.i) st->v.i = x; break;
+                    case AGG_MAX: if (st->count == 0 || x > st->v.i) st->v.i = x; break;
+                    default: break;
+                }
+            } else if (ag->t->types[item->col] == COL_TEXT) {
+                // Only MIN and MAX take TEXT
+                size_t len;
+                const char *str = block_text(b, r, &len);
+                if (agg_keep_text(ht, st, item->func == AGG_MIN ? OP_LT : OP_GT, str, (uint32_t)len) != 0) return -1;
+            } else {
+                double x = ((const double *)b->values)[r];
+                switch (item->func) {
+                    case AGG_SUM:
+                    case AGG_AVG: st->v.d += x; break;
+                    case AGG_MIN: if (st->count == 0 || x < st->v.d) st->v.d = x; break;
+                    case AGG_MAX: if (st->count == 0 || x > st->v.d) st->v.d = x; break;
+                    default: break;
+                }
+            }
+        }
+        st->count++;
+    }
+    return 0;
+}
+
+// Folds the partial state `from` of another worker into `into`, a group of `ht`
+int agg_merge(const Aggregation *ag, AggTable *ht, AggState *into, const AggState *from) {
+    for (int i = 0; i < ag->agg_count; i++) {
+        const SelectItem *item = &ag->aggs[i];
+        int is_int = item->col >= 0 && ag->t->types[item->col] == COL_INT;
+        if (from[i].count == 0) continue;
+        if (agg_is_text(ag, i)) {
+            uint32_t len;
+            const char *str = agg_text(&from[i], &len);
+            if (agg_keep_text(ht, &into[i], item->func == AGG_MIN ? OP_LT : OP_GT, str, len) != 0) return -1;
+            into[i].count += from[i].count;
+            continue;
+        }
+        switch (item->func) {
+            case AGG_SUM:
+                if (is_int) into[i].v.i += from[i].v.i;
+                else into[i].v.d += from[i].v.d;
+                break;
+            case AGG_AVG:
+                into[i].v.d += from[i].v.d;
+                break;
+            case AGG_MIN:
+                if (into[i].count == 0 || (is_int ? from[i].v.i < into[i].v.i : from[i].v.d < into[i].v.d)) into[i].v = from[i].v;
+                break;
+            case AGG_MAX:
+                if (into[i].count == 0 || (is_int ? from[i].v.i > into[i].v.i : from[i].v.d > into[i].v.d)) into[i].v = from[i].v;
+                break;
+            default:
+                break;
+        }
+        into[i].count += from[i].count;
+    }
+    return 0;
+}
+
+/**
+ * @brief Appends a group to `buf` as one self-contained record: the group as
+ * it is in memory, then the TEXT value of each MIN or MAX over TEXT.
+ * @return 0 on success, -1 if memory ran out.
+ */
+int group_encode(const Aggregation *ag, AggGroup *g, char **buf, size_t *len, size_t *cap) {
+    size_t size = group_size(ag->agg_count, g);
+    char *p = buf_extend(buf, len, cap, size);
+    if (!p) return -1;
+    memcpy(p, g, size);
+    const AggState *states = group_states(g);
+    for (int i = 0; i < ag->agg_count; i++) {
+        uint32_t text_len;
+        if (!agg_is_text(ag, i) || states[i].count == 0) continue;
+        agg_text(&states[i], &text_len);
+        if (!(p = buf_extend(buf, len, cap, sizeof(text_len) + text_len))) return -1;
+        memcpy(p, states[i].v.s, sizeof(text_len) + text_len);
+    }
+    return 0;
+}
+
+// Points the TEXT states of a group read back from a group_encode record at the values after it
+void group_decode(const Aggregation *ag, AggGroup *g) {
+    AggState *states = group_states(g);
+    const char *p = (const char *)g + group_size(ag->agg_count, g);
+    for (int i = 0; i < ag->agg_count; i++) {
+        uint32_t text_len;
+        if (!agg_is_text(ag, i) || states[i].count == 0) continue;
+        memcpy(&text_len, p, sizeof(text_len));
+        states[i].v.s = p;
+        p += sizeof(text_len) + text_len;
+    }
+}
+
+/**
+ * @brief Moves a worker's groups into its partition files, picked by the high
+ * bits of their hash, and empties its table. Each record is a 4-byte length
+ * and then a group_encode record; the key buffer is free to hold it.
+ * @return 0 on success, -1 if memory or temporary space ran out.
+ */
+int agg_spill(const Aggregation *ag, AggTable *ht) {
+    for (size_t i = 0; i < ht->cap; i++) {
+        AggGroup *g = ht->slots[i];
+        if (!g) continue;
+        FILE **fp = &ht->parts[(g->hash >> 32) % AGG_PARTITIONS];
+        if (!*fp) {
+            *fp = tmpfile();
+            if (!*fp) return -1;
+            setvbuf(*fp, NULL, _IOFBF, SORT_IO_BUFFER);
+        }
+        size_t len = 0;
+        if (group_encode(ag, g, &ht->key_buf, &len, &ht->key_cap) != 0) return -1;
+        uint32_t rec_len = (uint32_t)len;
+        if (fwrite(&rec_len, sizeof(rec_len), 1, *fp) != 1 || fwrite(ht->key_buf, 1, len, *fp) != len) return -1;
+    }
+    free(ht->slots);
+    arena_free(&ht->arena);
+    ht->slots = NULL;
+    ht->cap = ht->count = ht->bytes = 0;
+    return 0;
+}
+
+// Reads the next group of a partition file into *buf; returns 1, 0 at its end, or -1
+int agg_read_group(FILE *fp, const Aggregation *ag, char **buf, size_t *cap, AggGroup **g) {
+    uint32_t len;
+    if (fread(&len, sizeof(len), 1, fp) != 1) return ferror(fp) ? -1 : 0;
+    if (len > *cap) {
+        char *grown = realloc(*buf, len);
+        if (!grown) return -1;
+        *buf = grown;
+        *cap = len;
+    }
+    if (fread(*buf, 1, len, fp) != len) return -1;
+    *g = (AggGroup *)*buf;
+    group_decode(ag, *g);
+    return 1;
+}
+
+// Aggregates the selected rows of a block into the calling worker's table
+int aggregate_rows(void *arg, int worker, const Scan *s, size_t n, const uint64_t *bits, FILE *out) {
+    Aggregation *ag = arg;
+    AggTable *ht = &ag->tables[worker];
+    (void)out;
+    for (size_t w = 0; w < (n + 63) / 64; w++) {
+        uint64_t word = bits[w];
+        while (word) {
+            size_t r = w * 64 + (size_t)__builtin_ctzll(word);
+            word &= word - 1;
+            size_t key_len = build_group_key(ag, s, r, ht);
+            if (key_len == (size_t)-1) return -1;
+            AggGroup *g = agg_lookup(ht, ag->agg_count, hash_bytes(ht->key_buf, key_len), ht->key_buf, (uint32_t)key_len);
+            if (!g || agg_update(ag, ht, group_states(g), s, r) != 0) return -1;
+            if (ht->bytes + ht->cap * sizeof(AggGroup *) > ag->budget && agg_spill(ag, ht) != 0) return -1;
+        }
+    }
+    return 0;
+}
+
+void print_group_row(FILE *out, const Aggregation *ag, const SelectItem *items, int item_count, AggGroup *g) {
+    AggState *states = group_states(g);
+    int agg = 0;
+
+    for (int i = 0; i < item_count; i++) {
+        const SelectItem *item = &items[i];
+        if (!item->is_agg) {
+            uint32_t len;
+            const char *p = group_value(ag, g, item->col, &len);
+            int64_t iv;
+            double dv;
+            switch (ag->t->types[item->col]) {
+                case COL_INT: memcpy(&iv, p, 8); fprintf(out, "%-20lld", (long long)iv); break;
+                case COL_REAL: memcpy(&dv, p, 8); print_real(out, dv); break;
+                case COL_TEXT: fprintf(out, "%-20.*s", (int)len, p); break;
+            }
+            continue;
+        }
+
+        const AggState *st = &states[agg++];
+        int is_int = item->col >= 0 && ag->t->types[item->col] == COL_INT;
+        if (item->func == AGG_COUNT) fprintf(out, "%-20lld", (long long)st->count);
+        else if (st->count == 0) fprintf(out, "%-20s", "NULL");
+        else if (item->func == AGG_AVG) print_real(out, st->v.d / st->count);
+        else if (is_int) fprintf(out, "%-20lld", (long long)st->v.i);
+        else if (ag->t->types[item->col] == COL_REAL) print_real(out, st->v.d);
+        else {
+            uint32_t len;
+            const char *str = agg_text(st, &len);
+            fprintf(out, "%-20.*s", (int)len, str);
+        }
+    }
+    fputc('\n', out);
+}
+
+/**
+ * @brief Runs a GROUP BY (or whole-table) aggregation. Every scan worker fills
+ * its own hash table, so no locks are taken per row; the partial tables are
+ * merged into the first one at the end. A worker whose table outgrows its
+ * share of AGG_MEMORY moves its groups to partition files by hash; then
+ * every worker's groups are, and each partition is merged and passed on in
+ * turn, so only one partition's groups are in memory at a time.
+ */
+void run_aggregate(const Plan *plan, const Table *t, const Where *where, uint64_t *cands, long cand_count, uint64_t limit) {
+    const SelectItem *items = plan->items;
+    int item_count = plan->item_count;
+    int group_count = plan->group_count;
+    Aggregation *ag = calloc(1, sizeof(Aggregation));
+    if (!ag) {
+        reply("Not enough memory for aggregation.\n");
+        return;
+    }
+    ag->t = t;
+    ag->group_count = group_count;
+    memcpy(ag->group_cols, plan->group_cols, group_count * sizeof(int));
+    for (int i = 0; i < item_count; i++) {
+        if (items[i].is_agg) ag->aggs[ag->agg_count++] = items[i];
+    }
+    ag->budget = AGG_MEMORY / (size_t)scan_threads;
+
+    ParallelScan ps;
+    memset(&ps, 0, sizeof(ps));
+    ps.t = t;
+    ps.needed = plan->needed;
+    ps.where = where;
+    ps.cands = (cand_count >= 0) ? cands : NULL;
+    ps.cand_count = cand_count;
+    ps.fn = aggregate_rows;
+    ps.arg = ag;
+    scan_profile(&ps, plan, 0, PLAN_AGGREGATE);
+    if (cand_count != 0 && parallel_scan(&ps) != 0) {
+        reply("Table '%s' is missing column data.\n", t->name);
+        for (int w = 0; w < MAX_THREADS; w++) agg_table_free(&ag->tables[w]);
+        free(ag);
+        return;
+    }
+
+    AggTable *result = &ag->tables[0];
+    GroupPrinter gp = {ag, items, item_count, NULL, 0, 0};
+    Sorter sorter;
+    uint64_t groups = 0, seq = 0;
+    int failed = 0, spilled = 0;
+    Stamp lap;
+    if (ps.fn_stats) stamp(&lap);
+    sorter_init(&sorter, SORT_MEMORY, limit <= SORT_TOPK_MAX ? limit : 0);
+    for (int w = 0; w < ps.workers; w++) {
+        for (int p = 0; p < AGG_PARTITIONS; p++) spilled |= ag->tables[w].parts[p] != NULL;
+    }
+
+    if (!spilled) {
+        for (int w = 1; w < ps.workers && !failed; w++) {
+            AggTable *part = &ag->tables[w];
+            for (size_t i = 0; i < part->cap; i++) {
+                AggGroup *g = part->slots[i];
+                if (!g) continue;
+                AggGroup *into = agg_lookup(result, ag->agg_count, g->hash, group_key(g, ag->agg_count), g->key_len);
+                if (!into || agg_merge(ag, result, group_states(into), group_states(g)) != 0) {
+                    failed = 1;
+                    break;
+                }
+            }
+        }
+        // An aggregate without GROUP BY always yields one row, even over no rows
+        if (!failed && group_count == 0 && result->count == 0 && !agg_lookup(result, ag->agg_count, hash_bytes("", 0), "", 0)) failed = 1;
+        groups = result->count;
+        if (!failed && agg_emit(plan, result, &sorter, &gp, limit, &seq) != 0) failed = 1;
+    } else {
+        AggTable part;
+        char *buf = NULL;
+        size_t cap = 0;
+        memset(&part, 0, sizeof(part));
+        for (int w = 0; w < ps.workers && !failed; w++) {
+            if (agg_spill(ag, &ag->tables[w]) != 0) failed = 1;
+        }
+        for (int p = 0; p < AGG_PARTITIONS && !failed; p++) {
+            for (int w = 0; w < ps.workers && !failed; w++) {
+                FILE *fp = ag->tables[w].parts[p];
+                AggGroup *g;
+                int rc;
+                if (!fp) continue;
+                rewind(fp);
+                while ((rc = agg_read_group(fp, ag, &buf, &cap, &g)) > 0) {
+                    AggGroup *into = agg_lookup(&part, ag->agg_count, g->hash, group_key(g, ag->agg_count), g->key_len);
+                    if (!into || agg_merge(ag, &part, group_states(into), group_states(g)) != 0) {
+                        rc = -1;
+                        break;
+                    }
+                }
+                if (rc < 0) failed = 1;
+            }
+            groups += part.count;
+            if (!failed && agg_emit(plan, &part, &sorter, &gp, limit, &seq) != 0) failed = 1;
+            agg_table_free(&part);
+        }
+        free(buf);
+    }
+    op_add(ps.fn_stats, 0, groups, &lap);
+
+    if (failed) {
+        reply("Not enough memory or temporary space for aggregation.\n");
+    } else if (plan->order_count > 0) {
+        OpStats *sort = op_stats(plan, PLAN_SORT, 0);
+        if (sort) stamp(&lap);
+        if (sort_merge(&sorter, 1, limit, print_sorted_group, &gp) != 0 || gp.failed) reply("Not enough memory to sort.\n");
+        op_add(sort, 0, 0, &lap);
+    }
+    sorter_free(&sorter);
+    free(gp.buf);
+    for (int w = 0; w < MAX_THREADS; w++) agg_table_free(&ag->tables[w]);
+    free(ag);
+}
+
+// Finds a GROUP BY column's value in a group key; `len` is its byte length
+const char *group_value(const Aggregation *ag, AggGroup *g, int col, uint32_t *len) {
+    const char *p = group_key(g, ag->agg_count);
+    *len = 0;
+    for (int k = 0; k < ag->group_count; k++) {
+        int c = ag->group_cols[k];
+        *len = 8;
+        if (ag->t->types[c] == COL_TEXT) {
+            memcpy(len, p, sizeof(*len));
+            p += sizeof(*len);
+        }
+        if (c == col) return p;
+        p += *len;
+    }
+    return NULL;
+}
+
+// Appends one ORDER BY component of a group to s->key
+int group_sort_key(Sorter *s, const Plan *plan, const Aggregation *ag, const OrderKey *key, AggGroup *g) {
+    if (key->item < 0) {
+        uint32_t len;
+        const char *p = group_value(ag, g, key->col, &len);
+        int64_t iv;
+        double dv;
+        switch (ag->t->types[key->col]) {
+            case COL_INT: memcpy(&iv, p, 8); return sort_key_int(s, iv, key->desc);
+            case COL_REAL: memcpy(&dv, p, 8); return sort_key_real(s, dv, key->desc);
+            default: return sort_key_text(s, p, len, key->desc);
+        }
+    }
+
+    int agg = 0;
+    for (int i = 0; i < key->item; i++) agg += plan->items[i].is_agg;
+    const SelectItem *item = &plan->items[key->item];
+    const AggState *st = &group_states(g)[agg];
+    if (item->func == AGG_COUNT) return sort_key_int(s, st->count, key->desc);
+    if (st->count == 0) return sort_key_int(s, INT64_MIN, key->desc); // NULL sorts first
+    if (item->func == AGG_AVG) return sort_key_real(s, st->v.d / st->count, key->desc);
+    if (ag->t->types[item->col] == COL_INT) return sort_key_int(s, st->v.i, key->desc);
+    if (ag->t->types[item->col] == COL_REAL) return sort_key_real(s, st->v.d, key->desc);
+    uint32_t len;
+    const char *str = agg_text(st, &len);
+    return sort_key_text(s, str, len, key->desc);
+}
+
+/**
+ * @brief Passes on the groups of a finished table. With ORDER BY they go to
+ * the sorter `s` as group_encode records, so they outlive the table; `seq`
+ * numbers them to keep equal keys in order. Without it they are printed
+ * until `limit`, counting in `seq` across tables.
+ * @return 0 on success, -1 if memory or temporary space ran out.
+ */
+int agg_emit(const Plan *plan, AggTable *groups, Sorter *s, GroupPrinter *gp, uint64_t limit, uint64_t *seq) {
+    int rc = 0;
+    for (size_t i = 0; i < groups->cap && rc == 0; i++) {
+        AggGroup *g = groups->slots[i];
+        if (!g) continue;
+        if (plan->order_count == 0) {
+            if (limit && *seq >= limit) break;
+            print_group_row(result_stream(), gp->ag, gp->items, gp->item_count, g);
+            (*seq)++;
+            continue;
+        }
+        s->key_len = 0;
+        for (int k = 0; k < plan->order_count && rc == 0; k++) rc = group_sort_key(s, plan, gp->ag, &plan->order[k], g);
+        if (rc == 0) rc = sort_key_u64(s, (*seq)++, 0);
+        if (rc == 0 && sorter_wants(s)) {
+            size_t len = 0;
+            rc = group_encode(gp->ag, g, &gp->buf, &len, &gp->cap);
+            if (rc == 0) rc = sorter_add(s, gp->buf, (uint32_t)len);
+        }
+    }
+    return rc;
+}
+
+void print_sorted_group(void *arg, const char *payload, uint32_t len) {
+    GroupPrinter *gp = arg;
+    // A record need not be aligned for the group's states
+    if (len > gp->cap) {
+        char *grown = realloc(gp->buf, len);
+        if (!grown) {
+            gp->failed = 1;
+            return;
+        }
+        gp->buf = grown;
+        gp->cap = len;
+    }
+    memcpy(gp->buf, payload, len);
+    group_decode(gp->ag, (AggGroup *)gp->buf);
+    print_group_row(result_stream(), gp->ag, gp->items, gp->item_count, (AggGroup *)gp->buf);
+}
+
+// --- Sorting ---
+
+// Appends `add` bytes to a growable buffer and returns where they go, or NULL
+char *buf_extend(char **buf, size_t *len, size_t *cap, size_t add) {
+    if (*len + add > *cap) {
+        size_t new_cap = *cap ? *cap * 2 : 256;
+        while (new_cap < *len + add) new_cap *= 2;
+        char *grown = realloc(*buf, new_cap);
+        if (!grown) return NULL;
+        *buf = grown;
+        *cap = new_cap;
+    }
+    char *p = *buf + *len;
+    *len += add;
+    return p;
+}
+
+void sorter_init(Sorter *s, size_t budget, uint64_t limit) {
+    memset(s, 0, sizeof(*s));
+    s->budget = budget;
+    s->limit = limit;
+}
+
+void sorter_free(Sorter *s) {
+    for (int i = 0; i < s->run_count; i++) fclose(s->runs[i]);
+    free(s->runs);
+    free(s->buf);
+    free(s->recs);
+    free(s->key);
+    free(s->payload);
+    memset(s, 0, sizeof(*s));
+}
+
+// Sort keys are built from big-endian, sign-flipped components so that memcmp
+// orders them; a DESC component is stored with every bit inverted.
+int sort_key_u64(Sorter *s, uint64_t u, int desc) {
+    char *p = buf_extend(&s->key, &s->key_len, &s->key_cap, 8);
+    if (!p) return -1;
+    if (desc) u = ~u;
+    for (int i = 0; i < 8; i++) p[i] = (char)(u >> (56 - 8 * i));
+    return 0;
+}
+
+int sort_key_int(Sorter *s, int64_t v, int desc) {
+    return sort_key_u64(s, (uint64_t)v ^ (1ULL << 63), desc);
+}
+
+int sort_key_real(Sorter *s, double v, int desc) {
+    uint64_t u;
+    memcpy(&u, &v, sizeof(u));
+    u = (u >> 63) ? ~u : u | (1ULL << 63);
+    return sort_key_u64(s, u, desc);
+}
+
+// Text is escaped so no key is a prefix of another: 0x00 becomes 0x00 0x01
+// and the value ends with 0x00 0x00.
+int sort_key_text(Sorter *s, const char *str, size_t len, int desc) {
+    size_t at = s->key_len;
+    char *p = buf_extend(&s->key, &s->key_len, &s->key_cap, 2 * len + 2);
+    if (!p) return -1;
+    char *q = p;
+    for (size_t i = 0; i < len; i++) {
+        *q++ = str[i];
+        if (str[i] == 0) *q++ = 1;
+    }
+    *q++ = 0;
+    *q++ = 0;
+    s->key_len = at + (size_t)(q - p);
+    if (desc) {
+        for (char *c = p; c < q; c++) *c = (char)~*c;
+    }
+    return 0;
+}
+
+// Records are laid out as a 4-byte key length, a 4-byte payload length, the key and the payload
+int record_cmp(const char *a, const char *b) {
+    uint32_t la, lb;
+    memcpy(&la, a, sizeof(la));
+    memcpy(&lb, b, sizeof(lb));
+    int c = memcmp(a + 8, b + 8, la < lb ? la : lb);
+    return c ? c : (la > lb) - (la < lb);
+}
+
+int record_qsort_cmp(const void *a, const void *b) {
+    return record_cmp(*(char *const *)a, *(char *const *)b);
+}
+
+size_t record_size(const char *rec) {
+    uint32_t klen, plen;
+    memcpy(&klen, rec, sizeof(klen));
+    memcpy(&plen, rec + 4, sizeof(plen));
+    return 8 + (size_t)klen + plen;
+}
+
+// True if a row with the key in s->key can still make it into the output
+int sorter_wants(const Sorter *s) {
+    if (!s->limit || s->count < s->limit) return 1;
+    const char *worst = s->buf + s->recs[0];
+    uint32_t wlen;
+    memcpy(&wlen, worst, sizeof(wlen));
+    int c = memcmp(s->key, worst + 8, s->key_len < wlen ? s->key_len : wlen);
+    return c < 0 || (c == 0 && s->key_len < wlen);
+}
+
+void sorter_sift_down(Sorter *s, size_t i) {
+    for (;;) {
+        size_t big = i, l = 2 * i + 1, r = l + 1;
+        if (l < s->count && record_cmp(s->buf + s->recs[l], s->buf + s->recs[big]) > 0) big = l;
+        if (r < s->count && record_cmp(s->buf + s->recs[r], s->buf + s->recs[big]) > 0) big = r;
+        if (big == i) return;
+        size_t tmp = s->recs[i];
+        s->recs[i] = s->recs[big];
+        s->recs[big] = tmp;
+        i = big;
+    }
+}
+
+/**
+ * @brief Adds the record made of s->key and `payload`. With a limit the
+ * records form a max-heap of at most `limit` entries, the worst at the root;
+ * without one they are sorted and spilled as a run whenever they outgrow
+ * the sorter's memory budget.
+ */
+int sorter_add(Sorter *s, const void *payload, uint32_t payload_len) {
+    size_t off = s->len;
+    uint32_t klen = (uint32_t)s->key_len;
+    char *p = buf_extend(&s->buf, &s->len, &s->cap, 8 + (size_t)klen + payload_len);
+    if (!p) return -1;
+    memcpy(p, &klen, sizeof(klen));
+    memcpy(p + 4, &payload_len, sizeof(payload_len));
+    memcpy(p + 8, s->key, klen);
+    memcpy(p + 8 + klen, payload, payload_len);
+
+    if (s->limit && s->count == s->limit) {
+        // Replace the worst record; its bytes become garbage until the next compaction
+        s->dead += record_size(s->buf + s->recs[0]);
+        s->recs[0] = off;
+        sorter_sift_down(s, 0);
+        if (s->dead > s->len / 2 && s->len > s->budget) return sorter_compact(s);
+        return 0;
+    }
+    if (s->count == s->rec_cap) {
+        size_t new_cap = s->rec_cap ? s->rec_cap * 2 : 1024;
+        size_t *grown = realloc(s->recs, new_cap * sizeof(size_t));
+        if (!grown) return -1;
+        s->recs = grown;
+        s->rec_cap = new_cap;
+    }
+    size_t i = s->count++;
+    s->recs[i] = off;
+    if (s->limit) {
+        while (i > 0 && record_cmp(s->buf + s->recs[(i - 1) / 2], s->buf + s->recs[i]) < 0) {
+            size_t parent = (i - 1) / 2, tmp = s->recs[i];
+            s->recs[i] = s->recs[parent];
+            s->recs[parent] = tmp;
+            i = parent;
+        }
+        return 0;
+    }
+    return s->len >= s->budget ? sorter_spill(s) : 0;
+}
+
+// Drops the bytes of records pushed out of a top-K heap
+int sorter_compact(Sorter *s) {
+    char *buf = malloc(s->len - s->dead);
+    size_t len = 0;
+    if (!buf) return -1;
+    for (size_t i = 0; i < s->count; i++) {
+        size_t size = record_size(s->buf + s->recs[i]);
+        memcpy(buf + len, s->buf + s->recs[i], size);
+        s->recs[i] = len;
+        len += size;
+    }
+    free(s->buf);
+    s->buf = buf;
+    s->len = len;
+    s->cap = s->len;
+    s->dead = 0;
+    return 0;
+}
+
+// Returns the records held in memory, sorted, as an array of pointers into s->buf
+char **sorter_sorted(Sorter *s) {
+    char **recs = malloc((s->count ? s->count : 1) * sizeof(char *));
+    if (!recs) return NULL;
+    for (size_t i = 0; i < s->count; i++) recs[i] = s->buf + s->recs[i];
+    qsort(recs, s->count, sizeof(char *), record_qsort_cmp);
+    return recs;
+}
+
+// Writes the records held in memory to a temporary file as one sorted run
+int sorter_spill(Sorter *s) {
+    if (s->run_count == s->run_cap) {
+        int new_cap = s->run_cap ? s->run_cap * 2 : 8;
+        FILE **grown = realloc(s->runs, new_cap * sizeof(FILE *));
+        if (!grown) return -1;
+        s->runs = grown;
+        s->run_cap = new_cap;
+    }
+    char **recs = sorter_sorted(s);
+    FILE *fp = tmpfile();
+    int rc = (recs && fp) ? 0 : -1;
+    if (fp) setvbuf(fp, NULL, _IOFBF, SORT_IO_BUFFER);
+    for (size_t i = 0; i < s->count && rc == 0; i++) {
+        size_t size = record_size(recs[i]);
+        if (fwrite(recs[i], 1, size, fp) != size) rc = -1;
+    }
+    free(recs);
+    if (fp && (rc != 0 || fflush(fp) != 0)) {
+        fclose(fp);
+        return -1;
+    }
+    s->runs[s->run_count++] = fp;
+    s->len = s->count = 0;
+    return 0;
+}
+
+// Moves a merge cursor to the next record of its run; `cur` is NULL at the end
+int run_advance(RunCursor *c) {
+    if (!c->fp) {
+        c->cur = (c->pos < c->count) ? c->recs[c->pos++] : NULL;
+        return 0;
+    }
+    uint32_t lens[2];
+    if (fread(lens, sizeof(uint32_t), 2, c->fp) != 2) {
+        c->cur = NULL;
+        return ferror(c->fp) ? -1 : 0;
+    }
+    size_t size = 8 + (size_t)lens[0] + lens[1];
+    if (size > c->cap) {
+        char *grown = realloc(c->buf, size);
+        if (!grown) return -1;
+        c->buf = grown;
+        c->cap = size;
+    }
+    memcpy(c->buf, lens, 8);
+    if (fread(c->buf + 8, 1, size - 8, c->fp) != size - 8) return -1;
+    c->cur = c->buf;
+    return 0;
+}
+
+void run_heap_down(RunCursor *runs, int *heap, int count, int i) {
+    for (;;) {
+        int small = i, l = 2 * i + 1, r = l + 1;
+        if (l < count && record_cmp(runs[heap[l]].cur, runs[heap[small]].cur) < 0) small = l;
+        if (r < count && record_cmp(runs[heap[r]].cur, runs[heap[small]].cur) < 0) small = r;
+        if (small == i) return;
+        int tmp = heap[i];
+        heap[i] = heap[small];
+        heap[small] = tmp;
+        i = small;
+    }
+}
+
+/**
+ * @brief Merges the spilled runs and in-memory records of every sorter and
+ * passes the first `limit` records (all of them when 0) to `fn` in order.
+ */
+int sort_merge(Sorter *sorters, int sorter_count, uint64_t limit, RecordFn fn, void *arg) {
+    int run_count = 0, rc = 0;
+    for (int i = 0; i < sorter_count; i++) run_count += sorters[i].run_count + 1;
+    RunCursor *runs = calloc(run_count, sizeof(RunCursor));
+    int *heap = malloc(run_count * sizeof(int));
+    if (!runs || !heap) rc = -1;
+
+    int n = 0;
+    for (int i = 0; i < sorter_count && rc == 0; i++) {
+        Sorter *s = &sorters[i];
+        for (int k = 0; k < s->run_count && rc == 0; k++) {
+            runs[n].fp = s->runs[k];
+            rewind(runs[n].fp);
+            rc = run_advance(&runs[n++]);
+        }
+        if (rc == 0 && s->count > 0) {
+            runs[n].recs = sorter_sorted(s);
+            runs[n].count = s->count;
+            rc = runs[n].recs ? run_advance(&runs[n]) : -1;
+            n++;
+        }
+    }
+
+    int live = 0;
+    for (int i = 0; i < n && rc == 0; i++) {
+        if (runs[i].cur) heap[live++] = i;
+    }
+    for (int i = live / 2 - 1; i >= 0; i--) run_heap_down(runs, heap, live, i);
+    for (uint64_t out = 0; rc == 0 && live > 0 && (!limit || out < limit); out++) {
+        RunCursor *c = &runs[heap[0]];
+        uint32_t klen, plen;
+        memcpy(&klen, c->cur, sizeof(klen));
+        memcpy(&plen, c->cur + 4, sizeof(plen));
+        fn(arg, c->cur + 8 + klen, plen);
+        rc = run_advance(c);
+        if (!c->cur) heap[0] = heap[--live];
+        run_heap_down(runs, heap, live, 0);
+    }
+
+    for (int i = 0; runs && i < n; i++) {
+        free(runs[i].recs);
+        free(runs[i].buf);
+    }
+    free(runs);
+    free(heap);
+    return rc;
+}
+
+/**
+ * @brief Appends the values of `cols` in row r of the current block: INT and
+ * REAL values as their 8 bytes, TEXT as a 4-byte length and the bytes.
+ */
+int encode_row(char **buf, size_t *len, size_t *cap, const Scan *s, const int *cols, int count, size_t r) {
+    for (int i = 0; i < count; i++) {
+        const ColumnBlock *b = &s->blocks[cols[i]];
+        size_t size = sizeof(uint64_t);
+        const char *src = (const char *)&b->values[r];
+        if (s->t->types[cols[i]] == COL_TEXT) {
+            src = block_text(b, r, &size);
+            uint32_t size32 = (uint32_t)size;
+            char *p = buf_extend(buf, len, cap, sizeof(size32));
+            if (!p) return -1;
+            memcpy(p, &size32, sizeof(size32));
+        }
+        char *p = buf_extend(buf, len, cap, size);
+        if (!p) return -1;
+        memcpy(p, src, size);
+    }
+    return 0;
+}
+
+// Reads back one value written by encode_row and returns the position after it
+const char *decode_value(ColType type, const char *p, Value *v) {
+    uint32_t len;
+    switch (type) {
+        case COL_INT:
+            memcpy(&v->i, p, sizeof(v->i));
+            return p + sizeof(v->i);
+        case COL_REAL:
+            memcpy(&v->r, p, sizeof(v->r));
+            return p + sizeof(v->r);
+        default:
+            memcpy(&len, p, sizeof(len));
+            v->s = p + sizeof(len);
+            v->len = len;
+            return v->s + len;
+    }
+}
+
+void print_field(FILE *out, ColType type, const Value *v) {
+    switch (type) {
+        case COL_INT:
+            fprintf(out, "%-20lld", (long long)v->i);
+            break;
+        case COL_REAL:
+            print_real(out, v->r);
+            break;
+        case COL_TEXT:
+            fprintf(out, "%-20.*s", (int)v->len, v->s);
+            break;
+    }
+}
+
+/**
+ * @brief Sorts the selected rows of a block into the worker's sorter. The
+ * key is the ORDER BY columns followed by the row number, which keeps ties
+ * in table order; the payload holds the projected values.
+ */
+int sort_rows(void *arg, int worker, const Scan *s, size_t n, const uint64_t *bits, FILE *out) {
+    SortJob *job = arg;
+    Sorter *st = &job->sorters[worker];
+    const Table *t = s->t;
+    (void)out;
+
+    for (size_t w = 0; w < (n + 63) / 64; w++) {
+        uint64_t word = bits[w];
+        while (word) {
+            size_t r = w * 64 + (size_t)__builtin_ctzll(word);
+            word &= word - 1;
+
+            st->key_len = 0;
+            for (int k = 0; k < job->key_count; k++) {
+                int col = job->keys[k].col, desc = job->keys[k].desc, rc;
+                const ColumnBlock *b = &s->blocks[col];
+                if (t->types[col] == COL_INT) rc = sort_key_int(st, ((const int64_t *)b->values)[r], desc);
+                else if (t->types[col] == COL_REAL) rc = sort_key_real(st, ((const double *)b->values)[r], desc);
+                else {
+                    size_t len;
+                    const char *str = block_text(b, r, &len);
+                    rc = sort_key_text(st, str, len, desc);
+                }
+                if (rc != 0) return -1;
+            }
+            if (sort_key_u64(st, s->next_row - n + r, 0) != 0) return -1;
+            if (!sorter_wants(st)) continue;
+
+            st->payload_len = 0;
+            if (encode_row(&st->payload, &st->payload_len, &st->payload_cap, s, job->proj.cols, job->proj.count, r) != 0) return -1;
+            if (sorter_add(st, st->payload, (uint32_t)st->payload_len) != 0) return -1;
+        }
+    }
+    return 0;
+}
+
+// Prints a row record produced by sort_rows
+void print_sorted_row(void *arg, const char *payload, uint32_t len) {
+    const SortJob *job = arg;
+    const char *p = payload;
+    FILE *out = result_stream();
+    (void)len;
+    for (int i = 0; i < job->proj.count; i++) {
+        ColType type = job->t->types[job->proj.cols[i]];
+        Value v;
+        p = decode_value(type, p, &v);
+        print_field(out, type, &v);
+    }
+    fputc('\n', out);
+}
+
+/**
+ * @brief Runs a non-aggregate SELECT with ORDER BY: every scan worker sorts
+ * into its own sorter (a top-K heap when the LIMIT is small) and the results
+ * are merged.
+ */
+void run_sort(const Plan *plan, const Table *t, const Where *where, uint64_t *cands, long cand_count, uint64_t limit) {
+    SortJob *job = calloc(1, sizeof(SortJob));
+    if (!job) {
+        reply("Not enough memory to sort.\n");
+        return;
+    }
+    job->t = t;
+    job->keys = plan->order;
+    job->key_count = plan->order_count;
+    for (int i = 0; i < plan->item_count; i++) job->proj.cols[job->proj.count++] = plan->items[i].col;
+    size_t budget = SORT_MEMORY / (size_t)scan_threads;
+    for (int w = 0; w < MAX_THREADS; w++) sorter_init(&job->sorters[w], budget, limit <= SORT_TOPK_MAX ? limit : 0);
+
+    ParallelScan ps;
+    memset(&ps, 0, sizeof(ps));
+    ps.t = t;
+    ps.needed = plan->needed;
+    ps.where = where;
+    ps.cands = (cand_count >= 0) ? cands : NULL;
+    ps.cand_count = cand_count;
+    ps.fn = sort_rows;
+    ps.arg = job;
+    scan_profile(&ps, plan, 0, PLAN_SORT);
+    if (cand_count != 0 && parallel_scan(&ps) != 0) {
+        reply("Table '%s' is missing column data, or the sort ran out of memory or temporary space.\n", t->name);
+    } else if (cand_count != 0) {
+        Stamp lap;
+        if (ps.fn_stats) {
+            int runs = 0;
+            for (int w = 0; w < ps.workers; w++) runs += job->sorters[w].run_count;
+            if (runs > 0) snprintf(ps.fn_stats->note, sizeof(ps.fn_stats->note), "%d sorted runs spilled", runs);
+            stamp(&lap);
+        }
+        if (sort_merge(job->sorters, ps.workers, limit, print_sorted_row, job) != 0) reply("Error reading sorted runs back.\n");
+        op_add(ps.fn_stats, 0, 0, &lap);
+    }
+    for (int w = 0; w < MAX_THREADS; w++) sorter_free(&job->sorters[w]);
+    free(job);
+}
+
+// --- Joins ---
+
+/**
+ * @brief Returns the bytes rows are joined on: the 8 bytes of an INT or REAL
+ * (-0.0 is folded into 0.0, which compares equal to it) or a TEXT value.
+ */
+const char *join_key(const Scan *s, int col, size_t r, double *zero, size_t *len) {
+    const ColumnBlock *b = &s->blocks[col];
+    if (s->t->types[col] == COL_TEXT) return block_text(b, r, len);
+    *len = sizeof(uint64_t);
+    if (s->t->types[col] == COL_REAL && ((const double *)b->values)[r] == 0) {
+        *zero = 0.0;
+        return (const char *)zero;
+    }
+    return (const char *)&b->values[r];
+}
+
+// Adds a build row to the hash table, doubling the buckets as it fills
+int join_insert(JoinJob *job, uint64_t hash, const char *key, uint32_t key_len, const char *payload, uint32_t payload_len) {
+    if (job->entry_count >= job->bucket_count) {
+        size_t count = job->bucket_count ? job->bucket_count * 2 : 1024;
+        JoinEntry **buckets = calloc(count, sizeof(JoinEntry *));
+        if (!buckets) return -1;
+        for (size_t i = 0; i < job->bucket_count; i++) {
+            JoinEntry *e = job->buckets[i];
+            while (e) {
+                JoinEntry *next = e->next;
+                e->next = buckets[e->hash & (count - 1)];
+                buckets[e->hash & (count - 1)] = e;
+                e = next;
+            }
+        }
+        free(job->buckets);
+        job->buckets = buckets;
+        job->bucket_count = count;
+    }
+    size_t size = sizeof(JoinEntry) + key_len + payload_len;
+    JoinEntry *e = arena_alloc(&job->arena, size);
+    if (!e) return -1;
+    e->hash = hash;
+    e->key_len = key_len;
+    e->payload_len = payload_len;
+    memcpy(e->data, key, key_len);
+    memcpy(e->data + key_len, payload, payload_len);
+    e->next = job->buckets[hash & (job->bucket_count - 1)];
+    job->buckets[hash & (job->bucket_count - 1)] = e;
+    job->entry_count++;
+    job->bytes += size + sizeof(JoinEntry *);
+    return 0;
+}
+
+void join_reset(JoinJob *job) {
+    arena_free(&job->arena);
+    free(job->buckets);
+    job->buckets = NULL;
+    job->bucket_count = job->entry_count = job->bytes = 0;
+}
+
+// Appends a row to one side's partition file, picked by the high bits of its hash
+int join_spill_row(JoinJob *job, int side, uint64_t hash, const char *key, uint32_t key_len, const char *payload, uint32_t payload_len) {
+    FILE **fp = &job->parts[side][(hash >> 32) % JOIN_PARTITIONS];
+    JoinSpill h = {hash, key_len, payload_len};
+    if (!*fp) {
+        *fp = tmpfile();
+        if (!*fp) return -1;
+        setvbuf(*fp, NULL, _IOFBF, SORT_IO_BUFFER);
+    }
+    if (fwrite(&h, sizeof(h), 1, *fp) != 1 || fwrite(key, 1, key_len, *fp) != key_len ||
+        fwrite(payload, 1, payload_len, *fp) != payload_len) return -1;
+    return 0;
+}
+
+// Moves the hash table into the build side's partitions; later build rows go straight there
+int join_spill_table(JoinJob *job) {
+    for (size_t i = 0; i < job->bucket_count; i++) {
+        for (JoinEntry *e = job->buckets[i]; e; e = e->next) {
+            if (join_spill_row(job, job->build, e->hash, e->data, e->key_len, e->data + e->key_len, e->payload_len) != 0) return -1;
+        }
+    }
+    join_reset(job);
+    job->spilled = 1;
+    return 0;
+}
+
+// Reads the next row of a partition file, key then payload, into *buf. Returns 1, 0 at the end, or -1.
+int join_read_row(FILE *fp, JoinSpill *h, char **buf, size_t *cap) {
+    if (fread(h, sizeof(*h), 1, fp) != 1) return ferror(fp) ? -1 : 0;
+    size_t size = (size_t)h->key_len + h->payload_len;
+    if (size > *cap || !*buf) {
+        char *grown = realloc(*buf, size + 1);
+        if (!grown) return -1;
+        *buf = grown;
+        *cap = size + 1;
+    }
+    return fread(*buf, 1, size, fp) == size ? 1 : -1;
+}
+
+// Decodes a payload into vals (indexed by column) and returns its length
+size_t join_decode(const JoinSide *side, const char *row, Value *vals) {
+    const char *p = row;
+    for (int i = 0; i < side->col_count; i++) p = decode_value(side->t->types[side->cols[i]], p, &vals[side->cols[i]]);
+    return (size_t)(p - row);
+}
+
+void join_print(const JoinJob *job, FILE *out, Value vals[2][MAX_COLS]) {
+    const Plan *plan = job->plan;
+    for (int i = 0; i < plan->item_count; i++) {
+        const SelectItem *item = &plan->items[i];
+        print_field(out, job->sides[item->side].t->types[item->col], &vals[item->side][item->col]);
+    }
+    fputc('\n', out);
+}
+
+/**
+ * @brief Outputs one joined row: printed to `out`, or with ORDER BY added to
+ * the worker's sorter.
+ * @return 0, -1 on error, or 1 once LIMIT rows are out.
+ */
+int join_emit(JoinJob *job, int worker, FILE *out, const char *build_row, const char *probe_row) {
+    const Plan *plan = job->plan;
+    const char *rows[2];
+    size_t lens[2];
+    Value vals[2][MAX_COLS];
+
+    rows[job->build] = build_row;
+    rows[!job->build] = probe_row;
+    for (int side = 0; side < 2; side++) lens[side] = join_decode(&job->sides[side], rows[side], vals[side]);
+    if (job->stats) __atomic_fetch_add(&job->stats->rows_out, 1, __ATOMIC_RELAXED);
+    if (plan->order_count == 0) {
+        join_print(job, out, vals);
+        return (job->limit && ++job->emitted == job->limit) ? 1 : 0;
+    }
+
+    Sorter *st = &job->sorters[worker];
+    st->key_len = 0;
+    for (int k = 0; k < plan->order_count; k++) {
+        const OrderKey *key = &plan->order[k];
+        const Value *v = &vals[key->side][key->col];
+        int rc;
+        switch (job->sides[key->side].t->types[key->col]) {
+            case COL_INT: rc = sort_key_int(st, v->i, key->desc); break;
+            case COL_REAL: rc = sort_key_real(st, v->r, key->desc); break;
+            default: rc = sort_key_text(st, v->s, v->len, key->desc); break;
+        }
+        if (rc != 0) return -1;
+    }
+    if (!sorter_wants(st)) return 0;
+    uint32_t left_len = (uint32_t)lens[0];
+    st->payload_len = 0;
+    char *p = buf_extend(&st->payload, &st->payload_len, &st->payload_cap, sizeof(left_len) + lens[0] + lens[1]);
+    if (!p) return -1;
+    memcpy(p, &left_len, sizeof(left_len));
+    memcpy(p + sizeof(left_len), rows[0], lens[0]);
+    memcpy(p + sizeof(left_len) + lens[0], rows[1], lens[1]);
+    return sorter_add(st, st->payload, (uint32_t)st->payload_len) != 0 ? -1 : 0;
+}
+
+// Loads the selected rows of a build-side block into the hash table, or its partitions after a spill
+int join_build_rows(void *arg, int worker, const Scan *s, size_t n, const uint64_t *bits, FILE *out) {
+    JoinJob *job = arg;
+    const JoinSide *side = &job->sides[job->build];
+    (void)out;
+
+    for (size_t w = 0; w < (n + 63) / 64; w++) {
+        uint64_t word = bits[w];
+        while (word) {
+            size_t r = w * 64 + (size_t)__builtin_ctzll(word);
+            word &= word - 1;
+
+            double zero;
+            size_t key_len;
+            const char *key = join_key(s, side->key_col, r, &zero, &key_len);
+            uint64_t hash = hash_bytes(key, key_len);
+            job->row_len[worker] = 0;
+            if (encode_row(&job->rows[worker], &job->row_len[worker], &job->row_cap[worker], s, side->cols, side->col_count, r) != 0) return -1;
+            int rc = job->spilled ? join_spill_row(job, job->build, hash, key, (uint32_t)key_len, job->rows[worker], (uint32_t)job->row_len[worker])
+                                  : join_insert(job, hash, key, (uint32_t)key_len, job->rows[worker], (uint32_t)job->row_len[worker]);
+            if (rc != 0) return -1;
+            if (!job->spilled && job->bytes > JOIN_MEMORY && join_spill_table(job) != 0) return -1;
+        }
+    }
+    return 0;
+}
+
+// Joins the selected rows of a probe-side block against the hash table, or partitions them after a spill
+int join_probe_rows(void *arg, int worker, const Scan *s, size_t n, const uint64_t *bits, FILE *out) {
+    JoinJob *job = arg;
+    const JoinSide *side = &job->sides[!job->build];
+
+    for (size_t w = 0; w < (n + 63) / 64; w++) {
+        uint64_t word = bits[w];
+        while (word) {
+            size_t r = w * 64 + (size_t)__builtin_ctzll(word);
+            word &= word - 1;
+
+            double zero;
+            size_t key_len;
+            const char *key = join_key(s, side->key_col, r, &zero, &key_len);
+            uint64_t hash = hash_bytes(key, key_len);
+            int encoded = 0;
+            if (job->spilled) {
+                job->row_len[worker] = 0;
+                if (encode_row(&job->rows[worker], &job->row_len[worker], &job->row_cap[worker], s, side->cols, side->col_count, r) != 0 ||
+                    join_spill_row(job, !job->build, hash, key, (uint32_t)key_len, job->rows[worker], (uint32_t)job->row_len[worker]) != 0) return -1;
+                continue;
+            }
+            for (JoinEntry *e = job->buckets[hash & (job->bucket_count - 1)]; e; e = e->next) {
+                if (e->hash != hash || e->key_len != key_len || memcmp(e->data, key, key_len) != 0) continue;
+                if (!encoded) {
+                    job->row_len[worker] = 0;
+                    if (encode_row(&job->rows[worker], &job->row_len[worker], &job->row_cap[worker], s, side->cols, side->col_count, r) != 0) return -1;
+                    encoded = 1;
+                }
+                int rc = join_emit(job, worker, out, e->data + e->key_len, job->rows[worker]);
+                if (rc != 0) return rc;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Joins the partitions written once the build side outgrew
+ * JOIN_MEMORY, one pair at a time: a build partition is loaded into the hash
+ * table and the probe partition with the same hashes is streamed against it.
+ */
+int join_partitions(JoinJob *job) {
+    char *buf = NULL;
+    size_t cap = 0;
+    int rc = 0;
+
+    for (int p = 0; p < JOIN_PARTITIONS && rc == 0; p++) {
+        FILE *build = job->parts[job->build][p], *probe = job->parts[!job->build][p];
+        JoinSpill h;
+        int got;
+        if (!build || !probe) continue;
+
+        join_reset(job);
+        rewind(build);
+        while ((got = join_read_row(build, &h, &buf, &cap)) == 1) {
+            if (join_insert(job, h.hash, buf, h.key_len, buf + h.key_len, h.payload_len) != 0) {
+                got = -1;
+                break;
+            }
+        }
+        if (got < 0) rc = -1;
+
+        rewind(probe);
+        while (rc == 0 && (got = join_read_row(probe, &h, &buf, &cap)) == 1) {
+            for (JoinEntry *e = job->buckets[h.hash & (job->bucket_count - 1)]; e && rc == 0; e = e->next) {
+                if (e->hash != h.hash || e->key_len != h.key_len || memcmp(e->data, buf, h.key_len) != 0) continue;
+                rc = join_emit(job, 0, result_stream(), e->data + e->key_len, buf + h.key_len);
+            }
+        }
+        if (got < 0) rc = -1;
+    }
+    free(buf);
+    return rc < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Builds a hash table over one side on the calling thread, then probes
+ * it with the other side. The probe runs on every scan worker unless the
+ * build spilled or a LIMIT without ORDER BY must stop it early; with ORDER BY
+ * each worker sorts its own rows, otherwise output stays in probe-table order.
+ */
+int run_hash_join(JoinJob *job) {
+    const JoinSide *build = &job->sides[job->build], *probe = &job->sides[!job->build];
+    ParallelScan ps;
+
+    memset(&ps, 0, sizeof(ps));
+    ps.t = build->t;
+    ps.needed = build->needed;
+    ps.where = build->where;
+    ps.cands = (build->cand_count >= 0) ? build->cands : NULL;
+    ps.cand_count = build->cand_count;
+    ps.fn = join_build_rows;
+    ps.arg = job;
+    ps.serial = 1;
+    scan_profile(&ps, job->plan, job->build, PLAN_JOIN);
+    if (parallel_scan(&ps) != 0) return -1;
+    if (job->entry_count == 0 && !job->spilled) return 0;
+
+    memset(&ps, 0, sizeof(ps));
+    ps.t = probe->t;
+    ps.needed = probe->needed;
+    ps.where = probe->where;
+    ps.cands = (probe->cand_count >= 0) ? probe->cands : NULL;
+    ps.cand_count = probe->cand_count;
+    ps.fn = join_probe_rows;
+    ps.arg = job;
+    ps.out = job->plan->order_count ? NULL : result_stream();
+    ps.serial = job->spilled || (job->limit && !job->plan->order_count);
+    scan_profile(&ps, job->plan, !job->build, PLAN_JOIN);
+    if (parallel_scan(&ps) != 0) return -1;
+    if (!job->spilled) return 0;
+
+    Stamp lap;
+    if (job->stats) stamp(&lap);
+    int rc = join_partitions(job);
+    op_add(job->stats, 0, 0, &lap);
+    return rc;
+}
+
+// Moves to the next selected row of a merge join side; sets `done` after the last one
+int merge_next(MergeCursor *c) {
+    uint64_t row_count = c->side->t->header.row_count;
+    for (;;) {
+        for (c->r++; c->r < c->n; c->r++) {
+            if ((c->bits[c->r / 64] >> (c->r % 64)) & 1) return 0;
+        }
+        c->start += c->n;
+        if (c->start >= row_count) {
+            c->done = 1;
+            return 0;
+        }
+        c->n = (row_count - c->start < BLOCK_ROWS) ? (size_t)(row_count - c->start) : BLOCK_ROWS;
+        uint64_t bytes = c->s.bytes_read;
+        Stamp lap;
+        if (c->scan_stats) stamp(&lap);
+        if (scan_read_block(&c->s, c->start, c->n) != 0) return -1;
+        op_read(c->scan_stats, c->s.bytes_read - bytes);
+        op_add(c->scan_stats, 0, c->n, &lap);
+        select_rows(c->side->where, &c->s, c->n, c->bits);
+        if (c->scan_stats) op_add(c->filter_stats, c->n, bits_count(c->bits, c->n), &lap);
+        c->r = (size_t)-1;
+    }
+}
+
+void merge_key(const MergeCursor *c, Value *v) {
+    const ColumnBlock *b = &c->s.blocks[c->side->key_col];
+    if (c->side->t->types[c->side->key_col] == COL_INT) v->i = ((const int64_t *)b->values)[c->r];
+    else v->r = ((const double *)b->values)[c->r];
+}
+
+int merge_cmp(ColType type, const Value *a, const Value *b) {
+    if (type == COL_INT) return (a->i > b->i) - (a->i < b->i);
+    return (a->r > b->r) - (a->r < b->r);
+}
+
+/**
+ * @brief Joins two sides whose ON columns are both in ascending order in one
+ * pass over each. The right side's rows with the current key are buffered
+ * and every left row with that key is paired with them.
+ */
+int run_merge_join(JoinJob *job) {
+    MergeCursor cur[2];
+    ColType type = job->sides[0].t->types[job->sides[0].key_col];
+    char *group = NULL;
+    size_t group_len = 0, group_cap = 0;
+    size_t *offs = NULL;
+    size_t off_count = 0, off_cap = 0;
+    int rc = 0;
+
+    Stamp start = {0, 0};
+    if (job->stats) stamp(&start);
+    memset(cur, 0, sizeof(cur));
+    for (int i = 0; i < 2; i++) {
+        cur[i].side = &job->sides[i];
+        cur[i].r = (size_t)-1;
+        cur[i].scan_stats = op_stats(job->plan, PLAN_SCAN, i);
+        cur[i].filter_stats = op_stats(job->plan, PLAN_FILTER, i);
+        if (cur[i].scan_stats) cur[i].scan_stats->rows_in = cur[i].side->t->header.row_count;
+        if (scan_open(&cur[i].s, cur[i].side->t, cur[i].side->needed) != 0) rc = -1;
+        cur[i].s.sequential = 1;
+        if (rc == 0) rc = merge_next(&cur[i]);
+    }
+
+    while (rc == 0 && !cur[0].done && !cur[1].done) {
+        Value left, right, key;
+        merge_key(&cur[0], &left);
+        merge_key(&cur[1], &right);
+        int c = merge_cmp(type, &left, &right);
+        if (c != 0) {
+            rc = merge_next(&cur[c < 0 ? 0 : 1]);
+            continue;
+        }
+
+        key = right;
+        group_len = off_count = 0;
+        do {
+            if (off_count == off_cap) {
+                size_t new_cap = off_cap ? off_cap * 2 : 64;
+                size_t *grown = realloc(offs, new_cap * sizeof(size_t));
+                if (!grown) {
+                    rc = -1;
+                    break;
+                }
+                offs = grown;
+                off_cap = new_cap;
+            }
+            offs[off_count++] = group_len;
+            if (encode_row(&group, &group_len, &group_cap, &cur[1].s, cur[1].side->cols, cur[1].side->col_count, cur[1].r) != 0) rc = -1;
+            if (rc == 0) rc = merge_next(&cur[1]);
+            if (rc == 0 && !cur[1].done) merge_key(&cur[1], &right);
+        } while (rc == 0 && !cur[1].done && merge_cmp(type, &right, &key) == 0);
+
+        while (rc == 0 && !cur[0].done && merge_cmp(type, &left, &key) == 0) {
+            job->row_len[0] = 0;
+            if (encode_row(&job->rows[0], &job->row_len[0], &job->row_cap[0], &cur[0].s, cur[0].side->cols, cur[0].side->col_count, cur[0].r) != 0) rc = -1;
+            for (size_t i = 0; i < off_count && rc == 0; i++) rc = join_emit(job, 0, result_stream(), group + offs[i], job->rows[0]);
+            if (rc == 0) rc = merge_next(&cur[0]);
+            if (rc == 0 && !cur[0].done) merge_key(&cur[0], &left);
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        if (cur[i].s.t) scan_close(&cur[i].s);
+    }
+    free(group);
+    free(offs);
+
+    // The join's own time is whatever the merge took beyond reading and filtering its inputs
+    if (job->stats) {
+        Stamp end;
+        stamp(&end);
+        job->stats->wall_ns += end.wall_ns - start.wall_ns;
+        job->stats->cpu_ns += end.cpu_ns - start.cpu_ns;
+        for (int i = 0; i < 2; i++) {
+            const OpStats *input = cur[i].filter_stats ? cur[i].filter_stats : cur[i].scan_stats;
+            job->stats->rows_in += input->rows_out;
+            job->stats->wall_ns -= cur[i].scan_stats->wall_ns + (cur[i].filter_stats ? cur[i].filter_stats->wall_ns : 0);
+            job->stats->cpu_ns -= cur[i].scan_stats->cpu_ns + (cur[i].filter_stats ? cur[i].filter_stats->cpu_ns : 0);
+        }
+    }
+    return rc < 0 ? -1 : 0;
+}
+
+// Adds a column to the payload a join side carries, once
+void join_carry(JoinSide *side, int col) {
+    for (int i = 0; i < side->col_count; i++) {
+        if (side->cols[i] == col) return;
+    }
+    side->cols[side->col_count++] = col;
+}
+
+// Prints a joined row record produced by join_emit
+void print_sorted_join(void *arg, const char *payload, uint32_t len) {
+    const JoinJob *job = arg;
+    Value vals[2][MAX_COLS];
+    uint32_t left_len;
+    (void)len;
+    memcpy(&left_len, payload, sizeof(left_len));
+    join_decode(&job->sides[0], payload + sizeof(left_len), vals[0]);
+    join_decode(&job->sides[1], payload + sizeof(left_len) + left_len, vals[1]);
+    join_print(job, result_stream(), vals);
+}
+
+/**
+ * @brief Runs a SELECT over two joined tables. Each side's share of the WHERE
+ * clause is applied by its own scan, through an index when one helps. When
+ * both ON columns are known to be in ascending order the two scans are
+ * merged; otherwise the side with fewer rows is hashed and the other probes it.
+ */
+void run_join(const Plan *plan, const Table *const *tables, const Where *wheres, uint64_t limit) {
+    JoinJob *job = calloc(1, sizeof(JoinJob));
+    int rc = 0;
+    if (!job) {
+        reply("Not enough memory for the join.\n");
+        return;
+    }
+    job->plan = plan;
+    job->limit = limit;
+    job->stats = op_stats(plan, PLAN_JOIN, 0);
+    for (int i = 0; i < 2; i++) {
+        JoinSide *side = &job->sides[i];
+        OpStats *scan = op_stats(plan, PLAN_SCAN, i);
+        Stamp lap;
+        side->t = tables[i];
+        side->where = &wheres[i];
+        side->needed = i ? plan->join_needed : plan->needed;
+        side->key_col = plan->join_cols[i];
+        if (scan) stamp(&lap);
+        side->cand_count = plan_index_lookup(side->t, side->where, &side->cands);
+        if (scan) {
+            scan->candidates = side->cand_count;
+            op_add(scan, 0, 0, &lap);
+        }
+    }
+    for (int i = 0; i < plan->item_count; i++) join_carry(&job->sides[plan->items[i].side], plan->items[i].col);
+    for (int i = 0; i < plan->order_count; i++) join_carry(&job->sides[plan->order[i].side], plan->order[i].col);
+    size_t budget = SORT_MEMORY / (size_t)scan_threads;
+    for (int w = 0; w < MAX_THREADS; w++) sorter_init(&job->sorters[w], budget, limit <= SORT_TOPK_MAX ? limit : 0);
+
+    if (job->sides[0].cand_count != 0 && job->sides[1].cand_count != 0) {
+        uint64_t rows[2];
+        int sorted = 1;
+        for (int i = 0; i < 2; i++) {
+            const JoinSide *side = &job->sides[i];
+            rows[i] = (side->cand_count >= 0) ? (uint64_t)side->cand_count : side->t->header.row_count;
+            sorted = sorted && side->cand_count < 0 && ((side->t->header.sorted_cols >> side->key_col) & 1);
+        }
+        if (sorted) {
+            job->build = 1;
+            rc = run_merge_join(job);
+        } else {
+            job->build = (rows[1] <= rows[0]) ? 1 : 0;
+            rc = run_hash_join(job);
+        }
+        if (job->stats) {
+            snprintf(job->stats->note, sizeof(job->stats->note), sorted ? "merged in key order" : "hashed %s%s",
+                     job->sides[job->build].t->name, job->spilled ? ", partitioned to disk" : "");
+        }
+        if (rc == 0 && plan->order_count > 0) {
+            OpStats *sort = op_stats(plan, PLAN_SORT, 0);
+            Stamp lap;
+            if (sort) stamp(&lap);
+            rc = sort_merge(job->sorters, MAX_THREADS, limit, print_sorted_join, job);
+            op_add(sort, 0, 0, &lap);
+        }
+    }
+    if (rc != 0) {
+        reply("Table '%s' or '%s' is missing column data, or the join ran out of memory or temporary space.\n",
+               tables[0]->name, tables[1]->name);
+    }
+
+    join_reset(job);
+    for (int i = 0; i < 2; i++) {
+        free(job->sides[i].cands);
+        for (int p = 0; p < JOIN_PARTITIONS; p++) {
+            if (job->parts[i][p]) fclose(job->parts[i][p]);
+        }
+    }
+    for (int w = 0; w < MAX_THREADS; w++) {
+        sorter_free(&job->sorters[w]);
+        free(job->rows[w]);
+    }
+    free(job);
+}
+
+// --- Query Profiling ---
+
+// Where the running statement prints its result rows
+FILE *result_stream(void) {
+    return (session_profile && session_profile->sink) ? session_profile->sink : reply_stream();
+}
+
+// Counts the result rows EXPLAIN ANALYZE produces instead of printing them
+ssize_t sink_write(void *cookie, const char *buf, size_t len) {
+    Profile *prof = cookie;
+    prof->result_bytes += len;
+    for (const char *p = buf; (p = memchr(p, '\n', (size_t)(buf + len - p))) != NULL; p++) prof->result_rows++;
+    return (ssize_t)len;
+}
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void stamp(Stamp *s) {
+    struct timespec ts;
+    s->wall_ns = now_ns();
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    s->cpu_ns = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Adds rows to an operator's counters and, with `lap` given, the time
+ * since `lap`, which then restarts. Does nothing when `st` is NULL.
+ */
+void op_add(OpStats *st, uint64_t rows_in, uint64_t rows_out, Stamp *lap) {
+    if (!st) return;
+    if (rows_in) __atomic_fetch_add(&st->rows_in, rows_in, __ATOMIC_RELAXED);
+    if (rows_out) __atomic_fetch_add(&st->rows_out, rows_out, __ATOMIC_RELAXED);
+    if (!lap) return;
+    Stamp now;
+    stamp(&now);
+    __atomic_fetch_add(&st->wall_ns, now.wall_ns - lap->wall_ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->cpu_ns, now.cpu_ns - lap->cpu_ns, __ATOMIC_RELAXED);
+    *lap = now;
+}
+
+// Counts one block a scan loaded
+void op_read(OpStats *st, uint64_t bytes) {
+    if (!st) return;
+    __atomic_fetch_add(&st->bytes_read, bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->blocks_read, 1, __ATOMIC_RELAXED);
+}
+
+// Counters of an operator of the running EXPLAIN ANALYZE, or NULL
+OpStats *op_stats(const Plan *plan, PlanOp op, int side) {
+    if (!session_profile || plan->explain != EXPLAIN_ANALYZE) return NULL;
+    int node = plan_find(plan, op, side);
+    return node < 0 ? NULL : &session_profile->ops[node];
+}
+
+// Finds an operator of a SELECT plan, below a join on the input of table `side`; -1 if absent
+int plan_find(const Plan *plan, PlanOp op, int side) {
+    int node = plan->root;
+    while (node >= 0 && plan->nodes[node].op != op) {
+        const PlanNode *n = &plan->nodes[node];
+        node = (n->op == PLAN_JOIN && side) ? n->right : n->child;
+    }
+    return node;
+}
+
+// Points a scan at the counters of its table's scan and filter and of the operator it feeds
+void scan_profile(ParallelScan *ps, const Plan *plan, int side, PlanOp consumer) {
+    ps->scan_stats = op_stats(plan, PLAN_SCAN, side);
+    ps->filter_stats = op_stats(plan, PLAN_FILTER, side);
+    ps->fn_stats = op_stats(plan, consumer, side);
+}
+
+uint64_t bits_count(const uint64_t *bits, size_t n) {
+    uint64_t count = 0;
+    for (size_t w = 0; w < (n + 63) / 64; w++) count += (uint64_t)__builtin_popcountll(bits[w]);
+    return count;
+}
+
+/**
+ * @brief Fills in the row counts of the operators that run inside others: a
+ * projection, sort or limit sees what the operator below it produced.
+ * Nodes are added bottom-up, so each child is final before its parent.
+ */
+void profile_finish(const Plan *plan, uint64_t limit) {
+    OpStats *ops = session_profile->ops;
+    for (int i = 0; i < plan->node_count; i++) {
+        const PlanNode *n = &plan->nodes[i];
+        uint64_t below = n->child >= 0 ? ops[n->child].rows_out : 0;
+        uint64_t capped = (limit && below > limit) ? limit : below;
+        switch (n->op) {
+            case PLAN_PROJECT:
+                ops[i].rows_in = below;
+                ops[i].rows_out = (limit && plan->order_count == 0) ? capped : below;
+                break;
+            case PLAN_SORT:
+            case PLAN_LIMIT:
+                ops[i].rows_in = below;
+                ops[i].rows_out = capped;
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+const char *op_name(PlanOp op) {
+    static const char *names[] = {"Scan", "Filter", "Join", "Project", "Aggregate", "Sort", "Limit"};
+    return names[op];
+}
+
+/**
+ * @brief Prints the plan of a SELECT as a tree, root first, with the access
+ * path and join method it is expected to use. Under EXPLAIN ANALYZE each
+ * operator is followed by what it measured.
+ */
+void explain_select(const Plan *plan, const Table *const *tables, const Where *wheres, uint64_t limit) {
+    const Profile *prof = session_profile;
+    explain_node(plan, plan->root, 0, 0, tables, wheres, limit);
+    reply("Planning: %.3f ms%s, catalog %.3f ms\n", prof->parse_ns / 1e6, prof->cached ? " (cached plan)" : "",
+          prof->catalog_ns / 1e6);
+    if (plan->explain != EXPLAIN_ANALYZE) return;
+
+    uint64_t cpu_ns = 0;
+    for (int i = 0; i < plan->node_count; i++) cpu_ns += prof->ops[i].cpu_ns;
+    reply("Execution: %.3f ms, %.3f ms CPU over all threads; result of %llu rows (%llu bytes) not shown\n", prof->exec_ns / 1e6,
+          cpu_ns / 1e6, (unsigned long long)prof->result_rows, (unsigned long long)prof->result_bytes);
+}
+
+void explain_node(const Plan *plan, int node, int depth, int side, const Table *const *tables, const Where *wheres, uint64_t limit) {
+    const PlanNode *n = &plan->nodes[node];
+    const Table *t = tables[side];
+    int joined = plan->join_table[0] != '\0';
+    char label[MAX_COL_NAME + 8];
+
+    reply("%*s%s%s", depth * 3, "", depth ? "-> " : "", op_name(n->op));
+    switch (n->op) {
+        case PLAN_SCAN: {
+            uint64_t lo, hi;
+            int ix = plan_index_choice(t, &wheres[side], &lo, &hi);
+            reply(" %s (%llu rows)", t->name, (unsigned long long)t->header.row_count);
+            if (ix < 0) break;
+            reply(" using index %s on %s", t->indexes[ix].name, t->cols[t->indexes[ix].col]);
+            // The index is passed over at run time when the range holds too many rows
+            if (plan->explain != EXPLAIN_ANALYZE) break;
+            long candidates = session_profile->ops[node].candidates;
+            if (candidates >= 0) reply(": %ld candidates", candidates);
+            else reply(": not selective enough, scanned instead");
+            break;
+        }
+        case PLAN_FILTER:
+            reply(" ");
+            explain_where(&wheres[side], wheres[side].root, t, 1);
+            break;
+        case PLAN_JOIN: {
+            uint64_t lo, hi;
+            int sorted = 1;
+            for (int i = 0; i < 2; i++) {
+                sorted = sorted && plan_index_choice(tables[i], &wheres[i], &lo, &hi) < 0 &&
+                         ((tables[i]->header.sorted_cols >> plan->join_cols[i]) & 1);
+            }
+            reply(" %s ON %s.%s = %s.%s", sorted ? "(merge)" : "(hash)", tables[0]->name, tables[0]->cols[plan->join_cols[0]],
+                  tables[1]->name, tables[1]->cols[plan->join_cols[1]]);
+            break;
+        }
+        case PLAN_PROJECT:
+        case PLAN_AGGREGATE:
+            for (int i = 0; i < plan->item_count; i++) {
+                const SelectItem *item = &plan->items[i];
+                const Table *it = tables[item->side];
+                reply("%s%s%s%s", i ? ", " : " ", joined ? it->name : "", joined ? "." : "", item_label(it, item, label));
+            }
+            for (int i = 0; i < plan->group_count; i++) reply("%s%s", i ? ", " : " GROUP BY ", t->cols[plan->group_cols[i]]);
+            break;
+        case PLAN_SORT:
+            for (int i = 0; i < plan->order_count; i++) {
+                const OrderKey *key = &plan->order[i];
+                const char *name = key->item >= 0 ? item_label(t, &plan->items[key->item], label) : tables[key->side]->cols[key->col];
+                reply("%s%s%s%s%s", i ? ", " : " BY ", joined ? tables[key->side]->name : "", joined ? "." : "", name,
+                      key->desc ? " DESC" : "");
+            }
+            if (limit && limit <= SORT_TOPK_MAX) reply(" (top-%llu heap)", (unsigned long long)limit);
+            break;
+        case PLAN_LIMIT:
+            reply(" %llu", (unsigned long long)limit);
+            break;
+    }
+    reply("\n");
+    if (plan->explain == EXPLAIN_ANALYZE) {
+        reply("%*s", depth * 3 + (depth ? 6 : 3), "");
+        explain_stats(plan, node);
+    }
+
+    if (n->child >= 0) explain_node(plan, n->child, depth + 1, side, tables, wheres, limit);
+    if (n->right >= 0) explain_node(plan, n->right, depth + 1, 1, tables, wheres, limit);
+}
+
+// Prints a WHERE clause with its bound literals; OR inside AND is parenthesized
+void explain_where(const Where *w, int node, const Table *t, int top) {
+    static const char *ops[] = {"=", "<>", "<", "<=", ">", ">=", "LIKE"};
+    const Expr *e = &w->nodes[node];
+    if (e->kind != EXPR_CMP) {
+        int paren = !top && e->kind == EXPR_OR;
+        reply("%s", paren ? "(" : "");
+        explain_where(w, e->left, t, 0);
+        reply(" %s ", e->kind == EXPR_AND ? "AND" : "OR");
+        explain_where(w, e->right, t, e->kind == EXPR_OR);
+        reply("%s", paren ? ")" : "");
+        return;
+    }
+    if (t->types[e->col] != COL_TEXT) reply("%s %s %s", t->cols[e->col], ops[e->op], e->text);
+    else reply("%s %s '%s%s'", t->cols[e->col], ops[e->op], e->text, e->op == OP_PREFIX ? "%" : "");
+}
+
+/**
+ * @brief Prints the counters of one operator. A projection or limit that runs
+ * inside the operator next to it has no time of its own.
+ */
+void explain_stats(const Plan *plan, int node) {
+    const OpStats *st = &session_profile->ops[node];
+    const PlanNode *n = &plan->nodes[node];
+    reply("rows %llu in, %llu out", (unsigned long long)st->rows_in, (unsigned long long)st->rows_out);
+    if (n->op == PLAN_SCAN) {
+        double kb = st->bytes_read / 1024.0;
+        reply("; read %.1f %s in %llu blocks", kb >= 1024 ? kb / 1024 : kb, kb >= 1024 ? "MB" : "KB", (unsigned long long)st->blocks_read);
+        if (st->blocks_skipped) reply(", %llu skipped by zone maps", (unsigned long long)st->blocks_skipped);
+    }
+    if (st->wall_ns || st->cpu_ns) {
+        reply("; %.3f ms, %.3f ms CPU", st->wall_ns / 1e6, st->cpu_ns / 1e6);
+    } else if (n->op == PLAN_PROJECT || n->op == PLAN_LIMIT) {
+        int parent = -1;
+        for (int i = 0; i < plan->node_count; i++) {
+            if (plan->nodes[i].child == node) parent = i;
+        }
+        int with = (n->op == PLAN_PROJECT && parent >= 0 && plan->nodes[parent].op == PLAN_SORT) ? parent : n->child;
+        reply("; timed with %s", op_name(plan->nodes[with].op));
+    }
+    if (st->note[0]) reply("; %s", st->note);
+    reply("\n");
+}
+
+// --- Statements ---
+
+/**
+ * @brief Runs one statement. Its literals are lifted out as parameters and the
+ * rest of the text is the key of a cached plan, so a statement that repeats
+ * with different values is parsed and checked against the schema only once.
+ * @return 1 if the statement was 'exit', 0 otherwise.
+ */
+int run_statement(const char *cmd) {
+    Params params;
+    char *key = NULL;
+    size_t key_len = 0;
+    int quit = 0;
+    uint64_t started = now_ns();
+
+    memset(&params, 0, sizeof(params));
+    if (normalize_statement(cmd, &params, &key, &key_len) != 0 || key_len == 0) {
+        free(key);
+        params_free(&params);
+        return 0;
+    }
+
+    // EXPLAIN reports how long planning took, so its profile starts before parsing
+    Profile *prof = NULL;
+    if (key_len > 8 && strncasecmp(key, "EXPLAIN ", 8) == 0) prof = calloc(1, sizeof(Profile));
+    session_profile = prof;
+
+    uint64_t hash = hash_bytes(key, key_len);
+    Plan *plan = malloc(sizeof(Plan));
+    if (!plan) {
+        reply("Not enough memory to plan the statement.\n");
+    } else if (stmt_cache_lookup(key, hash, plan) != 0) {
+        if (parse_statement(cmd, plan) != 0) {
+            free(plan);
+            plan = NULL;
+        } else if (key_len < STMT_KEY_MAX && (plan->kind == STMT_SELECT || plan->kind == STMT_INSERT || plan->kind == STMT_LOAD)) {
+            stmt_cache_store(key, hash, plan);
+        }
+    } else if (prof) {
+        prof->cached = 1;
+    }
+    if (prof) prof->parse_ns = now_ns() - started - prof->catalog_ns;
+
+    Txn *txn = session_txn;
+    int ends_txn = plan && (plan->kind == STMT_COMMIT || plan->kind == STMT_ROLLBACK || plan->kind == STMT_EXIT);
+    if (plan && txn->failed && !ends_txn) {
+        reply("The transaction failed; ROLLBACK to end it.\n");
+    } else if (plan && txn->active && (plan->kind == STMT_CREATE_TABLE || plan->kind == STMT_CREATE_INDEX)) {
+        reply("CREATE cannot run inside a transaction.\n");
+    } else if (plan) {
+        // Outside a transaction a SELECT reads its own snapshot
+        int snapshot = plan->kind == STMT_SELECT && !txn->active;
+        if (snapshot) txn_snapshot_begin(txn);
+        switch (plan->kind) {
+            case STMT_CREATE_TABLE: handle_create(plan); break;
+            case STMT_CREATE_INDEX: handle_create_index(plan); break;
+            case STMT_INSERT: handle_insert(plan, &params); break;
+            case STMT_LOAD: handle_load(plan, &params); break;
+            case STMT_SELECT: handle_select(plan, &params); break;
+            case STMT_SET_THREADS:
+            case STMT_SET_MEMORY: handle_set(plan, &params); break;
+            case STMT_CHECKPOINT: handle_checkpoint(); break;
+            case STMT_BEGIN:
+            case STMT_COMMIT:
+            case STMT_ROLLBACK: handle_transaction(plan); break;
+            case STMT_VACUUM: handle_vacuum(); break;
+            case STMT_EXIT: quit = 1; break;
+        }
+        if (snapshot) txn_snapshot_end(txn);
+    }
+    session_profile = NULL;
+    free(prof);
+    free(plan);
+    free(key);
+    params_free(&params);
+    return quit;
+}
+
+/**
+ * @brief Tokenizes a statement into its cache key, the tokens joined by single
+ * spaces with each literal replaced by '?', and the list of those literals.
+ * @return 0 on success, -1 (after printing the reason) otherwise.
+ */
+int normalize_statement(const char *cmd, Params *params, char **key, size_t *key_len) {
+    Lexer lx;
+    FILE *out = open_memstream(key, key_len);
+    if (!out) return -1;
+    for (lex_init(&lx, cmd); lx.tok.type != TOK_END && lx.tok.type != TOK_ERROR; lex_next(&lx)) {
+        // A token that consumed nothing would be read again forever
+        if (lx.tok.src_len == 0) {
+            lx.tok.type = TOK_ERROR;
+            break;
+        }
+        if (ftell(out) > 0) fputc(' ', out);
+        if (lx.tok.param < 0) {
+            fputs(lx.tok.text, out);
+        } else {
+            fputc('?', out);
+            if (params_add(params, &lx.tok) != 0) {
+                reply("Not enough memory for the statement's values.\n");
+                fclose(out);
+                return -1;
+            }
+        }
+    }
+    fclose(out);
+    if (lx.tok.type == TOK_ERROR) {
+        reply("Syntax error near '%.*s'.\n", (int)strcspn(lx.tok.src, "\r\n"), lx.tok.src);
+        return -1;
+    }
+    return 0;
+}
+
+// Appends a literal's text, with quotes removed and '' unescaped
+int params_add(Params *ps, const Token *tok) {
+    const char *src = tok->src;
+    size_t len = tok->src_len;
+    if (tok->type == TOK_STRING) {
+        src++;
+        len -= 2;
+    }
+    if (ps->count == ps->cap) {
+        size_t cap = ps->cap ? ps->cap * 2 : 16;
+        Param *grown = realloc(ps->items, cap * sizeof(Param));
+        if (!grown) return -1;
+        ps->items = grown;
+        ps->cap = cap;
+    }
+    if (ps->text_len + len + 1 > ps->text_cap) {
+        size_t cap = (ps->text_len + len + 1) * 2;
+        char *grown = realloc(ps->text, cap);
+        if (!grown) return -1;
+        ps->text = grown;
+        ps->text_cap = cap;
+    }
+
+    char *out = ps->text + ps->text_len;
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        out[n++] = src[i];
+        if (tok->type == TOK_STRING && src[i] == tok->src[0]) i++;
+    }
+    out[n] = '\0';
+    ps->items[ps->count].type = tok->type;
+    ps->items[ps->count].off = (uint32_t)ps->text_len;
+    ps->items[ps->count++].len = (uint32_t)n;
+    ps->text_len += n + 1;
+    return 0;
+}
+
+const char *param_text(const Params *ps, int i) {
+    return ps->text + ps->items[i].off;
+}
+
+void params_free(Params *ps) {
+    free(ps->items);
+    free(ps->text);
+    memset(ps, 0, sizeof(*ps));
+}
+
+/**
+ * @brief Copies the cached plan for a key into `plan`, unless a table or index
+ * was created since it was made. Sessions get copies so that the cache can
+ * replace an entry while another session is still running its plan.
+ * @return 0 on a hit, -1 otherwise.
+ */
+int stmt_cache_lookup(const char *key, uint64_t hash, Plan *plan) {
+    int rc = -1;
+    pthread_mutex_lock(&catalog.lock);
+    uint64_t version = catalog.version;
+    pthread_mutex_unlock(&catalog.lock);
+
+    pthread_mutex_lock(&stmt_cache.lock);
+    for (int i = 0; i < STMT_CACHE_SIZE; i++) {
+        CachedPlan *c = &stmt_cache.entries[i];
+        if (c->plan && c->hash == hash && strcmp(c->key, key) == 0) {
+            if (c->plan->version == version) {
+                c->last_used = ++stmt_cache.tick;
+                *plan = *c->plan;
+                rc = 0;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stmt_cache.lock);
+    return rc;
+}
+
+/**
+ * @brief Caches a copy of a plan under its key, replacing a stale plan for the
+ * same key or else the least recently used one.
+ */
+int stmt_cache_store(const char *key, uint64_t hash, const Plan *plan) {
+    char *copy = strdup(key);
+    Plan *cached = malloc(sizeof(Plan));
+    if (!copy || !cached) {
+        free(copy);
+        free(cached);
+        return -1;
+    }
+    *cached = *plan;
+
+    pthread_mutex_lock(&stmt_cache.lock);
+    CachedPlan *slot = &stmt_cache.entries[0];
+    for (int i = 0; i < STMT_CACHE_SIZE; i++) {
+        CachedPlan *c = &stmt_cache.entries[i];
+        if (c->plan && c->hash == hash && strcmp(c->key, key) == 0) {
+            slot = c;
+            break;
+        }
+        if (!c->plan || (slot->plan && c->last_used < slot->last_used)) slot = c;
+    }
+    free(slot->key);
+    free(slot->plan);
+    slot->key = copy;
+    slot->hash = hash;
+    slot->plan = cached;
+    slot->last_used = ++stmt_cache.tick;
+    pthread_mutex_unlock(&stmt_cache.lock);
+    return 0;
+}
+
+// --- Statement Parsing ---
+
+/**
+ * @brief Parses a statement into a plan, resolving tables and columns through
+ * the catalog. Literals are only counted here; they are checked when bound.
+ * @return 0 on success, -1 (after printing the reason) otherwise.
+ */
+int parse_statement(const char *cmd, Plan *plan) {
+    Lexer lx;
+    int rc;
+
+    memset(plan, 0, sizeof(*plan));
+    plan->root = -1;
+    plan->where.root = -1;
+    plan->join_where.root = -1;
+    plan->limit_param = -1;
+    pthread_mutex_lock(&catalog.lock);
+    plan->version = catalog.version;
+    pthread_mutex_unlock(&catalog.lock);
+    lex_init(&lx, cmd);
+
+    if (accept_keyword(&lx, "SELECT")) rc = parse_select(&lx, plan);
+    else if (accept_keyword(&lx, "EXPLAIN")) {
+        plan->explain = accept_keyword(&lx, "ANALYZE") ? EXPLAIN_ANALYZE : EXPLAIN_PLAN;
+        if (!accept_keyword(&lx, "SELECT")) {
+            reply("EXPLAIN works on SELECT statements.\n");
+            return -1;
+        }
+        rc = parse_select(&lx, plan);
+    } else if (accept_keyword(&lx, "INSERT")) rc = parse_insert(&lx, plan);
+    else if (accept_keyword(&lx, "LOAD")) rc = parse_load(&lx, plan);
+    else if (accept_keyword(&lx, "CREATE")) {
+        if (accept_keyword(&lx, "TABLE")) rc = parse_create_table(&lx, plan);
+        else if (accept_keyword(&lx, "INDEX")) rc = parse_create_index(&lx, plan);
+        else {
+            reply("Use CREATE TABLE or CREATE INDEX.\n");
+            return -1;
+        }
+    } else if (accept_keyword(&lx, "SET")) rc = parse_set(&lx, plan);
+    else if (accept_keyword(&lx, "CHECKPOINT")) {
+        plan->kind = STMT_CHECKPOINT;
+        rc = 0;
+    } else if (accept_keyword(&lx, "BEGIN")) {
+        accept_keyword(&lx, "TRANSACTION");
+        plan->kind = STMT_BEGIN;
+        rc = 0;
+    } else if (accept_keyword(&lx, "COMMIT")) {
+        plan->kind = STMT_COMMIT;
+        rc = 0;
+    } else if (accept_keyword(&lx, "ROLLBACK")) {
+        plan->kind = STMT_ROLLBACK;
+        rc = 0;
+    } else if (accept_keyword(&lx, "VACUUM")) {
+        plan->kind = STMT_VACUUM;
+        rc = 0;
+    } else if (accept_keyword(&lx, "exit")) {
+        plan->kind = STMT_EXIT;
+        rc = 0;
+    } else {
+        reply("Unknown command.\n");
+        return -1;
+    }
+
+    if (rc == 0 && lx.tok.type != TOK_END) {
+        reply("Unexpected '%s' at the end of the statement.\n", lx.tok.text);
+        return -1;
+    }
+    plan->param_count = lx.literals;
+    return rc;
+}
+
+// Consumes the current token if it is the given keyword (in any case)
+int accept_keyword(Lexer *lx, const char *kw) {
+    if (lx->tok.type != TOK_IDENT || !str_ieq(lx->tok.text, kw)) return 0;
+    lex_next(lx);
+    return 1;
+}
+
+int accept_token(Lexer *lx, TokenType type) {
+    if (lx->tok.type != type) return 0;
+    lex_next(lx);
+    return 1;
+}
+
+int expect_keyword(Lexer *lx, const char *kw) {
+    if (accept_keyword(lx, kw)) return 0;
+    reply("Expected %s, got '%s'.\n", kw, token_text(&lx->tok));
+    return -1;
+}
+
+int expect_token(Lexer *lx, TokenType type, const char *text) {
+    if (accept_token(lx, type)) return 0;
+    reply("Expected '%s', got '%s'.\n", text, token_text(&lx->tok));
+    return -1;
+}
+
+// Reads an identifier into buf; `what` names it in the error message
+int parse_name(Lexer *lx, char *buf, size_t size, const char *what) {
+    if (lx->tok.type != TOK_IDENT || strlen(lx->tok.text) >= size) {
+        reply("Expected a %s name, got '%s'.\n", what, token_text(&lx->tok));
+        return -1;
+    }
+    strcpy(buf, lx->tok.text);
+    lex_next(lx);
+    return 0;
+}
+
+const char *token_text(const Token *tok) {
+    return tok->type == TOK_END ? "end of statement" : tok->text;
+}
+
+// CREATE TABLE table_name (col1 TYPE [DICT], col2 TYPE, ...)
+int parse_create_table(Lexer *lx, Plan *plan) {
+    Table *t = &plan->def;
+    plan->kind = STMT_CREATE_TABLE;
+    if (parse_name(lx, t->name, sizeof(t->name), "table") != 0 || expect_token(lx, TOK_LPAREN, "(") != 0) return -1;
+    do {
+        if (t->col_count == MAX_COLS) {
+            reply("A table can have at most %d columns.\n", MAX_COLS);
+            return -1;
+        }
+        if (parse_name(lx, t->cols[t->col_count], MAX_COL_NAME, "column") != 0) return -1;
+        t->types[t->col_count] = COL_TEXT;
+        if (lx->tok.type == TOK_IDENT) {
+            for (char *c = lx->tok.text; *c; c++) *c = (char)toupper((unsigned char)*c);
+            if (parse_type(lx->tok.text, &t->types[t->col_count]) != 0) {
+                reply("Unknown column type '%s'. Use INT, REAL or TEXT.\n", lx->tok.text);
+                return -1;
+            }
+            lex_next(lx);
+            // A length such as VARCHAR(20) is accepted and ignored
+            if (accept_token(lx, TOK_LPAREN) && (!accept_token(lx, TOK_NUMBER) || expect_token(lx, TOK_RPAREN, ")") != 0)) {
+                reply("Invalid length for column '%s'.\n", t->cols[t->col_count]);
+                return -1;
+            }
+        }
+        // TEXT DICT stores each distinct string once; meant for columns with few of them
+        if (accept_keyword(lx, "DICT")) {
+            if (t->types[t->col_count] != COL_TEXT) {
+                reply("Only TEXT columns can be DICT.\n");
+                return -1;
+            }
+            t->header.dict_cols |= (uint16_t)(1u << t->col_count);
+        }
+        for (int i = 0; i < t->col_count; i++) {
+            if (strcmp(t->cols[i], t->cols[t->col_count]) == 0) {
+                reply("Duplicate column '%s'.\n", t->cols[i]);
+                return -1;
+            }
+        }
+        t->col_count++;
+    } while (accept_token(lx, TOK_COMMA));
+    strcpy(plan->table, t->name);
+    return expect_token(lx, TOK_RPAREN, ")");
+}
+
+// CREATE INDEX index_name ON table_name(col)
+int parse_create_index(Lexer *lx, Plan *plan) {
+    char col_name[MAX_COL_NAME];
+    Table t;
+    plan->kind = STMT_CREATE_INDEX;
+    if (parse_name(lx, plan->index_name, sizeof(plan->index_name), "index") != 0 || expect_keyword(lx, "ON") != 0 ||
+        parse_name(lx, plan->table, sizeof(plan->table), "table") != 0 || expect_token(lx, TOK_LPAREN, "(") != 0 ||
+        parse_name(lx, col_name, sizeof(col_name), "column") != 0 || expect_token(lx, TOK_RPAREN, ")") != 0) {
+        return -1;
+    }
+    if (load_table(plan->table, &t) != 0) return -1;
+    if ((plan->index_col = find_column(&t, col_name)) < 0) {
+        reply("Unknown column '%s'.\n", col_name);
+        return -1;
+    }
+    return 0;
+}
+
+// INSERT INTO table_name VALUES (val1, val2, ...), (val1, val2, ...), ...
+int parse_insert(Lexer *lx, Plan *plan) {
+    Table t;
+    plan->kind = STMT_INSERT;
+    if (expect_keyword(lx, "INTO") != 0 || parse_name(lx, plan->table, sizeof(plan->table), "table") != 0) return -1;
+    if (load_table(plan->table, &t) != 0 || expect_keyword(lx, "VALUES") != 0) return -1;
+    do {
+        int n = 0;
+        if (expect_token(lx, TOK_LPAREN, "(") != 0) return -1;
+        do {
+            if (lx->tok.param < 0) {
+                reply("Expected a value in row %zu, got '%s'.\n", plan->row_count + 1, token_text(&lx->tok));
+                return -1;
+            }
+            n++;
+            lex_next(lx);
+        } while (accept_token(lx, TOK_COMMA));
+        if (expect_token(lx, TOK_RPAREN, ")") != 0) return -1;
+        if (n != t.col_count) {
+            reply("Expected %d values, got %d in row %zu.\n", t.col_count, n, plan->row_count + 1);
+            return -1;
+        }
+        plan->row_count++;
+    } while (accept_token(lx, TOK_COMMA));
+    return 0;
+}
+
+// LOAD DATA 'file.csv' INTO table_name; the file name is parameter 0
+int parse_load(Lexer *lx, Plan *plan) {
+    Table t;
+    plan->kind = STMT_LOAD;
+    if (expect_keyword(lx, "DATA") != 0) return -1;
+    if (lx->tok.type != TOK_STRING) {
+        reply("Expected a quoted file name, got '%s'.\n", token_text(&lx->tok));
+        return -1;
+    }
+    lex_next(lx);
+    if (expect_keyword(lx, "INTO") != 0 || parse_name(lx, plan->table, sizeof(plan->table), "table") != 0) return -1;
+    return load_table(plan->table, &t);
+}
+
+// SET THREADS n or SET MEMORY mb; the number is parameter 0
+int parse_set(Lexer *lx, Plan *plan) {
+    if (accept_keyword(lx, "MEMORY")) plan->kind = STMT_SET_MEMORY;
+    else if (accept_keyword(lx, "THREADS")) plan->kind = STMT_SET_THREADS;
+    else {
+        reply("Expected THREADS or MEMORY, got '%s'.\n", token_text(&lx->tok));
+        return -1;
+    }
+    if (lx->tok.type != TOK_NUMBER) {
+        reply("Usage: SET %s n.\n", plan->kind == STMT_SET_MEMORY ? "MEMORY" : "THREADS");
+        return -1;
+    }
+    lex_next(lx);
+    return 0;
+}
+
+/**
+ * @brief Parses a SELECT into a scan, an optional filter and a projection or
+ * aggregation on top; a JOIN adds the second table's scan and filter and a
+ * join of the two. The FROM clause is read first so the SELECT list can be
+ * resolved against the tables.
+ */
+int parse_select(Lexer *lx, Plan *plan) {
+    Lexer list = *lx;
+    Table t, u;
+    Scope sc = {{&t, &u}, 1};
+    plan->kind = STMT_SELECT;
+
+    // SELECT * FROM table_name
+    // SELECT col1, col2 FROM table_name WHERE col1 > 10 AND col2 LIKE 'ab%'
+    // SELECT col1, COUNT(*), AVG(col2) FROM table_name WHERE ... GROUP BY col1
+    // SELECT ... ORDER BY col1 DESC, col2 LIMIT 10
+    // SELECT a.col1, b.col2 FROM a JOIN b ON a.id = b.a_id WHERE ...
+
+    while (lx->tok.type != TOK_END && !(lx->tok.type == TOK_IDENT && str_ieq(lx->tok.text, "FROM"))) lex_next(lx);
+    if (expect_keyword(lx, "FROM") != 0 || parse_name(lx, plan->table, sizeof(plan->table), "table") != 0) return -1;
+    if (load_table(plan->table, &t) != 0) return -1;
+    int joined = accept_keyword(lx, "JOIN");
+    if (!joined && accept_keyword(lx, "INNER")) {
+        if (expect_keyword(lx, "JOIN") != 0) return -1;
+        joined = 1;
+    }
+    if (joined && parse_join(lx, plan, &sc, &u) != 0) return -1;
+
+    if (list.tok.type == TOK_STAR) {
+        for (int side = 0; side < sc.count; side++) {
+            for (int i = 0; i < sc.tables[side]->col_count; i++) {
+                SelectItem *item = &plan->items[plan->item_count++];
+                item->is_agg = 0;
+                item->side = side;
+                item->col = i;
+            }
+        }
+        lex_next(&list);
+    } else {
+        do {
+            if (plan->item_count == MAX_SELECT_ITEMS) {
+                reply("Too many items in SELECT list.\n");
+                return -1;
+            }
+            if (parse_select_item(&list, &sc, &plan->items[plan->item_count]) != 0) return -1;
+            plan->agg_count += plan->items[plan->item_count++].is_agg;
+        } while (accept_token(&list, TOK_COMMA));
+    }
+    if (!(list.tok.type == TOK_IDENT && str_ieq(list.tok.text, "FROM"))) {
+        reply("Invalid SELECT item '%s'.\n", token_text(&list.tok));
+        return -1;
+    }
+
+    if (accept_keyword(lx, "WHERE")) {
+        plan->where.root = parse_where_or(lx, &sc, &plan->where);
+        if (plan->where.root < 0) return -1;
+        if (joined && split_where(plan) != 0) return -1;
+    }
+    if (accept_keyword(lx, "GROUP")) {
+        if (expect_keyword(lx, "BY") != 0) return -1;
+        do {
+            char name[MAX_COL_NAME];
+            int side;
+            if (parse_name(lx, name, sizeof(name), "column") != 0) return -1;
+            int c = resolve_column(&sc, name, &side);
+            if (c < 0) return -1;
+            if (plan->group_count < MAX_COLS) plan->group_cols[plan->group_count++] = c;
+        } while (accept_token(lx, TOK_COMMA));
+    }
+
+    int aggregate = plan->agg_count > 0 || plan->group_count > 0;
+    if (aggregate && joined) {
+        reply("Aggregates and GROUP BY are not supported on a JOIN.\n");
+        return -1;
+    }
+    if (aggregate) {
+        for (int i = 0; i < plan->item_count; i++) {
+            int grouped = plan->items[i].is_agg;
+            for (int g = 0; g < plan->group_count && !grouped; g++) grouped = (plan->group_cols[g] == plan->items[i].col);
+            if (!grouped) {
+                reply("Column '%s' must appear in GROUP BY or inside an aggregate.\n", t.cols[plan->items[i].col]);
+                return -1;
+            }
+        }
+    }
+    if (accept_keyword(lx, "ORDER")) {
+        if (expect_keyword(lx, "BY") != 0) return -1;
+        do {
+            if (plan->order_count == MAX_COLS) {
+                reply("Too many ORDER BY keys.\n");
+                return -1;
+            }
+            if (parse_order_key(lx, &sc, plan, &plan->order[plan->order_count++]) != 0) return -1;
+        } while (accept_token(lx, TOK_COMMA));
+    }
+    if (accept_keyword(lx, "LIMIT")) {
+        if (lx->tok.type != TOK_NUMBER) {
+            reply("LIMIT needs a row count, got '%s'.\n", token_text(&lx->tok));
+            return -1;
+        }
+        plan->limit_param = lx->tok.param;
+        lex_next(lx);
+    }
+
+    // Only the selected, grouped, ordered, joined and filtered columns are read
+    int *needed[2] = {plan->needed, plan->join_needed};
+    for (int i = 0; i < plan->item_count; i++) {
+        if (plan->items[i].col >= 0) needed[plan->items[i].side][plan->items[i].col] = 1;
+    }
+    for (int i = 0; i < plan->group_count; i++) plan->needed[plan->group_cols[i]] = 1;
+    for (int i = 0; i < plan->order_count; i++) needed[plan->order[i].side][plan->order[i].col] = 1;
+    for (int i = 0; i < plan->where.count; i++) {
+        if (plan->where.nodes[i].kind == EXPR_CMP) plan->needed[plan->where.nodes[i].col] = 1;
+    }
+    if (joined) {
+        plan->needed[plan->join_cols[0]] = plan->join_needed[plan->join_cols[1]] = 1;
+        for (int i = 0; i < plan->join_where.count; i++) {
+            if (plan->join_where.nodes[i].kind == EXPR_CMP) plan->join_needed[plan->join_where.nodes[i].col] = 1;
+        }
+    }
+
+    plan->root = plan_add(plan, PLAN_SCAN, -1);
+    if (plan->where.root >= 0) plan->root = plan_add(plan, PLAN_FILTER, plan->root);
+    if (joined) {
+        int right = plan_add(plan, PLAN_SCAN, -1);
+        if (plan->join_where.root >= 0) right = plan_add(plan, PLAN_FILTER, right);
+        plan->root = plan_add(plan, PLAN_JOIN, plan->root);
+        plan->nodes[plan->root].right = right;
+    }
+    plan->root = plan_add(plan, aggregate ? PLAN_AGGREGATE : PLAN_PROJECT, plan->root);
+    if (plan->order_count > 0) plan->root = plan_add(plan, PLAN_SORT, plan->root);
+    if (plan->limit_param >= 0) plan->root = plan_add(plan, PLAN_LIMIT, plan->root);
+    return 0;
+}
+
+// JOIN table ON a.x = b.y, with the two columns in either order
+int parse_join(Lexer *lx, Plan *plan, Scope *sc, Table *u) {
+    int cols[2], sides[2];
+    if (parse_name(lx, plan->join_table, sizeof(plan->join_table), "table") != 0) return -1;
+    if (strcmp(plan->join_table, plan->table) == 0) {
+        reply("A table cannot be joined with itself.\n");
+        return -1;
+    }
+    if (load_table(plan->join_table, u) != 0) return -1;
+    sc->count = 2;
+    if (expect_keyword(lx, "ON") != 0) return -1;
+    for (int i = 0; i < 2; i++) {
+        if (lx->tok.type != TOK_IDENT) {
+            reply("Expected a column after ON, got '%s'.\n", token_text(&lx->tok));
+            return -1;
+        }
+        if ((cols[i] = resolve_column(sc, lx->tok.text, &sides[i])) < 0) return -1;
+        lex_next(lx);
+        if (i == 0) {
+            if (lx->tok.type != TOK_OP || strcmp(lx->tok.text, "=") != 0) {
+                reply("ON needs two columns compared with '='.\n");
+                return -1;
+            }
+            lex_next(lx);
+        }
+    }
+    if (sides[0] == sides[1]) {
+        reply("ON must compare a column of each table.\n");
+        return -1;
+    }
+    plan->join_cols[sides[0]] = cols[0];
+    plan->join_cols[sides[1]] = cols[1];
+    if (sc->tables[0]->types[plan->join_cols[0]] != u->types[plan->join_cols[1]]) {
+        reply("Columns '%s' and '%s' have different types.\n", sc->tables[0]->cols[plan->join_cols[0]],
+               u->cols[plan->join_cols[1]]);
+        return -1;
+    }
+    return 0;
+}
+
+int plan_add(Plan *plan, PlanOp op, int child) {
+    plan->nodes[plan->node_count].op = op;
+    plan->nodes[plan->node_count].child = child;
+    plan->nodes[plan->node_count].right = -1;
+    return plan->node_count++;
+}
+
+/**
+ * @brief Parses one SELECT list entry: a column name or an aggregate such as
+ * COUNT(*), SUM(col), AVG(col), MIN(col) or MAX(col).
+ */
+int parse_select_item(Lexer *lx, const Scope *sc, SelectItem *item) {
+    static const char *funcs[] = {"COUNT", "SUM", "AVG", "MIN", "MAX"};
+    char name[MAX_TOKEN_LEN];
+
+    memset(item, 0, sizeof(*item));
+    if (lx->tok.type != TOK_IDENT) {
+        reply("Invalid SELECT item '%s'.\n", token_text(&lx->tok));
+        return -1;
+    }
+    strcpy(name, lx->tok.text);
+    lex_next(lx);
+
+    if (lx->tok.type == TOK_LPAREN) {
+        int f = 0;
+        while (f < 5 && !str_ieq(name, funcs[f])) f++;
+        if (f == 5) {
+            reply("Unknown function '%s'.\n", name);
+            return -1;
+        }
+        item->is_agg = 1;
+        item->func = (AggFunc)f;
+        lex_next(lx);
+        if (lx->tok.type == TOK_STAR && item->func == AGG_COUNT) {
+            item->col = -1;
+        } else if (lx->tok.type != TOK_IDENT) {
+            reply("Unknown column '%s'.\n", lx->tok.text);
+            return -1;
+        } else if ((item->col = resolve_column(sc, lx->tok.text, &item->side)) < 0) {
+            return -1;
+        }
+        lex_next(lx);
+        if (lx->tok.type != TOK_RPAREN) {
+            reply("Missing ')' after %s.\n", funcs[f]);
+            return -1;
+        }
+        lex_next(lx);
+        if ((item->func == AGG_SUM || item->func == AGG_AVG) && sc->tables[item->side]->types[item->col] == COL_TEXT) {
+            reply("%s needs an INT or REAL column.\n", funcs[f]);
+            return -1;
+        }
+    } else if ((item->col = resolve_column(sc, name, &item->side)) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Parses one ORDER BY key and an optional ASC or DESC. Grouped queries
+ * can order by a GROUP BY column or by an aggregate from the SELECT list.
+ */
+int parse_order_key(Lexer *lx, const Scope *sc, const Plan *plan, OrderKey *key) {
+    SelectItem item;
+    if (lx->tok.type != TOK_IDENT) {
+        reply("Expected a column after ORDER BY, got '%s'.\n", token_text(&lx->tok));
+        return -1;
+    }
+    if (parse_select_item(lx, sc, &item) != 0) return -1;
+    key->item = -1;
+    key->side = item.side;
+    key->col = item.col;
+    if (item.is_agg) {
+        for (int i = 0; i < plan->item_count && key->item < 0; i++) {
+            const SelectItem *it = &plan->items[i];
+            if (it->is_agg && it->func == item.func && it->col == item.col) key->item = i;
+        }
+        if (key->item < 0) {
+            reply("An aggregate in ORDER BY must also be in the SELECT list.\n");
+            return -1;
+        }
+    } else if (plan->agg_count > 0 || plan->group_count > 0) {
+        int grouped = 0;
+        for (int g = 0; g < plan->group_count && !grouped; g++) grouped = (plan->group_cols[g] == item.col);
+        if (!grouped) {
+            reply("Column '%s' must appear in GROUP BY to be used in ORDER BY.\n", sc->tables[0]->cols[item.col]);
+            return -1;
+        }
+    }
+    key->desc = accept_keyword(lx, "DESC");
+    if (!key->desc) accept_keyword(lx, "ASC");
+    return 0;
+}
+
+// --- Query Parsing ---
+
+void lex_init(Lexer *lx, const char *str) {
+    lx->p = str;
+    lx->literals = 0;
+    lex_next(lx);
+}
+
+/**
+ * @brief Advances to the next token. Quoted strings are returned without
+ * their quotes ('' inside a string is an escaped quote).
+ */
+void lex_next(Lexer *lx) {
+    Token *tok = &lx->tok;
+    const char *p = lx->p;
+    size_t len = 0;
+
+    while (isspace((unsigned char)*p)) p++;
+    tok->text[0] = '\0';
+    tok->type = TOK_ERROR;
+    tok->src = p;
+    tok->param = -1;
+
+    if (*p == '\0' || *p == ';') {
+        tok->type = TOK_END;
+    } else if (isalpha((unsigned char)*p) || *p == '_') {
+        while ((isalnum((unsigned char)*p) || *p == '_' || *p == '.') && len < MAX_TOKEN_LEN - 1) tok->text[len++] = *p++;
+        tok->type = TOK_IDENT;
+    } else if (isdigit((unsigned char)*p) || ((*p == '-' || *p == '+' || *p == '.') && (isdigit((unsigned char)p[1]) || p[1] == '.'))) {
+        char *end;
+        strtod(p, &end);
+        while (p < end && len < MAX_TOKEN_LEN - 1) tok->text[len++] = *p++;
+        // "-.", "+." and ".." start no number
+        if (end > tok->src) tok->type = TOK_NUMBER;
+    } else if (*p == '\'' || *p == '"') {
+        // Strings longer than a token are kept whole in `src`
+        char quote = *p++;
+        while (*p) {
+            if (*p == quote) {
+                if (p[1] != quote) break;
+                p++;
+            }
+            if (len < MAX_TOKEN_LEN - 1) tok->text[len++] = *p;
+            p++;
+        }
+        if (*p == quote) {
+            p++;
+            tok->type = TOK_STRING;
+        }
+    } else if (*p == '=' || *p == '<' || *p == '>' || *p == '!') {
+        tok->text[len++] = *p++;
+        if (*p == '=' || (tok->text[0] == '<' && *p == '>')) tok->text[len++] = *p++;
+        tok->type = TOK_OP;
+    } else {
+        tok->text[len++] = *p;
+        switch (*p++) {
+            case '(': tok->type = TOK_LPAREN; break;
+            case ')': tok->type = TOK_RPAREN; break;
+            case ',': tok->type = TOK_COMMA; break;
+            case '*': tok->type = TOK_STAR; break;
+        }
+    }
+    tok->text[len] = '\0';
+    tok->src_len = (size_t)(p - tok->src);
+    if (tok->type == TOK_NUMBER || tok->type == TOK_STRING) tok->param = lx->literals++;
+    lx->p = p;
+}
+
+int str_ieq(const char *a, const char *b) {
+    while (*a && *b && toupper((unsigned char)*a) == toupper((unsigned char)*b)) a++, b++;
+    return *a == '\0' && *b == '\0';
+}
+
+int parse_where_or(Lexer *lx, const Scope *sc, Where *w) {
+    int left = parse_where_and(lx, sc, w);
+    while (left >= 0 && lx->tok.type == TOK_IDENT && str_ieq(lx->tok.text, "OR")) {
+        lex_next(lx);
+        int right = parse_where_and(lx, sc, w);
+        left = (right < 0) ? -1 : where_combine(w, EXPR_OR, left, right);
+    }
+    return left;
+}
+
+int parse_where_and(Lexer *lx, const Scope *sc, Where *w) {
+    int left = parse_where_predicate(lx, sc, w);
+    while (left >= 0 && lx->tok.type == TOK_IDENT && str_ieq(lx->tok.text, "AND")) {
+        lex_next(lx);
+        int right = parse_where_predicate(lx, sc, w);
+        left = (right < 0) ? -1 : where_combine(w, EXPR_AND, left, right);
+    }
+    return left;
+}
+
+int where_combine(Where *w, ExprKind kind, int left, int right) {
+    if (w->count == MAX_PREDICATES * 2) {
+        reply("WHERE clause is too long.\n");
+        return -1;
+    }
+    Expr *e = &w->nodes[w->count];
+    e->kind = kind;
+    e->left = left;
+    e->right = right;
+    return w->count++;
+}
+
+// Collects the terms of the top-level AND chain, OR subtrees included
+void collect_terms(const Where *w, int node, int *out, int *count) {
+    const Expr *e = &w->nodes[node];
+    if (e->kind == EXPR_AND) {
+        collect_terms(w, e->left, out, count);
+        collect_terms(w, e->right, out, count);
+    } else {
+        out[(*count)++] = node;
+    }
+}
+
+// The table every column under `node` belongs to, or -1 if it mixes both
+int where_side(const Where *w, int node) {
+    const Expr *e = &w->nodes[node];
+    if (e->kind == EXPR_CMP) return e->side;
+    int left = where_side(w, e->left), right = where_side(w, e->right);
+    return (left == right) ? left : -1;
+}
+
+// Copies the subtree under `node` into `dst` and returns its new root
+int where_copy(Where *dst, const Where *src, int node) {
+    const Expr *e = &src->nodes[node];
+    if (e->kind != EXPR_CMP) {
+        int left = where_copy(dst, src, e->left);
+        int right = (left < 0) ? -1 : where_copy(dst, src, e->right);
+        return (right < 0) ? -1 : where_combine(dst, e->kind, left, right);
+    }
+    dst->nodes[dst->count] = *e;
+    return dst->count++;
+}
+
+/**
+ * @brief Divides a join's WHERE clause between its tables: every term of the
+ * top-level AND chain must use the columns of one table, and is evaluated
+ * by that table's scan before the join.
+ */
+int split_where(Plan *plan) {
+    Where all = plan->where;
+    Where *sides[2] = {&plan->where, &plan->join_where};
+    int terms[MAX_PREDICATES * 2], count = 0;
+
+    collect_terms(&all, all.root, terms, &count);
+    for (int i = 0; i < 2; i++) {
+        sides[i]->count = 0;
+        sides[i]->root = -1;
+    }
+    for (int i = 0; i < count; i++) {
+        int side = where_side(&all, terms[i]);
+        if (side < 0) {
+            reply("Each AND term of a join's WHERE clause may only use columns of one table.\n");
+            return -1;
+        }
+        Where *w = sides[side];
+        int node = where_copy(w, &all, terms[i]);
+        if (node >= 0) node = (w->root < 0) ? node : where_combine(w, EXPR_AND, w->root, node);
+        if (node < 0) return -1;
+        w->root = node;
+    }
+    return 0;
+}
+
+// col <op> literal | col LIKE 'prefix%' | ( condition )
+int parse_where_predicate(Lexer *lx, const Scope *sc, Where *w) {
+    if (lx->tok.type == TOK_LPAREN) {
+        lex_next(lx);
+        int node = parse_where_or(lx, sc, w);
+        if (node < 0) return -1;
+        if (lx->tok.type != TOK_RPAREN) {
+            reply("Missing ')' in WHERE clause.\n");
+            return -1;
+        }
+        lex_next(lx);
+        return node;
+    }
+
+    if (lx->tok.type != TOK_IDENT) {
+        reply("Expected a column name in WHERE clause, got '%s'.\n", lx->tok.text);
+        return -1;
+    }
+    int side;
+    int col = resolve_column(sc, lx->tok.text, &side);
+    if (col < 0) return -1;
+    const Table *t = sc->tables[side];
+    if (w->count == MAX_PREDICATES * 2) {
+        reply("WHERE clause is too long.\n");
+        return -1;
+    }
+    Expr *e = &w->nodes[w->count];
+    memset(e, 0, sizeof(*e));
+    e->kind = EXPR_CMP;
+    e->side = side;
+    e->col = col;
+
+    lex_next(lx);
+    const char *op = lx->tok.text;
+    if (lx->tok.type == TOK_IDENT && str_ieq(op, "LIKE")) e->op = OP_PREFIX;
+    else if (lx->tok.type != TOK_OP) {
+        reply("Expected a comparison after '%s'.\n", t->cols[col]);
+        return -1;
+    }
+    else if (strcmp(op, "=") == 0) e->op = OP_EQ;
+    else if (strcmp(op, "!=") == 0 || strcmp(op, "<>") == 0) e->op = OP_NE;
+    else if (strcmp(op, "<") == 0) e->op = OP_LT;
+    else if (strcmp(op, "<=") == 0) e->op = OP_LE;
+    else if (strcmp(op, ">") == 0) e->op = OP_GT;
+    else if (strcmp(op, ">=") == 0) e->op = OP_GE;
+    else {
+        reply("Unknown operator '%s'.\n", op);
+        return -1;
+    }
+
+    lex_next(lx);
+    if (lx->tok.param < 0) {
+        reply("Expected a literal after '%s %s'.\n", t->cols[col], e->op == OP_PREFIX ? "LIKE" : op);
+        return -1;
+    }
+    if (e->op == OP_PREFIX && t->types[col] != COL_TEXT) {
+        reply("LIKE needs a TEXT column.\n");
+        return -1;
+    }
+    e->param = lx->tok.param;
+    lex_next(lx);
+    return w->count++;
+}
+
+/**
+ * @brief Fills in the literal of every comparison from the statement's
+ * parameters. Works on a copy of a plan's WHERE clause.
+ * @return 0 on success, -1 (after printing the reason) otherwise.
+ */
+int bind_where(Where *w, const Table *t, const Params *params) {
+    for (int i = 0; i < w->count; i++) {
+        Expr *e = &w->nodes[i];
+        if (e->kind == EXPR_CMP && bind_literal(e, t, param_text(params, e->param)) != 0) return -1;
+    }
+    return 0;
+}
+
+// Converts a comparison's literal to its column type; LIKE without a trailing '%' becomes '='
+int bind_literal(Expr *e, const Table *t, const char *text) {
+    snprintf(e->text, sizeof(e->text), "%s", text);
+    if (e->op == OP_PREFIX) {
+        size_t len = strlen(e->text);
+        if (strcspn(e->text, "%_") < len - (len > 0 && e->text[len - 1] == '%')) {
+            reply("Only prefix patterns such as 'abc%%' are supported by LIKE.\n");
+            return -1;
+        }
+        if (len > 0 && e->text[len - 1] == '%') e->text[len - 1] = '\0';
+        else e->op = OP_EQ;
+    }
+
+    if (convert_value(t->types[e->col], e->text, strlen(e->text), &e->lit) != 0) {
+        reply("Invalid %s literal '%s'.\n", type_name(t->types[e->col]), e->text);
+        return -1;
+    }
+    return 0;
+}
+
+// --- Filter Kernels ---
+
+/**
+ * @brief Evaluates a WHERE subtree over the current block of a scan, producing
+ * one bit per row. AND skips its right side when the left selects nothing.
+ */
+void eval_where(const Where *w, int node, Scan *s, size_t n, uint64_t *bits) {
+    const Expr *e = &w->nodes[node];
+    size_t words = (n + 63) / 64;
+
+    if (e->kind != EXPR_CMP) {
+        uint64_t rhs[BITMAP_WORDS];
+        uint64_t any = 0;
+        eval_where(w, e->left, s, n, bits);
+        for (size_t i = 0; i < words; i++) any |= bits[i];
+        if (e->kind == EXPR_AND && !any) return;
+        eval_where(w, e->right, s, n, rhs);
+        for (size_t i = 0; i < words; i++) {
+            bits[i] = (e->kind == EXPR_AND) ? (bits[i] & rhs[i]) : (bits[i] | rhs[i]);
+        }
+        return;
+    }
+
+    const ColumnBlock *b = &s->blocks[e->col];
+    memset(bits, 0, BITMAP_WORDS * sizeof(uint64_t));
+    // A DICT column compares each string of its dictionary once, then only looks up codes
+    if (b->dict && (s->code_sets[node] || build_code_set(w, node, s) == 0)) {
+        filter_codes(s, node, b->values, n, bits);
+        return;
+    }
+    switch (s->t->types[e->col]) {
+        case COL_INT: filter_int64((const int64_t *)b->values, n, e->op, e->lit.i, bits); break;
+        case COL_REAL: filter_double((const double *)b->values, n, e->op, e->lit.r, bits); break;
+        case COL_TEXT: filter_text(b, n, e->op, e->lit.s, e->lit.len, bits); break;
+    }
+}
+
+// Every operator is a union of the orderings less/equal/greater it accepts,
+// which lets the kernels build each bit without branching on the operator.
+int op_orderings(CmpOp op) {
+    switch (op) {
+        case OP_EQ: return ORD_EQ;
+        case OP_NE: return ORD_LT | ORD_GT;
+        case OP_LT: return ORD_LT;
+        case OP_LE: return ORD_LT | ORD_EQ;
+        case OP_GT: return ORD_GT;
+        case OP_GE: return ORD_GT | ORD_EQ;
+        default: return ORD_EQ;
+    }
+}
+
+void filter_int64(const int64_t *v, size_t n, CmpOp op, int64_t k, uint64_t *bits) {
+    int ord = op_orderings(op);
+    uint64_t want_lt = (ord & ORD_LT) != 0, want_eq = (ord & ORD_EQ) != 0, want_gt = (ord & ORD_GT) != 0;
+    size_t i = 0;
+#ifdef HAVE_AVX2_KERNELS
+    if (cpu_has_avx2()) i = filter_int64_avx2(v, n, ord, k, bits);
+#endif
+    for (; i < n; i++) {
+        int64_t x = v[i];
+        uint64_t hit = ((x < k) & want_lt) | ((x == k) & want_eq) | ((x > k) & want_gt);
+        bits[i / 64] |= hit << (i % 64);
+    }
+}
+
+void filter_double(const double *v, size_t n, CmpOp op, double k, uint64_t *bits) {
+    int ord = op_orderings(op);
+    uint64_t want_lt = (ord & ORD_LT) != 0, want_eq = (ord & ORD_EQ) != 0, want_gt = (ord & ORD_GT) != 0;
+    size_t i = 0;
+#ifdef HAVE_AVX2_KERNELS
+    if (cpu_has_avx2()) i = filter_double_avx2(v, n, ord, k, bits);
+#endif
+    for (; i < n; i++) {
+        double x = v[i];
+        uint64_t hit = ((x < k) & want_lt) | ((x == k) & want_eq) | ((x > k) & want_gt);
+        bits[i / 64] |= hit << (i % 64);
+    }
+}
+
+int text_matches(const char *str, size_t len, CmpOp op, const char *k, size_t k_len) {
+    if (op == OP_PREFIX) return len >= k_len && memcmp(str, k, k_len) == 0;
+    int cmp = memcmp(str, k, len < k_len ? len : k_len);
+    if (cmp == 0) cmp = (len > k_len) - (len < k_len);
+    return (op_orderings(op) & (cmp < 0 ? ORD_LT : cmp > 0 ? ORD_GT : ORD_EQ)) != 0;
+}
+
+void filter_text(const ColumnBlock *b, size_t n, CmpOp op, const char *k, size_t k_len, uint64_t *bits) {
+    for (size_t r = 0; r < n; r++) {
+        size_t len;
+        const char *str = block_text(b, r, &len);
+        uint64_t hit = (uint64_t)text_matches(str, len, op, k, k_len);
+        bits[r / 64] |= hit << (r % 64);
+    }
+}
+
+// Records which codes of a DICT column satisfy the comparison at `node`
+int build_code_set(const Where *w, int node, Scan *s) {
+    const Expr *e = &w->nodes[node];
+    const Dict *d = s->dicts[e->col];
+    uint64_t *set = calloc(d->count / 64 + 1, sizeof(uint64_t));
+    if (!set) return -1;
+    s->code_matches[node] = 0;
+    for (uint32_t code = d->count; code-- > 0;) {
+        size_t len;
+        const char *str = dict_text(d, code, &len);
+        if (!text_matches(str, len, e->op, e->lit.s, e->lit.len)) continue;
+        set[code / 64] |= 1ULL << (code % 64);
+        s->code_matches[node]++;
+        s->code_first[node] = code;
+    }
+    s->code_sets[node] = set;
+    return 0;
+}
+
+/**
+ * @brief Selects the rows whose code is in the set built for `node`. One
+ * accepted code (the usual equality test) becomes an integer comparison.
+ */
+void filter_codes(const Scan *s, int node, const uint64_t *codes, size_t n, uint64_t *bits) {
+    const uint64_t *set = s->code_sets[node];
+    if (s->code_matches[node] == 0) return;
+    if (s->code_matches[node] == 1) {
+        filter_int64((const int64_t *)codes, n, OP_EQ, s->code_first[node], bits);
+        return;
+    }
+    for (size_t r = 0; r < n; r++) {
+        uint64_t code = codes[r];
+        bits[r / 64] |= ((set[code / 64] >> (code % 64)) & 1) << (r % 64);
+    }
+}
+
+#ifdef HAVE_AVX2_KERNELS
+int cpu_has_avx2(void) {
+    static int has_avx2 = -1;
+    if (has_avx2 < 0) {
+        __builtin_cpu_init();
+        has_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    return has_avx2;
+}
+
+// The AVX2 kernels compare four rows per instruction and return how many rows
+// they covered; the scalar loop finishes the remainder.
+__attribute__((target("avx2")))
+size_t filter_int64_avx2(const int64_t *v, size_t n, int ord, int64_t k, uint64_t *bits) {
+    const __m256i key = _mm256_set1_epi64x(k);
+    const int want_lt = (ord & ORD_LT) ? 0xF : 0, want_eq = (ord & ORD_EQ) ? 0xF : 0, want_gt = (ord & ORD_GT) ? 0xF : 0;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(v + i));
+        int lt = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(key, x)));
+        int eq = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(x, key)));
+        int gt = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(x, key)));
+        uint64_t hits = (uint64_t)((lt & want_lt) | (eq & want_eq) | (gt & want_gt));
+        bits[i / 64] |= hits << (i % 64);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+size_t filter_double_avx2(const double *v, size_t n, int ord, double k, uint64_t *bits) {
+    const __m256d key = _mm256_set1_pd(k);
+    const int want_lt = (ord & ORD_LT) ? 0xF : 0, want_eq = (ord & ORD_EQ) ? 0xF : 0, want_gt = (ord & ORD_GT) ? 0xF : 0;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d x = _mm256_loadu_pd(v + i);
+        int lt = _mm256_movemask_pd(_mm256_cmp_pd(x, key, _CMP_LT_OQ));
+        int eq = _mm256_movemask_pd(_mm256_cmp_pd(x, key, _CMP_EQ_OQ));
+        int gt = _mm256_movemask_pd(_mm256_cmp_pd(x, key, _CMP_GT_OQ));
+        uint64_t hits = (uint64_t)((lt & want_lt) | (eq & want_eq) | (gt & want_gt));
+        bits[i / 64] |= hits << (i % 64);
+    }
+    return i;
+}
+#endif
+
+// --- Bulk Writes ---
+
+/**
+ * @brief Prepares to append rows to a table. Each column and heap file gets a
+ * large write buffer positioned at the current row count, which is copied
+ * into the buffer pool as it fills. The rows are logged under log
+ * transaction `txn` as they are added. The caller holds the table's writer lock.
+ */
+int appender_open(Appender *a, Table *t, uint64_t txn) {
+    memset(a, 0, sizeof(*a));
+    a->t = t;
+    a->row_count = t->header.row_count;
+    a->txn = txn;
+    for (int c = 0; c < MAX_COLS; c++) a->col_out[c].file = a->heap_out[c].file = a->zone_file[c] = -1;
+    for (int i = 0; i < MAX_INDEXES; i++) a->indexes[i].file = -1;
+    // Reserve the front of the batch for the ROWS record's table name, first row and count
+    a->batch_len = sizeof(uint16_t) + strlen(t->name) + sizeof(uint64_t) + sizeof(uint32_t);
+    if (t->index_count > 0) {
+        // Index pages change in place before the commit, so recovery must know
+        // to rebuild them even if this transaction never logs a row
+        char name[sizeof(uint16_t) + MAX_TABLE_NAME];
+        wal_append(WAL_BEGIN, a->txn, name, (uint32_t)wal_put_name(name, t->name));
+        if (wal_write() != 0) return -1;
+    }
+
+    for (int c = 0; c < t->col_count; c++) {
+        char path[MAX_PATH_LEN];
+        if (is_dict(t, c)) {
+            // New dictionary entries go after the last valid one
+            column_path(path, t->name, c, "heap");
+            if (codes_open(a, c) != 0 || writer_open(&a->heap_out[c], path, 0) != 0 ||
+                dict_load(&a->dicts[c], a->heap_out[c].file, 1) != 0) goto fail;
+            a->heap_out[c].off = a->dicts[c].size;
+        } else {
+            // Writing at the row slot overwrites anything left past the row count
+            column_path(path, t->name, c, "col");
+            if (writer_open(&a->col_out[c], path, a->row_count * sizeof(uint64_t)) != 0) goto fail;
+        }
+
+        if (t->types[c] == COL_TEXT && !is_dict(t, c)) {
+            if (a->row_count > 0 && pool_read(a->col_out[c].file, (a->row_count - 1) * sizeof(uint64_t),
+                                              &a->heap_end[c], sizeof(uint64_t), 0) != 0) goto fail;
+            column_path(path, t->name, c, "heap");
+            if (writer_open(&a->heap_out[c], path, a->heap_end[c]) != 0) goto fail;
+        }
+
+        // The entry of a partly filled last block is carried on if it covers
+        // the block's rows; otherwise that block stays unknown
+        column_path(path, t->name, c, "zone");
+        if (access(path, F_OK) != 0) {
+            int fd = open(path, O_RDWR | O_CREAT, 0644);
+            if (fd < 0) goto fail;
+            close(fd);
+        }
+        if ((a->zone_file[c] = pool_file(path)) < 0) goto fail;
+        uint64_t in_block = a->row_count % BLOCK_ROWS;
+        if (in_block > 0) {
+            ZoneEntry *z = &a->zones[c];
+            if (pool_read(a->zone_file[c], (a->row_count / BLOCK_ROWS) * sizeof(ZoneEntry), z, sizeof(*z), 0) != 0 || z->rows < in_block) {
+                z->rows = UINT64_MAX;
+            } else {
+                z->rows = in_block;
+            }
+        }
+    }
+    for (int i = 0; i < t->index_count; i++) {
+        if (index_open(&a->indexes[i], t, &t->indexes[i]) != 0) goto fail;
+    }
+
+    // New values of a column still in ascending order are checked against its last one
+    a->sorted = t->header.sorted_cols;
+    for (int c = 0; c < t->col_count; c++) {
+        uint64_t last;
+        if (!((a->sorted >> c) & 1) || a->row_count == 0) continue;
+        if (pool_read(a->col_out[c].file, (a->row_count - 1) * sizeof(uint64_t), &last, sizeof(last), 0) != 0) goto fail;
+        if (t->types[c] == COL_INT) memcpy(&a->last[c].i, &last, sizeof(last));
+        else memcpy(&a->last[c].r, &last, sizeof(last));
+    }
+    return 0;
+
+fail:
+    appender_close(a, 0);
+    return -1;
+}
+
+int appender_add(Appender *a, const Value *vals) {
+    const Table *t = a->t;
+    for (int c = 0; c < t->col_count; c++) {
+        int rc;
+        switch (t->types[c]) {
+            case COL_INT:
+                rc = writer_put(&a->col_out[c], &vals[c].i, sizeof(int64_t));
+                if (a->row_count > 0 && vals[c].i < a->last[c].i) a->sorted &= (uint16_t)~(1u << c);
+                a->last[c].i = vals[c].i;
+                break;
+            case COL_REAL:
+                rc = writer_put(&a->col_out[c], &vals[c].r, sizeof(double));
+                // NaN is out of order wherever it appears
+                if (vals[c].r != vals[c].r || (a->row_count > 0 && vals[c].r < a->last[c].r)) a->sorted &= (uint16_t)~(1u << c);
+                a->last[c].r = vals[c].r;
+                break;
+            default:
+                if (is_dict(t, c)) {
+                    int64_t code = dict_code(a, c, &vals[c]);
+                    rc = (code < 0) ? -1 : codes_put(a, c, (uint64_t)code);
+                    break;
+                }
+                if (writer_put(&a->heap_out[c], vals[c].s, vals[c].len) != 0) return -1;
+                a->heap_end[c] += vals[c].len;
+                rc = writer_put(&a->col_out[c], &a->heap_end[c], sizeof(uint64_t));
+                break;
+        }
+        if (rc != 0) return -1;
+        zone_add(&a->zones[c], t->types[c], &vals[c]);
+    }
+
+    // Index entries are added before the header so a crash never leaves a
+    // visible row unindexed; entries for rows past the row count are ignored.
+    for (int i = 0; i < t->index_count; i++) {
+        int col = t->indexes[i].col;
+        if (index_insert(&a->indexes[i], index_key(t->types[col], &vals[col]), a->row_count) < 0) return -1;
+    }
+    a->row_count++;
+    if (a->row_count % BLOCK_ROWS == 0) {
+        for (int c = 0; c < t->col_count; c++) {
+            if (zone_write(a, c) != 0) return -1;
+            memset(&a->zones[c], 0, sizeof(ZoneEntry));
+        }
+    }
+
+    if (a->replay) return 0;
+    if (wal_encode_row(a, vals) != 0) return -1;
+    if (a->batch_len >= WAL_BATCH_BYTES && wal_flush_batch(a) != 0) return -1;
+    return 0;
+}
+
+/**
+ * @brief Copies every buffered byte into the pool and closes every file. With
+ * `commit` set the remaining rows and a COMMIT record are logged, at a->lsn;
+ * the caller then waits for the log (wal_commit) and publishes the new row
+ * count (publish_tables). Without it the rows never become visible.
+ */
+int appender_close(Appender *a, int commit) {
+    int rc = 0;
+    for (int c = 0; c < MAX_COLS; c++) {
+        // The last byte of codes is written even when only partly filled
+        char last = (char)a->code_acc[c];
+        if (a->code_fill[c] > 0 && a->col_out[c].file >= 0 && writer_put(&a->col_out[c], &last, 1) != 0) rc = -1;
+        a->code_fill[c] = 0;
+        dict_free(&a->dicts[c]);
+        if (writer_close(&a->col_out[c]) != 0) rc = -1;
+        if (writer_close(&a->heap_out[c]) != 0) rc = -1;
+        if (a->zone_file[c] < 0) continue;
+        // A rolled-back append only widens the zone of the block it ends in
+        if (a->row_count % BLOCK_ROWS != 0 && zone_write(a, c) != 0) rc = -1;
+        pool_release(a->zone_file[c]);
+        a->zone_file[c] = -1;
+    }
+    for (int i = 0; i < MAX_INDEXES; i++) {
+        if (a->indexes[i].file >= 0 && index_close(&a->indexes[i]) != 0) rc = -1;
+    }
+    if (commit && rc == 0 && !a->replay) {
+        char payload[sizeof(uint16_t) + MAX_TABLE_NAME + sizeof(uint64_t) + sizeof(uint32_t)];
+        size_t len = wal_put_name(payload, a->t->name);
+        memcpy(payload + len, &a->row_count, sizeof(a->row_count));
+        memcpy(payload + len + sizeof(a->row_count), &a->more, sizeof(a->more));
+        // Rows that never reached the log must not be committed
+        if (wal_flush_batch(a) != 0) rc = -1;
+        else a->lsn = wal_append(WAL_COMMIT, a->txn, payload, (uint32_t)(len + sizeof(a->row_count) + sizeof(a->more)));
+    }
+    free(a->batch);
+    a->batch = NULL;
+    return rc;
+}
+
+/**
+ * @brief Copies what an open appender has buffered into the pool, so its own
+ * transaction can read the rows: the writers' buffers, the partly filled last
+ * byte of each DICT column and the zone entry of the last block. The appender
+ * carries on where it was.
+ */
+int appender_sync(Appender *a) {
+    int rc = 0;
+    for (int c = 0; c < a->t->col_count; c++) {
+        if (writer_flush(&a->col_out[c]) != 0 || writer_flush(&a->heap_out[c]) != 0) rc = -1;
+        char last = (char)a->code_acc[c];
+        if (a->code_fill[c] > 0 && pool_write(a->col_out[c].file, a->col_out[c].off, &last, 1) != 0) rc = -1;
+        if (a->zone_file[c] >= 0 && a->row_count % BLOCK_ROWS != 0 && zone_write(a, c) != 0) rc = -1;
+    }
+    return rc;
+}
+
+int writer_open(ColumnWriter *w, const char *path, uint64_t off) {
+    w->file = pool_file(path);
+    w->off = off;
+    w->len = 0;
+    w->buf = malloc(WRITE_BUFFER_SIZE);
+    return (w->file >= 0 && w->buf) ? 0 : -1;
+}
+
+int writer_put(ColumnWriter *w, const void *data, size_t len) {
+    if (w->len + len > WRITE_BUFFER_SIZE) {
+        if (pool_write(w->file, w->off, w->buf, w->len) != 0) return -1;
+        w->off += w->len;
+        w->len = 0;
+    }
+    if (len > WRITE_BUFFER_SIZE) {
+        if (pool_write(w->file, w->off, data, len) != 0) return -1;
+        w->off += len;
+        return 0;
+    }
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+    return 0;
+}
+
+// Copies the buffered bytes into the pool and carries on after them
+int writer_flush(ColumnWriter *w) {
+    if (w->file < 0 || w->len == 0) return 0;
+    if (pool_write(w->file, w->off, w->buf, w->len) != 0) return -1;
+    w->off += w->len;
+    w->len = 0;
+    return 0;
+}
+
+int writer_close(ColumnWriter *w) {
+    int rc = 0;
+    if (w->file >= 0 && w->buf && w->len > 0) rc = pool_write(w->file, w->off, w->buf, w->len);
+    if (w->file >= 0) pool_release(w->file);
+    free(w->buf);
+    w->buf = NULL;
+    w->file = -1;
+    return rc;
+}
+
+/**
+ * @brief Splits one CSV line in place. Quoted fields may contain commas and
+ * "" for a literal quote; unquoted fields are trimmed.
+ * @return The number of fields.
+ */
+int csv_split(char *line, char **fields, int max_fields) {
+    int count = 0;
+    char *p = line;
+    while (count < max_fields) {
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '"') {
+            char *out = ++p;
+            fields[count++] = out;
+            while (*p) {
+                if (*p == '"' && p[1] == '"') p++;
+                else if (*p == '"') break;
+                *out++ = *p++;
+            }
+            if (*p == '"') p++;
+            while (*p && *p != ',') p++;
+            int at_end = (*p == '\0');
+            *out = '\0';
+            if (at_end) break;
+            p++;
+        } else {
+            fields[count++] = p;
+            p += strcspn(p, ",");
+            int at_end = (*p == '\0');
+            *p = '\0';
+            trim_whitespace(fields[count - 1]);
+            if (at_end) break;
+            p++;
+        }
+    }
+    return count;
+}
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// --- B+-Tree Indexes ---
+
+/**
+ * @brief Order-preserving 64-bit key for a value: comparing keys as unsigned
+ * integers orders INT and REAL values exactly and TEXT values by their first
+ * eight bytes. TEXT matches are therefore rechecked against the WHERE clause.
+ */
+uint64_t index_key(ColType type, const Value *v) {
+    uint64_t bits;
+    switch (type) {
+        case COL_INT:
+            return (uint64_t)v->i ^ (1ULL << 63);
+        case COL_REAL:
+            memcpy(&bits, &v->r, sizeof(bits));
+            return (bits & (1ULL << 63)) ? ~bits : bits | (1ULL << 63);
+        default:
+            bits = 0;
+            for (size_t i = 0; i < 8; i++) {
+                bits = (bits << 8) | (i < v->len ? (unsigned char)v->s[i] : 0);
+            }
+            return bits;
+    }
+}
+
+// Key of row r in the current block of a scan
+uint64_t block_key(const Scan *s, int col, size_t r) {
+    Value v;
+    memset(&v, 0, sizeof(v));
+    switch (s->t->types[col]) {
+        case COL_INT: v.i = ((const int64_t *)s->blocks[col].values)[r]; break;
+        case COL_REAL: v.r = ((const double *)s->blocks[col].values)[r]; break;
+        case COL_TEXT: v.s = block_text(&s->blocks[col], r, &v.len); break;
+    }
+    return index_key(s->t->types[col], &v);
+}
+
+int entry_cmp(const IndexEntry *a, const IndexEntry *b) {
+    if (a->key != b->key) return a->key < b->key ? -1 : 1;
+    if (a->row != b->row) return a->row < b->row ? -1 : 1;
+    return 0;
+}
+
+int entry_qsort_cmp(const void *a, const void *b) {
+    return entry_cmp((const IndexEntry *)a, (const IndexEntry *)b);
+}
+
+void index_path(char *buf, const char *table_name, const char *index_name) {
+    snprintf(buf, MAX_PATH_LEN, "%s.%s.bpt", table_name, index_name);
+}
+
+int index_open(Index *ix, const Table *t, const IndexDef *def) {
+    char path[MAX_PATH_LEN];
+    index_path(path, t->name, def->name);
+    ix->file = pool_file(path);
+    if (ix->file < 0) return -1;
+    if (pool_read(ix->file, 0, &ix->meta, sizeof(ix->meta), 0) != 0 ||
+        memcmp(ix->meta.magic, INDEX_MAGIC, sizeof(ix->meta.magic)) != 0) {
+        pool_release(ix->file);
+        ix->file = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Stores the meta page of an index opened for writing
+int index_close(Index *ix) {
+    int rc = 0;
+    if (ix->file >= 0) {
+        if (pool_write(ix->file, 0, &ix->meta, sizeof(ix->meta)) != 0) rc = -1;
+        pool_release(ix->file);
+    }
+    ix->file = -1;
+    return rc;
+}
+
+int page_read(Index *ix, uint64_t page_no, IndexPage *page) {
+    return pool_read(ix->file, page_no * BPT_PAGE_SIZE, page, BPT_PAGE_SIZE, 0);
+}
+
+int page_write(Index *ix, uint64_t page_no, const IndexPage *page) {
+    return pool_write(ix->file, page_no * BPT_PAGE_SIZE, page, BPT_PAGE_SIZE);
+}
+
+// Number of separators <= e, i.e. the child of an inner page that covers e
+uint32_t inner_child_slot(const IndexPage *page, const IndexEntry *e) {
+    uint32_t lo = 0, hi = page->count;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (entry_cmp(&page->inner[mid].sep, e) <= 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+uint64_t inner_child(const IndexPage *page, uint32_t slot) {
+    return slot == 0 ? page->next : page->inner[slot - 1].child;
+}
+
+// Position of the first leaf entry >= e
+uint32_t leaf_lower_bound(const IndexPage *page, const IndexEntry *e) {
+    uint32_t lo = 0, hi = page->count;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (entry_cmp(&page->entries[mid], e) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * @brief Inserts e below page_no. A page that is already full is split before
+ * the insert; the caller then receives the new right sibling and its first key.
+ * @return 1 if the page split, 0 if not, -1 on I/O error.
+ */
+int index_insert_at(Index *ix, uint64_t page_no, const IndexEntry *e, IndexEntry *up_sep, uint64_t *up_page) {
+    IndexPage page, right;
+    if (page_read(ix, page_no, &page) != 0) return -1;
+
+    if (page.is_leaf) {
+        uint32_t pos = leaf_lower_bound(&page, e);
+        if (page.count < BPT_LEAF_MAX) {
+            memmove(&page.entries[pos + 1], &page.entries[pos], (page.count - pos) * sizeof(IndexEntry));
+            page.entries[pos] = *e;
+            page.count++;
+            return page_write(ix, page_no, &page);
+        }
+
+        // Split the full leaf in half, then insert into the proper side
+        uint64_t right_no = ix->meta.page_count++;
+        uint32_t half = page.count / 2;
+        memset(&right, 0, sizeof(right));
+        right.is_leaf = 1;
+        right.count = page.count - half;
+        memcpy(right.entries, &page.entries[half], right.count * sizeof(IndexEntry));
+        right.next = page.next;
+        page.count = half;
+        page.next = right_no;
+
+        IndexPage *target = (pos <= half) ? &page : &right;
+        if (target == &right) pos -= half;
+        memmove(&target->entries[pos + 1], &target->entries[pos], (target->count - pos) * sizeof(IndexEntry));
+        target->entries[pos] = *e;
+        target->count++;
+
+        if (page_write(ix, page_no, &page) != 0 || page_write(ix, right_no, &right) != 0) return -1;
+        *up_sep = right.entries[0];
+        *up_page = right_no;
+        return 1;
+    }
+
+    uint32_t slot = inner_child_slot(&page, e);
+    IndexEntry sep;
+    uint64_t child_no;
+    int split = index_insert_at(ix, inner_child(&page, slot), e, &sep, &child_no);
+    if (split <= 0) return split;
+
+    if (page.count == BPT_INNER_MAX) {
+        // Move the upper half of the separators to a new sibling; the middle
+        // separator moves up to the parent.
+        uint64_t right_no = ix->meta.page_count++;
+        uint32_t mid = page.count / 2;
+        memset(&right, 0, sizeof(right));
+        right.is_leaf = 0;
+        right.next = page.inner[mid].child;
+        right.count = page.count - mid - 1;
+        memcpy(right.inner, &page.inner[mid + 1], right.count * sizeof(page.inner[0]));
+        *up_sep = page.inner[mid].sep;
+        *up_page = right_no;
+        page.count = mid;
+
+        IndexPage *target = (entry_cmp(&sep, up_sep) < 0) ? &page : &right;
+        slot = inner_child_slot(target, &sep);
+        memmove(&target->inner[slot + 1], &target->inner[slot], (target->count - slot) * sizeof(page.inner[0]));
+        target->inner[slot].sep = sep;
+        target->inner[slot].child = child_no;
+        target->count++;
+
+        if (page_write(ix, page_no, &page) != 0 || page_write(ix, right_no, &right) != 0) return -1;
+        return 1;
+    }
+
+    memmove(&page.inner[slot + 1], &page.inner[slot], (page.count - slot) * sizeof(page.inner[0]));
+    page.inner[slot].sep = sep;
+    page.inner[slot].child = child_no;
+    page.count++;
+    return page_write(ix, page_no, &page);
+}
+
+int index_insert(Index *ix, uint64_t key, uint64_t row) {
+    IndexEntry e = {key, row}, sep;
+    uint64_t right_no;
+    int split = index_insert_at(ix, ix->meta.root, &e, &sep, &right_no);
+    if (split <= 0) return split;
+
+    // The root split: grow the tree by one level
+    IndexPage root;
+    memset(&root, 0, sizeof(root));
+    root.is_leaf = 0;
+    root.count = 1;
+    root.next = ix->meta.root;
+    root.inner[0].sep = sep;
+    root.inner[0].child = right_no;
+    ix->meta.root = ix->meta.page_count++;
+    ix->meta.height++;
+    return page_write(ix, ix->meta.root, &root);
+}
+
+/**
+ * @brief Collects the rows whose keys fall in [lo, hi], stopping early once
+ * more than `limit` rows match.
+ * @return The number of rows written to *rows, or -1 if the limit was exceeded
+ * or the index could not be read.
+ */
+long index_range(Index *ix, uint64_t lo, uint64_t hi, uint64_t limit, uint64_t **rows) {
+    IndexPage page;
+    IndexEntry start = {lo, 0};
+    uint64_t page_no = ix->meta.root;
+    size_t count = 0, cap = 64;
+
+    *rows = malloc(cap * sizeof(uint64_t));
+    if (!*rows) return -1;
+    for (;;) {
+        if (page_read(ix, page_no, &page) != 0) goto fail;
+        if (page.is_leaf) break;
+        page_no = inner_child(&page, inner_child_slot(&page, &start));
+    }
+
+    uint32_t pos = leaf_lower_bound(&page, &start);
+    for (;;) {
+        for (; pos < page.count; pos++) {
+            if (page.entries[pos].key > hi) return (long)count;
+            if (count == limit) goto fail;
+            if (count == cap) {
+                uint64_t *grown = realloc(*rows, cap * 2 * sizeof(uint64_t));
+                if (!grown) goto fail;
+                *rows = grown;
+                cap *= 2;
+            }
+            (*rows)[count++] = page.entries[pos].row;
+        }
+        if (page.next == 0) return (long)count;
+        if (page_read(ix, page.next, &page) != 0) goto fail;
+        pos = 0;
+    }
+
+fail:
+    free(*rows);
+    *rows = NULL;
+    return -1;
+}
+
+/**
+ * @brief Builds an index file bottom-up from entries sorted by (key, row):
+ * full leaves first, then each inner level over the one below.
+ */
+int index_build(const char *path, int col, IndexEntry *entries, size_t count) {
+    Index ix;
+    IndexPage page;
+    size_t level_count = 0;
+    uint64_t *level_pages = malloc((count / BPT_LEAF_MAX + 1) * sizeof(uint64_t));
+    IndexEntry *level_keys = malloc((count / BPT_LEAF_MAX + 1) * sizeof(IndexEntry));
+    int rc = -1;
+
+    memset(&ix, 0, sizeof(ix));
+    pool_drop_file(path);
+    FILE *fp = fopen(path, "wb");
+    if (fp) fclose(fp);
+    ix.file = fp ? pool_file(path) : -1;
+    if (ix.file < 0 || !level_pages || !level_keys) goto done;
+    memcpy(ix.meta.magic, INDEX_MAGIC, sizeof(ix.meta.magic));
+    ix.meta.version = TABLE_VERSION;
+    ix.meta.col = (uint32_t)col;
+    ix.meta.page_count = 1;
+    ix.meta.height = 1;
+
+    size_t i = 0;
+    do {
+        size_t n = (count - i < BPT_LEAF_MAX) ? count - i : BPT_LEAF_MAX;
+        memset(&page, 0, sizeof(page));
+        page.is_leaf = 1;
+        page.count = (uint32_t)n;
+        memcpy(page.entries, &entries[i], n * sizeof(IndexEntry));
+        uint64_t page_no = ix.meta.page_count++;
+        page.next = (i + n < count) ? page_no + 1 : 0;
+        if (page_write(&ix, page_no, &page) != 0) goto done;
+        if (n > 0) level_keys[level_count] = entries[i];
+        level_pages[level_count++] = page_no;
+        i += n;
+    } while (i < count);
+
+    while (level_count > 1) {
+        size_t out = 0;
+        for (i = 0; i < level_count; ) {
+            size_t n = (level_count - i < BPT_INNER_MAX + 1) ? level_count - i : BPT_INNER_MAX + 1;
+            memset(&page, 0, sizeof(page));
+            page.is_leaf = 0;
+            page.next = level_pages[i];
+            page.count = (uint32_t)(n - 1);
+            for (size_t j = 1; j < n; j++) {
+                page.inner[j - 1].sep = level_keys[i + j];
+                page.inner[j - 1].child = level_pages[i + j];
+            }
+            uint64_t page_no = ix.meta.page_count++;
+            if (page_write(&ix, page_no, &page) != 0) goto done;
+            level_keys[out] = level_keys[i];
+            level_pages[out++] = page_no;
+            i += n;
+        }
+        level_count = out;
+        ix.meta.height++;
+    }
+    ix.meta.root = level_pages[0];
+    rc = 0;
+
+done:
+    if (ix.file >= 0 && index_close(&ix) != 0) rc = -1;
+    free(level_pages);
+    free(level_keys);
+    return rc;
+}
+
+/**
+ * @brief Builds (or rebuilds) an index file from a full scan of its column.
+ * The file is written under a temporary name and synced before it replaces
+ * the old one, so a failed build never leaves a half index.
+ * @return 0 on success, -1 (after printing the reason) otherwise.
+ */
+int build_index(const Table *t, const char *index_name, int col) {
+    char path[MAX_PATH_LEN], tmp_path[MAX_PATH_LEN + 4];
+    int needed[MAX_COLS] = {0};
+    Scan scan;
+
+    uint64_t row_count = t->header.row_count;
+    IndexEntry *entries = malloc((row_count ? row_count : 1) * sizeof(IndexEntry));
+    needed[col] = 1;
+    if (!entries) {
+        reply("Not enough memory to index %llu rows.\n", (unsigned long long)row_count);
+        return -1;
+    }
+    if (scan_open(&scan, t, needed) != 0) {
+        reply("Table '%s' is missing column data.\n", t->name);
+        free(entries);
+        return -1;
+    }
+    for (uint64_t start = 0; start < row_count; start += BLOCK_ROWS) {
+        size_t n = (row_count - start < BLOCK_ROWS) ? (size_t)(row_count - start) : BLOCK_ROWS;
+        if (scan_read_block(&scan, start, n) != 0) {
+            reply("Table '%s' is missing column data.\n", t->name);
+            scan_close(&scan);
+            free(entries);
+            return -1;
+        }
+        for (size_t r = 0; r < n; r++) {
+            entries[start + r].key = block_key(&scan, col, r);
+            entries[start + r].row = start + r;
+        }
+    }
+    scan_close(&scan);
+    qsort(entries, row_count, sizeof(IndexEntry), entry_qsort_cmp);
+
+    index_path(path, t->name, index_name);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    int rc = index_build(tmp_path, col, entries, row_count);
+    free(entries);
+    if (rc == 0) rc = sync_path(tmp_path);
+    // The pool forgets both names: the old file's pages are stale after the rename
+    pool_drop_file(tmp_path);
+    pool_drop_file(path);
+    if (rc != 0 || rename(tmp_path, path) != 0) {
+        reply_error("Error writing index");
+        remove(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+void handle_create_index(const Plan *plan) {
+    const char *index_name = plan->index_name;
+    int col = plan->index_col;
+    Table t;
+
+    // The index is built from the latest rows, which no writer may add to meanwhile
+    int lock_fd = table_lock_open(plan->table, 1);
+    if (lock_fd < 0) return;
+    if (table_refresh(plan->table, &t) != 0) {
+        close(lock_fd);
+        return;
+    }
+    for (int i = 0; i < t.index_count; i++) {
+        if (strcmp(t.indexes[i].name, index_name) == 0) {
+            reply("Index '%s' already exists.\n", index_name);
+            close(lock_fd);
+            return;
+        }
+    }
+    if (t.index_count == MAX_INDEXES) {
+        reply("Table '%s' already has %d indexes.\n", t.name, MAX_INDEXES);
+        close(lock_fd);
+        return;
+    }
+    if (build_index(&t, index_name, col) != 0) {
+        close(lock_fd);
+        return;
+    }
+
+    char registry[MAX_PATH_LEN];
+    sprintf(registry, "%s.idx", t.name);
+    FILE *fp = fopen(registry, "a");
+    if (!fp) {
+        reply_error("Error registering index");
+        close(lock_fd);
+        return;
+    }
+    fprintf(fp, "%s %s\n", index_name, t.cols[col]);
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) reply_error("Error registering index");
+    fclose(fp);
+    catalog_invalidate(t.name);
+    close(lock_fd);
+
+    reply("Index '%s' created on %s(%s), %llu rows.\n", index_name, t.name, t.cols[col],
+           (unsigned long long)t.header.row_count);
+}
+
+void collect_conjuncts(const Where *w, int node, int *out, int *count) {
+    const Expr *e = &w->nodes[node];
+    if (e->kind == EXPR_AND) {
+        collect_conjuncts(w, e->left, out, count);
+        collect_conjuncts(w, e->right, out, count);
+    } else if (e->kind == EXPR_CMP) {
+        out[(*count)++] = node;
+    }
+}
+
+/**
+ * @brief Fetches the rows an index bounds a WHERE clause to. The clause itself
+ * is re-evaluated on each fetched row.
+ * @return The sorted candidate row count, or -1 if the query should scan.
+ */
+long plan_index_lookup(const Table *t, const Where *w, uint64_t **rows) {
+    uint64_t best_lo, best_hi;
+    int best = plan_index_choice(t, w, &best_lo, &best_hi);
+    if (best < 0) return -1;
+    if (best_lo > best_hi) {
+        *rows = NULL;
+        return 0;
+    }
+
+    // A writer changing the index holds its latch; the query scans rather than wait
+    int latch = index_latch(t);
+    if (latch < 0) return -1;
+
+    // Fetching rows one by one only wins while the range is selective
+    Index ix;
+    if (index_open(&ix, t, &t->indexes[best]) != 0) {
+        close(latch);
+        return -1;
+    }
+    long count = index_range(&ix, best_lo, best_hi, t->header.row_count / INDEX_SELECTIVITY + 1, rows);
+    pool_release(ix.file);
+    close(latch);
+    if (count > 0) qsort(*rows, (size_t)count, sizeof(uint64_t), row_qsort_cmp);
+    return count;
+}
+
+/**
+ * @brief Looks for an index that bounds the rows a WHERE clause can match. Only
+ * predicates that every match must satisfy (the top-level AND chain) are used,
+ * and an index with an equality bound is preferred. Bounds are inclusive.
+ * @return The index's position in t->indexes, or -1 if none helps.
+ */
+int plan_index_choice(const Table *t, const Where *w, uint64_t *lo_out, uint64_t *hi_out) {
+    int conj[MAX_PREDICATES * 2];
+    int conj_count = 0;
+    int best = -1, best_point = 0;
+
+    if (w->root < 0 || t->index_count == 0) return -1;
+    collect_conjuncts(w, w->root, conj, &conj_count);
+
+    for (int i = 0; i < t->index_count; i++) {
+        uint64_t lo = 0, hi = UINT64_MAX;
+        int bounded = 0;
+        int col = t->indexes[i].col;
+        for (int j = 0; j < conj_count; j++) {
+            const Expr *e = &w->nodes[conj[j]];
+            if (e->col != col || e->op == OP_NE) continue;
+            uint64_t k = index_key(t->types[col], &e->lit);
+            if (e->op == OP_PREFIX) {
+                Value high = e->lit;
+                char padded[8];
+                memset(padded, 0xFF, sizeof(padded));
+                memcpy(padded, e->lit.s, e->lit.len < 8 ? e->lit.len : 8);
+                high.s = padded;
+                high.len = 8;
+                if (k > lo) lo = k;
+                k = index_key(COL_TEXT, &high);
+                if (k < hi) hi = k;
+            } else {
+                if ((e->op == OP_EQ || e->op == OP_GT || e->op == OP_GE) && k > lo) lo = k;
+                if ((e->op == OP_EQ || e->op == OP_LT || e->op == OP_LE) && k < hi) hi = k;
+            }
+            bounded = 1;
+        }
+        if (bounded && (best < 0 || (lo == hi && !best_point))) {
+            best = i;
+            *lo_out = lo;
+            *hi_out = hi;
+            best_point = (lo == hi);
+        }
+    }
+    return best;
+}
+
+int row_qsort_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// --- Buffer Pool ---
+
+/**
+ * @brief Sets up the frame table and page hash. Frame buffers are allocated
+ * on first use, up to the memory budget.
+ */
+int pool_init(size_t budget) {
+    pool.frames = calloc(POOL_MAX_FRAMES, sizeof(Frame));
+    pool.buckets = malloc(POOL_MAX_FRAMES * sizeof(int));
+    if (!pool.frames || !pool.buckets) return -1;
+    for (int i = 0; i < POOL_MAX_FRAMES; i++) pool.buckets[i] = -1;
+    for (int i = 0; i < POOL_MAX_FILES; i++) pool.files[i].fd = -1;
+    pool_set_budget(budget);
+    return 0;
+}
+
+// Flushes every dirty page and closes every file
+void pool_shutdown(void) {
+    pool_flush(-1);
+    pthread_mutex_lock(&pool.lock);
+    for (int i = 0; i < POOL_MAX_FILES; i++) {
+        if (pool.files[i].fd >= 0) pool_close_file(i);
+    }
+    for (int i = 0; i < pool.frame_count; i++) free(pool.frames[i].data);
+    pool.frame_count = 0;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/**
+ * @brief Changes the memory budget. Shrinking writes back and releases the
+ * frames past the new limit; pinned frames are left until a later call.
+ */
+int pool_set_budget(size_t budget) {
+    int limit = (int)(budget / POOL_PAGE_SIZE);
+    int rc = 0;
+    if (limit < POOL_MIN_FRAMES) limit = POOL_MIN_FRAMES;
+    if (limit > POOL_MAX_FRAMES) limit = POOL_MAX_FRAMES;
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.frame_count > limit) {
+        Frame *f = &pool.frames[pool.frame_count - 1];
+        if (f->pins > 0 || f->loading) {
+            rc = -1;
+            break;
+        }
+        if (f->file >= 0 && pool_evict(pool.frame_count - 1) != 0) rc = -1;
+        free(f->data);
+        memset(f, 0, sizeof(*f));
+        pool.frame_count--;
+    }
+    pool.frame_limit = limit > pool.frame_count ? limit : pool.frame_count;
+    if (pool.hand >= pool.frame_limit) pool.hand = 0;
+    pthread_mutex_unlock(&pool.lock);
+    return rc;
+}
+
+uint32_t pool_hash(int file, uint64_t page_no) {
+    uint64_t h = (page_no ^ ((uint64_t)file << 40)) * 0x9E3779B97F4A7C15ULL;
+    return (uint32_t)(h >> 32) & (POOL_MAX_FRAMES - 1);
+}
+
+// Looks up a resident page; the pool lock must be held
+int pool_find(int file, uint64_t page_no) {
+    int i = pool.buckets[pool_hash(file, page_no)];
+    while (i >= 0 && (pool.frames[i].file != file || pool.frames[i].page_no != page_no)) i = pool.frames[i].next;
+    return i;
+}
+
+void pool_unhash(int frame) {
+    Frame *f = &pool.frames[frame];
+    int *link = &pool.buckets[pool_hash(f->file, f->page_no)];
+    while (*link != frame) link = &pool.frames[*link].next;
+    *link = f->next;
+    f->file = -1;
+}
+
+// Writes back a dirty frame; the pool lock must be held
+int pool_write_back(int frame) {
+    Frame *f = &pool.frames[frame];
+    if (!f->dirty) return 0;
+    int fd = pool.files[f->file].fd;
+    const char *p = f->data;
+    size_t left = f->len;
+    off_t off = (off_t)(f->page_no * POOL_PAGE_SIZE);
+    while (left > 0) {
+        ssize_t n = pwrite(fd, p, left, off);
+        if (n <= 0) return -1;
+        p += n;
+        left -= (size_t)n;
+        off += n;
+    }
+    f->dirty = 0;
+    return 0;
+}
+
+// Removes an unpinned page from the pool, writing it back first if needed
+int pool_evict(int frame) {
+    if (pool_write_back(frame) != 0) return -1;
+    pool_unhash(frame);
+    return 0;
+}
+
+/**
+ * @brief Finds a frame for a new page: a never used one while the budget
+ * allows, otherwise the next unpinned frame the clock hand reaches whose
+ * reference bit is clear. The pool lock must be held.
+ * @return The frame, or -1 if every frame is pinned.
+ */
+int pool_victim(void) {
+    if (pool.frame_count < pool.frame_limit) {
+        Frame *f = &pool.frames[pool.frame_count];
+        f->data = malloc(POOL_PAGE_SIZE);
+        if (f->data) {
+            f->file = -1;
+            return pool.frame_count++;
+        }
+    }
+    for (int step = 0; step < 2 * pool.frame_count; step++) {
+        int i = pool.hand;
+        Frame *f = &pool.frames[i];
+        pool.hand = (pool.hand + 1) % pool.frame_count;
+        if (f->pins > 0 || f->loading) continue;
+        if (f->ref) {
+            f->ref = 0;
+            continue;
+        }
+        if (f->file >= 0 && pool_evict(i) != 0) continue;
+        return i;
+    }
+    return -1;
+}
+
+/**
+ * @brief Pins a page of a file in memory, reading it on a miss. Pages read
+ * by sequential scans start without their reference bit, so a large scan
+ * recycles its own frames instead of pushing out the hot set.
+ * @return The frame holding the page, or -1 on error.
+ */
+int pool_pin(int file, uint64_t page_no, int sequential) {
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        int i = pool_find(file, page_no);
+        if (i < 0) break;
+        Frame *f = &pool.frames[i];
+        if (f->loading) {
+            pthread_cond_wait(&pool.cond, &pool.lock);
+            continue;
+        }
+        f->pins++;
+        f->ref = 1;
+        pool.hits++;
+        pthread_mutex_unlock(&pool.lock);
+        return i;
+    }
+
+    int i = pool_victim();
+    if (i < 0) {
+        pthread_mutex_unlock(&pool.lock);
+        reply("Buffer pool is full of pinned pages; raise SET MEMORY.\n");
+        return -1;
+    }
+    Frame *f = &pool.frames[i];
+    uint32_t bucket = pool_hash(file, page_no);
+    f->file = file;
+    f->page_no = page_no;
+    f->pins = 1;
+    f->dirty = 0;
+    f->ref = !sequential;
+    f->loading = 1;
+    f->next = pool.buckets[bucket];
+    pool.buckets[bucket] = i;
+    pool.misses++;
+    int fd = pool.files[file].fd;
+    pthread_mutex_unlock(&pool.lock);
+
+    // The read happens outside the lock; others wanting this page wait on `loading`
+    size_t got = 0;
+    ssize_t n = 1;
+    while (got < POOL_PAGE_SIZE && n > 0) {
+        n = pread(fd, f->data + got, POOL_PAGE_SIZE - got, (off_t)(page_no * POOL_PAGE_SIZE + got));
+        if (n > 0) got += (size_t)n;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    f->loading = 0;
+    f->len = (uint32_t)got;
+    if (n < 0) {
+        f->pins = 0;
+        pool_unhash(i);
+        i = -1;
+    }
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+    return i;
+}
+
+void pool_unpin(int frame, int dirty) {
+    pthread_mutex_lock(&pool.lock);
+    pool.frames[frame].pins--;
+    if (dirty) pool.frames[frame].dirty = 1;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+char *pool_data(int frame) {
+    return pool.frames[frame].data;
+}
+
+size_t pool_len(int frame) {
+    return pool.frames[frame].len;
+}
+
+/**
+ * @brief Copies `len` bytes at file offset `off` out of the pool.
+ * @return 0 on success, -1 if the range is past the end of the file.
+ */
+int pool_read(int file, uint64_t off, void *buf, size_t len, int sequential) {
+    char *out = buf;
+    while (len > 0) {
+        uint64_t page_no = off / POOL_PAGE_SIZE;
+        size_t at = (size_t)(off % POOL_PAGE_SIZE);
+        size_t n = (len < POOL_PAGE_SIZE - at) ? len : POOL_PAGE_SIZE - at;
+        int f = pool_pin(file, page_no, sequential);
+        if (f < 0) return -1;
+        if (pool_len(f) < at + n) {
+            pool_unpin(f, 0);
+            return -1;
+        }
+        memcpy(out, pool_data(f) + at, n);
+        pool_unpin(f, 0);
+        out += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Copies `len` bytes into the pool at file offset `off`, extending the file as needed
+int pool_write(int file, uint64_t off, const void *buf, size_t len) {
+    const char *in = buf;
+    while (len > 0) {
+        uint64_t page_no = off / POOL_PAGE_SIZE;
+        size_t at = (size_t)(off % POOL_PAGE_SIZE);
+        size_t n = (len < POOL_PAGE_SIZE - at) ? len : POOL_PAGE_SIZE - at;
+        int f = pool_pin(file, page_no, 0);
+        if (f < 0) return -1;
+        Frame *fr = &pool.frames[f];
+        if (fr->len < at) memset(fr->data + fr->len, 0, at - fr->len);
+        memcpy(fr->data + at, in, n);
+        if (fr->len < at + n) fr->len = (uint32_t)(at + n);
+        pool_unpin(f, 1);
+        in += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Returns a handle to a file, opening it on first use; every handle
+ * must be given back with pool_release. When the file table is full the
+ * least recently used unreferenced file is written back and closed.
+ * @return The handle, or -1 if the file cannot be opened.
+ */
+int pool_file(const char *path) {
+    int slot = -1;
+    pthread_mutex_lock(&pool.lock);
+    pool.tick++;
+    for (int i = 0; i < POOL_MAX_FILES; i++) {
+        if (pool.files[i].fd >= 0 && strcmp(pool.files[i].path, path) == 0) {
+            pool.files[i].used = pool.tick;
+            pool.files[i].refs++;
+            pthread_mutex_unlock(&pool.lock);
+            return i;
+        }
+        if (pool.files[i].fd < 0 && slot < 0) slot = i;
+    }
+    if (slot < 0) {
+        for (int i = 0; i < POOL_MAX_FILES; i++) {
+            if (pool.files[i].refs == 0 && (slot < 0 || pool.files[i].used < pool.files[slot].used)) slot = i;
+        }
+        if (slot >= 0 && pool_close_file(slot) != 0) slot = -1;
+    }
+    int fd = (slot >= 0) ? open(path, O_RDWR) : -1;
+    if (fd >= 0) {
+        snprintf(pool.files[slot].path, MAX_PATH_LEN, "%s", path);
+        pool.files[slot].fd = fd;
+        pool.files[slot].refs = 1;
+        pool.files[slot].used = pool.tick;
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return fd >= 0 ? slot : -1;
+}
+
+void pool_release(int file) {
+    pthread_mutex_lock(&pool.lock);
+    if (--pool.files[file].refs == 0 && pool.files[file].retired && pool_close_file(file) == 0) pool.files[file].retired = 0;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// Writes back and drops every page of a file, then closes it; the pool lock must be held
+int pool_close_file(int file) {
+    int rc = 0;
+    for (int k = 0; k < pool.frame_count; k++) {
+        if (pool.frames[k].file == file && pool_evict(k) != 0) rc = -1;
+    }
+    if (rc == 0) {
+        close(pool.files[file].fd);
+        pool.files[file].fd = -1;
+    }
+    return rc;
+}
+
+/**
+ * @brief Forgets a file that is about to be replaced or recreated outside the
+ * pool. Its pages are discarded without being written back.
+ */
+void pool_drop_file(const char *path) {
+    char drop[POOL_MAX_FILES] = {0};
+    int found = 0;
+    pthread_mutex_lock(&pool.lock);
+    for (int i = 0; i < POOL_MAX_FILES; i++) {
+        if (pool.files[i].fd >= 0 && !pool.files[i].retired && strcmp(pool.files[i].path, path) == 0) drop[i] = found = 1;
+    }
+    if (found) pool_retire(drop);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/**
+ * @brief Forgets every file of a table, after another process may have changed
+ * them on disk. A file with dirty pages is kept: a writer in this process is
+ * appending to it and holds the table's writer lock, so no other process did.
+ */
+void pool_drop_table(const char *table_name) {
+    char drop[POOL_MAX_FILES] = {0};
+    int found = 0;
+    pthread_mutex_lock(&pool.lock);
+    for (int i = 0; i < POOL_MAX_FILES; i++) {
+        if (pool.files[i].fd >= 0 && !pool.files[i].retired && table_file_of(pool.files[i].path, table_name)) drop[i] = found = 1;
+    }
+    for (int k = 0; k < pool.frame_count; k++) {
+        if (pool.frames[k].file >= 0 && pool.frames[k].dirty) drop[pool.frames[k].file] = 0;
+    }
+    if (found) pool_retire(drop);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/**
+ * @brief Drops the files marked in `drop` and discards their pages; the pool
+ * lock must be held. A file still in use is only retired: its handles keep
+ * reading the old file through the open descriptor until the last one is
+ * released, while pool_file opens the path afresh.
+ */
+void pool_retire(const char *drop) {
+    for (int k = 0; k < pool.frame_count; k++) {
+        Frame *f = &pool.frames[k];
+        if (f->file < 0 || !drop[f->file]) continue;
+        f->dirty = 0;
+        if (f->pins == 0 && !f->loading) pool_unhash(k);
+    }
+    for (int i = 0; i < POOL_MAX_FILES; i++) {
+        if (!drop[i]) continue;
+        pool.files[i].path[0] = '\0';
+        if (pool.files[i].refs > 0) {
+            pool.files[i].retired = 1;
+        } else {
+            close(pool.files[i].fd);
+            pool.files[i].fd = -1;
+        }
+    }
+}
+
+// Writes back the dirty pages of one file, or of every file when `file` is -1
+int pool_flush(int file) {
+    int rc = 0;
+    pthread_mutex_lock(&pool.lock);
+    for (int k = 0; k < pool.frame_count; k++) {
+        Frame *f = &pool.frames[k];
+        if (f->file >= 0 && (file < 0 || f->file == file) && !f->loading && pool_write_back(k) != 0) rc = -1;
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return rc;
+}
+
+/**
+ * @brief Writes back the dirty pages of every file of a table, without
+ * syncing them, so other processes read them once a commit is published.
+ */
+int pool_flush_table(const char *table_name) {
+    int rc = 0;
+    pthread_mutex_lock(&pool.lock);
+    for (int k = 0; k < pool.frame_count; k++) {
+        Frame *f = &pool.frames[k];
+        if (f->file < 0 || !f->dirty || f->loading || !table_file_of(pool.files[f->file].path, table_name)) continue;
+        if (pool_write_back(k) != 0) rc = -1;
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return rc;
+}
+
+// Whether a path names one of a table's files: <table>.<anything>
+int table_file_of(const char *path, const char *table_name) {
+    size_t len = strlen(table_name);
+    return strncmp(path, table_name, len) == 0 && path[len] == '.';
+}
+
+/**
+ * @brief Makes a file durable: dirty pages held by the pool are written back
+ * and the file is fsynced.
+ */
+int sync_path(const char *path) {
+    int file = -1;
+    pthread_mutex_lock(&pool.lock);
+    for (int i = 0; i < POOL_MAX_FILES && file < 0; i++) {
+        if (pool.files[i].fd >= 0 && strcmp(pool.files[i].path, path) == 0) file = i;
+    }
+    pthread_mutex_unlock(&pool.lock);
+    if (file >= 0) {
+        if (pool_flush(file) != 0) return -1;
+        return fsync(pool.files[file].fd);
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    int rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+// --- Write-Ahead Log ---
+
+int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) return -1;
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Flushes every file of a table (columns, heaps, indexes, header) to disk
+int sync_table(const char *table_name) {
+    char path[MAX_PATH_LEN];
+    Table t;
+    int rc = 0;
+    if (load_table(table_name, &t) != 0) return -1;
+    for (int c = 0; c < t.col_count; c++) {
+        column_path(path, t.name, c, "col");
+        if (sync_path(path) != 0) rc = -1;
+        // Tables from before zone maps have no zone file until they are next appended to
+        column_path(path, t.name, c, "zone");
+        if (access(path, F_OK) == 0 && sync_path(path) != 0) rc = -1;
+        if (t.types[c] == COL_TEXT) {
+            column_path(path, t.name, c, "heap");
+            if (sync_path(path) != 0) rc = -1;
+        }
+    }
+    for (int i = 0; i < t.index_count; i++) {
+        index_path(path, t.name, t.indexes[i].name);
+        if (sync_path(path) != 0) rc = -1;
+    }
+    sprintf(path, "%s.dat", t.name);
+    if (sync_path(path) != 0) rc = -1;
+    return rc;
+}
+
+/**
+ * @brief Adds a record to the log buffer. The buffer is written out, but not
+ * synced, once it grows past WAL_BUFFER_SIZE.
+ * @return The log position just past the record, to pass to wal_commit.
+ */
+uint64_t wal_append(uint32_t type, uint64_t txn, const char *payload, uint32_t len) {
+    WalRecord rec = {WAL_MAGIC, type, txn, len, (uint32_t)hash_bytes(payload, len)};
+    uint64_t lsn;
+
+    pthread_mutex_lock(&wal.lock);
+    size_t need = wal.len + sizeof(rec) + len;
+    if (need > wal.cap) {
+        size_t cap = need > WAL_BUFFER_SIZE ? need * 2 : WAL_BUFFER_SIZE * 2;
+        char *grown = realloc(wal.buf, cap);
+        if (!grown) {
+            wal.failed = 1;
+            pthread_mutex_unlock(&wal.lock);
+            return wal.next_lsn;
+        }
+        wal.buf = grown;
+        wal.cap = cap;
+    }
+    memcpy(wal.buf + wal.len, &rec, sizeof(rec));
+    memcpy(wal.buf + wal.len + sizeof(rec), payload, len);
+    wal.len += sizeof(rec) + len;
+    wal.next_lsn += sizeof(rec) + len;
+    lsn = wal.next_lsn;
+
+    if (wal.len >= WAL_BUFFER_SIZE && !wal.syncing) {
+        if (write_all(wal.fd, wal.buf, wal.len) != 0) wal.failed = 1;
+        wal.written_lsn += wal.len;
+        wal.len = 0;
+    }
+    pthread_mutex_unlock(&wal.lock);
+    return lsn;
+}
+
+// Hands buffered records to the OS without waiting for the disk
+int wal_write(void) {
+    pthread_mutex_lock(&wal.lock);
+    while (wal.syncing) pthread_cond_wait(&wal.cond, &wal.lock);
+    if (wal.len > 0) {
+        if (write_all(wal.fd, wal.buf, wal.len) != 0) wal.failed = 1;
+        wal.written_lsn += wal.len;
+        wal.len = 0;
+    }
+    int rc = wal.failed ? -1 : 0;
+    pthread_mutex_unlock(&wal.lock);
+    return rc;
+}
+
+/**
+ * @brief Waits until the log is durable up to `lsn` (group commit). The first
+ * waiter writes out the buffer and syncs it while the others wait; records
+ * appended during that sync go out together with the next one, so concurrent
+ * commits share a single fdatasync.
+ * @return 0 once durable, -1 if the log could not be written.
+ */
+int wal_commit(uint64_t lsn) {
+    pthread_mutex_lock(&wal.lock);
+    while (!wal.failed && wal.synced_lsn < lsn) {
+        if (wal.syncing) {
+            pthread_cond_wait(&wal.cond, &wal.lock);
+            continue;
+        }
+        wal.syncing = 1;
+        char *buf = wal.buf;
+        size_t len = wal.len;
+        uint64_t target = wal.written_lsn + len;
+        // Appenders get a fresh buffer while this one is written
+        wal.buf = NULL;
+        wal.len = wal.cap = 0;
+        pthread_mutex_unlock(&wal.lock);
+
+        int rc = write_all(wal.fd, buf, len);
+        if (rc == 0) rc = fdatasync(wal.fd);
+        free(buf);
+
+        pthread_mutex_lock(&wal.lock);
+        if (rc != 0) wal.failed = 1;
+        wal.written_lsn = target;
+        if (rc == 0) wal.synced_lsn = target;
+        wal.syncing = 0;
+        pthread_cond_broadcast(&wal.cond);
+    }
+    int rc = wal.failed ? -1 : 0;
+    pthread_mutex_unlock(&wal.lock);
+    return rc;
+}
+
+void wal_mark_dirty(const char *table_name) {
+    int found = 0;
+    pthread_mutex_lock(&wal.lock);
+    for (int i = 0; i < wal.dirty_count && !found; i++) found = (strcmp(wal.dirty[i], table_name) == 0);
+    if (!found && wal.dirty_count < MAX_DIRTY_TABLES) strcpy(wal.dirty[wal.dirty_count++], table_name);
+    else if (!found) wal.dirty_overflow = 1;
+    pthread_mutex_unlock(&wal.lock);
+}
+
+/**
+ * @brief Makes every table written since the last checkpoint durable in its
+ * own files, then empties the log. Must not run while rows are being appended:
+ * callers hold wal.gate exclusively, or are the only thread.
+ * @return 0 on success, 1 if put off because a transaction still has rows
+ * in the log, -1 on error.
+ */
+int wal_checkpoint(void) {
+    if (wal.fd < 0) return 0;
+    pthread_mutex_lock(&wal.lock);
+    int open_txns = wal.open_txns;
+    pthread_mutex_unlock(&wal.lock);
+    if (open_txns > 0) return 1;
+    if (wal_commit(wal.next_lsn) != 0) return -1;
+    if (wal.dirty_overflow && pool_flush(-1) == 0) sync(); // Too many tables were tracked to name them all
+    for (int i = 0; i < wal.dirty_count; i++) {
+        if (sync_table(wal.dirty[i]) != 0) return -1;
+    }
+    // Headers are published by renaming them into place
+    if (wal.dirty_count > 0 && sync_path(".") != 0) return -1;
+    if (ftruncate(wal.fd, 0) != 0 || fsync(wal.fd) != 0) return -1;
+    wal.dirty_count = 0;
+    wal.dirty_overflow = 0;
+    pthread_mutex_lock(&wal.lock);
+    wal.checkpoint_lsn = wal.next_lsn;
+    pthread_mutex_unlock(&wal.lock);
+    return 0;
+}
+
+void wal_maybe_checkpoint(void) {
+    pthread_mutex_lock(&wal.lock);
+    int due = wal.next_lsn - wal.checkpoint_lsn >= WAL_CHECKPOINT_BYTES && wal.open_txns == 0;
+    pthread_mutex_unlock(&wal.lock);
+    if (!due) return;
+
+    // Another session may have checkpointed while this one waited for the gate
+    pthread_rwlock_wrlock(&wal.gate);
+    if (wal.next_lsn - wal.checkpoint_lsn >= WAL_CHECKPOINT_BYTES && wal_checkpoint() < 0) {
+        reply_error("Checkpoint failed");
+    }
+    pthread_rwlock_unlock(&wal.gate);
+}
+
+// Writes a table name as a 2-byte length and the bytes
+size_t wal_put_name(char *p, const char *name) {
+    uint16_t len = (uint16_t)strlen(name);
+    memcpy(p, &len, sizeof(len));
+    memcpy(p + sizeof(len), name, len);
+    return sizeof(len) + len;
+}
+
+const char *wal_get_name(const char *p, const char *end, char *name) {
+    uint16_t len;
+    if (end - p < (long)sizeof(len)) return NULL;
+    memcpy(&len, p, sizeof(len));
+    p += sizeof(len);
+    if (len >= MAX_TABLE_NAME || end - p < (long)len) return NULL;
+    memcpy(name, p, len);
+    name[len] = '\0';
+    return p + len;
+}
+
+// Adds a row to the appender's batch: 8 bytes per INT or REAL, a 4-byte length and the bytes per TEXT
+int wal_encode_row(Appender *a, const Value *vals) {
+    const Table *t = a->t;
+    size_t need = a->batch_len;
+    for (int c = 0; c < t->col_count; c++) need += (t->types[c] == COL_TEXT) ? sizeof(uint32_t) + vals[c].len : 8;
+    if (need > a->batch_cap) {
+        size_t cap = need > WAL_BATCH_BYTES ? need * 2 : WAL_BATCH_BYTES * 2;
+        char *grown = realloc(a->batch, cap);
+        if (!grown) return -1;
+        a->batch = grown;
+        a->batch_cap = cap;
+    }
+    char *p = a->batch + a->batch_len;
+    for (int c = 0; c < t->col_count; c++) {
+        if (t->types[c] == COL_TEXT) {
+            uint32_t len = (uint32_t)vals[c].len;
+            memcpy(p, &len, sizeof(len));
+            if (len) memcpy(p + sizeof(len), vals[c].s, len);
+            p += sizeof(len) + len;
+        } else {
+            memcpy(p, t->types[c] == COL_INT ? (const void *)&vals[c].i : (const void *)&vals[c].r, 8);
+            p += 8;
+        }
+    }
+    a->batch_len = (size_t)(p - a->batch);
+    a->batch_rows++;
+    return 0;
+}
+
+const char *wal_decode_row(const Table *t, const char *p, const char *end, Value *vals) {
+    for (int c = 0; c < t->col_count; c++) {
+        memset(&vals[c], 0, sizeof(Value));
+        if (t->types[c] == COL_TEXT) {
+            uint32_t len;
+            if (end - p < (long)sizeof(len)) return NULL;
+            memcpy(&len, p, sizeof(len));
+            p += sizeof(len);
+            if (end - p < (long)len) return NULL;
+            vals[c].s = p;
+            vals[c].len = len;
+            p += len;
+        } else {
+            if (end - p < 8) return NULL;
+            memcpy(t->types[c] == COL_INT ? (void *)&vals[c].i : (void *)&vals[c].r, p, 8);
+            p += 8;
+        }
+    }
+    return p;
+}
+
+/**
+ * @brief Logs the batched rows as one ROWS record. The front of the batch is
+ * reserved for the record's table name, first row and row count.
+ * @return 0 on success, -1 if the log has failed; the transaction must not commit.
+ */
+int wal_flush_batch(Appender *a) {
+    if (a->batch_rows == 0) return 0;
+    uint64_t start_row = a->row_count - a->batch_rows;
+    size_t head = wal_put_name(a->batch, a->t->name);
+    memcpy(a->batch + head, &start_row, sizeof(start_row));
+    memcpy(a->batch + head + sizeof(start_row), &a->batch_rows, sizeof(a->batch_rows));
+    wal_append(WAL_ROWS, a->txn, a->batch, (uint32_t)a->batch_len);
+    a->batch_len = head + sizeof(start_row) + sizeof(a->batch_rows);
+    a->batch_rows = 0;
+    pthread_mutex_lock(&wal.lock);
+    int rc = wal.failed ? -1 : 0;
+    pthread_mutex_unlock(&wal.lock);
+    return rc;
+}
+
+/**
+ * @brief Recovers once every process that used the directory has stopped,
+ * cleanly or not. The committed rows of every log left behind, including the
+ * single log of earlier versions, are replayed and the logs removed. Then
+ * whatever a writer left in a table's lock file when it died is settled.
+ */
+void wal_recover(void) {
+    char (*names)[MAX_PATH_LEN] = NULL;
+    int count = list_files(".wal", &names);
+    int log_count = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (strncmp(names[i], "minisql", 7) == 0) memmove(names[log_count++], names[i], MAX_PATH_LEN);
+    }
+    uint64_t recovered = log_count > 0 ? wal_replay(names, log_count, NULL, 0, 0) : 0;
+    for (int i = 0; i < log_count; i++) remove(names[i]);
+    if (log_count > 0) sync_path(".");
+    free(names);
+
+    count = list_files(".lock", &names);
+    for (int i = 0; i < count; i++) {
+        names[i][strlen(names[i]) - strlen(".lock")] = '\0';
+        int fd = table_lock_open(names[i], 0);
+        if (fd >= 0) close(fd);
+    }
+    free(names);
+    if (recovered > 0) reply("Recovered %llu rows from the write-ahead log.\n", (unsigned long long)recovered);
+}
+
+/**
+ * @brief Re-applies committed rows that may not have reached the table files.
+ * Each committed ROWS record is rewritten at its own row number, in row order
+ * per table across all the logs, so replaying rows that did reach the disk is
+ * harmless; a table never ends up with fewer rows than it had published.
+ * Index pages are not logged, so every index of a table named in the logs is
+ * rebuilt. With `only_txn`, just that commit of the `table_count` tables
+ * listed is replayed and published as one commit; their indexes are left to
+ * the caller.
+ * @return The number of rows replayed.
+ */
+uint64_t wal_replay(char (*logs)[MAX_PATH_LEN], int log_count, char (*tables)[MAX_TABLE_NAME], int table_count,
+                    uint64_t only_txn) {
+    FILE **fps = calloc((size_t)log_count, sizeof(FILE *));
+    WalReplay *rp = calloc(1, sizeof(WalReplay));
+    Table *tabs = calloc(MAX_TXN_TABLES, sizeof(Table));
+    Appender *apps = calloc(MAX_TXN_TABLES, sizeof(Appender));
+    Appender *done[MAX_TXN_TABLES];
+    int done_count = 0;
+    char *payload = NULL;
+    size_t payload_cap = 0;
+    uint64_t recovered = 0;
+    Appender *app = NULL;
+
+    if (!fps || !rp || !tabs || !apps) {
+        free(fps);
+        free(rp);
+        free(tabs);
+        free(apps);
+        return 0;
+    }
+    for (int i = 0; i < log_count; i++) {
+        if ((fps[i] = fopen(logs[i], "rb")) != NULL) wal_scan(fps[i], i, tables, table_count, only_txn, rp);
+    }
+    if (rp->count > 0) qsort(rp->rows, rp->count, sizeof(WalRows), wal_rows_cmp);
+
+    for (size_t i = 0; i <= rp->count; i++) {
+        const WalRows *w = (i < rp->count) ? &rp->rows[i] : NULL;
+        uint64_t start_row;
+        uint32_t n;
+
+        // A run of rows ends at the next table or gap; a single commit is published once all its tables are done
+        if (app && (!w || strcmp(app->t->name, w->table) != 0 || w->start_row != app->row_count)) {
+            if (appender_close(app, 1) == 0) done[done_count++] = app;
+            app = NULL;
+        }
+        if (done_count > 0 && (!only_txn || !w || done_count == MAX_TXN_TABLES)) {
+            publish_tables(done, done_count);
+            done_count = 0;
+        }
+        if (!w) break;
+        if (!app) {
+            Table *t = &tabs[done_count];
+            if (table_refresh(w->table, t) != 0) continue;
+            if (w->start_row > t->header.row_count) {
+                reply("Log for '%s' starts at row %llu past its %llu rows; skipped.\n", w->table,
+                       (unsigned long long)w->start_row, (unsigned long long)t->header.row_count);
+                continue;
+            }
+            // Indexes are rebuilt afterwards rather than patched row by row
+            uint64_t published = t->header.row_count;
+            t->header.row_count = w->start_row;
+            t->index_count = 0;
+            if (appender_open(&apps[done_count], t, 0) != 0) continue;
+            app = &apps[done_count];
+            app->replay = 1;
+            app->floor_rows = published;
+        }
+
+        if (w->len > payload_cap) {
+            char *grown = realloc(payload, w->len);
+            if (!grown) continue;
+            payload = grown;
+            payload_cap = w->len;
+        }
+        if (fseek(fps[w->log], w->off, SEEK_SET) != 0 || fread(payload, 1, w->len, fps[w->log]) != w->len) continue;
+        const char *end = payload + w->len;
+        const char *p = payload + sizeof(uint16_t) + strlen(w->table);
+        memcpy(&start_row, p, sizeof(start_row));
+        memcpy(&n, p + sizeof(start_row), sizeof(n));
+        p += sizeof(start_row) + sizeof(n);
+        for (uint32_t r = 0; r < n && p; r++) {
+            Value vals[MAX_COLS];
+            p = wal_decode_row(app->t, p, end, vals);
+            if (p && appender_add(app, vals) != 0) p = NULL;
+            if (p) recovered++;
+        }
+    }
+    for (int i = 0; i < log_count; i++) {
+        if (fps[i]) fclose(fps[i]);
+    }
+
+    for (int i = 0; i < rp->touched_count; i++) {
+        if (!only_txn) rebuild_indexes(rp->touched[i]);
+        if (sync_table(rp->touched[i]) != 0) reply_error("Error syncing recovered table");
+    }
+    free(fps);
+    free(rp->rows);
+    free(rp);
+    free(tabs);
+    free(apps);
+    free(payload);
+    return recovered;
+}
+
+/**
+ * @brief Collects from one log the ROWS records of committed transactions,
+ * and the tables its records name, optionally only for the `table_count`
+ * tables listed and one log transaction. The log is trusted up to its first torn or corrupt record.
+ */
+int wal_scan(FILE *fp, int log, char (*tables)[MAX_TABLE_NAME], int table_count, uint64_t only_txn, WalReplay *rp) {
+    WalRecord rec;
+    char *payload = NULL;
+    size_t payload_cap = 0;
+    uint64_t *committed = NULL;
+    size_t committed_count = 0, committed_cap = 0;
+    size_t first = rp->count;
+
+    while (fread(&rec, sizeof(rec), 1, fp) == 1 && rec.magic == WAL_MAGIC) {
+        char name[MAX_TABLE_NAME];
+        long off = ftell(fp);
+        if (rec.len > payload_cap) {
+            char *grown = realloc(payload, rec.len);
+            if (!grown) break;
+            payload = grown;
+            payload_cap = rec.len;
+        }
+        if (fread(payload, 1, rec.len, fp) != rec.len || (uint32_t)hash_bytes(payload, rec.len) != rec.checksum) break;
+        const char *end = payload + rec.len;
+        const char *p = wal_get_name(payload, end, name);
+        if (!p || (only_txn && rec.txn != only_txn)) continue;
+        int listed = table_count == 0;
+        for (int i = 0; i < table_count && !listed; i++) listed = (strcmp(tables[i], name) == 0);
+        if (!listed) continue;
+
+        int seen = 0;
+        for (int i = 0; i < rp->touched_count && !seen; i++) seen = (strcmp(rp->touched[i], name) == 0);
+        if (!seen && rp->touched_count < MAX_DIRTY_TABLES) strcpy(rp->touched[rp->touched_count++], name);
+
+        if (rec.type == WAL_COMMIT) {
+            // A COMMIT from before multi-table transactions ends after the row count
+            uint32_t more = 0;
+            if (end - p >= (long)(sizeof(uint64_t) + sizeof(more))) memcpy(&more, p + sizeof(uint64_t), sizeof(more));
+            if (more > 0) continue;
+            if (committed_count == committed_cap) {
+                committed_cap = committed_cap ? committed_cap * 2 : 64;
+                uint64_t *grown = realloc(committed, committed_cap * sizeof(uint64_t));
+                if (!grown) break;
+                committed = grown;
+            }
+            committed[committed_count++] = rec.txn;
+        } else if (rec.type == WAL_ROWS && end - p >= (long)(sizeof(uint64_t) + sizeof(uint32_t))) {
+            if (rp->count == rp->cap) {
+                size_t cap = rp->cap ? rp->cap * 2 : 256;
+                WalRows *grown = realloc(rp->rows, cap * sizeof(WalRows));
+                if (!grown) break;
+                rp->rows = grown;
+                rp->cap = cap;
+            }
+            WalRows *w = &rp->rows[rp->count++];
+            w->log = log;
+            w->off = off;
+            w->len = rec.len;
+            w->txn = rec.txn;
+            memcpy(&w->start_row, p, sizeof(w->start_row));
+            strcpy(w->table, name);
+        }
+    }
+
+    // Only rows of committed transactions are kept
+    size_t kept = first;
+    for (size_t i = first; i < rp->count; i++) {
+        int is_committed = 0;
+        for (size_t k = 0; k < committed_count && !is_committed; k++) is_committed = (committed[k] == rp->rows[i].txn);
+        if (is_committed) rp->rows[kept++] = rp->rows[i];
+    }
+    rp->count = kept;
+    free(payload);
+    free(committed);
+    return 0;
+}
+
+// Orders ROWS records by table, then by first row
+int wal_rows_cmp(const void *a, const void *b) {
+    const WalRows *x = a, *y = b;
+    int c = strcmp(x->table, y->table);
+    if (c != 0) return c;
+    return (x->start_row > y->start_row) - (x->start_row < y->start_row);
+}
+
+/**
+ * @brief Recovers the logs of stopped processes when this is the only one
+ * running (`alone`), then creates this process's own empty log.
+ */
+int wal_open(int alone) {
+    if (alone) wal_recover();
+    // A log left by an earlier process with the same pid may still hold an unpublished commit
+    for (int n = 0; wal.fd < 0; n++) {
+        if (n == 0) snprintf(wal.path, sizeof(wal.path), "minisql-%d.wal", (int)getpid());
+        else snprintf(wal.path, sizeof(wal.path), "minisql-%d-%d.wal", (int)getpid(), n);
+        wal.fd = open(wal.path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+        if (wal.fd < 0 && errno != EEXIST) return -1;
+    }
+    if (fsync(wal.fd) != 0 || sync_path(".") != 0) return -1;
+    return 0;
+}
+
+// Checkpoints and removes this process's log; its tables no longer need it
+void wal_close(void) {
+    if (wal.fd < 0) return;
+    int rc = wal_checkpoint();
+    if (rc < 0) reply_error("Checkpoint failed");
+    close(wal.fd);
+    wal.fd = -1;
+    if (rc == 0) unlink(wal.path);
+    free(wal.buf);
+    wal.buf = NULL;
+    wal.len = wal.cap = 0;
+}
+
+// --- Storage Helpers ---
+
+/**
+ * @brief Copies the schema and header of a table out of the catalog.
+ * @return 0 on success, -1 (after printing the reason) otherwise.
+ */
+int load_table(const char *table_name, Table *t) {
+    uint64_t started = session_profile ? now_ns() : 0;
+    pthread_mutex_lock(&catalog.lock);
+    const Table *cached = catalog_get(table_name);
+    if (cached) *t = *cached;
+    pthread_mutex_unlock(&catalog.lock);
+    if (session_profile) session_profile->catalog_ns += now_ns() - started;
+    return cached ? 0 : -1;
+}
+
+/**
+ * @brief Reads the schema and binary header of a table from its files.
+ * @return 0 on success, 1 if the table is still in the text format of earlier
+ * versions (only its schema is read), -1 (after printing the reason) otherwise.
+ */
+int read_table(const char *table_name, Table *t) {
+    char schema_filename[MAX_PATH_LEN];
+    char line[MAX_ROW_LEN];
+
+    memset(t, 0, sizeof(*t));
+    snprintf(t->name, sizeof(t->name), "%s", table_name);
+    sprintf(schema_filename, "%s.sch", t->name);
+
+    FILE *fp = fopen(schema_filename, "r");
+    if (!fp) {
+        reply("Table '%s' does not exist.\n", table_name);
+        return -1;
+    }
+    uint16_t dict_cols = 0;
+    while (t->col_count < MAX_COLS && fgets(line, sizeof(line), fp)) {
+        char name[MAX_COL_NAME], type[MAX_COL_NAME] = "TEXT", encoding[MAX_COL_NAME] = "";
+        if (sscanf(line, "%49s %49s %49s", name, type, encoding) < 1) continue;
+        if (parse_type(type, &t->types[t->col_count]) != 0) t->types[t->col_count] = COL_TEXT;
+        if (strcmp(encoding, "DICT") == 0) dict_cols |= (uint16_t)(1u << t->col_count);
+        strcpy(t->cols[t->col_count++], name);
+    }
+    fclose(fp);
+
+    // Text rows are left in <table>.legacy until their conversion is complete
+    sprintf(schema_filename, "%s.legacy", t->name);
+    if (access(schema_filename, F_OK) == 0) return 1;
+    if (read_header(t->name, &t->header) != 0) {
+        sprintf(schema_filename, "%s.dat", t->name);
+        if (access(schema_filename, F_OK) == 0) return 1;
+        reply("Table '%s' has no data file.\n", table_name);
+        return -1;
+    }
+
+    // Secondary indexes, one "name column" line each
+    sprintf(schema_filename, "%s.idx", t->name);
+    fp = fopen(schema_filename, "r");
+    while (fp && t->index_count < MAX_INDEXES && fgets(line, sizeof(line), fp)) {
+        char name[MAX_COL_NAME], col[MAX_COL_NAME];
+        if (sscanf(line, "%49s %49s", name, col) != 2) continue;
+        int c = find_column(t, col);
+        if (c < 0) continue;
+        strcpy(t->indexes[t->index_count].name, name);
+        t->indexes[t->index_count++].col = c;
+    }
+    if (fp) fclose(fp);
+
+    if ((int)t->header.col_count != t->col_count || t->header.dict_cols != dict_cols) {
+        reply("Table '%s' header does not match its schema.\n", table_name);
+        return -1;
+    }
+    for (int i = 0; i < t->col_count; i++) {
+        if (t->header.col_types[i] != t->types[i]) {
+            reply("Table '%s' header does not match its schema.\n", table_name);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Converts a table from the text format of earlier versions, one line
+ * of comma-joined values per row in <table>.dat, to the column format. The
+ * text is set aside as <table>.legacy and its rows are fed through an
+ * appender into new column files. The header is written once they are
+ * durable, and <table>.legacy is removed last; while it exists the table is
+ * converted again from the start, so a crash part way loses no rows. Lines
+ * that do not make a row, such as values that earlier versions split at a
+ * quoted comma, are copied to <table>.rejected to be fixed and loaded again.
+ * @return 0 on success, -1 (after printing the reason) otherwise.
+ */
+int convert_legacy_table(const char *table_name) {
+    char data_filename[MAX_PATH_LEN], legacy_filename[MAX_PATH_LEN], schema_filename[MAX_PATH_LEN];
+    char rejected_filename[MAX_PATH_LEN];
+    char line[MAX_ROW_LEN], original[MAX_ROW_LEN];
+    Table t;
+    Appender a;
+
+    int lock_fd = table_lock_open(table_name, 1);
+    if (lock_fd < 0) return -1;
+    // Another process may have converted it while we waited for the lock
+    int rc = read_table(table_name, &t);
+    if (rc <= 0) {
+        close(lock_fd);
+        return rc;
+    }
+    snprintf(data_filename, sizeof(data_filename), "%s.dat", table_name);
+    snprintf(legacy_filename, sizeof(legacy_filename), "%s.legacy", table_name);
+    snprintf(schema_filename, sizeof(schema_filename), "%s.sch", table_name);
+    snprintf(rejected_filename, sizeof(rejected_filename), "%s.rejected", table_name);
+    if (access(legacy_filename, F_OK) != 0 && (rename(data_filename, legacy_filename) != 0 || sync_path(".") != 0)) {
+        reply_error("Error converting table");
+        close(lock_fd);
+        return -1;
+    }
+    FILE *fp = fopen(legacy_filename, "r");
+    if (!fp) {
+        reply_error("Error converting table");
+        close(lock_fd);
+        return -1;
+    }
+    if (create_table_files(&t, schema_filename) != 0 || read_header(table_name, &t.header) != 0 ||
+        appender_open(&a, &t, 0) != 0) {
+        reply("Could not prepare table '%s' for converting.\n", table_name);
+        fclose(fp);
+        close(lock_fd);
+        return -1;
+    }
+    // Nothing is logged: until the header is written the rows are only in <table>.legacy
+    a.replay = 1;
+
+    // Left by an attempt that did not finish, and written again below
+    remove(rejected_filename);
+    FILE *rejected = NULL;
+    uint64_t line_no = 0, rejected_count = 0;
+    rc = 0;
+    while (rc == 0 && fgets(line, sizeof(line), fp)) {
+        char *fields[MAX_COLS + 1], *save = NULL;
+        Value vals[MAX_COLS];
+        int n = 0, bad = 0;
+        line_no++;
+        line[strcspn(line, "\r\n")] = '\0';
+        strcpy(original, line);
+        // Split the way earlier versions printed rows, so empty values are
+        // skipped; they only trimmed the end of each value
+        for (char *tok = strtok_r(line, ",", &save); tok && n <= MAX_COLS; tok = strtok_r(NULL, ",", &save)) {
+            trim_whitespace(tok);
+            fields[n++] = tok;
+        }
+        if (n == 0) continue;
+        if (n != t.col_count) {
+            if (rejected_count == 0) {
+                reply("Line %llu of %s: expected %d values, got %d.\n", (unsigned long long)line_no, legacy_filename,
+                       t.col_count, n);
+            }
+            bad = 1;
+        }
+        for (int i = 0; i < n && !bad; i++) {
+            if (convert_value(t.types[i], fields[i], strlen(fields[i]), &vals[i]) != 0) {
+                if (rejected_count == 0) {
+                    reply("Line %llu of %s: invalid %s value '%s' for column '%s'.\n", (unsigned long long)line_no,
+                           legacy_filename, type_name(t.types[i]), fields[i], t.cols[i]);
+                }
+                bad = 1;
+            }
+        }
+        if (bad) {
+            if (!rejected) rejected = fopen(rejected_filename, "w");
+            if (!rejected || fprintf(rejected, "%s\n", original) < 0) {
+                reply_error("Error writing rejected rows");
+                rc = -1;
+            }
+            rejected_count++;
+        } else if (appender_add(&a, vals) != 0) {
+            reply("Error writing to table '%s'.\n", table_name);
+            rc = -1;
+        }
+    }
+    if (rc == 0 && ferror(fp)) {
+        reply_error("Error reading legacy rows");
+        rc = -1;
+    }
+    fclose(fp);
+    // The rejected lines must be durable before <table>.legacy goes
+    if (rejected && (fflush(rejected) != 0 || fsync(fileno(rejected)) != 0) && rc == 0) {
+        reply_error("Error writing rejected rows");
+        rc = -1;
+    }
+    if (rejected && fclose(rejected) != 0 && rc == 0) {
+        reply_error("Error writing rejected rows");
+        rc = -1;
+    }
+    if (appender_close(&a, 1) != 0 && rc == 0) {
+        reply("Error writing to table '%s'.\n", table_name);
+        rc = -1;
+    }
+
+    if (rc == 0) {
+        for (int c = 0; c < t.col_count && rc == 0; c++) {
+            char path[MAX_PATH_LEN];
+            column_path(path, table_name, c, "col");
+            if (sync_path(path) != 0) rc = -1;
+            column_path(path, table_name, c, "zone");
+            if (sync_path(path) != 0) rc = -1;
+            column_path(path, table_name, c, "heap");
+            if (t.types[c] == COL_TEXT && sync_path(path) != 0) rc = -1;
+        }
+        t.header.row_count = a.row_count;
+        t.header.sorted_cols = a.sorted;
+        if (rc != 0 || write_header(&t) != 0 || sync_path(".") != 0 || remove(legacy_filename) != 0) {
+            reply_error("Error converting table");
+            rc = -1;
+        }
+    }
+    close(lock_fd);
+    if (rc != 0) {
+        reply("Table '%s' was not converted; its rows are kept in %s.\n", table_name, legacy_filename);
+        return -1;
+    }
+    if (rejected_count > 0) {
+        reply("Table '%s' converted without %llu rows; they are in %s to fix and LOAD DATA.\n", table_name,
+               (unsigned long long)rejected_count, rejected_filename);
+    }
+    return 0;
+}
+
+// --- Catalog ---
+
+/**
+ * @brief Returns the catalog entry of a table, reading its files the first
+ * time the table is used. A table still in the text format of earlier
+ * versions is converted then, with catalog.lock released meanwhile, since the
+ * conversion waits for the table's writer lock. When the catalog is full an
+ * older entry is dropped. The caller holds catalog.lock.
+ * @return NULL (after printing the reason) if the table cannot be loaded.
+ */
+Table *catalog_get(const char *table_name) {
+    for (int i = 0; i < catalog.count; i++) {
+        if (strcmp(catalog.tables[i]->name, table_name) == 0) return catalog.tables[i];
+    }
+    Table *t = malloc(sizeof(Table));
+    if (!t) {
+        reply("Not enough memory to load table '%s'.\n", table_name);
+        return NULL;
+    }
+    int rc = read_table(table_name, t);
+    if (rc != 0) {
+        free(t);
+        if (rc < 0) return NULL;
+        pthread_mutex_unlock(&catalog.lock);
+        rc = convert_legacy_table(table_name);
+        pthread_mutex_lock(&catalog.lock);
+        return rc == 0 ? catalog_get(table_name) : NULL;
+    }
+    // Pages cached before the table was last used may predate another process's commits
+    pool_drop_table(table_name);
+    return catalog_put(t);
+}
+
+// Adds a table read from disk to the catalog; the caller holds catalog.lock
+Table *catalog_put(Table *t) {
+    if (catalog.count == MAX_CATALOG_TABLES) {
+        free(catalog.tables[0]);
+        memmove(&catalog.tables[0], &catalog.tables[1], (MAX_CATALOG_TABLES - 1) * sizeof(Table *));
+        catalog.count--;
+    }
+    catalog.tables[catalog.count++] = t;
+    return t;
+}
+
+// Drops a table's entry after its schema or indexes change; cached plans are re-checked
+void catalog_invalidate(const char *table_name) {
+    pthread_mutex_lock(&catalog.lock);
+    for (int i = 0; i < catalog.count; i++) {
+        if (strcmp(catalog.tables[i]->name, table_name) == 0) {
+            free(catalog.tables[i]);
+            catalog.tables[i] = catalog.tables[--catalog.count];
+            break;
+        }
+    }
+    catalog.version++;
+    pthread_mutex_unlock(&catalog.lock);
+}
+
+/**
+ * @brief Copies out a table as a snapshot sees it: the schema from the catalog
+ * and the row count of the newest commit up to `snapshot`. When the header on
+ * disk is not the one cached, another process has committed to the table, so
+ * the pages this process holds of it are dropped first.
+ * @return 0 on success, -1 (after printing the reason) otherwise.
+ */
+int table_snapshot(const char *table_name, uint64_t snapshot, Table *t) {
+    TableHeader h;
+    pthread_mutex_lock(&catalog.lock);
+    Table *cached = catalog_get(table_name);
+    if (cached && read_header(table_name, &h) == 0 && memcmp(&h, &cached->header, sizeof(h)) != 0) {
+        pool_drop_table(table_name);
+        cached->header = h;
+    }
+    if (cached) *t = *cached;
+    pthread_mutex_unlock(&catalog.lock);
+    if (!cached) return -1;
+    t->header.row_count = version_rows(table_name, snapshot, &t->header);
+    return 0;
+}
+
+/**
+ * @brief Re-reads a table from its files for a writer holding its writer
+ * lock, and replaces its catalog entry. Cached pages are dropped unless the
+ * header is the one this process last saw.
+ * @return 0 on success, -1 (after printing the reason) otherwise.
+ */
+int table_refresh(const char *table_name, Table *t) {
+    Table *fresh = malloc(sizeof(Table));
+    if (!fresh) {
+        reply("Not enough memory to load table '%s'.\n", table_name);
+        return -1;
+    }
+    int rc = read_table(table_name, fresh);
+    if (rc != 0) {
+        // A writer holds the lock a conversion would wait for
+        if (rc > 0) reply("Table '%s' has not been converted to the column format yet.\n", table_name);
+        free(fresh);
+        return -1;
+    }
+    pthread_mutex_lock(&catalog.lock);
+    int found = -1;
+    for (int i = 0; i < catalog.count && found < 0; i++) {
+        if (strcmp(catalog.tables[i]->name, table_name) == 0) found = i;
+    }
+    if (found < 0 || memcmp(&catalog.tables[found]->header, &fresh->header, sizeof(TableHeader)) != 0) {
+        pool_drop_table(table_name);
+    }
+    if (found >= 0) {
+        free(catalog.tables[found]);
+        catalog.tables[found] = fresh;
+    } else {
+        catalog_put(fresh);
+    }
+    *t = *fresh;
+    pthread_mutex_unlock(&catalog.lock);
+    return 0;
+}
+
+/**
+ * @brief Reads the binary header of a table. Version 1 headers end before
+ * commit_txn, which then reads as 0.
+ * @return 0 on success, -1 (leaving `h` zeroed) if <table>.dat is missing or
+ * not a table header.
+ */
+int read_header(const char *table_name, TableHeader *h) {
+    char data_filename[MAX_PATH_LEN];
+    snprintf(data_filename, sizeof(data_filename), "%s.dat", table_name);
+    memset(h, 0, sizeof(*h));
+    int fd = open(data_filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = pread(fd, h, sizeof(*h), 0);
+    close(fd);
+    if (n < (ssize_t)offsetof(TableHeader, commit_txn) || memcmp(h->magic, TABLE_MAGIC, sizeof(h->magic)) != 0) {
+        memset(h, 0, sizeof(*h));
+        return -1;
+    }
+    return 0;
+}
+
+// Replaces <table>.dat with a synced copy, so a reader never sees a header half written
+int write_header(const Table *t) {
+    char data_filename[MAX_PATH_LEN], tmp_filename[MAX_PATH_LEN + 4];
+    sprintf(data_filename, "%s.dat", t->name);
+    snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", data_filename);
+    int fd = open(tmp_filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    int rc = write_all(fd, (const char *)&t->header, sizeof(t->header));
+    if (rc == 0) rc = fdatasync(fd);
+    if (close(fd) != 0) rc = -1;
+    if (rc == 0) rc = rename(tmp_filename, data_filename);
+    if (rc != 0) remove(tmp_filename);
+    return rc;
+}
+
+// Column files are named <table>.<index>.col and <table>.<index>.heap
+void column_path(char *buf, const char *table_name, int col, const char *ext) {
+    snprintf(buf, MAX_PATH_LEN, "%s.%d.%s", table_name, col, ext);
+}
+
+int find_column(const Table *t, const char *name) {
+    for (int i = 0; i < t->col_count; i++) {
+        if (strcmp(t->cols[i], name) == 0) return i;
+    }
+    return -1;
+}
+
+/**
+ * @brief Finds a SELECT's column by name, optionally qualified with its table
+ * as table.col. Prints why when the name is unknown or matches both tables.
+ * @return The column index with its table in *side, or -1.
+ */
+int resolve_column(const Scope *sc, const char *name, int *side) {
+    const char *dot = strchr(name, '.');
+    int found = -1;
+    for (int i = 0; i < sc->count; i++) {
+        const Table *t = sc->tables[i];
+        int col = find_column(t, name);
+        if (col < 0 && dot && strlen(t->name) == (size_t)(dot - name) && strncmp(t->name, name, (size_t)(dot - name)) == 0) {
+            col = find_column(t, dot + 1);
+        }
+        if (col < 0) continue;
+        if (found >= 0) {
+            reply("Column '%s' is in both tables; write it as table.%s.\n", name, name);
+            return -1;
+        }
+        found = col;
+        *side = i;
+    }
+    if (found < 0) reply("Unknown column '%s'.\n", name);
+    return found;
+}
+
+const char *type_name(ColType type) {
+    switch (type) {
+        case COL_INT: return "INT";
+        case COL_REAL: return "REAL";
+        default: return "TEXT";
+    }
+}
+
+int parse_type(const char *str, ColType *type) {
+    if (strcmp(str, "INT") == 0 || strcmp(str, "INTEGER") == 0) *type = COL_INT;
+    else if (strcmp(str, "REAL") == 0 || strcmp(str, "FLOAT") == 0 || strcmp(str, "DOUBLE") == 0) *type = COL_REAL;
+    else if (strcmp(str, "TEXT") == 0 || strncmp(str, "VARCHAR", 7) == 0 || strncmp(str, "CHAR", 4) == 0) *type = COL_TEXT;
+    else return -1;
+    return 0;
+}
+
+// Converts an unquoted, NUL-terminated value of the given column type
+int convert_value(ColType type, const char *str, size_t len, Value *val) {
+    char *end;
+    memset(val, 0, sizeof(*val));
+    errno = 0;
+    switch (type) {
+        case COL_INT:
+            val->i = strtoll(str, &end, 10);
+            return (len == 0 || *end || errno == ERANGE) ? -1 : 0;
+        case COL_REAL:
+            // Too small a value underflows to the nearest one; too large a value is refused
+            val->r = strtod(str, &end);
+            return (len == 0 || *end || (errno == ERANGE && isinf(val->r))) ? -1 : 0;
+        case COL_TEXT:
+            val->s = str;
+            val->len = len;
+            return 0;
+    }
+    return -1;
+}
+
+// --- Transactions ---
+
+/**
+ * @brief Maps minisql.txn, creating it if needed. The first process to use
+ * the directory (finding no other holding byte 1) resets the process slots
+ * and seeds the commit counter from the tables.
+ * @return 1 if no other process uses the directory, 0 if some do, -1 on error.
+ */
+int txn_open(void) {
+    txns.fd = open(TXN_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (txns.fd < 0) return -1;
+    int alone = file_lock(txns.fd, F_WRLCK, 1, 0) == 0;
+    // A process that is recovering holds byte 1 exclusively until it is done
+    if (!alone && file_lock(txns.fd, F_RDLCK, 1, 1) != 0) return -1;
+    if (alone && ftruncate(txns.fd, sizeof(TxnShared)) != 0) return -1;
+    void *map = mmap(NULL, sizeof(TxnShared), PROT_READ | PROT_WRITE, MAP_SHARED, txns.fd, 0);
+    if (map == MAP_FAILED) return -1;
+    txns.shared = map;
+    if (alone) {
+        if (txns.shared->magic != TXN_MAGIC) {
+            memset(txns.shared, 0, sizeof(TxnShared));
+            txns.shared->magic = TXN_MAGIC;
+        }
+        memset(txns.shared->slots, 0, sizeof(txns.shared->slots));
+        txn_seed();
+    }
+    return alone;
+}
+
+// Starts commit numbers after the newest one any table header or version file records
+void txn_seed(void) {
+    char (*names)[MAX_PATH_LEN] = NULL;
+    uint64_t last = txns.shared->last_commit;
+
+    int count = list_files(".dat", &names);
+    for (int i = 0; i < count; i++) {
+        TableHeader h;
+        names[i][strlen(names[i]) - strlen(".dat")] = '\0';
+        if (read_header(names[i], &h) == 0 && h.commit_txn > last) last = h.commit_txn;
+    }
+    free(names);
+
+    count = list_files(".ver", &names);
+    for (int i = 0; i < count; i++) {
+        struct stat st;
+        VersionEntry v;
+        int fd = open(names[i], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) continue;
+        if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(v) &&
+            pread(fd, &v, sizeof(v), (st.st_size / sizeof(v) - 1) * sizeof(v)) == sizeof(v) && v.txn > last) last = v.txn;
+        close(fd);
+    }
+    free(names);
+    txns.shared->last_commit = last;
+}
+
+/**
+ * @brief Takes a process slot, lets other processes start, and starts the
+ * background vacuum. A slot left by a process that has died is reused.
+ * @return 0 on success, -1 if every slot is taken.
+ */
+int txn_start(void) {
+    pthread_mutex_lock(&txns.commit);
+    file_lock(txns.fd, F_WRLCK, 0, 1);
+    for (int i = 0; i < MAX_PROCESSES && txns.slot < 0; i++) {
+        TxnSlot *slot = &txns.shared->slots[i];
+        if (slot->pid != 0 && (kill(slot->pid, 0) == 0 || errno != ESRCH)) continue;
+        __atomic_store_n(&slot->oldest, UINT64_MAX, __ATOMIC_SEQ_CST);
+        slot->pid = (int32_t)getpid();
+        txns.slot = i;
+    }
+    file_lock(txns.fd, F_UNLCK, 0, 1);
+    pthread_mutex_unlock(&txns.commit);
+    if (txns.slot < 0) return -1;
+
+    // Recovery is over; from here other processes may run alongside
+    file_lock(txns.fd, F_RDLCK, 1, 1);
+
+    // Only the main thread (or the server's event loop) takes SIGINT and SIGTERM
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    txns.vacuum_started = pthread_create(&txns.vacuum, NULL, vacuum_main, NULL) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return 0;
+}
+
+// Stops the vacuum and gives up the process slot
+void txn_close(void) {
+    if (txns.vacuum_started) {
+        pthread_mutex_lock(&txns.lock);
+        txns.stopping = 1;
+        pthread_cond_broadcast(&txns.cond);
+        pthread_mutex_unlock(&txns.lock);
+        pthread_join(txns.vacuum, NULL);
+        txns.vacuum_started = 0;
+    }
+    if (txns.shared && txns.slot >= 0) {
+        TxnSlot *slot = &txns.shared->slots[txns.slot];
+        __atomic_store_n(&slot->oldest, UINT64_MAX, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&slot->pid, 0, __ATOMIC_SEQ_CST);
+        txns.slot = -1;
+    }
+    if (txns.shared) munmap(txns.shared, sizeof(TxnShared));
+    txns.shared = NULL;
+    if (txns.fd >= 0) close(txns.fd);
+    txns.fd = -1;
+}
+
+/**
+ * @brief Gives a transaction its snapshot, the last published commit. The
+ * first snapshot of the process is announced in its slot and the commit
+ * re-read until both agree: a vacuum that missed the announcement read the
+ * commit counter before it, so its horizon is no newer than the snapshot.
+ */
+void txn_snapshot_begin(Txn *txn) {
+    if (txn->reading) return;
+    uint64_t *last = &txns.shared->last_commit;
+    pthread_mutex_lock(&txns.lock);
+    uint64_t snapshot = __atomic_load_n(last, __ATOMIC_SEQ_CST);
+    if (!txns.reading) {
+        uint64_t *oldest = &txns.shared->slots[txns.slot].oldest;
+        while (1) {
+            __atomic_store_n(oldest, snapshot, __ATOMIC_SEQ_CST);
+            uint64_t again = __atomic_load_n(last, __ATOMIC_SEQ_CST);
+            if (again == snapshot) break;
+            snapshot = again;
+        }
+    }
+    txn->snapshot = snapshot;
+    txn->prev_reading = NULL;
+    txn->next_reading = txns.reading;
+    if (txns.reading) txns.reading->prev_reading = txn;
+    txns.reading = txn;
+    txn->reading = 1;
+    pthread_mutex_unlock(&txns.lock);
+}
+
+// Unregisters a transaction's snapshot; the slot keeps the oldest one still read
+void txn_snapshot_end(Txn *txn) {
+    if (!txn->reading) return;
+    pthread_mutex_lock(&txns.lock);
+    if (txn->prev_reading) txn->prev_reading->next_reading = txn->next_reading;
+    else txns.reading = txn->next_reading;
+    if (txn->next_reading) txn->next_reading->prev_reading = txn->prev_reading;
+    uint64_t oldest = UINT64_MAX;
+    for (Txn *r = txns.reading; r; r = r->next_reading) {
+        if (r->snapshot < oldest) oldest = r->snapshot;
+    }
+    __atomic_store_n(&txns.shared->slots[txns.slot].oldest, oldest, __ATOMIC_SEQ_CST);
+    txn->reading = 0;
+    txn->prev_reading = txn->next_reading = NULL;
+    pthread_mutex_unlock(&txns.lock);
+}
+
+/**
+ * @brief Returns a transaction's entry for a table it writes. The first time,
+ * the table's writer lock is taken (waiting for another writer to finish) and
+ * an appender opened on its latest rows; the first table also gives the
+ * transaction its log id. A table with indexes is marked as having its index
+ * pages changed, which keeps readers off them until the writer is done.
+ * @return NULL (after printing the reason) if the table cannot be written.
+ */
+TxnTable *txn_table(Txn *txn, const char *table_name) {
+    for (int i = 0; i < txn->table_count; i++) {
+        if (strcmp(txn->tables[i]->t.name, table_name) == 0) return txn->tables[i];
+    }
+    if (txn->table_count == MAX_TXN_TABLES) {
+        reply("A transaction may write at most %d tables.\n", MAX_TXN_TABLES);
+        return NULL;
+    }
+    TxnTable *tt = calloc(1, sizeof(TxnTable));
+    if (!tt) {
+        reply("Not enough memory to write table '%s'.\n", table_name);
+        return NULL;
+    }
+    if ((tt->lock_fd = table_lock_open(table_name, 1)) < 0) {
+        free(tt);
+        return NULL;
+    }
+    LockState st;
+    memset(&st, 0, sizeof(st));
+    int rc = table_refresh(table_name, &tt->t);
+    if (rc == 0 && tt->t.index_count > 0) {
+        // Readers in the middle of an index lookup hold the latch shared
+        st.index_dirty = 1;
+        if (file_lock(tt->lock_fd, F_WRLCK, 1, 1) != 0 || lock_state_write(tt->lock_fd, &st) != 0) {
+            reply_error("Error locking the table's indexes");
+            rc = -1;
+        }
+        file_lock(tt->lock_fd, F_UNLCK, 1, 1);
+    }
+
+    if (rc == 0) {
+        pthread_rwlock_rdlock(&wal.gate);
+        if (txn->table_count == 0) {
+            pthread_mutex_lock(&wal.lock);
+            txn->wal_txn = wal.next_txn++;
+            wal.open_txns++;
+            pthread_mutex_unlock(&wal.lock);
+        }
+        rc = appender_open(&tt->app, &tt->t, txn->wal_txn);
+        pthread_rwlock_unlock(&wal.gate);
+        if (rc != 0) {
+            reply("Could not prepare table '%s' for writing.\n", table_name);
+            if (txn->table_count == 0) {
+                pthread_mutex_lock(&wal.lock);
+                wal.open_txns--;
+                pthread_mutex_unlock(&wal.lock);
+            }
+        }
+    }
+    if (rc != 0) {
+        // Nothing was changed yet
+        memset(&st, 0, sizeof(st));
+        if (tt->t.index_count > 0) lock_state_write(tt->lock_fd, &st);
+        close(tt->lock_fd);
+        free(tt);
+        return NULL;
+    }
+    txn->tables[txn->table_count++] = tt;
+    return tt;
+}
+
+/**
+ * @brief Copies out a table for a statement of a transaction. A table the
+ * transaction writes shows its latest rows and the transaction's own, which
+ * are copied into the pool first; any other shows the transaction's snapshot.
+ * @return 0 on success, -1 (after printing the reason) otherwise.
+ */
+int txn_read_table(Txn *txn, const char *table_name, Table *t) {
+    for (int i = 0; i < txn->table_count; i++) {
+        TxnTable *tt = txn->tables[i];
+        if (strcmp(tt->t.name, table_name) != 0) continue;
+        if (appender_sync(&tt->app) != 0) {
+            reply("Error reading table '%s'.\n", table_name);
+            return -1;
+        }
+        *t = tt->t;
+        t->header.row_count = tt->app.row_count;
+        t->header.sorted_cols = tt->app.sorted;
+        return 0;
+    }
+    return table_snapshot(table_name, txn->snapshot, t);
+}
+
+/**
+ * @brief Ends a write statement. Outside BEGIN ... COMMIT the statement is a
+ * transaction of its own and commits, or rolls back if it failed; inside one
+ * a failure leaves the transaction able only to roll back.
+ * @return 0 if the statement's rows stand, -1 otherwise.
+ */
+int txn_finish(Txn *txn, int rc) {
+    if (rc != 0) {
+        if (txn->active) txn->failed = 1;
+        else txn_rollback(txn);
+        return -1;
+    }
+    return txn->active ? 0 : txn_commit(txn);
+}
+
+/**
+ * @brief Commits a transaction: each table's remaining rows and a COMMIT
+ * record are logged, the log is synced, the tables' pages are written back
+ * and their new row counts published as one commit. Until that is done each
+ * table's lock file names the commit, so if this process dies in between the
+ * next writer of the table finishes the job from the log.
+ * @return 0 on success, -1 (after printing the reason) otherwise.
+ */
+int txn_commit(Txn *txn) {
+    Appender *apps[MAX_TXN_TABLES];
+    uint64_t lsn = 0;
+    int n = txn->table_count;
+    int rc = 0;
+
+    pthread_rwlock_rdlock(&wal.gate);
+    for (int i = 0; i < n; i++) {
+        Appender *a = &txn->tables[i]->app;
+        // Only the last COMMIT commits, so after a failure none may follow
+        a->more = (uint32_t)(n - 1 - i);
+        if (appender_close(a, rc == 0) != 0) rc = -1;
+        if (a->lsn > lsn) lsn = a->lsn;
+        apps[i] = a;
+    }
+    pthread_rwlock_unlock(&wal.gate);
+
+    LockState st;
+    memset(&st, 0, sizeof(st));
+    st.txn = txn->wal_txn;
+    snprintf(st.log, sizeof(st.log), "%s", wal.path);
+    for (int i = 0; i < n && rc == 0; i++) {
+        st.index_dirty = txn->tables[i]->t.index_count > 0;
+        if (lock_state_write(txn->tables[i]->lock_fd, &st) != 0) rc = -1;
+    }
+    if (rc == 0 && n > 0 && wal_commit(lsn) != 0) rc = -1;
+    // Other processes read the rows from the files once they are published
+    for (int i = 0; i < n && rc == 0; i++) {
+        if (pool_flush_table(txn->tables[i]->t.name) != 0) rc = -1;
+    }
+    if (rc == 0 && n > 0 && publish_tables(apps, n) != 0) rc = -1;
+    for (int i = 0; i < n && rc == 0; i++) wal_mark_dirty(txn->tables[i]->t.name);
+    if (rc != 0) reply_error("Error committing the transaction");
+    txn_end(txn, rc == 0);
+    return rc;
+}
+
+/**
+ * @brief Rolls a transaction back. Its rows were never published, so they
+ * stay past each table's row count until the next writer overwrites them.
+ * The pages are written back first, so this process never writes them over
+ * another's later. A table with indexes is published again unchanged: its
+ * index pages changed, and other processes must drop what they cached.
+ */
+void txn_rollback(Txn *txn) {
+    int rc = 0;
+    for (int i = 0; i < txn->table_count; i++) {
+        TxnTable *tt = txn->tables[i];
+        if (appender_close(&tt->app, 0) != 0) rc = -1;
+        if (pool_flush_table(tt->t.name) != 0) rc = -1;
+        if (rc == 0 && tt->t.index_count > 0 && publish_unchanged(&tt->t) != 0) rc = -1;
+    }
+    if (rc != 0) reply_error("Error rolling back the transaction");
+    txn_end(txn, rc == 0);
+}
+
+/**
+ * @brief Releases what a transaction holds once it has committed or rolled
+ * back. Without `clean` the lock files keep their state, for the next writer
+ * to resolve.
+ */
+void txn_end(Txn *txn, int clean) {
+    LockState st;
+    memset(&st, 0, sizeof(st));
+    for (int i = 0; i < txn->table_count; i++) {
+        TxnTable *tt = txn->tables[i];
+        if (clean && lock_state_write(tt->lock_fd, &st) != 0) reply_error("Error unlocking the table");
+        close(tt->lock_fd);
+        free(tt);
+    }
+    if (txn->table_count > 0) {
+        pthread_mutex_lock(&wal.lock);
+        wal.open_txns--;
+        pthread_mutex_unlock(&wal.lock);
+    }
+    txn->table_count = 0;
+    txn->wal_txn = 0;
+    txn_snapshot_end(txn);
+    txn->active = 0;
+    txn->failed = 0;
+}
+
+/**
+ * @brief Publishes the new row counts of a transaction's tables as one
+ * commit. Under the commit lock the commit takes the next number, each
+ * table's version file gains the new version and its header is replaced;
+ * last_commit moves on only after every table, so a snapshot sees all of
+ * the commit or none of it.
+ * @return 0 on success, -1 if a table could not be published.
+ */
+int publish_tables(Appender **apps, int count) {
+    int rc = 0;
+    pthread_mutex_lock(&txns.commit);
+    file_lock(txns.fd, F_WRLCK, 0, 1);
+    uint64_t commit = __atomic_load_n(&txns.shared->last_commit, __ATOMIC_SEQ_CST) + 1;
+    for (int i = 0; i < count; i++) {
+        Table *t = apps[i]->t;
+        uint64_t rows = apps[i]->row_count > apps[i]->floor_rows ? apps[i]->row_count : apps[i]->floor_rows;
+        if (version_append(t, commit, rows) != 0) rc = -1;
+
+        pthread_mutex_lock(&catalog.lock);
+        t->header.row_count = rows;
+        t->header.sorted_cols = apps[i]->sorted;
+        t->header.commit_txn = commit;
+        t->header.version = TABLE_VERSION;
+        if (write_header(t) != 0) rc = -1;
+        for (int k = 0; k < catalog.count; k++) {
+            if (strcmp(catalog.tables[k]->name, t->name) == 0) catalog.tables[k]->header = t->header;
+        }
+        pthread_mutex_unlock(&catalog.lock);
+    }
+    // Even after a failure: the commit number is taken by whatever headers were written
+    __atomic_store_n(&txns.shared->last_commit, commit, __ATOMIC_SEQ_CST);
+    file_lock(txns.fd, F_UNLCK, 0, 1);
+    pthread_mutex_unlock(&txns.commit);
+    return rc;
+}
+
+// Publishes a table's current rows again as a new commit, so other processes drop their cached pages
+int publish_unchanged(Table *t) {
+    Appender a;
+    Appender *apps[1] = {&a};
+    memset(&a, 0, sizeof(a));
+    a.t = t;
+    a.row_count = t->header.row_count;
+    a.sorted = t->header.sorted_cols;
+    return publish_tables(apps, 1);
+}
+
+/**
+ * @brief Returns how many rows of a table a snapshot sees. The header answers
+ * unless it was published after the snapshot; then the newest older version
+ * in <table>.ver does, or the table had no rows yet.
+ */
+uint64_t version_rows(const char *table_name, uint64_t snapshot, const TableHeader *h) {
+    char path[MAX_PATH_LEN];
+    struct stat st;
+    VersionEntry v;
+    uint64_t rows = 0;
+
+    if (h->commit_txn <= snapshot) return h->row_count;
+    snprintf(path, sizeof(path), "%s.ver", table_name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    if (fstat(fd, &st) == 0) {
+        // Entries are in commit order; find the first one newer than the snapshot
+        uint64_t lo = 0, hi = (uint64_t)st.st_size / sizeof(v);
+        while (lo < hi) {
+            uint64_t mid = (lo + hi) / 2;
+            if (pread(fd, &v, sizeof(v), (off_t)(mid * sizeof(v))) != sizeof(v)) break;
+            if (v.txn <= snapshot) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo > 0 && pread(fd, &v, sizeof(v), (off_t)((lo - 1) * sizeof(v))) == sizeof(v)) rows = v.row_count;
+    }
+    close(fd);
+    return rows;
+}
+
+/**
+ * @brief Adds a table's new version to <table>.ver before its header changes.
+ * A table without the file first records the version being replaced.
+ */
+int version_append(const Table *t, uint64_t txn, uint64_t row_count) {
+    char path[MAX_PATH_LEN];
+    VersionEntry v[2];
+    int n = 0;
+
+    snprintf(path, sizeof(path), "%s.ver", t->name);
+    int fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT) {
+        fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        v[n].txn = t->header.commit_txn;
+        v[n++].row_count = t->header.row_count;
+    }
+    if (fd < 0) return -1;
+    v[n].txn = txn;
+    v[n++].row_count = row_count;
+    int rc = write_all(fd, (const char *)v, n * sizeof(VersionEntry));
+    close(fd);
+    return rc;
+}
+
+// Takes or (with F_UNLCK) releases an open file description lock on one byte
+int file_lock(int fd, short type, off_t start, int wait) {
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = start;
+    fl.l_len = 1;
+    int rc;
+    while ((rc = fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &fl)) != 0 && errno == EINTR) {}
+    return rc;
+}
+
+/**
+ * @brief Takes the writer lock of a table, shared by every process using the
+ * directory. Locks between processes have no deadlock detection, so with
+ * `wait` a writer polls for up to LOCK_TIMEOUT seconds and then gives up;
+ * without it the lock is only tried. Whatever a writer that died left in the
+ * lock file is resolved before returning.
+ * @return The lock file's descriptor, which releases the lock when closed, or -1.
+ */
+int table_lock_open(const char *table_name, int wait) {
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s.lock", table_name);
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        if (wait) reply_error("Error opening the table's lock file");
+        return -1;
+    }
+    double deadline = now_seconds() + LOCK_TIMEOUT;
+    useconds_t backoff = 1000;
+    while (file_lock(fd, F_WRLCK, 0, 0) != 0) {
+        if (!wait || (errno != EAGAIN && errno != EACCES) || now_seconds() > deadline) {
+            if (wait) reply("Timed out waiting for another writer of '%s'.\n", table_name);
+            close(fd);
+            return -1;
+        }
+        usleep(backoff);
+        if (backoff < 100000) backoff *= 2;
+    }
+    if (table_lock_recover(fd, table_name) != 0) {
+        if (wait) reply("Could not recover what the last writer of '%s' left.\n", table_name);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Finishes what the last writer of a table left undone when it died:
+ * a commit it logged but did not publish is replayed from its log, and
+ * indexes it was changing are rebuilt. The caller holds the writer lock.
+ */
+int table_lock_recover(int fd, const char *table_name) {
+    char names[MAX_TXN_TABLES][MAX_TABLE_NAME];
+    LockState states[MAX_TXN_TABLES];
+    int fds[MAX_TXN_TABLES];
+    int count = 1, rc = 0;
+
+    memset(&states[0], 0, sizeof(LockState));
+    if (pread(fd, &states[0], sizeof(LockState), 0) < 0) return -1;
+    if (!states[0].txn && !states[0].index_dirty) return 0;
+    fds[0] = fd;
+    snprintf(names[0], sizeof(names[0]), "%s", table_name);
+
+    if (states[0].txn) {
+        // The commit may span tables. Those whose lock is free and still names
+        // it are taken too, so the commit is published whole; a table whose
+        // lock is held has a writer that resolved it on taking the lock.
+        WalReplay *rp = calloc(1, sizeof(WalReplay));
+        FILE *fp = rp ? fopen(states[0].log, "rb") : NULL;
+        if (fp) {
+            wal_scan(fp, 0, NULL, 0, states[0].txn, rp);
+            fclose(fp);
+        }
+        for (int i = 0; rp && i < rp->touched_count && count < MAX_TXN_TABLES; i++) {
+            char path[MAX_PATH_LEN];
+            if (strcmp(rp->touched[i], table_name) == 0) continue;
+            snprintf(path, sizeof(path), "%s.lock", rp->touched[i]);
+            int other = open(path, O_RDWR | O_CLOEXEC);
+            LockState *st = &states[count];
+            memset(st, 0, sizeof(*st));
+            if (other >= 0 && file_lock(other, F_WRLCK, 0, 0) == 0 && pread(other, st, sizeof(*st), 0) >= 0 &&
+                st->txn == states[0].txn && strcmp(st->log, states[0].log) == 0) {
+                fds[count] = other;
+                strcpy(names[count++], rp->touched[i]);
+            } else if (other >= 0) {
+                close(other);
+            }
+        }
+        if (rp) free(rp->rows);
+        free(rp);
+        wal_replay(&states[0].log, 1, names, count, states[0].txn);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (states[i].index_dirty && rebuild_indexes(names[i]) != 0) rc = -1;
+        memset(&states[i], 0, sizeof(LockState));
+        if (rc == 0 && lock_state_write(fds[i], &states[i]) != 0) rc = -1;
+        if (i > 0) close(fds[i]);
+    }
+    return rc;
+}
+
+int lock_state_write(int fd, const LockState *st) {
+    return pwrite(fd, st, sizeof(*st), 0) == (ssize_t)sizeof(*st) ? 0 : -1;
+}
+
+/**
+ * @brief Takes a table's index latch for a query. It fails, and the query
+ * scans instead, while a writer is changing index pages, or once a commit
+ * came after `t` was read, since the pages this process cached may predate it.
+ * @return A descriptor to close after the lookup, or -1.
+ */
+int index_latch(const Table *t) {
+    char path[MAX_PATH_LEN];
+    LockState st;
+    TableHeader h;
+
+    snprintf(path, sizeof(path), "%s.lock", t->name);
+    int fd = open(path, O_RDONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    memset(&st, 0, sizeof(st));
+    if (file_lock(fd, F_RDLCK, 1, 0) != 0 || pread(fd, &st, sizeof(st), 0) < 0 || st.index_dirty ||
+        read_header(t->name, &h) != 0 || h.commit_txn != t->header.commit_txn) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Rebuilds every index of a table from its published rows, then
+ * publishes the rows again so other processes drop the index pages they cached.
+ */
+int rebuild_indexes(const char *table_name) {
+    Table t;
+    if (table_refresh(table_name, &t) != 0) return -1;
+    if (t.index_count == 0) return 0;
+    int rc = 0;
+    for (int i = 0; i < t.index_count; i++) {
+        if (build_index(&t, t.indexes[i].name, t.indexes[i].col) != 0) rc = -1;
+    }
+    if (rc == 0) rc = publish_unchanged(&t);
+    return rc;
+}
+
+// Runs the vacuum every VACUUM_INTERVAL seconds until txn_close
+void *vacuum_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&txns.lock);
+    while (!txns.stopping) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += VACUUM_INTERVAL;
+        pthread_cond_timedwait(&txns.cond, &txns.lock, &until);
+        if (txns.stopping) break;
+        pthread_mutex_unlock(&txns.lock);
+        vacuum_run();
+        pthread_mutex_lock(&txns.lock);
+    }
+    pthread_mutex_unlock(&txns.lock);
+    return NULL;
+}
+
+/**
+ * @brief Drops the table versions no snapshot of any process can still read.
+ * A table whose writer lock is taken is left for the next pass; taking it
+ * also resolves what a writer that died left behind.
+ * @return The number of versions removed.
+ */
+long vacuum_run(void) {
+    char (*names)[MAX_PATH_LEN] = NULL;
+    uint64_t horizon = vacuum_horizon();
+    long removed = 0;
+
+    int count = list_files(".lock", &names);
+    for (int i = 0; i < count; i++) {
+        names[i][strlen(names[i]) - strlen(".lock")] = '\0';
+        int fd = table_lock_open(names[i], 0);
+        if (fd < 0) continue;
+        long n = vacuum_table(names[i], horizon);
+        if (n > 0) removed += n;
+        close(fd);
+    }
+    free(names);
+    return removed;
+}
+
+/**
+ * @brief Rewrites <table>.ver without the versions older than the newest one
+ * up to `horizon`, which every snapshot still read sees instead. The file is
+ * removed once that one is all that is left and the header shows it too.
+ * The caller holds the table's writer lock.
+ * @return The number of versions removed, or -1 on error.
+ */
+long vacuum_table(const char *table_name, uint64_t horizon) {
+    char path[MAX_PATH_LEN], tmp[MAX_PATH_LEN + 4];
+    struct stat st;
+    TableHeader h;
+
+    snprintf(path, sizeof(path), "%s.ver", table_name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    size_t count = (size_t)st.st_size / sizeof(VersionEntry);
+    VersionEntry *v = malloc((count ? count : 1) * sizeof(VersionEntry));
+    if (!v || pread(fd, v, count * sizeof(VersionEntry), 0) != (ssize_t)(count * sizeof(VersionEntry))) {
+        free(v);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    size_t keep = 0;
+    while (keep + 1 < count && v[keep + 1].txn <= horizon) keep++;
+    long removed = (long)keep;
+    if (count > 0 && keep == count - 1 && v[keep].txn <= horizon && read_header(table_name, &h) == 0 &&
+        h.commit_txn == v[keep].txn && h.row_count == v[keep].row_count) {
+        free(v);
+        return unlink(path) == 0 ? removed : -1;
+    }
+    if (removed == 0) {
+        free(v);
+        return 0;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int rc = fd < 0 ? -1 : write_all(fd, (const char *)(v + keep), (count - keep) * sizeof(VersionEntry));
+    if (fd >= 0 && close(fd) != 0) rc = -1;
+    if (rc == 0) rc = rename(tmp, path);
+    if (rc != 0) remove(tmp);
+    free(v);
+    return rc == 0 ? removed : -1;
+}
+
+/**
+ * @brief Returns the oldest commit a snapshot of any process may still read.
+ * The commit counter is read before the slots; see txn_snapshot_begin. Slots
+ * of processes that have died are freed.
+ */
+uint64_t vacuum_horizon(void) {
+    uint64_t horizon = __atomic_load_n(&txns.shared->last_commit, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&txns.commit);
+    file_lock(txns.fd, F_WRLCK, 0, 1);
+    for (int i = 0; i < MAX_PROCESSES; i++) {
+        TxnSlot *slot = &txns.shared->slots[i];
+        int32_t pid = __atomic_load_n(&slot->pid, __ATOMIC_SEQ_CST);
+        if (pid == 0) continue;
+        if (kill(pid, 0) != 0 && errno == ESRCH) {
+            __atomic_store_n(&slot->pid, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        uint64_t oldest = __atomic_load_n(&slot->oldest, __ATOMIC_SEQ_CST);
+        if (oldest < horizon) horizon = oldest;
+    }
+    file_lock(txns.fd, F_UNLCK, 0, 1);
+    pthread_mutex_unlock(&txns.commit);
+    return horizon;
+}
+
+/**
+ * @brief Lists the files in the current directory whose names end in `suffix`.
+ * @return The number of names, in a new array at *names, or -1.
+ */
+int list_files(const char *suffix, char (**names)[MAX_PATH_LEN]) {
+    size_t suffix_len = strlen(suffix);
+    int count = 0, cap = 0;
+    struct dirent *de;
+
+    *names = NULL;
+    DIR *dir = opendir(".");
+    if (!dir) return -1;
+    while ((de = readdir(dir)) != NULL) {
+        size_t len = strlen(de->d_name);
+        if (len <= suffix_len || len >= MAX_PATH_LEN || strcmp(de->d_name + len - suffix_len, suffix) != 0) continue;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 16;
+            char (*grown)[MAX_PATH_LEN] = realloc(*names, (size_t)cap * MAX_PATH_LEN);
+            if (!grown) break;
+            *names = grown;
+        }
+        strcpy((*names)[count++], de->d_name);
+    }
+    closedir(dir);
+    return count;
+}
+
+// --- Server ---
+
+void server_signal(int sig) {
+    (void)sig;
+    server_stop = 1;
+}
+
+/**
+ * @brief Serves clients on a Unix domain socket until SIGINT or SIGTERM.
+ * Each line a client sends is one statement; the reply is the output the
+ * statement would print in the shell, followed by a line holding only ".".
+ * One thread waits on every connection with epoll and `workers` threads run
+ * statements, each session's in order. Sessions start with
+ * (CPUs / workers) scan threads; SET THREADS changes only its own session.
+ * @return 0 after a clean shutdown, 1 if the socket could not be set up.
+ */
+int server_run(const char *path, int workers) {
+    struct sigaction sa;
+    struct epoll_event ev, events[64];
+    pthread_t threads[MAX_THREADS];
+    sigset_t block, old;
+    int started = 0;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = server_signal; // No SA_RESTART, so epoll_wait returns to check server_stop
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (server_listen(path) != 0) {
+        perror("Error opening the server socket");
+        return 1;
+    }
+    server.session_threads = scan_threads / workers > 0 ? scan_threads / workers : 1;
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    server.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    int rc = (server.epoll_fd < 0 || server.wake_fd < 0) ? -1 : epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.listen_fd, &ev);
+    ev.data.ptr = &server;
+    if (rc == 0) rc = epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.wake_fd, &ev);
+
+    // Only this thread takes SIGINT and SIGTERM; workers and their scan threads inherit the mask
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    while (rc == 0 && started < workers && pthread_create(&threads[started], NULL, server_worker, NULL) == 0) started++;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (rc != 0 || started == 0) {
+        perror("Error starting the server");
+    } else {
+        printf("Serving on %s with %d workers. Send SIGINT or SIGTERM to stop.\n", path, started);
+        fflush(stdout);
+    }
+    while (rc == 0 && started > 0 && !server_stop) {
+        int n = epoll_wait(server.epoll_fd, events, 64, -1);
+        int reap = 0;
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) server_accept();
+            else if (events[i].data.ptr == &server) reap = 1;
+            else server_read(events[i].data.ptr);
+        }
+        // Freed only after the batch, which may still hold events of the same sessions
+        if (reap) server_reap();
+    }
+
+    // Statements already running finish; queued ones are dropped
+    pthread_mutex_lock(&server.lock);
+    server.stopping = 1;
+    pthread_cond_broadcast(&server.cond);
+    pthread_mutex_unlock(&server.lock);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    while (server.sessions) {
+        Session *sn = server.sessions;
+        server.sessions = sn->next;
+        session_free(sn);
+    }
+    close(server.listen_fd);
+    unlink(path);
+    if (server.epoll_fd >= 0) close(server.epoll_fd);
+    if (server.wake_fd >= 0) close(server.wake_fd);
+    printf("Server stopped.\n");
+    return rc == 0 && started > 0 ? 0 : 1;
+}
+
+// Binds a listening socket at `path`, replacing a stale socket file
+int server_listen(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    server.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server.listen_fd < 0) return -1;
+    unlink(path);
+    if (bind(server.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) return -1;
+    return listen(server.listen_fd, SOMAXCONN);
+}
+
+/**
+ * @brief Accepts every pending connection. Client sockets stay blocking: the
+ * event loop reads only when epoll reports data, and a worker writing a reply
+ * waits for the client to read it.
+ */
+void server_accept(void) {
+    static const cookie_io_functions_t io = {.write = session_write};
+    struct epoll_event ev;
+
+    while (1) {
+        int fd = accept4(server.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EMFILE || errno == ENFILE) {
+                // Stop polling the listener, which would stay readable, until a session closes
+                epoll_ctl(server.epoll_fd, EPOLL_CTL_DEL, server.listen_fd, NULL);
+                server.accept_paused = 1;
+                printf("Out of file descriptors; new connections wait.\n");
+            }
+            return;
+        }
+        struct timeval timeout = {SESSION_SEND_TIMEOUT, 0};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        Session *sn = calloc(1, sizeof(Session));
+        if (sn) sn->out = fopencookie(sn, "w", io);
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = sn;
+        if (!sn || !sn->out || epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            if (sn && sn->out) fclose(sn->out);
+            free(sn);
+            close(fd);
+            continue;
+        }
+        setvbuf(sn->out, NULL, _IOFBF, SESSION_OUT_BUFFER);
+        sn->fd = fd;
+        sn->threads = server.session_threads;
+        pthread_mutex_lock(&server.lock);
+        sn->next = server.sessions;
+        server.sessions = sn;
+        pthread_mutex_unlock(&server.lock);
+    }
+}
+
+/**
+ * @brief Reads what a client sent and queues the session once it holds a
+ * complete line. At end of input a last unterminated line still runs, and the
+ * session closes after replying to everything it sent.
+ */
+void server_read(Session *sn) {
+    char buf[SERVER_READ_SIZE];
+    ssize_t n = read(sn->fd, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR) return;
+
+    pthread_mutex_lock(&server.lock);
+    if (n > 0 && !sn->closing) {
+        // Drop consumed input before growing the buffer
+        if (sn->in_off > 0 && sn->in_len + (size_t)n > sn->in_cap) {
+            memmove(sn->in, sn->in + sn->in_off, sn->in_len - sn->in_off);
+            sn->in_len -= sn->in_off;
+            sn->in_off = 0;
+        }
+        if (sn->in_len + (size_t)n + 1 > sn->in_cap) {
+            size_t cap = (sn->in_len + (size_t)n + 1) * 2;
+            char *grown = (cap <= SESSION_INPUT_MAX) ? realloc(sn->in, cap) : NULL;
+            if (!grown) {
+                sn->closing = 1;
+            } else {
+                sn->in = grown;
+                sn->in_cap = cap;
+            }
+        }
+        if (!sn->closing) {
+            memcpy(sn->in + sn->in_len, buf, (size_t)n);
+            sn->in_len += (size_t)n;
+        }
+    } else if (n <= 0) {
+        epoll_ctl(server.epoll_fd, EPOLL_CTL_DEL, sn->fd, NULL);
+        if (sn->in_len > sn->in_off && sn->in[sn->in_len - 1] != '\n') sn->in[sn->in_len++] = '\n';
+        sn->eof = 1;
+    }
+
+    if (!sn->busy) {
+        if (!sn->closing && session_next_line(sn) >= 0) session_queue(sn);
+        else if (sn->closing || sn->eof) sn->done = 1;
+    }
+    int done = sn->done;
+    pthread_mutex_unlock(&server.lock);
+    if (done) {
+        uint64_t one = 1;
+        if (write(server.wake_fd, &one, sizeof(one)) < 0) server_reap();
+    }
+}
+
+// Frees the sessions that have finished; runs on the event loop only
+void server_reap(void) {
+    uint64_t count;
+    Session *done = NULL;
+    if (read(server.wake_fd, &count, sizeof(count)) < 0) count = 0;
+
+    pthread_mutex_lock(&server.lock);
+    for (Session **p = &server.sessions; *p;) {
+        Session *sn = *p;
+        if (sn->done) {
+            *p = sn->next;
+            sn->next = done;
+            done = sn;
+        } else {
+            p = &sn->next;
+        }
+    }
+    pthread_mutex_unlock(&server.lock);
+
+    while (done) {
+        Session *sn = done;
+        done = sn->next;
+        session_free(sn);
+    }
+    if (server.accept_paused) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.listen_fd, &ev) == 0) server.accept_paused = 0;
+    }
+}
+
+// Returns the length of the session's next complete line, or -1; under server.lock
+int session_next_line(Session *sn) {
+    char *nl = memchr(sn->in + sn->in_off, '\n', sn->in_len - sn->in_off);
+    return nl ? (int)(nl - (sn->in + sn->in_off)) : -1;
+}
+
+// Marks a session busy and hands it to the workers; under server.lock
+void session_queue(Session *sn) {
+    sn->busy = 1;
+    sn->next_ready = NULL;
+    if (server.ready_tail) server.ready_tail->next_ready = sn;
+    else server.ready_head = sn;
+    server.ready_tail = sn;
+    pthread_cond_signal(&server.cond);
+}
+
+/**
+ * @brief Runs queued sessions' statements. A session keeps its worker while
+ * it has complete lines waiting, then goes back to the event loop.
+ */
+void *server_worker(void *arg) {
+    char *line = NULL;
+    size_t line_cap = 0;
+    (void)arg;
+
+    pthread_mutex_lock(&server.lock);
+    while (1) {
+        while (!server.ready_head && !server.stopping) pthread_cond_wait(&server.cond, &server.lock);
+        if (server.stopping) break;
+        Session *sn = server.ready_head;
+        server.ready_head = sn->next_ready;
+        if (!server.ready_head) server.ready_tail = NULL;
+
+        while (1) {
+            int len = session_next_line(sn);
+            if (len < 0 || sn->closing || server.stopping) break;
+            if ((size_t)len + 1 > line_cap) {
+                char *grown = realloc(line, (size_t)len + 1);
+                if (!grown) {
+                    sn->closing = 1;
+                    break;
+                }
+                line = grown;
+                line_cap = (size_t)len + 1;
+            }
+            memcpy(line, sn->in + sn->in_off, (size_t)len);
+            line[len] = '\0';
+            sn->in_off += (size_t)len + 1;
+            if (sn->in_off == sn->in_len) sn->in_off = sn->in_len = 0;
+            pthread_mutex_unlock(&server.lock);
+
+            session_run(sn, line);
+
+            pthread_mutex_lock(&server.lock);
+        }
+        sn->busy = 0;
+        if (sn->closing || sn->eof) {
+            uint64_t one = 1;
+            sn->done = 1;
+            if (write(server.wake_fd, &one, sizeof(one)) < 0) reply_error("Error waking the event loop");
+        }
+    }
+    pthread_mutex_unlock(&server.lock);
+    free(line);
+    return NULL;
+}
+
+/**
+ * @brief Runs one statement of a session with its output and SET THREADS, and
+ * ends the reply. 'exit' and a client that stopped reading close the session.
+ */
+void session_run(Session *sn, const char *line) {
+    reply_out = sn->out;
+    scan_threads = sn->threads;
+    session_txn = &sn->txn;
+    int quit = run_statement(line);
+    if (!quit) wal_maybe_checkpoint();
+    fputs(REPLY_END, sn->out);
+    fflush(sn->out);
+    sn->threads = scan_threads;
+    session_txn = NULL;
+    reply_out = NULL;
+
+    if (quit || sn->broken) {
+        pthread_mutex_lock(&server.lock);
+        sn->closing = 1;
+        pthread_mutex_unlock(&server.lock);
+    }
+}
+
+// Write function of a session's reply stream; gives up on a client for good after a failed write
+ssize_t session_write(void *cookie, const char *buf, size_t len) {
+    Session *sn = cookie;
+    if (sn->broken || write_all(sn->fd, buf, len) != 0) {
+        sn->broken = 1;
+        return -1;
+    }
+    return (ssize_t)len;
+}
+
+// Frees a closed session; a transaction it left open is rolled back
+void session_free(Session *sn) {
+    session_txn = &sn->txn;
+    txn_rollback(&sn->txn);
+    session_txn = NULL;
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_DEL, sn->fd, NULL);
+    fclose(sn->out);
+    close(sn->fd);
+    free(sn->in);
+    free(sn);
 }